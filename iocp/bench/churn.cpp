@@ -0,0 +1,196 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Module:
+//      churn.cpp
+//
+// Abstract:
+//      Connection churn benchmark for the echo server (Linux).  Each thread
+//      connects, sends one byte, waits for the echo and closes, as fast as it
+//      can.  The echo proves the server accepted the connection and serviced it,
+//      so the rate reported is accepts per second as seen by the server.
+//
+//      Connections are closed abortively by default (SO_LINGER 0) so the client
+//      does not run out of ephemeral ports to TIME_WAIT; use -g for a graceful
+//      close.
+//
+//  Usage:
+//      churn [-n:host] [-e:port] [-t:threads] [-d:seconds] [-g]
+//
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAXTHREADS 256
+
+typedef struct _OPTIONS
+{
+	char szHostname[64];
+	char szPort[16];
+	int nTotalThreads;
+	int nSeconds;
+	bool bGraceful;
+} OPTIONS;
+
+typedef struct _THREADSTATS
+{
+	unsigned long long ullConnections;
+	unsigned long long ullErrors;
+	char pad[48];
+} THREADSTATS;
+
+static OPTIONS g_Options = {"localhost", "5001", 4, 10, false};
+static THREADSTATS g_Stats[MAXTHREADS];
+static struct addrinfo *g_pAddr = NULL;
+static volatile bool g_bStop = false;
+
+static bool ValidOptions(int argc, char *argv[])
+{
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (argv[i][0] != '-' || argv[i][1] == '\0')
+			return (false);
+		switch (argv[i][1])
+		{
+		case 'n':
+			if (strlen(argv[i]) > 3)
+				snprintf(g_Options.szHostname, sizeof(g_Options.szHostname), "%s", &argv[i][3]);
+			break;
+		case 'e':
+			if (strlen(argv[i]) > 3)
+				snprintf(g_Options.szPort, sizeof(g_Options.szPort), "%s", &argv[i][3]);
+			break;
+		case 't':
+			if (strlen(argv[i]) > 3)
+				g_Options.nTotalThreads = atoi(&argv[i][3]);
+			if (g_Options.nTotalThreads < 1 || g_Options.nTotalThreads > MAXTHREADS)
+				return (false);
+			break;
+		case 'd':
+			if (strlen(argv[i]) > 3)
+				g_Options.nSeconds = atoi(&argv[i][3]);
+			if (g_Options.nSeconds < 1)
+				return (false);
+			break;
+		case 'g':
+			g_Options.bGraceful = true;
+			break;
+		default:
+			return (false);
+		}
+	}
+	return (true);
+}
+
+//
+// One connect / echo one byte / close cycle.
+//
+static bool Churn(void)
+{
+
+	char ch = 'x';
+	int sd = socket(g_pAddr->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	int nOne = 1;
+	struct linger lingerStruct;
+	bool bRet = false;
+
+	if (sd < 0)
+		return (false);
+
+	setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &nOne, sizeof(nOne));
+	if (!g_Options.bGraceful)
+	{
+		lingerStruct.l_onoff = 1;
+		lingerStruct.l_linger = 0;
+		setsockopt(sd, SOL_SOCKET, SO_LINGER, &lingerStruct, sizeof(lingerStruct));
+	}
+
+	if (connect(sd, g_pAddr->ai_addr, g_pAddr->ai_addrlen) == 0 &&
+		send(sd, &ch, 1, MSG_NOSIGNAL) == 1 &&
+		recv(sd, &ch, 1, 0) == 1)
+		bRet = true;
+
+	close(sd);
+	return (bRet);
+}
+
+static void *ChurnThread(void *lpParameter)
+{
+
+	THREADSTATS *pStats = (THREADSTATS *)lpParameter;
+
+	while (!g_bStop)
+	{
+		if (Churn())
+			pStats->ullConnections++;
+		else
+			pStats->ullErrors++;
+	}
+	return (NULL);
+}
+
+int main(int argc, char *argv[])
+{
+
+	struct addrinfo hints;
+	pthread_t threads[MAXTHREADS];
+	unsigned long long ullConnections = 0;
+	unsigned long long ullErrors = 0;
+	struct timespec tsStart, tsEnd;
+	double dSeconds = 0;
+	int nRet = 0;
+
+	if (!ValidOptions(argc, argv))
+	{
+		printf("Usage:\n  churn [-n:host] [-e:port] [-t:threads] [-d:seconds] [-g]\n");
+		printf("  -n:host\tServer to connect to (default: localhost)\n");
+		printf("  -e:port\tServer port (default: 5001)\n");
+		printf("  -t:threads\tConnecting threads, 1-%d (default: 4)\n", MAXTHREADS);
+		printf("  -d:seconds\tDuration (default: 10)\n");
+		printf("  -g\t\tGraceful close instead of abortive\n");
+		return (1);
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((nRet = getaddrinfo(g_Options.szHostname, g_Options.szPort, &hints, &g_pAddr)) != 0)
+	{
+		printf("getaddrinfo(%s) failed: %s\n", g_Options.szHostname, gai_strerror(nRet));
+		return (1);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &tsStart);
+	for (int i = 0; i < g_Options.nTotalThreads; i++)
+		pthread_create(&threads[i], NULL, ChurnThread, &g_Stats[i]);
+
+	sleep(g_Options.nSeconds);
+	g_bStop = true;
+
+	for (int i = 0; i < g_Options.nTotalThreads; i++)
+	{
+		pthread_join(threads[i], NULL);
+		ullConnections += g_Stats[i].ullConnections;
+		ullErrors += g_Stats[i].ullErrors;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &tsEnd);
+	dSeconds = (tsEnd.tv_sec - tsStart.tv_sec) + (tsEnd.tv_nsec - tsStart.tv_nsec) / 1e9;
+
+	printf("threads=%d seconds=%.2f connections=%llu errors=%llu accepts/s=%.0f\n",
+		   g_Options.nTotalThreads, dSeconds, ullConnections, ullErrors, ullConnections / dSeconds);
+
+	freeaddrinfo(g_pAddr);
+	return (0);
+}
@@ -0,0 +1,141 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Module:
+//      cuckoo.cpp
+//
+// Abstract:
+//      Inserts into the cuckoo hash table (server/iocpcuckoo.cpp), the way
+//      net_demo/hash_table/benchmark.zig and benchmark.js measure the Zig
+//      HashMap and @ronomon/hash-table: a table reserved for -r:runs times
+//      -n:insertions keys, each a 128-byte zero transfer under a sequential
+//      128-bit id, filled one run at a time, with a line per run in their
+//      format.  Then looks every id up again, and as many ids never inserted,
+//      and checks all were found, and none.
+//
+//  Usage:
+//      cuckoo [-n:insertions] [-r:runs] [-v:bytes]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "iocpcuckoo.h"
+
+typedef struct _OPTIONS
+{
+	int nInsertions;
+	int nRuns;
+	int nValue;
+} OPTIONS;
+
+static OPTIONS g_Options = {1000000, 5, 128};
+
+static bool CuckooBenchOptions(int argc, char *argv[])
+{
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (argv[i][0] != '-' || argv[i][1] == '\0')
+			return (false);
+		switch (argv[i][1])
+		{
+		case 'n':
+			if (strlen(argv[i]) > 3)
+				g_Options.nInsertions = atoi(&argv[i][3]);
+			if (g_Options.nInsertions < 1)
+				return (false);
+			break;
+		case 'r':
+			if (strlen(argv[i]) > 3)
+				g_Options.nRuns = atoi(&argv[i][3]);
+			if (g_Options.nRuns < 1)
+				return (false);
+			break;
+		case 'v':
+			if (strlen(argv[i]) > 3)
+				g_Options.nValue = atoi(&argv[i][3]);
+			if (g_Options.nValue < 0)
+				return (false);
+			break;
+		default:
+			return (false);
+		}
+	}
+	return (true);
+}
+
+static long long NowMs(void)
+{
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000LL + ts.tv_nsec / 1000000);
+}
+
+int main(int argc, char *argv[])
+{
+
+	CUCKOO_TABLE table;
+	U128 id = {0, 0};
+	char *pTransfer = NULL;
+	LPVOID pValue = NULL;
+	long long llStart = 0;
+	long long llFound = 0;
+	long long llFull = 0;
+	long long llTotal = 0;
+
+	if (!CuckooBenchOptions(argc, argv))
+	{
+		printf("Usage:\n  cuckoo [-n:insertions] [-r:runs] [-v:bytes]\n");
+		printf("  -n:insertions\tInsertions per run (default: 1000000)\n");
+		printf("  -r:runs\tRuns, the table holds them all (default: 5)\n");
+		printf("  -v:bytes\tValue size (default: 128, a transfer)\n");
+		return (1);
+	}
+
+	llTotal = (long long)g_Options.nInsertions * g_Options.nRuns;
+	pTransfer = (char *)calloc(1, g_Options.nValue + 1);
+	if (llTotal > 0xFFFFFFFF || pTransfer == NULL || !CuckooCreate(&table, (DWORD)llTotal, g_Options.nValue))
+	{
+		printf("out of memory for %lld insertions\n", llTotal);
+		return (1);
+	}
+
+	for (int nRun = 0; nRun < g_Options.nRuns; nRun++)
+	{
+		llStart = NowMs();
+		for (int i = 0; i < g_Options.nInsertions; i++)
+		{
+			if (CuckooInsert(&table, &id, &pValue) != CUCKOO_INSERTED)
+				llFull++;
+			else if (pValue)
+				memcpy(pValue, pTransfer, g_Options.nValue);
+			id.ullLow++;
+		}
+		printf("%d hash table insertions in %lldms\n", g_Options.nInsertions, NowMs() - llStart);
+	}
+
+	llStart = NowMs();
+	for (id.ullLow = 0; id.ullLow < (ULONGLONG)llTotal; id.ullLow++)
+		llFound += CuckooFind(&table, &id, &pValue);
+	printf("%lld hash table positive lookups in %lldms\n", llTotal, NowMs() - llStart);
+
+	llStart = NowMs();
+	for (id.ullHigh = 1, id.ullLow = 0; id.ullLow < (ULONGLONG)llTotal; id.ullLow++)
+		llFound += CuckooFind(&table, &id, &pValue);
+	printf("%lld hash table negative lookups in %lldms\n", llTotal, NowMs() - llStart);
+
+	printf("buckets=%u load_pct=%.1f full=%lld errors=%d\n", table.dwBuckets,
+		   100.0 * table.dwCount / ((double)table.dwBuckets * CUCKOO_SLOTS), llFull,
+		   llFound == llTotal - llFull ? 0 : 1);
+
+	CuckooDestroy(&table);
+	free(pTransfer);
+	return (llFound == llTotal - llFull && llFull == 0 ? 0 : 1);
+}
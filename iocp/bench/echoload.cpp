@@ -0,0 +1,290 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Module:
+//      echoload.cpp
+//
+// Abstract:
+//      Sustained echo load for the echo server (Linux).  Each thread drives its
+//      share of the connections from one epoll loop and keeps a fixed number of
+//      messages in flight on every connection: whenever a whole message has been
+//      echoed back, another one is sent.  The rate reported is echoed messages
+//      and bytes per second, which together with the server's own counters gives
+//      the system calls spent per message.
+//
+//  Usage:
+//      echoload [-n:host] [-e:port] [-t:threads] [-c:connections] [-s:bytes]
+//               [-p:pipeline] [-d:seconds]
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAXTHREADS 256
+#define IOBUFSIZE (64 * 1024)
+
+typedef struct _OPTIONS
+{
+	char szHostname[64];
+	char szPort[16];
+	int nTotalThreads;
+	int nConnections;
+	int nMessageSize;
+	int nPipeline;
+	int nSeconds;
+} OPTIONS;
+
+typedef struct _CONNECTION
+{
+	int sd;
+	size_t cbToSend;
+	size_t cbReceived; // bytes of the message being echoed back
+	bool bWantWrite;
+} CONNECTION;
+
+typedef struct _THREADSTATS
+{
+	unsigned long long ullMessages;
+	unsigned long long ullBytes;
+	unsigned long long ullErrors;
+	char pad[40];
+} THREADSTATS;
+
+static OPTIONS g_Options = {"localhost", "5001", 4, 64, 64, 1, 10};
+static THREADSTATS g_Stats[MAXTHREADS];
+static struct addrinfo *g_pAddr = NULL;
+static volatile bool g_bStop = false;
+
+static bool ValidOptions(int argc, char *argv[])
+{
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (argv[i][0] != '-' || argv[i][1] == '\0')
+			return (false);
+		switch (argv[i][1])
+		{
+		case 'n':
+			if (strlen(argv[i]) > 3)
+				snprintf(g_Options.szHostname, sizeof(g_Options.szHostname), "%s", &argv[i][3]);
+			break;
+		case 'e':
+			if (strlen(argv[i]) > 3)
+				snprintf(g_Options.szPort, sizeof(g_Options.szPort), "%s", &argv[i][3]);
+			break;
+		case 't':
+			if (strlen(argv[i]) > 3)
+				g_Options.nTotalThreads = atoi(&argv[i][3]);
+			if (g_Options.nTotalThreads < 1 || g_Options.nTotalThreads > MAXTHREADS)
+				return (false);
+			break;
+		case 'c':
+			if (strlen(argv[i]) > 3)
+				g_Options.nConnections = atoi(&argv[i][3]);
+			if (g_Options.nConnections < 1)
+				return (false);
+			break;
+		case 's':
+			if (strlen(argv[i]) > 3)
+				g_Options.nMessageSize = atoi(&argv[i][3]);
+			if (g_Options.nMessageSize < 1)
+				return (false);
+			break;
+		case 'p':
+			if (strlen(argv[i]) > 3)
+				g_Options.nPipeline = atoi(&argv[i][3]);
+			if (g_Options.nPipeline < 1)
+				return (false);
+			break;
+		case 'd':
+			if (strlen(argv[i]) > 3)
+				g_Options.nSeconds = atoi(&argv[i][3]);
+			if (g_Options.nSeconds < 1)
+				return (false);
+			break;
+		default:
+			return (false);
+		}
+	}
+	return (true);
+}
+
+static bool SetInterest(int fdEpoll, CONNECTION *pConn, bool bWantWrite)
+{
+
+	struct epoll_event event;
+
+	if (pConn->bWantWrite == bWantWrite)
+		return (true);
+	pConn->bWantWrite = bWantWrite;
+	event.events = EPOLLIN | (bWantWrite ? EPOLLOUT : 0);
+	event.data.ptr = pConn;
+	return (epoll_ctl(fdEpoll, EPOLL_CTL_MOD, pConn->sd, &event) == 0);
+}
+
+static bool Connect(int fdEpoll, CONNECTION *pConn)
+{
+
+	struct epoll_event event;
+	int nOne = 1;
+
+	pConn->sd = socket(g_pAddr->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (pConn->sd < 0)
+		return (false);
+	setsockopt(pConn->sd, IPPROTO_TCP, TCP_NODELAY, &nOne, sizeof(nOne));
+	if (connect(pConn->sd, g_pAddr->ai_addr, g_pAddr->ai_addrlen) != 0)
+		return (false);
+	fcntl(pConn->sd, F_SETFL, fcntl(pConn->sd, F_GETFL, 0) | O_NONBLOCK);
+
+	pConn->cbToSend = (size_t)g_Options.nMessageSize * g_Options.nPipeline;
+	pConn->cbReceived = 0;
+	pConn->bWantWrite = true;
+	event.events = EPOLLIN | EPOLLOUT;
+	event.data.ptr = pConn;
+	return (epoll_ctl(fdEpoll, EPOLL_CTL_ADD, pConn->sd, &event) == 0);
+}
+
+static void *LoadThread(void *lpParameter)
+{
+
+	THREADSTATS *pStats = (THREADSTATS *)lpParameter;
+	int nConnections = g_Options.nConnections / g_Options.nTotalThreads +
+					   ((pStats - g_Stats) < g_Options.nConnections % g_Options.nTotalThreads);
+	CONNECTION *pConns = (CONNECTION *)calloc(nConnections ? nConnections : 1, sizeof(CONNECTION));
+	struct epoll_event events[256];
+	static char buffer[IOBUFSIZE];
+	char recvbuf[IOBUFSIZE];
+	int fdEpoll = epoll_create1(EPOLL_CLOEXEC);
+	ssize_t nRet = 0;
+
+	for (int i = 0; i < nConnections; i++)
+	{
+		if (!Connect(fdEpoll, &pConns[i]))
+		{
+			printf("connect failed: %s\n", strerror(errno));
+			pStats->ullErrors++;
+			g_bStop = true;
+		}
+	}
+
+	while (!g_bStop)
+	{
+		int nEvents = epoll_wait(fdEpoll, events, 256, 100);
+
+		for (int i = 0; i < nEvents; i++)
+		{
+			CONNECTION *pConn = (CONNECTION *)events[i].data.ptr;
+
+			if (events[i].events & EPOLLIN)
+			{
+				nRet = recv(pConn->sd, recvbuf, sizeof(recvbuf), 0);
+				if (nRet <= 0 && !(nRet < 0 && errno == EAGAIN))
+				{
+					pStats->ullErrors++;
+					epoll_ctl(fdEpoll, EPOLL_CTL_DEL, pConn->sd, NULL);
+					continue;
+				}
+				if (nRet > 0)
+				{
+					pStats->ullBytes += nRet;
+					pConn->cbReceived += nRet;
+					while (pConn->cbReceived >= (size_t)g_Options.nMessageSize)
+					{
+						pConn->cbReceived -= g_Options.nMessageSize;
+						pConn->cbToSend += g_Options.nMessageSize;
+						pStats->ullMessages++;
+					}
+				}
+			}
+
+			while (pConn->cbToSend)
+			{
+				nRet = send(pConn->sd, buffer, pConn->cbToSend < sizeof(buffer) ? pConn->cbToSend : sizeof(buffer),
+							MSG_NOSIGNAL);
+				if (nRet <= 0)
+					break;
+				pConn->cbToSend -= nRet;
+			}
+			SetInterest(fdEpoll, pConn, pConn->cbToSend != 0);
+		}
+	}
+
+	for (int i = 0; i < nConnections; i++)
+		if (pConns[i].sd > 0)
+			close(pConns[i].sd);
+	close(fdEpoll);
+	free(pConns);
+	return (NULL);
+}
+
+int main(int argc, char *argv[])
+{
+
+	struct addrinfo hints;
+	pthread_t threads[MAXTHREADS];
+	unsigned long long ullMessages = 0;
+	unsigned long long ullBytes = 0;
+	unsigned long long ullErrors = 0;
+	struct timespec tsStart, tsEnd;
+	double dSeconds = 0;
+	int nRet = 0;
+
+	if (!ValidOptions(argc, argv))
+	{
+		printf("Usage:\n  echoload [-n:host] [-e:port] [-t:threads] [-c:connections] [-s:bytes] [-p:pipeline] [-d:seconds]\n");
+		printf("  -n:host\tServer to connect to (default: localhost)\n");
+		printf("  -e:port\tServer port (default: 5001)\n");
+		printf("  -t:threads\tLoad threads, 1-%d (default: 4)\n", MAXTHREADS);
+		printf("  -c:connections\tConnections in total (default: 64)\n");
+		printf("  -s:bytes\tMessage size (default: 64)\n");
+		printf("  -p:pipeline\tMessages in flight per connection (default: 1)\n");
+		printf("  -d:seconds\tDuration (default: 10)\n");
+		return (1);
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((nRet = getaddrinfo(g_Options.szHostname, g_Options.szPort, &hints, &g_pAddr)) != 0)
+	{
+		printf("getaddrinfo(%s) failed: %s\n", g_Options.szHostname, gai_strerror(nRet));
+		return (1);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &tsStart);
+	for (int i = 0; i < g_Options.nTotalThreads; i++)
+		pthread_create(&threads[i], NULL, LoadThread, &g_Stats[i]);
+
+	sleep(g_Options.nSeconds);
+	g_bStop = true;
+
+	for (int i = 0; i < g_Options.nTotalThreads; i++)
+	{
+		pthread_join(threads[i], NULL);
+		ullMessages += g_Stats[i].ullMessages;
+		ullBytes += g_Stats[i].ullBytes;
+		ullErrors += g_Stats[i].ullErrors;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &tsEnd);
+	dSeconds = (tsEnd.tv_sec - tsStart.tv_sec) + (tsEnd.tv_nsec - tsStart.tv_nsec) / 1e9;
+
+	printf("threads=%d connections=%d size=%d pipeline=%d seconds=%.2f messages=%llu errors=%llu msgs/s=%.0f MB/s=%.1f\n",
+		   g_Options.nTotalThreads, g_Options.nConnections, g_Options.nMessageSize, g_Options.nPipeline,
+		   dSeconds, ullMessages, ullErrors, ullMessages / dSeconds, ullBytes / dSeconds / (1024 * 1024));
+
+	freeaddrinfo(g_pAddr);
+	return (0);
+}
@@ -0,0 +1,214 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Module:
+//      framing.cpp
+//
+// Abstract:
+//      Throughput of the server's length-prefixed framing (server/iocpframe.cpp)
+//      on one core (Linux).  Builds a stream of -n:frames frames with payloads
+//      of up to -s bytes, cuts it into receives of random sizes up to -r
+//      bytes, and runs every receive through FrameReceive with the echo
+//      handler, the way a worker does once the receive has completed.  The
+//      copy into the receive buffer stands for the kernel's and is timed too.
+//      Reports frames per second and the share of bytes that had to be
+//      reassembled, then checks the replies are the stream again.
+//
+//  Usage:
+//      framing [-n:frames] [-s:bytes] [-r:bytes] [-i:iterations]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "iocpserver.h"
+#include "iocpframe.h"
+#include "iocppool.h"
+
+typedef struct _OPTIONS
+{
+	int nFrames;
+	int nPayload;
+	int nRecv;
+	int nIterations;
+} OPTIONS;
+
+static OPTIONS g_Options = {1000000, 32, MAX_BUFF_SIZE, 5};
+
+static bool FrameBenchOptions(int argc, char *argv[])
+{
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (argv[i][0] != '-' || argv[i][1] == '\0')
+			return (false);
+		switch (argv[i][1])
+		{
+		case 'n':
+			if (strlen(argv[i]) > 3)
+				g_Options.nFrames = atoi(&argv[i][3]);
+			if (g_Options.nFrames < 1)
+				return (false);
+			break;
+		case 's':
+			if (strlen(argv[i]) > 3)
+				g_Options.nPayload = atoi(&argv[i][3]);
+			if (g_Options.nPayload < 0 || g_Options.nPayload > FRAME_MAX_SIZE - FRAME_HEADER_SIZE)
+				return (false);
+			break;
+		case 'r':
+			if (strlen(argv[i]) > 3)
+				g_Options.nRecv = atoi(&argv[i][3]);
+			if (g_Options.nRecv < 1 || g_Options.nRecv > MAX_BUFF_SIZE)
+				return (false);
+			break;
+		case 'i':
+			if (strlen(argv[i]) > 3)
+				g_Options.nIterations = atoi(&argv[i][3]);
+			if (g_Options.nIterations < 1)
+				return (false);
+			break;
+		default:
+			return (false);
+		}
+	}
+	return (true);
+}
+
+static double Now(void)
+{
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+//
+// xorshift, so the stream doesn't depend on the C library's rand()
+//
+static unsigned long long NextRandom(unsigned long long *pullState)
+{
+
+	*pullState ^= *pullState << 13;
+	*pullState ^= *pullState >> 7;
+	*pullState ^= *pullState << 17;
+	return (*pullState);
+}
+
+//
+// Run the stream through the framing once.  With pReplies, the replies are
+// appended there and their length returned.
+//
+static size_t FrameStream(const char *pStream, size_t cbStream, char *pBuffer, char *pReplies,
+						  long long *pllFrames, long long *pllCarried)
+{
+
+	FRAME_STATE state = {0};
+	FRAME_OUTPUT output;
+	unsigned long long ullRandom = 0x9E3779B97F4A7C15ULL;
+	size_t cbPos = 0;
+	size_t cbReplies = 0;
+	DWORD cbRecv = 0;
+
+	while (cbPos < cbStream)
+	{
+		cbRecv = (DWORD)(NextRandom(&ullRandom) % g_Options.nRecv) + 1;
+		if (cbRecv > cbStream - cbPos)
+			cbRecv = (DWORD)(cbStream - cbPos);
+		memcpy(pBuffer, pStream + cbPos, cbRecv);
+		cbPos += cbRecv;
+		if (!FrameReceive(&state, pBuffer, cbRecv, FrameEcho, NULL, &output))
+		{
+			printf("FrameReceive() failed at byte %zu\n", cbPos);
+			exit(1);
+		}
+		*pllFrames += output.dwFrames;
+		*pllCarried += output.cbCarry;
+		if (output.pCarry && pReplies)
+		{
+			memcpy(pReplies + cbReplies, output.pCarry, output.cbCarry);
+			cbReplies += output.cbCarry;
+		}
+		if (pReplies)
+		{
+			memcpy(pReplies + cbReplies, pBuffer + output.dwOffset, output.cbReplies);
+			cbReplies += output.cbReplies;
+		}
+		if (output.pCarry)
+			CtxtPoolFree(&g_BufferPool, output.pCarry);
+	}
+	FrameStateFree(&state);
+	return (cbReplies);
+}
+
+int main(int argc, char *argv[])
+{
+
+	char *pStream = NULL;
+	char *pReplies = NULL;
+	char *pBuffer = NULL;
+	size_t cbStream = 0;
+	size_t cbReplies = 0;
+	unsigned long long ullRandom = 1;
+	DWORD cbPayload = 0;
+	long long llFrames = 0;
+	long long llCarried = 0;
+	double dStart = 0.0;
+	double dElapsed = 0.0;
+	bool bMatch = false;
+
+	if (!FrameBenchOptions(argc, argv))
+	{
+		printf("Usage:\n  framing [-n:frames] [-s:bytes] [-r:bytes] [-i:iterations]\n");
+		printf("  -n:frames\tFrames in the stream (default: 1000000)\n");
+		printf("  -s:bytes\tLargest payload, payloads are 0 to this many bytes (default: 32)\n");
+		printf("  -r:bytes\tLargest receive (default: %d)\n", MAX_BUFF_SIZE);
+		printf("  -i:iterations\tTimes the stream is run through (default: 5)\n");
+		return (1);
+	}
+
+	pStream = (char *)malloc((size_t)g_Options.nFrames * (FRAME_HEADER_SIZE + g_Options.nPayload));
+	pReplies = (char *)malloc((size_t)g_Options.nFrames * (FRAME_HEADER_SIZE + g_Options.nPayload));
+	if (pStream == NULL || pReplies == NULL || !CtxtPoolCreate(0, CTXT_POOL_CHUNK))
+	{
+		printf("out of memory for %d frames\n", g_Options.nFrames);
+		return (1);
+	}
+	pBuffer = (char *)CtxtPoolAlloc(&g_BufferPool);
+
+	for (int i = 0; i < g_Options.nFrames; i++)
+	{
+		cbPayload = (DWORD)(NextRandom(&ullRandom) % (g_Options.nPayload + 1));
+		memcpy(pStream + cbStream, &cbPayload, FRAME_HEADER_SIZE);
+		for (DWORD j = 0; j < cbPayload; j++)
+			pStream[cbStream + FRAME_HEADER_SIZE + j] = (char)(i + j);
+		cbStream += FRAME_HEADER_SIZE + cbPayload;
+	}
+
+	dStart = Now();
+	for (int i = 0; i < g_Options.nIterations; i++)
+		FrameStream(pStream, cbStream, pBuffer, NULL, &llFrames, &llCarried);
+	dElapsed = Now() - dStart;
+
+	cbReplies = FrameStream(pStream, cbStream, pBuffer, pReplies, &llFrames, &llCarried);
+	bMatch = (cbReplies == cbStream && memcmp(pReplies, pStream, cbStream) == 0);
+
+	printf("frames=%d max_payload=%d max_recv=%d mframes_per_s=%.2f gb_per_s=%.2f ns_per_frame=%.1f carried_pct=%.2f errors=%d\n",
+		   g_Options.nFrames, g_Options.nPayload, g_Options.nRecv,
+		   (double)g_Options.nFrames * g_Options.nIterations / dElapsed / 1e6,
+		   (double)cbStream * g_Options.nIterations / dElapsed / 1e9,
+		   dElapsed * 1e9 / ((double)g_Options.nFrames * g_Options.nIterations),
+		   100.0 * llCarried / ((double)cbStream * (g_Options.nIterations + 1)),
+		   bMatch ? 0 : 1);
+
+	CtxtPoolFree(&g_BufferPool, pBuffer);
+	CtxtPoolDestroy();
+	free(pReplies);
+	free(pStream);
+	return (bMatch ? 0 : 1);
+}
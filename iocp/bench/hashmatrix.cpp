@@ -0,0 +1,730 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Module:
+//      hashmatrix.cpp
+//
+// Abstract:
+//      The measurements net_demo/hash_table/README.md lists as missing, for
+//      four open addressing designs of a table of 128-bit ids (Linux): linear
+//      probing, Robin Hood, Swiss-style groups of 16 control bytes probed with
+//      SSE2, and the server's cuckoo table (server/iocpcuckoo.cpp).  For every
+//      table, number of keys (-s, 10k to 10M) and load factor (-l, 25 to 90
+//      percent), a table is sized so the keys fill it to that load, its pages
+//      are touched first unless -u is given, and the keys (random, never
+//      zero) are inserted, looked up, and as many absent keys looked up.
+//
+//      The report is CSV on stdout, a header then a row per combination: the
+//      nanoseconds per insert, positive and negative lookup; the mean and
+//      99th percentile probe length of the lookups, counted in slots for
+//      linear probing and Robin Hood, groups for Swiss and buckets for cuckoo;
+//      and the last level cache misses per operation where the kernel exposes
+//      the hardware counter, -1 where it does not (e.g. most VMs).
+//
+//  Usage:
+//      hashmatrix [-t:table,...] [-s:keys,...] [-l:percent,...] [-u]
+//
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "iocpcuckoo.h"
+
+#define MAXLIST 16
+#define PROBES_MAX 4096 // histogram buckets; longer probes count as the last
+#define SWISS_GROUP 16
+#define SWISS_EMPTY 0x80
+
+typedef struct _OPTIONS
+{
+	char szTables[128];
+	DWORD dwKeys[MAXLIST];
+	int nKeys;
+	int nLoads[MAXLIST];
+	int nLoadCount;
+	bool bPrefault;
+} OPTIONS;
+
+static OPTIONS g_Options = {"linear,robinhood,swiss,cuckoo", {10000, 100000, 1000000, 10000000}, 4,
+							{25, 50, 70, 80, 90}, 5, true};
+
+//
+// One design.  Create sizes the table so dwKeys keys fill nLoad percent of
+// it; Find counts the slots, groups or buckets it reads into *pdwProbes when
+// that is not NULL.
+//
+typedef struct _TABLE_OPS
+{
+	const char *szName;
+	const char *szProbeUnit;
+	void *(*pfnCreate)(DWORD dwKeys, int nLoad, DWORD *pdwSlots);
+	void (*pfnPrefault)(void *pTable);
+	bool (*pfnInsert)(void *pTable, const U128 *pKey);
+	bool (*pfnFind)(void *pTable, const U128 *pKey, DWORD *pdwProbes);
+	void (*pfnDestroy)(void *pTable);
+} TABLE_OPS;
+
+//
+// linear probing, Robin Hood and Swiss share a layout: keys in slot order,
+// zero for a free slot, and for Swiss a control byte per slot
+//
+typedef struct _OPEN_TABLE
+{
+	PU128 pKeys;
+	BYTE *pCtrl;
+	DWORD dwSlots;
+	DWORD dwGroups;
+} OPEN_TABLE;
+
+static inline bool KeyEqual(const U128 *pA, const U128 *pB)
+{
+
+	return (((pA->ullLow ^ pB->ullLow) | (pA->ullHigh ^ pB->ullHigh)) == 0);
+}
+
+static inline bool KeyZero(const U128 *pA)
+{
+
+	return ((pA->ullLow | pA->ullHigh) == 0);
+}
+
+//
+// the cuckoo table's mixer, so every design spreads the keys alike
+//
+static inline ULONGLONG KeyHash(const U128 *pKey)
+{
+
+	ULONGLONG ullHash = pKey->ullLow ^ (pKey->ullHigh * 0xC2B2AE3D27D4EB4FULL);
+
+	ullHash ^= ullHash >> 33;
+	ullHash *= 0xFF51AFD7ED558CCDULL;
+	ullHash ^= ullHash >> 33;
+	ullHash *= 0xC4CEB9FE1A85EC53ULL;
+	ullHash ^= ullHash >> 33;
+	return (ullHash);
+}
+
+static inline DWORD HomeSlot(ULONGLONG ullHash, DWORD dwSlots)
+{
+
+	return ((DWORD)(((ullHash >> 32) * dwSlots) >> 32));
+}
+
+static void *OpenCreate(DWORD dwKeys, int nLoad, DWORD *pdwSlots)
+{
+
+	OPEN_TABLE *pTable = (OPEN_TABLE *)calloc(1, sizeof(OPEN_TABLE));
+
+	if (pTable == NULL)
+		return (NULL);
+	pTable->dwSlots = (DWORD)(((ULONGLONG)dwKeys * 100 + nLoad - 1) / nLoad);
+	pTable->pKeys = (PU128)calloc(pTable->dwSlots, sizeof(U128));
+	if (pTable->pKeys == NULL)
+	{
+		free(pTable);
+		return (NULL);
+	}
+	*pdwSlots = pTable->dwSlots;
+	return (pTable);
+}
+
+static void OpenPrefault(void *pTable)
+{
+
+	OPEN_TABLE *pOpen = (OPEN_TABLE *)pTable;
+
+	memset(pOpen->pKeys, 0, (size_t)pOpen->dwSlots * sizeof(U128));
+}
+
+static void OpenDestroy(void *pTable)
+{
+
+	OPEN_TABLE *pOpen = (OPEN_TABLE *)pTable;
+
+	free(pOpen->pKeys);
+	free(pOpen->pCtrl);
+	free(pOpen);
+}
+
+static bool LinearInsert(void *pTable, const U128 *pKey)
+{
+
+	OPEN_TABLE *pOpen = (OPEN_TABLE *)pTable;
+	DWORD dwSlot = HomeSlot(KeyHash(pKey), pOpen->dwSlots);
+
+	while (!KeyZero(&pOpen->pKeys[dwSlot]))
+	{
+		if (KeyEqual(&pOpen->pKeys[dwSlot], pKey))
+			return (false);
+		if (++dwSlot == pOpen->dwSlots)
+			dwSlot = 0;
+	}
+	pOpen->pKeys[dwSlot] = *pKey;
+	return (true);
+}
+
+static bool LinearFind(void *pTable, const U128 *pKey, DWORD *pdwProbes)
+{
+
+	OPEN_TABLE *pOpen = (OPEN_TABLE *)pTable;
+	DWORD dwSlot = HomeSlot(KeyHash(pKey), pOpen->dwSlots);
+	DWORD dwProbes = 1;
+	bool bFound = false;
+
+	for (; !KeyZero(&pOpen->pKeys[dwSlot]); dwProbes++)
+	{
+		if (KeyEqual(&pOpen->pKeys[dwSlot], pKey))
+		{
+			bFound = true;
+			break;
+		}
+		if (++dwSlot == pOpen->dwSlots)
+			dwSlot = 0;
+	}
+	if (pdwProbes)
+		*pdwProbes = dwProbes;
+	return (bFound);
+}
+
+//
+// how far the key in dwSlot lies from its home slot
+//
+static inline DWORD RobinHoodDistance(OPEN_TABLE *pOpen, DWORD dwSlot)
+{
+
+	DWORD dwHome = HomeSlot(KeyHash(&pOpen->pKeys[dwSlot]), pOpen->dwSlots);
+
+	return (dwSlot >= dwHome ? dwSlot - dwHome : dwSlot + pOpen->dwSlots - dwHome);
+}
+
+static bool RobinHoodInsert(void *pTable, const U128 *pKey)
+{
+
+	OPEN_TABLE *pOpen = (OPEN_TABLE *)pTable;
+	DWORD dwSlot = HomeSlot(KeyHash(pKey), pOpen->dwSlots);
+	DWORD dwDistance = 0;
+	DWORD dwOther = 0;
+	U128 key = *pKey;
+	U128 other;
+
+	//
+	// a key further from home than the one in the slot takes the slot, and
+	// the one it displaces goes on looking
+	//
+	while (!KeyZero(&pOpen->pKeys[dwSlot]))
+	{
+		if (KeyEqual(&pOpen->pKeys[dwSlot], &key))
+			return (false);
+		dwOther = RobinHoodDistance(pOpen, dwSlot);
+		if (dwOther < dwDistance)
+		{
+			other = pOpen->pKeys[dwSlot];
+			pOpen->pKeys[dwSlot] = key;
+			key = other;
+			dwDistance = dwOther;
+		}
+		if (++dwSlot == pOpen->dwSlots)
+			dwSlot = 0;
+		dwDistance++;
+	}
+	pOpen->pKeys[dwSlot] = key;
+	return (true);
+}
+
+static bool RobinHoodFind(void *pTable, const U128 *pKey, DWORD *pdwProbes)
+{
+
+	OPEN_TABLE *pOpen = (OPEN_TABLE *)pTable;
+	DWORD dwSlot = HomeSlot(KeyHash(pKey), pOpen->dwSlots);
+	DWORD dwDistance = 0;
+	bool bFound = false;
+
+	//
+	// the keys met are ordered by distance, so one nearer home than the key
+	// would be here ends the search
+	//
+	for (; !KeyZero(&pOpen->pKeys[dwSlot]); dwDistance++)
+	{
+		if (KeyEqual(&pOpen->pKeys[dwSlot], pKey))
+		{
+			bFound = true;
+			break;
+		}
+		if (RobinHoodDistance(pOpen, dwSlot) < dwDistance)
+			break;
+		if (++dwSlot == pOpen->dwSlots)
+			dwSlot = 0;
+	}
+	if (pdwProbes)
+		*pdwProbes = dwDistance + 1;
+	return (bFound);
+}
+
+static void *SwissCreate(DWORD dwKeys, int nLoad, DWORD *pdwSlots)
+{
+
+	OPEN_TABLE *pTable = (OPEN_TABLE *)calloc(1, sizeof(OPEN_TABLE));
+
+	if (pTable == NULL)
+		return (NULL);
+	pTable->dwGroups = (DWORD)(((ULONGLONG)dwKeys * 100 + nLoad * SWISS_GROUP - 1) / (nLoad * SWISS_GROUP));
+	pTable->dwSlots = pTable->dwGroups * SWISS_GROUP;
+	pTable->pKeys = (PU128)calloc(pTable->dwSlots, sizeof(U128));
+	pTable->pCtrl = (BYTE *)aligned_alloc(SWISS_GROUP, pTable->dwSlots);
+	if (pTable->pKeys == NULL || pTable->pCtrl == NULL)
+	{
+		OpenDestroy(pTable);
+		return (NULL);
+	}
+	memset(pTable->pCtrl, SWISS_EMPTY, pTable->dwSlots);
+	*pdwSlots = pTable->dwSlots;
+	return (pTable);
+}
+
+//
+// a bit per control byte of the group equal to bValue
+//
+static inline DWORD SwissMatch(const BYTE *pGroup, BYTE bValue)
+{
+
+#ifdef __SSE2__
+	__m128i ctrl = _mm_load_si128((const __m128i *)pGroup);
+
+	return ((DWORD)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)bValue))));
+#else
+	DWORD dwMask = 0;
+
+	for (int i = 0; i < SWISS_GROUP; i++)
+		dwMask |= (DWORD)(pGroup[i] == bValue) << i;
+	return (dwMask);
+#endif
+}
+
+//
+// Look the key up group by group; the group index is the high hash bits
+// scaled, the control byte the low seven.  An absent key ends at the first
+// group with a free slot, where *pdwFree is set for an insert.
+//
+static inline bool SwissLookup(OPEN_TABLE *pOpen, const U128 *pKey, DWORD *pdwProbes, DWORD *pdwFree)
+{
+
+	ULONGLONG ullHash = KeyHash(pKey);
+	DWORD dwGroup = HomeSlot(ullHash, pOpen->dwGroups);
+	BYTE bTag = (BYTE)(ullHash & 0x7F);
+	DWORD dwMatch = 0;
+	DWORD dwEmpty = 0;
+	DWORD dwSlot = 0;
+
+	for (DWORD dwProbes = 1;; dwProbes++)
+	{
+		for (dwMatch = SwissMatch(&pOpen->pCtrl[dwGroup * SWISS_GROUP], bTag); dwMatch; dwMatch &= dwMatch - 1)
+		{
+			dwSlot = dwGroup * SWISS_GROUP + __builtin_ctz(dwMatch);
+			if (KeyEqual(&pOpen->pKeys[dwSlot], pKey))
+			{
+				*pdwProbes = dwProbes;
+				return (true);
+			}
+		}
+		dwEmpty = SwissMatch(&pOpen->pCtrl[dwGroup * SWISS_GROUP], SWISS_EMPTY);
+		if (dwEmpty)
+		{
+			*pdwProbes = dwProbes;
+			*pdwFree = dwGroup * SWISS_GROUP + __builtin_ctz(dwEmpty);
+			return (false);
+		}
+		if (++dwGroup == pOpen->dwGroups)
+			dwGroup = 0;
+	}
+}
+
+static bool SwissInsert(void *pTable, const U128 *pKey)
+{
+
+	OPEN_TABLE *pOpen = (OPEN_TABLE *)pTable;
+	DWORD dwProbes = 0;
+	DWORD dwFree = 0;
+
+	if (SwissLookup(pOpen, pKey, &dwProbes, &dwFree))
+		return (false);
+	pOpen->pCtrl[dwFree] = (BYTE)(KeyHash(pKey) & 0x7F);
+	pOpen->pKeys[dwFree] = *pKey;
+	return (true);
+}
+
+static bool SwissFind(void *pTable, const U128 *pKey, DWORD *pdwProbes)
+{
+
+	DWORD dwProbes = 0;
+	DWORD dwFree = 0;
+	bool bFound = SwissLookup((OPEN_TABLE *)pTable, pKey, &dwProbes, &dwFree);
+
+	if (pdwProbes)
+		*pdwProbes = dwProbes;
+	return (bFound);
+}
+
+static void *CuckooBenchCreate(DWORD dwKeys, int nLoad, DWORD *pdwSlots)
+{
+
+	PCUCKOO_TABLE pTable = (PCUCKOO_TABLE)malloc(sizeof(CUCKOO_TABLE));
+
+	//
+	// the table is sized for its capacity at CUCKOO_LOAD_MAX, so ask for the
+	// capacity that puts dwKeys at nLoad
+	//
+	if (pTable == NULL || !CuckooCreate(pTable, (DWORD)((ULONGLONG)dwKeys * CUCKOO_LOAD_MAX / nLoad), 0))
+	{
+		free(pTable);
+		return (NULL);
+	}
+	*pdwSlots = pTable->dwBuckets * CUCKOO_SLOTS;
+	return (pTable);
+}
+
+static void CuckooBenchPrefault(void *pTable)
+{
+
+	PCUCKOO_TABLE pCuckoo = (PCUCKOO_TABLE)pTable;
+
+	memset(pCuckoo->pBuckets, 0, (size_t)pCuckoo->dwBuckets * sizeof(CUCKOO_BUCKET));
+}
+
+static bool CuckooBenchInsert(void *pTable, const U128 *pKey)
+{
+
+	LPVOID pValue = NULL;
+
+	return (CuckooInsert((PCUCKOO_TABLE)pTable, pKey, &pValue) == CUCKOO_INSERTED);
+}
+
+static bool CuckooBenchFind(void *pTable, const U128 *pKey, DWORD *pdwProbes)
+{
+
+	LPVOID pValue = NULL;
+
+	if (pdwProbes)
+		*pdwProbes = CuckooProbeLength((PCUCKOO_TABLE)pTable, pKey);
+	return (CuckooFind((PCUCKOO_TABLE)pTable, pKey, &pValue));
+}
+
+static void CuckooBenchDestroy(void *pTable)
+{
+
+	CuckooDestroy((PCUCKOO_TABLE)pTable);
+	free(pTable);
+}
+
+static const TABLE_OPS g_Tables[] = {
+	{"linear", "slots", OpenCreate, OpenPrefault, LinearInsert, LinearFind, OpenDestroy},
+	{"robinhood", "slots", OpenCreate, OpenPrefault, RobinHoodInsert, RobinHoodFind, OpenDestroy},
+	{"swiss", "groups", SwissCreate, OpenPrefault, SwissInsert, SwissFind, OpenDestroy},
+	{"cuckoo", "buckets", CuckooBenchCreate, CuckooBenchPrefault, CuckooBenchInsert, CuckooBenchFind,
+	 CuckooBenchDestroy},
+	{NULL}};
+
+//
+// parse "a,b,c" into at most MAXLIST numbers from llMin to llMax
+//
+static int ParseList(const char *szList, long long *pllValues, long long llMin, long long llMax)
+{
+
+	int nValues = 0;
+	char *pEnd = NULL;
+
+	while (*szList && nValues < MAXLIST)
+	{
+		pllValues[nValues] = strtoll(szList, &pEnd, 10);
+		if (pEnd == szList || pllValues[nValues] < llMin || pllValues[nValues] > llMax)
+			return (0);
+		nValues++;
+		szList = (*pEnd == ',') ? pEnd + 1 : pEnd;
+		if (*pEnd != ',' && *pEnd != '\0')
+			return (0);
+	}
+	return (nValues);
+}
+
+static bool HashMatrixOptions(int argc, char *argv[])
+{
+
+	long long llValues[MAXLIST];
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (argv[i][0] != '-' || argv[i][1] == '\0')
+			return (false);
+		switch (argv[i][1])
+		{
+		case 't':
+			if (strlen(argv[i]) <= 3)
+				return (false);
+			snprintf(g_Options.szTables, sizeof(g_Options.szTables), "%s", &argv[i][3]);
+			break;
+		case 's':
+			g_Options.nKeys = strlen(argv[i]) > 3 ? ParseList(&argv[i][3], llValues, 1, 0x7FFFFFFF / 4) : 0;
+			if (g_Options.nKeys == 0)
+				return (false);
+			for (int j = 0; j < g_Options.nKeys; j++)
+				g_Options.dwKeys[j] = (DWORD)llValues[j];
+			break;
+		case 'l':
+			g_Options.nLoadCount = strlen(argv[i]) > 3 ? ParseList(&argv[i][3], llValues, 1, 95) : 0;
+			if (g_Options.nLoadCount == 0)
+				return (false);
+			for (int j = 0; j < g_Options.nLoadCount; j++)
+				g_Options.nLoads[j] = (int)llValues[j];
+			break;
+		case 'u':
+			g_Options.bPrefault = false;
+			break;
+		default:
+			return (false);
+		}
+	}
+	return (true);
+}
+
+static double Now(void)
+{
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+//
+// xorshift, so the keys don't depend on the C library's rand()
+//
+static unsigned long long NextRandom(unsigned long long *pullState)
+{
+
+	*pullState ^= *pullState << 13;
+	*pullState ^= *pullState >> 7;
+	*pullState ^= *pullState << 17;
+	return (*pullState);
+}
+
+//
+// Random keys, never zero; the top bit of the high half tells the keys that
+// are inserted from the ones that are not, so none is both.
+//
+static void MakeKeys(PU128 pKeys, DWORD dwKeys, unsigned long long ullSeed, bool bInserted)
+{
+
+	for (DWORD i = 0; i < dwKeys; i++)
+	{
+		pKeys[i].ullLow = NextRandom(&ullSeed) | 1;
+		pKeys[i].ullHigh = NextRandom(&ullSeed) & ~(1ULL << 63);
+		if (!bInserted)
+			pKeys[i].ullHigh |= 1ULL << 63;
+	}
+}
+
+//
+// last level cache misses of this thread in user mode, -1 if the counter
+// can't be opened
+//
+static int CacheMissCounter(void)
+{
+
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return ((int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+}
+
+static void CounterStart(int fdCounter)
+{
+
+	if (fdCounter < 0)
+		return;
+	ioctl(fdCounter, PERF_EVENT_IOC_RESET, 0);
+	ioctl(fdCounter, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+static double CounterStop(int fdCounter, DWORD dwOps)
+{
+
+	long long llCount = 0;
+
+	if (fdCounter < 0)
+		return (-1.0);
+	ioctl(fdCounter, PERF_EVENT_IOC_DISABLE, 0);
+	if (read(fdCounter, &llCount, sizeof(llCount)) != sizeof(llCount))
+		return (-1.0);
+	return ((double)llCount / dwOps);
+}
+
+//
+// mean and 99th percentile of a probe length histogram
+//
+static void ProbeStats(const unsigned long long *pullHistogram, DWORD dwOps, double *pdMean, int *pnP99)
+{
+
+	unsigned long long ullSeen = 0;
+	double dSum = 0.0;
+
+	*pnP99 = -1;
+	for (int i = 0; i < PROBES_MAX; i++)
+	{
+		dSum += (double)i * pullHistogram[i];
+		ullSeen += pullHistogram[i];
+		if (*pnP99 < 0 && ullSeen * 100 >= (unsigned long long)dwOps * 99)
+			*pnP99 = i;
+	}
+	*pdMean = dSum / dwOps;
+}
+
+//
+// Time one phase's lookups, then count their probe lengths in a second pass
+// so the counting doesn't weigh on the time.  Returns the keys found.
+//
+static DWORD LookupPhase(const TABLE_OPS *pOps, void *pTable, PU128 pKeys, DWORD dwKeys, int fdCounter,
+						 double *pdNs, double *pdMisses, double *pdProbeMean, int *pnProbeP99)
+{
+
+	static unsigned long long ullHistogram[PROBES_MAX];
+	DWORD dwFound = 0;
+	DWORD dwProbes = 0;
+	double dStart = 0.0;
+
+	CounterStart(fdCounter);
+	dStart = Now();
+	for (DWORD i = 0; i < dwKeys; i++)
+		dwFound += pOps->pfnFind(pTable, &pKeys[i], NULL);
+	*pdNs = (Now() - dStart) * 1e9 / dwKeys;
+	*pdMisses = CounterStop(fdCounter, dwKeys);
+
+	memset(ullHistogram, 0, sizeof(ullHistogram));
+	for (DWORD i = 0; i < dwKeys; i++)
+	{
+		pOps->pfnFind(pTable, &pKeys[i], &dwProbes);
+		ullHistogram[dwProbes < PROBES_MAX ? dwProbes : PROBES_MAX - 1]++;
+	}
+	ProbeStats(ullHistogram, dwKeys, pdProbeMean, pnProbeP99);
+	return (dwFound);
+}
+
+static bool RunOne(const TABLE_OPS *pOps, DWORD dwKeys, int nLoad, PU128 pKeys, PU128 pAbsent, int fdCounter)
+{
+
+	void *pTable = NULL;
+	DWORD dwSlots = 0;
+	DWORD dwFailed = 0;
+	DWORD dwFound = 0;
+	DWORD dwFalse = 0;
+	double dStart = 0.0;
+	double dInsertNs = 0.0;
+	double dInsertMisses = 0.0;
+	double dPosNs = 0.0, dPosMisses = 0.0, dPosMean = 0.0;
+	double dNegNs = 0.0, dNegMisses = 0.0, dNegMean = 0.0;
+	int nPosP99 = 0;
+	int nNegP99 = 0;
+
+	pTable = pOps->pfnCreate(dwKeys, nLoad, &dwSlots);
+	if (pTable == NULL)
+	{
+		fprintf(stderr, "%s: out of memory for %u keys at %d%%\n", pOps->szName, dwKeys, nLoad);
+		return (false);
+	}
+	if (g_Options.bPrefault)
+		pOps->pfnPrefault(pTable);
+
+	CounterStart(fdCounter);
+	dStart = Now();
+	for (DWORD i = 0; i < dwKeys; i++)
+		dwFailed += !pOps->pfnInsert(pTable, &pKeys[i]);
+	dInsertNs = (Now() - dStart) * 1e9 / dwKeys;
+	dInsertMisses = CounterStop(fdCounter, dwKeys);
+
+	dwFound = LookupPhase(pOps, pTable, pKeys, dwKeys, fdCounter, &dPosNs, &dPosMisses, &dPosMean, &nPosP99);
+	dwFalse = LookupPhase(pOps, pTable, pAbsent, dwKeys, fdCounter, &dNegNs, &dNegMisses, &dNegMean, &nNegP99);
+
+	printf("%s,%u,%d,%.1f,%u,%d,%.1f,%.1f,%.1f,%.2f,%d,%.2f,%d,%s,%.2f,%.2f,%.2f,%u,%u\n", pOps->szName, dwKeys,
+		   nLoad, 100.0 * (dwKeys - dwFailed) / dwSlots, dwSlots, g_Options.bPrefault ? 1 : 0, dInsertNs, dPosNs,
+		   dNegNs, dPosMean, nPosP99, dNegMean, nNegP99, pOps->szProbeUnit, dInsertMisses, dPosMisses, dNegMisses,
+		   dwFailed, (dwKeys - dwFailed - dwFound) + dwFalse);
+	fflush(stdout);
+
+	pOps->pfnDestroy(pTable);
+	return (dwFound + dwFailed == dwKeys && dwFalse == 0);
+}
+
+int main(int argc, char *argv[])
+{
+
+	PU128 pKeys = NULL;
+	PU128 pAbsent = NULL;
+	DWORD dwMaxKeys = 0;
+	int fdCounter = -1;
+	bool bOk = true;
+	char szName[32];
+	char szList[sizeof(g_Options.szTables) + 2];
+
+	if (!HashMatrixOptions(argc, argv))
+	{
+		printf("Usage:\n  hashmatrix [-t:table,...] [-s:keys,...] [-l:percent,...] [-u]\n");
+		printf("  -t:table,...\tTables: linear, robinhood, swiss, cuckoo (default: all)\n");
+		printf("  -s:keys,...\tKeys inserted (default: 10000,100000,1000000,10000000)\n");
+		printf("  -l:percent,...\tLoad factors, 1-95 (default: 25,50,70,80,90)\n");
+		printf("  -u\t\tLeave the tables' pages untouched before inserting (default: touch them)\n");
+		return (1);
+	}
+
+	for (int i = 0; i < g_Options.nKeys; i++)
+		if (g_Options.dwKeys[i] > dwMaxKeys)
+			dwMaxKeys = g_Options.dwKeys[i];
+	pKeys = (PU128)malloc((size_t)dwMaxKeys * sizeof(U128));
+	pAbsent = (PU128)malloc((size_t)dwMaxKeys * sizeof(U128));
+	if (pKeys == NULL || pAbsent == NULL)
+	{
+		fprintf(stderr, "out of memory for %u keys\n", dwMaxKeys);
+		return (1);
+	}
+	MakeKeys(pKeys, dwMaxKeys, 0x9E3779B97F4A7C15ULL, true);
+	MakeKeys(pAbsent, dwMaxKeys, 0xD1B54A32D192ED03ULL, false);
+
+	fdCounter = CacheMissCounter();
+	if (fdCounter < 0)
+		fprintf(stderr, "no cache miss counter (%s), misses reported as -1\n", strerror(errno));
+
+	printf("table,keys,load_pct,actual_load_pct,slots,prefaulted,insert_ns,pos_lookup_ns,neg_lookup_ns,"
+		   "pos_probe_mean,pos_probe_p99,neg_probe_mean,neg_probe_p99,probe_unit,"
+		   "insert_misses,pos_lookup_misses,neg_lookup_misses,failed_inserts,errors\n");
+	snprintf(szList, sizeof(szList), ",%s,", g_Options.szTables);
+	for (int t = 0; g_Tables[t].szName; t++)
+	{
+		snprintf(szName, sizeof(szName), ",%s,", g_Tables[t].szName);
+		if (strstr(szList, szName) == NULL)
+			continue;
+		for (int s = 0; s < g_Options.nKeys; s++)
+			for (int l = 0; l < g_Options.nLoadCount; l++)
+				bOk &= RunOne(&g_Tables[t], g_Options.dwKeys[s], g_Options.nLoads[l], pKeys, pAbsent, fdCounter);
+	}
+
+	if (fdCounter >= 0)
+		close(fdCounter);
+	free(pKeys);
+	free(pAbsent);
+	return (bOk ? 0 : 1);
+}
@@ -0,0 +1,217 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Module:
+//      idlemem.cpp
+//
+// Abstract:
+//      Resident memory of the echo server per idle connection (Linux).  Reads
+//      the server's VmRSS from /proc, opens the requested number of connections
+//      and leaves them idle, optionally after echoing one message on each, then
+//      reads VmRSS again and reports the difference scaled to 10k connections.
+//      Both processes need a file descriptor limit above the connection count.
+//
+//  Usage:
+//      idlemem -p:pid [-n:host] [-e:port] [-c:connections] [-s:bytes] [-d:seconds]
+//
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define IOBUFSIZE (64 * 1024)
+
+typedef struct _OPTIONS
+{
+	char szHostname[64];
+	char szPort[16];
+	int nPid;
+	int nConnections;
+	int nMessageSize;
+	int nSeconds;
+} OPTIONS;
+
+static OPTIONS g_Options = {"localhost", "5001", 0, 10000, 0, 2};
+
+static bool ValidOptions(int argc, char *argv[])
+{
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (argv[i][0] != '-' || argv[i][1] == '\0')
+			return (false);
+		switch (argv[i][1])
+		{
+		case 'n':
+			if (strlen(argv[i]) > 3)
+				snprintf(g_Options.szHostname, sizeof(g_Options.szHostname), "%s", &argv[i][3]);
+			break;
+		case 'e':
+			if (strlen(argv[i]) > 3)
+				snprintf(g_Options.szPort, sizeof(g_Options.szPort), "%s", &argv[i][3]);
+			break;
+		case 'p':
+			if (strlen(argv[i]) > 3)
+				g_Options.nPid = atoi(&argv[i][3]);
+			break;
+		case 'c':
+			if (strlen(argv[i]) > 3)
+				g_Options.nConnections = atoi(&argv[i][3]);
+			if (g_Options.nConnections < 1)
+				return (false);
+			break;
+		case 's':
+			if (strlen(argv[i]) > 3)
+				g_Options.nMessageSize = atoi(&argv[i][3]);
+			if (g_Options.nMessageSize < 0 || g_Options.nMessageSize > IOBUFSIZE)
+				return (false);
+			break;
+		case 'd':
+			if (strlen(argv[i]) > 3)
+				g_Options.nSeconds = atoi(&argv[i][3]);
+			if (g_Options.nSeconds < 0)
+				return (false);
+			break;
+		default:
+			return (false);
+		}
+	}
+	return (g_Options.nPid > 0);
+}
+
+//
+// VmRSS of a process in KB, -1 if it can't be read
+//
+static long ReadRss(int nPid)
+{
+
+	char szPath[64];
+	char szLine[256];
+	long lRss = -1;
+	FILE *fp = NULL;
+
+	snprintf(szPath, sizeof(szPath), "/proc/%d/status", nPid);
+	if ((fp = fopen(szPath, "r")) == NULL)
+		return (-1);
+	while (fgets(szLine, sizeof(szLine), fp))
+	{
+		if (strncmp(szLine, "VmRSS:", 6) == 0)
+		{
+			lRss = atol(&szLine[6]);
+			break;
+		}
+	}
+	fclose(fp);
+	return (lRss);
+}
+
+//
+// send one message and wait until all of it has come back
+//
+static bool Echo(int sd, char *buffer)
+{
+
+	ssize_t nRet = 0;
+	int nReceived = 0;
+
+	if (send(sd, buffer, g_Options.nMessageSize, MSG_NOSIGNAL) != g_Options.nMessageSize)
+		return (false);
+	while (nReceived < g_Options.nMessageSize)
+	{
+		nRet = recv(sd, buffer, g_Options.nMessageSize - nReceived, 0);
+		if (nRet <= 0)
+			return (false);
+		nReceived += (int)nRet;
+	}
+	return (true);
+}
+
+int main(int argc, char *argv[])
+{
+
+	struct addrinfo hints;
+	struct addrinfo *pAddr = NULL;
+	struct rlimit rl;
+	static char buffer[IOBUFSIZE];
+	int *pSockets = NULL;
+	int nOpen = 0;
+	int nOne = 1;
+	long lBefore = 0;
+	long lAfter = 0;
+	int nRet = 0;
+
+	if (!ValidOptions(argc, argv))
+	{
+		printf("Usage:\n  idlemem -p:pid [-n:host] [-e:port] [-c:connections] [-s:bytes] [-d:seconds]\n");
+		printf("  -p:pid\tProcess id of the server to measure\n");
+		printf("  -n:host\tServer to connect to (default: localhost)\n");
+		printf("  -e:port\tServer port (default: 5001)\n");
+		printf("  -c:connections\tIdle connections to open (default: 10000)\n");
+		printf("  -s:bytes\tEcho one message of this size on each first (default: 0, none)\n");
+		printf("  -d:seconds\tTime for the server to settle before measuring (default: 2)\n");
+		return (1);
+	}
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+	{
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((nRet = getaddrinfo(g_Options.szHostname, g_Options.szPort, &hints, &pAddr)) != 0)
+	{
+		printf("getaddrinfo(%s) failed: %s\n", g_Options.szHostname, gai_strerror(nRet));
+		return (1);
+	}
+
+	if ((lBefore = ReadRss(g_Options.nPid)) < 0)
+	{
+		printf("can't read VmRSS of process %d\n", g_Options.nPid);
+		return (1);
+	}
+
+	pSockets = (int *)calloc(g_Options.nConnections, sizeof(int));
+	for (nOpen = 0; nOpen < g_Options.nConnections; nOpen++)
+	{
+		pSockets[nOpen] = socket(pAddr->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (pSockets[nOpen] < 0)
+		{
+			printf("socket failed after %d connections: %s\n", nOpen, strerror(errno));
+			break;
+		}
+		setsockopt(pSockets[nOpen], IPPROTO_TCP, TCP_NODELAY, &nOne, sizeof(nOne));
+		if (connect(pSockets[nOpen], pAddr->ai_addr, pAddr->ai_addrlen) != 0 ||
+			(g_Options.nMessageSize && !Echo(pSockets[nOpen], buffer)))
+		{
+			printf("connection %d failed: %s\n", nOpen, strerror(errno));
+			close(pSockets[nOpen]);
+			break;
+		}
+	}
+
+	sleep(g_Options.nSeconds);
+	lAfter = ReadRss(g_Options.nPid);
+
+	printf("connections=%d message=%d rss_before=%ldKB rss_after=%ldKB per_connection=%.0fB per_10k=%.1fMB\n",
+		   nOpen, g_Options.nMessageSize, lBefore, lAfter,
+		   nOpen ? (lAfter - lBefore) * 1024.0 / nOpen : 0.0,
+		   nOpen ? (lAfter - lBefore) * 10000.0 / nOpen / 1024.0 : 0.0);
+
+	for (int i = 0; i < nOpen; i++)
+		close(pSockets[i]);
+	free(pSockets);
+	freeaddrinfo(pAddr);
+	return (0);
+}
@@ -0,0 +1,608 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Module:
+//      ledger.cpp
+//
+// Abstract:
+//      Transfers per second through the ledger frame handler
+//      (server/iocpledger.cpp), on Linux.  Frames carry -b:batch transfers
+//      between -a:accounts accounts picked at random.
+//
+//      Without -e the frames are built into a stream of -n:transfers
+//      transfers and run in process, on one core, through FrameReceive in
+//      MAX_BUFF_SIZE receives, the way a worker does once the receive has
+//      completed; the copy into the receive buffer stands for the kernel's.
+//      With -s:receives they go through a worker's batch step instead:
+//      FrameCollect on that many receives, LedgerHandleBatch on all their
+//      frames at once, then FramePack on each.
+//
+//      With -e:port the frames go to a server started with -f:ledger over
+//      -c:connections connections shared by -t:threads threads, each keeping
+//      -p:pipeline frames in flight, for -d:seconds.  Every transfer sent has
+//      an id of its own, so none is answered LEDGER_EXISTS.
+//
+//      Either way every result code is checked, and the report is transfers
+//      per second and the number that came back other than LEDGER_OK.
+//
+//  Usage:
+//      ledger [-n:transfers] [-b:batch] [-a:accounts] [-i:iterations] [-s:receives]
+//      ledger -e:port [-b:batch] [-a:accounts] [-t:threads] [-c:connections]
+//             [-p:pipeline] [-d:seconds]
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "iocpserver.h"
+#include "iocpframe.h"
+#include "iocpledger.h"
+#include "iocppool.h"
+
+#define MAXTHREADS 256
+#define STREAMFRAMES 1024 // frames each connection cycles through
+#define MAXSTEP 256		  // receives in a batch step, as in a completion batch
+
+typedef struct _OPTIONS
+{
+	char szPort[16];
+	int nTransfers;
+	int nBatch;
+	int nAccounts;
+	int nIterations;
+	int nStep;
+	int nTotalThreads;
+	int nConnections;
+	int nPipeline;
+	int nSeconds;
+} OPTIONS;
+
+typedef struct _CONNECTION
+{
+	int sd;
+	char *pFrames;		  // -p:pipeline frames, sent in turn
+	size_t cbToSend;
+	size_t cbSent;		  // into pFrames, wraps at its end
+	size_t cbReply;		  // bytes of the reply being received
+	int nOldest;		  // frame answered next
+	int nStream;		  // stream frame it is refilled from
+	unsigned long long ullIdHigh; // high half of its transfer ids
+	unsigned long long ullId;	  // low half of the last one used
+	bool bWantWrite;
+} CONNECTION;
+
+typedef struct _THREADSTATS
+{
+	unsigned long long ullTransfers;
+	unsigned long long ullRejected;
+	unsigned long long ullErrors;
+	char pad[40];
+} THREADSTATS;
+
+static OPTIONS g_Options = {"", 1000000, 32, 10000, 5, 1, 4, 64, 4, 10};
+static THREADSTATS g_Stats[MAXTHREADS];
+static struct addrinfo *g_pAddr = NULL;
+static char *g_pStream = NULL;
+static size_t g_cbStream = 0;
+static volatile bool g_bStop = false;
+
+static bool LedgerBenchOptions(int argc, char *argv[])
+{
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (argv[i][0] != '-' || argv[i][1] == '\0')
+			return (false);
+		switch (argv[i][1])
+		{
+		case 'e':
+			if (strlen(argv[i]) <= 3)
+				return (false);
+			snprintf(g_Options.szPort, sizeof(g_Options.szPort), "%s", &argv[i][3]);
+			break;
+		case 'n':
+			if (strlen(argv[i]) > 3)
+				g_Options.nTransfers = atoi(&argv[i][3]);
+			if (g_Options.nTransfers < 1)
+				return (false);
+			break;
+		case 'b':
+			if (strlen(argv[i]) > 3)
+				g_Options.nBatch = atoi(&argv[i][3]);
+			if (g_Options.nBatch < 1 || g_Options.nBatch > (int)LEDGER_BATCH_MAX)
+				return (false);
+			break;
+		case 'a':
+			if (strlen(argv[i]) > 3)
+				g_Options.nAccounts = atoi(&argv[i][3]);
+			if (g_Options.nAccounts < 2 || g_Options.nAccounts > LEDGER_ACCOUNTS_MAX)
+				return (false);
+			break;
+		case 'i':
+			if (strlen(argv[i]) > 3)
+				g_Options.nIterations = atoi(&argv[i][3]);
+			if (g_Options.nIterations < 1)
+				return (false);
+			break;
+		case 's':
+			if (strlen(argv[i]) > 3)
+				g_Options.nStep = atoi(&argv[i][3]);
+			if (g_Options.nStep < 1 || g_Options.nStep > MAXSTEP)
+				return (false);
+			break;
+		case 't':
+			if (strlen(argv[i]) > 3)
+				g_Options.nTotalThreads = atoi(&argv[i][3]);
+			if (g_Options.nTotalThreads < 1 || g_Options.nTotalThreads > MAXTHREADS)
+				return (false);
+			break;
+		case 'c':
+			if (strlen(argv[i]) > 3)
+				g_Options.nConnections = atoi(&argv[i][3]);
+			if (g_Options.nConnections < 1)
+				return (false);
+			break;
+		case 'p':
+			if (strlen(argv[i]) > 3)
+				g_Options.nPipeline = atoi(&argv[i][3]);
+			if (g_Options.nPipeline < 1 || g_Options.nPipeline > STREAMFRAMES)
+				return (false);
+			break;
+		case 'd':
+			if (strlen(argv[i]) > 3)
+				g_Options.nSeconds = atoi(&argv[i][3]);
+			if (g_Options.nSeconds < 1)
+				return (false);
+			break;
+		default:
+			return (false);
+		}
+	}
+	return (true);
+}
+
+static double Now(void)
+{
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+//
+// xorshift, so the stream doesn't depend on the C library's rand()
+//
+static unsigned long long NextRandom(unsigned long long *pullState)
+{
+
+	*pullState ^= *pullState << 13;
+	*pullState ^= *pullState >> 7;
+	*pullState ^= *pullState << 17;
+	return (*pullState);
+}
+
+static void AccountId(U128 *pId, unsigned long long ullAccount)
+{
+
+	pId->ullLow = ullAccount + 1;
+	pId->ullHigh = ullAccount * 0x9E3779B97F4A7C15ULL;
+}
+
+//
+// nFrames frames of g_Options.nBatch transfers, written back to back from
+// g_pStream on, llTransfers in all
+//
+static bool BuildStream(int nFrames, long long llTransfers)
+{
+
+	unsigned long long ullRandom = 1;
+	unsigned long long ullDebit = 0;
+	unsigned long long ullCredit = 0;
+	long long llId = 0;
+	DWORD cbPayload = 0;
+	TRANSFER *pTransfer = NULL;
+
+	g_pStream = (char *)calloc(nFrames, FRAME_HEADER_SIZE + g_Options.nBatch * sizeof(TRANSFER));
+	if (g_pStream == NULL)
+		return (false);
+	for (int i = 0; i < nFrames && llId < llTransfers; i++)
+	{
+		cbPayload = (DWORD)((llTransfers - llId < g_Options.nBatch ? llTransfers - llId : g_Options.nBatch) *
+							sizeof(TRANSFER));
+		memcpy(g_pStream + g_cbStream, &cbPayload, FRAME_HEADER_SIZE);
+		pTransfer = (TRANSFER *)(g_pStream + g_cbStream + FRAME_HEADER_SIZE);
+		for (DWORD j = 0; j < cbPayload / sizeof(TRANSFER); j++, pTransfer++)
+		{
+			ullDebit = NextRandom(&ullRandom) % g_Options.nAccounts;
+			ullCredit = (ullDebit + 1 + NextRandom(&ullRandom) % (g_Options.nAccounts - 1)) % g_Options.nAccounts;
+			pTransfer->Id.ullLow = (unsigned long long)++llId;
+			AccountId(&pTransfer->DebitId, ullDebit);
+			AccountId(&pTransfer->CreditId, ullCredit);
+			pTransfer->ullAmount = 1 + NextRandom(&ullRandom) % 100;
+		}
+		g_cbStream += FRAME_HEADER_SIZE + cbPayload;
+	}
+	return (true);
+}
+
+//
+// Give the frame's transfers the ids ullHigh:*pullId + 1 on, so no two sent
+// are alike and the ledger never answers LEDGER_EXISTS.
+//
+static void StampFrame(char *pFrame, unsigned long long ullHigh, unsigned long long *pullId)
+{
+
+	TRANSFER *pTransfer = (TRANSFER *)(pFrame + FRAME_HEADER_SIZE);
+
+	for (int i = 0; i < g_Options.nBatch; i++, pTransfer++)
+	{
+		pTransfer->Id.ullLow = ++*pullId;
+		pTransfer->Id.ullHigh = ullHigh;
+	}
+}
+
+//
+// count the result codes in a run of reply bytes, cbReply bytes into a reply
+// of cbFrame bytes; returns the replies completed
+//
+static int CountReplies(const char *pReply, size_t cbReply, size_t *pcbPos, size_t cbFrame,
+						unsigned long long *pullTransfers, unsigned long long *pullRejected)
+{
+
+	int nReplies = 0;
+
+	for (size_t i = 0; i < cbReply; i++)
+	{
+		if (*pcbPos >= FRAME_HEADER_SIZE)
+		{
+			(*pullTransfers)++;
+			*pullRejected += (pReply[i] != LEDGER_OK);
+		}
+		if (++*pcbPos == cbFrame)
+		{
+			*pcbPos = 0;
+			nReplies++;
+		}
+	}
+	return (nReplies);
+}
+
+//
+// count the replies one receive came to, the carry's first, and give the
+// carry back
+//
+static void CountOutput(char *pBuffer, PFRAME_OUTPUT pOutput, size_t *pcbReply, unsigned long long *pullTransfers,
+						unsigned long long *pullRejected)
+{
+
+	if (pOutput->pCarry)
+	{
+		CountReplies(pOutput->pCarry, pOutput->cbCarry, pcbReply, FRAME_HEADER_SIZE + g_Options.nBatch,
+					 pullTransfers, pullRejected);
+		CtxtPoolFree(&g_BufferPool, pOutput->pCarry);
+	}
+	CountReplies(pBuffer + pOutput->dwOffset, pOutput->cbReplies, pcbReply, FRAME_HEADER_SIZE + g_Options.nBatch,
+				 pullTransfers, pullRejected);
+}
+
+static int RunInProcess(void)
+{
+
+	FRAME_STATE state = {0};
+	FRAME_OUTPUT output;
+	FRAME_BATCH batch = {0};
+	FRAME_OUTPUT outputs[MAXSTEP];
+	char *apBuffers[MAXSTEP] = {0};
+	char *pBuffer = NULL;
+	int nReceives = 0;
+	size_t cbPos = 0;
+	size_t cbReply = 0;
+	DWORD cbRecv = 0;
+	unsigned long long ullTransfers = 0;
+	unsigned long long ullRejected = 0;
+	unsigned long long ullId = 0;
+	size_t cbFrame = FRAME_HEADER_SIZE + g_Options.nBatch * sizeof(TRANSFER);
+	double dStart = 0.0;
+	double dElapsed = 0.0;
+	int nFrames = (g_Options.nTransfers + g_Options.nBatch - 1) / g_Options.nBatch;
+
+	//
+	// whole frames only, so every reply is as long as the next
+	//
+	g_Options.nTransfers = nFrames * g_Options.nBatch;
+	if (!BuildStream(nFrames, g_Options.nTransfers) || !CtxtPoolCreate(0, CTXT_POOL_CHUNK) || !LedgerCreate() ||
+		!FrameBatchCreate(&batch, MAX_BUFF_SIZE, FRAME_BATCH_MAX))
+	{
+		printf("out of memory for %d transfers\n", g_Options.nTransfers);
+		return (1);
+	}
+	for (int i = 0; i < g_Options.nStep; i++)
+		apBuffers[i] = (char *)CtxtPoolAlloc(&g_BufferPool);
+	pBuffer = apBuffers[0];
+
+	for (int i = 0; i < g_Options.nIterations; i++)
+	{
+		for (cbPos = 0; cbPos < g_cbStream; cbPos += cbFrame)
+			StampFrame(g_pStream + cbPos, i + 1, &ullId);
+
+		dStart = Now();
+		for (cbPos = 0; cbPos < g_cbStream && g_Options.nStep == 1; cbPos += cbRecv)
+		{
+			cbRecv = g_cbStream - cbPos < MAX_BUFF_SIZE ? (DWORD)(g_cbStream - cbPos) : MAX_BUFF_SIZE;
+			memcpy(pBuffer, g_pStream + cbPos, cbRecv);
+			if (!FrameReceive(&state, pBuffer, cbRecv, LedgerHandle, NULL, &output))
+			{
+				printf("FrameReceive() failed at byte %zu\n", cbPos);
+				return (1);
+			}
+			CountOutput(pBuffer, &output, &cbReply, &ullTransfers, &ullRejected);
+		}
+
+		//
+		// or a step of receives at a time, as from that many connections
+		//
+		for (cbPos = 0; cbPos < g_cbStream && g_Options.nStep > 1;)
+		{
+			for (nReceives = 0; nReceives < g_Options.nStep && cbPos < g_cbStream; nReceives++, cbPos += cbRecv)
+			{
+				if (batch.dwCapacity - batch.dwViews < FRAME_RECEIVE_MAX(MAX_BUFF_SIZE))
+					break;
+				cbRecv = g_cbStream - cbPos < MAX_BUFF_SIZE ? (DWORD)(g_cbStream - cbPos) : MAX_BUFF_SIZE;
+				memcpy(apBuffers[nReceives], g_pStream + cbPos, cbRecv);
+				if (!FrameCollect(&state, apBuffers[nReceives], cbRecv, NULL, &batch, &outputs[nReceives]))
+				{
+					printf("FrameCollect() failed at byte %zu\n", cbPos);
+					return (1);
+				}
+			}
+			LedgerHandleBatch(batch.pViews, batch.dwViews);
+			for (int j = 0; j < nReceives; j++)
+			{
+				if (!FramePack(&batch, apBuffers[j], &outputs[j]))
+				{
+					printf("FramePack() failed\n");
+					return (1);
+				}
+				CountOutput(apBuffers[j], &outputs[j], &cbReply, &ullTransfers, &ullRejected);
+			}
+			batch.dwViews = 0;
+		}
+		dElapsed += Now() - dStart;
+	}
+
+	printf("transfers=%d batch=%d accounts=%d step=%d mtransfers_per_s=%.2f ns_per_transfer=%.1f rejected=%llu errors=%d\n",
+		   g_Options.nTransfers, g_Options.nBatch, g_Options.nAccounts, g_Options.nStep,
+		   (double)g_Options.nTransfers * g_Options.nIterations / dElapsed / 1e6,
+		   dElapsed * 1e9 / ((double)g_Options.nTransfers * g_Options.nIterations), ullRejected,
+		   ullTransfers == (unsigned long long)g_Options.nTransfers * g_Options.nIterations ? 0 : 1);
+
+	FrameStateFree(&state);
+	FrameBatchDestroy(&batch);
+	for (int i = 0; i < g_Options.nStep; i++)
+		CtxtPoolFree(&g_BufferPool, apBuffers[i]);
+	LedgerDestroy();
+	CtxtPoolDestroy();
+	free(g_pStream);
+	return (ullRejected == 0 ? 0 : 1);
+}
+
+static bool SetInterest(int fdEpoll, CONNECTION *pConn, bool bWantWrite)
+{
+
+	struct epoll_event event;
+
+	if (pConn->bWantWrite == bWantWrite)
+		return (true);
+	pConn->bWantWrite = bWantWrite;
+	event.events = EPOLLIN | (bWantWrite ? EPOLLOUT : 0);
+	event.data.ptr = pConn;
+	return (epoll_ctl(fdEpoll, EPOLL_CTL_MOD, pConn->sd, &event) == 0);
+}
+
+static bool Connect(int fdEpoll, CONNECTION *pConn, unsigned long long ullConnection)
+{
+
+	struct epoll_event event;
+	size_t cbFrame = FRAME_HEADER_SIZE + g_Options.nBatch * sizeof(TRANSFER);
+	int nOne = 1;
+
+	pConn->sd = socket(g_pAddr->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	pConn->pFrames = (char *)malloc(cbFrame * g_Options.nPipeline);
+	if (pConn->sd < 0 || pConn->pFrames == NULL)
+		return (false);
+	setsockopt(pConn->sd, IPPROTO_TCP, TCP_NODELAY, &nOne, sizeof(nOne));
+	if (connect(pConn->sd, g_pAddr->ai_addr, g_pAddr->ai_addrlen) != 0)
+		return (false);
+	fcntl(pConn->sd, F_SETFL, fcntl(pConn->sd, F_GETFL, 0) | O_NONBLOCK);
+
+	pConn->cbToSend = cbFrame * g_Options.nPipeline;
+	pConn->ullIdHigh = ullConnection;
+	pConn->ullId = 0;
+	pConn->cbSent = 0;
+	pConn->cbReply = 0;
+	pConn->nOldest = 0;
+	for (pConn->nStream = 0; pConn->nStream < g_Options.nPipeline; pConn->nStream++)
+	{
+		memcpy(pConn->pFrames + pConn->nStream * cbFrame, g_pStream + pConn->nStream * cbFrame, cbFrame);
+		StampFrame(pConn->pFrames + pConn->nStream * cbFrame, pConn->ullIdHigh, &pConn->ullId);
+	}
+	pConn->bWantWrite = true;
+	event.events = EPOLLIN | EPOLLOUT;
+	event.data.ptr = pConn;
+	return (epoll_ctl(fdEpoll, EPOLL_CTL_ADD, pConn->sd, &event) == 0);
+}
+
+static void *LoadThread(void *lpParameter)
+{
+
+	THREADSTATS *pStats = (THREADSTATS *)lpParameter;
+	int nConnections = g_Options.nConnections / g_Options.nTotalThreads +
+					   ((pStats - g_Stats) < g_Options.nConnections % g_Options.nTotalThreads);
+	CONNECTION *pConns = (CONNECTION *)calloc(nConnections ? nConnections : 1, sizeof(CONNECTION));
+	struct epoll_event events[256];
+	char recvbuf[64 * 1024];
+	size_t cbFrame = FRAME_HEADER_SIZE + g_Options.nBatch * sizeof(TRANSFER);
+	size_t cbFrames = cbFrame * g_Options.nPipeline;
+	size_t cbSend = 0;
+	int nReplies = 0;
+	int fdEpoll = epoll_create1(EPOLL_CLOEXEC);
+	ssize_t nRet = 0;
+
+	for (int i = 0; i < nConnections; i++)
+	{
+		if (!Connect(fdEpoll, &pConns[i], (unsigned long long)(pStats - g_Stats) << 32 | (i + 1)))
+		{
+			printf("connect failed: %s\n", strerror(errno));
+			pStats->ullErrors++;
+			g_bStop = true;
+		}
+	}
+
+	while (!g_bStop)
+	{
+		int nEvents = epoll_wait(fdEpoll, events, 256, 100);
+
+		for (int i = 0; i < nEvents; i++)
+		{
+			CONNECTION *pConn = (CONNECTION *)events[i].data.ptr;
+
+			if (events[i].events & EPOLLIN)
+			{
+				nRet = recv(pConn->sd, recvbuf, sizeof(recvbuf), 0);
+				if (nRet <= 0 && !(nRet < 0 && errno == EAGAIN))
+				{
+					pStats->ullErrors++;
+					epoll_ctl(fdEpoll, EPOLL_CTL_DEL, pConn->sd, NULL);
+					continue;
+				}
+				nReplies = nRet > 0 ? CountReplies(recvbuf, nRet, &pConn->cbReply, FRAME_HEADER_SIZE + g_Options.nBatch,
+												   &pStats->ullTransfers, &pStats->ullRejected)
+									: 0;
+
+				//
+				// an answered frame was sent whole, so it is refilled with the
+				// next one of the stream and fresh ids, to go after the others
+				//
+				for (int j = 0; j < nReplies; j++)
+				{
+					memcpy(pConn->pFrames + pConn->nOldest * cbFrame, g_pStream + pConn->nStream * cbFrame, cbFrame);
+					StampFrame(pConn->pFrames + pConn->nOldest * cbFrame, pConn->ullIdHigh, &pConn->ullId);
+					pConn->nOldest = (pConn->nOldest + 1) % g_Options.nPipeline;
+					pConn->nStream = (pConn->nStream + 1) % STREAMFRAMES;
+					pConn->cbToSend += cbFrame;
+				}
+			}
+
+			while (pConn->cbToSend)
+			{
+				cbSend = cbFrames - pConn->cbSent < pConn->cbToSend ? cbFrames - pConn->cbSent : pConn->cbToSend;
+				nRet = send(pConn->sd, pConn->pFrames + pConn->cbSent, cbSend, MSG_NOSIGNAL);
+				if (nRet <= 0)
+					break;
+				pConn->cbToSend -= nRet;
+				pConn->cbSent = (pConn->cbSent + nRet) % cbFrames;
+			}
+			SetInterest(fdEpoll, pConn, pConn->cbToSend != 0);
+		}
+	}
+
+	for (int i = 0; i < nConnections; i++)
+	{
+		if (pConns[i].sd > 0)
+			close(pConns[i].sd);
+		free(pConns[i].pFrames);
+	}
+	close(fdEpoll);
+	free(pConns);
+	return (NULL);
+}
+
+static int RunNetwork(void)
+{
+
+	struct addrinfo hints;
+	pthread_t threads[MAXTHREADS];
+	unsigned long long ullTransfers = 0;
+	unsigned long long ullRejected = 0;
+	unsigned long long ullErrors = 0;
+	double dStart = 0.0;
+	double dSeconds = 0.0;
+	int nRet = 0;
+
+	if (!BuildStream(STREAMFRAMES, (long long)STREAMFRAMES * g_Options.nBatch))
+	{
+		printf("out of memory for %d frames\n", STREAMFRAMES);
+		return (1);
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((nRet = getaddrinfo("localhost", g_Options.szPort, &hints, &g_pAddr)) != 0)
+	{
+		printf("getaddrinfo(localhost) failed: %s\n", gai_strerror(nRet));
+		return (1);
+	}
+
+	dStart = Now();
+	for (int i = 0; i < g_Options.nTotalThreads; i++)
+		pthread_create(&threads[i], NULL, LoadThread, &g_Stats[i]);
+
+	sleep(g_Options.nSeconds);
+	g_bStop = true;
+
+	for (int i = 0; i < g_Options.nTotalThreads; i++)
+	{
+		pthread_join(threads[i], NULL);
+		ullTransfers += g_Stats[i].ullTransfers;
+		ullRejected += g_Stats[i].ullRejected;
+		ullErrors += g_Stats[i].ullErrors;
+	}
+	dSeconds = Now() - dStart;
+
+	printf("threads=%d connections=%d batch=%d pipeline=%d seconds=%.2f transfers=%llu rejected=%llu errors=%llu mtransfers_per_s=%.2f\n",
+		   g_Options.nTotalThreads, g_Options.nConnections, g_Options.nBatch, g_Options.nPipeline, dSeconds,
+		   ullTransfers, ullRejected, ullErrors, ullTransfers / dSeconds / 1e6);
+
+	freeaddrinfo(g_pAddr);
+	free(g_pStream);
+	return (ullRejected == 0 && ullErrors == 0 ? 0 : 1);
+}
+
+int main(int argc, char *argv[])
+{
+
+	if (!LedgerBenchOptions(argc, argv))
+	{
+		printf("Usage:\n  ledger [-n:transfers] [-b:batch] [-a:accounts] [-i:iterations] [-s:receives]\n");
+		printf("  ledger -e:port [-b:batch] [-a:accounts] [-t:threads] [-c:connections] [-p:pipeline] [-d:seconds]\n");
+		printf("  -e:port\tSend to the server on this port, started with -f:ledger (default: in process)\n");
+		printf("  -n:transfers\tTransfers in the stream, in process (default: 1000000)\n");
+		printf("  -b:batch\tTransfers per frame, 1-%d (default: 32)\n", (int)LEDGER_BATCH_MAX);
+		printf("  -a:accounts\tAccounts the transfers are between (default: 10000)\n");
+		printf("  -i:iterations\tTimes the stream is run through, in process (default: 5)\n");
+		printf("  -s:receives\tReceives handled in one batch step, in process, 1-%d (default: 1, each on its own)\n",
+			   MAXSTEP);
+		printf("  -t:threads\tLoad threads, 1-%d (default: 4)\n", MAXTHREADS);
+		printf("  -c:connections\tConnections in total (default: 64)\n");
+		printf("  -p:pipeline\tFrames in flight per connection (default: 4)\n");
+		printf("  -d:seconds\tDuration (default: 10)\n");
+		return (1);
+	}
+
+	return (g_Options.szPort[0] ? RunNetwork() : RunInProcess());
+}
@@ -0,0 +1,176 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Module:
+//      timerwheel.cpp
+//
+// Abstract:
+//      Cost of the server's hierarchical timing wheel (server/iocptimer.cpp)
+//      with many timers armed (Linux).  Arms the requested number of timers at
+//      random deadlines up to -r ticks ahead, re-arms every one of them (what
+//      an idle timeout does on I/O), cancels every other one, then advances the
+//      wheel until the rest have fired, and reports the time per operation.
+//      Timers that fire at the wrong tick are counted as errors.
+//
+//  Usage:
+//      timerwheel [-n:timers] [-r:ticks] [-s:seed]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "iocptimer.h"
+
+typedef struct _OPTIONS
+{
+	int nTimers;
+	int nRange;
+	int nSeed;
+} OPTIONS;
+
+static OPTIONS g_Options = {1000000, 65536, 1};
+
+typedef struct _BENCH_STATE
+{
+	PTIMER_WHEEL pWheel;
+	long long llFired;
+	long long llErrors;
+} BENCH_STATE;
+
+static bool ValidOptions(int argc, char *argv[])
+{
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (argv[i][0] != '-' || argv[i][1] == '\0')
+			return (false);
+		switch (argv[i][1])
+		{
+		case 'n':
+			if (strlen(argv[i]) > 3)
+				g_Options.nTimers = atoi(&argv[i][3]);
+			if (g_Options.nTimers < 1)
+				return (false);
+			break;
+		case 'r':
+			if (strlen(argv[i]) > 3)
+				g_Options.nRange = atoi(&argv[i][3]);
+			if (g_Options.nRange < 1)
+				return (false);
+			break;
+		case 's':
+			if (strlen(argv[i]) > 3)
+				g_Options.nSeed = atoi(&argv[i][3]);
+			break;
+		default:
+			return (false);
+		}
+	}
+	return (true);
+}
+
+static double Now(void)
+{
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+//
+// xorshift, so the deadlines don't depend on the C library's rand()
+//
+static unsigned long long NextRandom(unsigned long long *pullState)
+{
+
+	*pullState ^= *pullState << 13;
+	*pullState ^= *pullState >> 7;
+	*pullState ^= *pullState << 17;
+	return (*pullState);
+}
+
+static VOID TimerFired(PTIMER_ENTRY pTimer, LPVOID lpParam)
+{
+
+	BENCH_STATE *pState = (BENCH_STATE *)lpParam;
+
+	pState->llFired++;
+	if (pTimer->ullExpires != pState->pWheel->ullNow - 1)
+		pState->llErrors++;
+}
+
+int main(int argc, char *argv[])
+{
+
+	PTIMER_WHEEL pWheel = NULL;
+	PTIMER_ENTRY pTimers = NULL;
+	BENCH_STATE state = {0};
+	unsigned long long ullRandom = 0;
+	ULONGLONG ullStart = 1000;
+	ULONGLONG ullTick = 0;
+	double dArm = 0.0;
+	double dRearm = 0.0;
+	double dCancel = 0.0;
+	double dAdvance = 0.0;
+	double dStart = 0.0;
+	long long llCancelled = 0;
+
+	if (!ValidOptions(argc, argv))
+	{
+		printf("Usage:\n  timerwheel [-n:timers] [-r:ticks] [-s:seed]\n");
+		printf("  -n:timers\tTimers armed at once (default: 1000000)\n");
+		printf("  -r:ticks\tDeadlines are up to this many ticks ahead (default: 65536)\n");
+		printf("  -s:seed\tSeed of the deadlines (default: 1)\n");
+		return (1);
+	}
+
+	pWheel = (PTIMER_WHEEL)calloc(1, sizeof(TIMER_WHEEL));
+	pTimers = (PTIMER_ENTRY)calloc(g_Options.nTimers, sizeof(TIMER_ENTRY));
+	if (pWheel == NULL || pTimers == NULL)
+	{
+		printf("out of memory for %d timers\n", g_Options.nTimers);
+		return (1);
+	}
+	TimerWheelInitialize(pWheel, ullStart);
+	state.pWheel = pWheel;
+	ullRandom = 0x9E3779B97F4A7C15ULL ^ (unsigned long long)g_Options.nSeed;
+
+	dStart = Now();
+	for (int i = 0; i < g_Options.nTimers; i++)
+		TimerSet(pWheel, &pTimers[i], ullStart + 1 + NextRandom(&ullRandom) % g_Options.nRange);
+	dArm = Now() - dStart;
+
+	dStart = Now();
+	for (int i = 0; i < g_Options.nTimers; i++)
+		TimerSet(pWheel, &pTimers[i], ullStart + 1 + NextRandom(&ullRandom) % g_Options.nRange);
+	dRearm = Now() - dStart;
+
+	dStart = Now();
+	for (int i = 0; i < g_Options.nTimers; i += 2, llCancelled++)
+		TimerCancel(pWheel, &pTimers[i]);
+	dCancel = Now() - dStart;
+
+	//
+	// advance a tick at a time, like a worker waking up every tick would
+	//
+	dStart = Now();
+	for (ullTick = ullStart; pWheel->dwArmed; ullTick++)
+		TimerWheelAdvance(pWheel, ullTick, TimerFired, &state);
+	dAdvance = Now() - dStart;
+
+	printf("timers=%d range=%d arm_ns=%.1f rearm_ns=%.1f cancel_ns=%.1f advance_ns_per_timer=%.1f ticks=%llu fired=%lld errors=%lld\n",
+		   g_Options.nTimers, g_Options.nRange,
+		   dArm * 1e9 / g_Options.nTimers, dRearm * 1e9 / g_Options.nTimers,
+		   dCancel * 1e9 / llCancelled, state.llFired ? dAdvance * 1e9 / state.llFired : 0.0,
+		   (unsigned long long)(ullTick - ullStart), state.llFired,
+		   state.llErrors + (g_Options.nTimers - llCancelled - state.llFired));
+
+	free(pTimers);
+	free(pWheel);
+	return (state.llErrors ? 1 : 0);
+}
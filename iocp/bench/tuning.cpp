@@ -0,0 +1,364 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Module:
+//      tuning.cpp
+//
+// Abstract:
+//      Latency and throughput of the echo server under a socket tuning
+//      profile (server/iocptune.cpp), on Linux.  Start the server with
+//      -y:profile and run this with the same -y:profile, which it applies to
+//      its own sockets too.
+//
+//      First the latency: -c:connections threads each send a -s:bytes message
+//      and wait for its echo, over and over, for -d:seconds, and the round
+//      trips are reported as p50 and p99.  Then the throughput: as many threads
+//      each stream -b:bytes writes, -w:bytes in flight at most, and read the
+//      echo back, for as long, reported in MB/s echoed.
+//
+//  Usage:
+//      tuning [-y:profile] [-n:host] [-e:port] [-c:connections] [-s:bytes]
+//             [-b:bytes] [-w:bytes] [-d:seconds]
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "iocpserver.h"
+#include "iocptune.h"
+
+#define MAXTHREADS 256
+#define MAXSAMPLES (1024 * 1024)   // round trips kept per thread
+#define IOBUFSIZE (1024 * 1024)
+
+typedef struct _OPTIONS
+{
+	const TUNE_PROFILE *pProfile;
+	char szHostname[64];
+	char szPort[16];
+	int nConnections;
+	int nMessageSize;
+	int nWriteSize;
+	int nWindow;
+	int nSeconds;
+} OPTIONS;
+
+typedef struct _THREADSTATS
+{
+	unsigned int *pSamples; // round trips, in ns
+	unsigned long long ullSamples;
+	unsigned long long ullBytes;
+	unsigned long long ullErrors;
+	char pad[32];
+} THREADSTATS;
+
+static OPTIONS g_Options = {&g_TuneProfiles[0], "localhost", "5001", 4, 64, 64 * 1024, 256 * 1024, 5};
+static THREADSTATS g_Stats[MAXTHREADS];
+static struct addrinfo *g_pAddr = NULL;
+static volatile bool g_bStop = false;
+
+static bool TuningOptions(int argc, char *argv[])
+{
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (argv[i][0] != '-' || argv[i][1] == '\0')
+			return (false);
+		switch (argv[i][1])
+		{
+		case 'y':
+			g_Options.pProfile = strlen(argv[i]) > 3 ? TuneProfileFind(&argv[i][3]) : NULL;
+			if (g_Options.pProfile == NULL)
+				return (false);
+			break;
+		case 'n':
+			if (strlen(argv[i]) > 3)
+				snprintf(g_Options.szHostname, sizeof(g_Options.szHostname), "%s", &argv[i][3]);
+			break;
+		case 'e':
+			if (strlen(argv[i]) > 3)
+				snprintf(g_Options.szPort, sizeof(g_Options.szPort), "%s", &argv[i][3]);
+			break;
+		case 'c':
+			if (strlen(argv[i]) > 3)
+				g_Options.nConnections = atoi(&argv[i][3]);
+			if (g_Options.nConnections < 1 || g_Options.nConnections > MAXTHREADS)
+				return (false);
+			break;
+		case 's':
+			if (strlen(argv[i]) > 3)
+				g_Options.nMessageSize = atoi(&argv[i][3]);
+			if (g_Options.nMessageSize < 1 || g_Options.nMessageSize > IOBUFSIZE)
+				return (false);
+			break;
+		case 'b':
+			if (strlen(argv[i]) > 3)
+				g_Options.nWriteSize = atoi(&argv[i][3]);
+			if (g_Options.nWriteSize < 1 || g_Options.nWriteSize > IOBUFSIZE)
+				return (false);
+			break;
+		case 'w':
+			if (strlen(argv[i]) > 3)
+				g_Options.nWindow = atoi(&argv[i][3]);
+			if (g_Options.nWindow < 1)
+				return (false);
+			break;
+		case 'd':
+			if (strlen(argv[i]) > 3)
+				g_Options.nSeconds = atoi(&argv[i][3]);
+			if (g_Options.nSeconds < 1)
+				return (false);
+			break;
+		default:
+			return (false);
+		}
+	}
+	return (true);
+}
+
+static unsigned long long NowNs(void)
+{
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+//
+// a connection to the server with the profile's options
+//
+static int Connect(void)
+{
+
+	int sd = socket(g_pAddr->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	if (sd < 0)
+		return (-1);
+	if (!TuneSocketBuffers(sd, g_Options.pProfile) || connect(sd, g_pAddr->ai_addr, g_pAddr->ai_addrlen) != 0 ||
+		!TuneSocket(sd, g_Options.pProfile))
+	{
+		printf("connect failed: %s\n", strerror(errno));
+		close(sd);
+		return (-1);
+	}
+	return (sd);
+}
+
+static void *LatencyThread(void *lpParameter)
+{
+
+	THREADSTATS *pStats = (THREADSTATS *)lpParameter;
+	char *pBuffer = (char *)calloc(1, g_Options.nMessageSize);
+	unsigned long long ullStart = 0;
+	ssize_t nRet = 0;
+	int nReceived = 0;
+	int sd = Connect();
+
+	if (sd < 0 || pBuffer == NULL)
+	{
+		pStats->ullErrors++;
+		g_bStop = true;
+	}
+
+	while (!g_bStop)
+	{
+		ullStart = NowNs();
+		if (send(sd, pBuffer, g_Options.nMessageSize, MSG_NOSIGNAL) != g_Options.nMessageSize)
+		{
+			pStats->ullErrors++;
+			break;
+		}
+		for (nReceived = 0; nReceived < g_Options.nMessageSize; nReceived += (int)nRet)
+		{
+			nRet = recv(sd, pBuffer + nReceived, g_Options.nMessageSize - nReceived, 0);
+			if (nRet <= 0)
+				break;
+		}
+		if (nReceived < g_Options.nMessageSize)
+		{
+			pStats->ullErrors++;
+			break;
+		}
+		if (pStats->ullSamples < MAXSAMPLES)
+			pStats->pSamples[pStats->ullSamples] = (unsigned int)(NowNs() - ullStart);
+		pStats->ullSamples++;
+	}
+
+	if (sd >= 0)
+		close(sd);
+	free(pBuffer);
+	return (NULL);
+}
+
+static void *ThroughputThread(void *lpParameter)
+{
+
+	THREADSTATS *pStats = (THREADSTATS *)lpParameter;
+	char *pBuffer = (char *)calloc(1, IOBUFSIZE);
+	long long llInFlight = 0;
+	struct pollfd pfd;
+	ssize_t nRet = 0;
+	int sd = Connect();
+
+	if (sd < 0 || pBuffer == NULL)
+	{
+		pStats->ullErrors++;
+		g_bStop = true;
+	}
+	else
+		fcntl(sd, F_SETFL, fcntl(sd, F_GETFL, 0) | O_NONBLOCK);
+
+	while (!g_bStop)
+	{
+		pfd.fd = sd;
+		pfd.events = POLLIN | (llInFlight < g_Options.nWindow ? POLLOUT : 0);
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+		if (pfd.revents & POLLOUT)
+		{
+			nRet = send(sd, pBuffer, g_Options.nWriteSize, MSG_NOSIGNAL);
+			if (nRet > 0)
+				llInFlight += nRet;
+		}
+		if (pfd.revents & (POLLIN | POLLERR | POLLHUP))
+		{
+			nRet = recv(sd, pBuffer, IOBUFSIZE, 0);
+			if (nRet <= 0 && !(nRet < 0 && errno == EAGAIN))
+			{
+				pStats->ullErrors++;
+				break;
+			}
+			if (nRet > 0)
+			{
+				llInFlight -= nRet;
+				pStats->ullBytes += nRet;
+			}
+		}
+	}
+
+	if (sd >= 0)
+		close(sd);
+	free(pBuffer);
+	return (NULL);
+}
+
+static int CompareSamples(const void *p1, const void *p2)
+{
+
+	unsigned int u1 = *(const unsigned int *)p1;
+	unsigned int u2 = *(const unsigned int *)p2;
+
+	return (u1 < u2 ? -1 : u1 > u2);
+}
+
+//
+// run nThreads of pfnThread for the duration, return the seconds it took
+//
+static double RunPhase(void *(*pfnThread)(void *))
+{
+
+	pthread_t threads[MAXTHREADS];
+	struct timespec tsStart, tsEnd;
+
+	g_bStop = false;
+	clock_gettime(CLOCK_MONOTONIC, &tsStart);
+	for (int i = 0; i < g_Options.nConnections; i++)
+		pthread_create(&threads[i], NULL, pfnThread, &g_Stats[i]);
+	sleep(g_Options.nSeconds);
+	g_bStop = true;
+	for (int i = 0; i < g_Options.nConnections; i++)
+		pthread_join(threads[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &tsEnd);
+	return ((tsEnd.tv_sec - tsStart.tv_sec) + (tsEnd.tv_nsec - tsStart.tv_nsec) / 1e9);
+}
+
+int main(int argc, char *argv[])
+{
+
+	struct addrinfo hints;
+	unsigned int *pSamples = NULL;
+	unsigned long long ullSamples = 0;
+	unsigned long long ullKept = 0;
+	unsigned long long ullBytes = 0;
+	unsigned long long ullErrors = 0;
+	double dSeconds = 0;
+	int nRet = 0;
+
+	if (!TuningOptions(argc, argv))
+	{
+		printf("Usage:\n  tuning [-y:profile] [-n:host] [-e:port] [-c:connections] [-s:bytes] [-b:bytes] [-w:bytes] [-d:seconds]\n");
+		printf("  -y:profile\tSocket tuning profile, the server's too:");
+		for (int j = 0; g_TuneProfiles[j].szName; j++)
+			printf(" %s", g_TuneProfiles[j].szName);
+		printf(" (default: %s)\n", g_TuneProfiles[0].szName);
+		printf("  -n:host\tServer to connect to (default: localhost)\n");
+		printf("  -e:port\tServer port (default: 5001)\n");
+		printf("  -c:connections\tConnections, a thread each, 1-%d (default: 4)\n", MAXTHREADS);
+		printf("  -s:bytes\tMessage size of the latency phase (default: 64)\n");
+		printf("  -b:bytes\tWrite size of the throughput phase (default: 65536)\n");
+		printf("  -w:bytes\tBytes in flight per connection in the throughput phase (default: 262144)\n");
+		printf("  -d:seconds\tDuration of each phase (default: 5)\n");
+		return (1);
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((nRet = getaddrinfo(g_Options.szHostname, g_Options.szPort, &hints, &g_pAddr)) != 0)
+	{
+		printf("getaddrinfo(%s) failed: %s\n", g_Options.szHostname, gai_strerror(nRet));
+		return (1);
+	}
+
+	pSamples = (unsigned int *)malloc((size_t)g_Options.nConnections * MAXSAMPLES * sizeof(unsigned int));
+	if (pSamples == NULL)
+	{
+		printf("out of memory\n");
+		return (1);
+	}
+	for (int i = 0; i < g_Options.nConnections; i++)
+		g_Stats[i].pSamples = pSamples + (size_t)i * MAXSAMPLES;
+
+	//
+	// the round trips kept are moved together and sorted for the percentiles
+	//
+	RunPhase(LatencyThread);
+	for (int i = 0; i < g_Options.nConnections; i++)
+	{
+		unsigned long long ullThread = g_Stats[i].ullSamples < MAXSAMPLES ? g_Stats[i].ullSamples : MAXSAMPLES;
+
+		memmove(pSamples + ullKept, g_Stats[i].pSamples, ullThread * sizeof(unsigned int));
+		ullKept += ullThread;
+		ullSamples += g_Stats[i].ullSamples;
+		ullErrors += g_Stats[i].ullErrors;
+		g_Stats[i].ullErrors = 0;
+	}
+	qsort(pSamples, ullKept, sizeof(unsigned int), CompareSamples);
+
+	dSeconds = RunPhase(ThroughputThread);
+	for (int i = 0; i < g_Options.nConnections; i++)
+	{
+		ullBytes += g_Stats[i].ullBytes;
+		ullErrors += g_Stats[i].ullErrors;
+	}
+
+	printf("profile=%s connections=%d size=%d round_trips=%llu p50_us=%.1f p99_us=%.1f write=%d window=%d MB/s=%.1f errors=%llu\n",
+		   g_Options.pProfile->szName, g_Options.nConnections, g_Options.nMessageSize, ullSamples,
+		   ullKept ? pSamples[ullKept / 2] / 1e3 : 0.0, ullKept ? pSamples[ullKept * 99 / 100] / 1e3 : 0.0,
+		   g_Options.nWriteSize, g_Options.nWindow, ullBytes / dSeconds / (1024 * 1024), ullErrors);
+
+	free(pSamples);
+	freeaddrinfo(g_pAddr);
+	return (ullErrors == 0 ? 0 : 1);
+}
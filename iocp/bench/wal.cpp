@@ -0,0 +1,280 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Module:
+//      wal.cpp
+//
+// Abstract:
+//      Durable transfers per second through the server's write-ahead log
+//      (server/iocpwal.cpp), on Linux.  -t:threads threads stand for the
+//      connections: each appends -p:pipeline batches of -b:batch 128-byte
+//      transfers, waits until the log is durable up to the last one, the way
+//      a connection's reply waits, and starts over, for -d:seconds.
+//
+//      -m:wal (the default) appends to the log, which commits them in groups
+//      of -g:bytes[:microseconds].  -m:sync is the baseline without group
+//      commit: every thread writes its own batches with pwrite and waits in
+//      fdatasync, the blocking way.  A transfer counts once it is durable.
+//
+//      The log file (-f:path) is truncated first and removed at the end.
+//
+//  Usage:
+//      wal [-m:wal|sync] [-f:path] [-t:threads] [-b:batch] [-p:pipeline]
+//          [-g:bytes[:microseconds]] [-d:seconds]
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "iocpserver.h"
+#include "iocpledger.h"
+#include "iocpwal.h"
+
+#define MAXTHREADS 1024
+
+typedef struct _OPTIONS
+{
+	bool bSync;
+	char szPath[256];
+	int nTotalThreads;
+	int nBatch;
+	int nPipeline;
+	int nSeconds;
+} OPTIONS;
+
+typedef struct _THREADSTATS
+{
+	WAL_WAITER Waiter;
+	volatile bool bReleased;
+	unsigned long long ullTransfers;
+	unsigned long long ullErrors;
+	char pad[24];
+} THREADSTATS;
+
+static OPTIONS g_Options = {false, "wal.bench", 64, 32, 1, 5};
+static THREADSTATS g_Stats[MAXTHREADS];
+static volatile bool g_bStop = false;
+static volatile unsigned long long g_ullOffset = 0; // -m:sync, where the next batch is written
+static int g_fdSync = -1;
+
+static bool WalBenchOptions(int argc, char *argv[])
+{
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (argv[i][0] != '-' || argv[i][1] == '\0')
+			return (false);
+		switch (argv[i][1])
+		{
+		case 'm':
+			if (strcmp(argv[i], "-m:sync") == 0)
+				g_Options.bSync = true;
+			else if (strcmp(argv[i], "-m:wal") == 0)
+				g_Options.bSync = false;
+			else
+				return (false);
+			break;
+		case 'f':
+			if (strlen(argv[i]) <= 3)
+				return (false);
+			snprintf(g_Options.szPath, sizeof(g_Options.szPath), "%s", &argv[i][3]);
+			break;
+		case 't':
+			if (strlen(argv[i]) > 3)
+				g_Options.nTotalThreads = atoi(&argv[i][3]);
+			if (g_Options.nTotalThreads < 1 || g_Options.nTotalThreads > MAXTHREADS)
+				return (false);
+			break;
+		case 'b':
+			if (strlen(argv[i]) > 3)
+				g_Options.nBatch = atoi(&argv[i][3]);
+			if (g_Options.nBatch < 1 || g_Options.nBatch > (int)LEDGER_BATCH_MAX)
+				return (false);
+			break;
+		case 'p':
+			if (strlen(argv[i]) > 3)
+				g_Options.nPipeline = atoi(&argv[i][3]);
+			if (g_Options.nPipeline < 1)
+				return (false);
+			break;
+		case 'g':
+			if (strlen(argv[i]) > 3)
+			{
+				g_dwWalWindow = (DWORD)atoi(&argv[i][3]);
+				if (strchr(&argv[i][3], ':'))
+					g_dwWalLatency = (DWORD)atoi(strchr(&argv[i][3], ':') + 1);
+			}
+			if (g_dwWalWindow < 1 || g_dwWalWindow > WAL_BUFFER_SIZE / 2)
+				return (false);
+			break;
+		case 'd':
+			if (strlen(argv[i]) > 3)
+				g_Options.nSeconds = atoi(&argv[i][3]);
+			if (g_Options.nSeconds < 1)
+				return (false);
+			break;
+		default:
+			return (false);
+		}
+	}
+	return (true);
+}
+
+static double Now(void)
+{
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+//
+// the committer made a thread's last append durable
+//
+static VOID BenchReleased(PWAL_WAITER pWaiter, BOOL bDurable)
+{
+
+	THREADSTATS *pStats = (THREADSTATS *)((char *)pWaiter - offsetof(THREADSTATS, Waiter));
+
+	pStats->ullErrors += !bDurable;
+	pStats->bReleased = true;
+}
+
+//
+// one batch of transfers with ids of the thread's own
+//
+static void FillBatch(TRANSFER *pBatch, int nThread, unsigned long long *pullId)
+{
+
+	for (int i = 0; i < g_Options.nBatch; i++)
+	{
+		memset(&pBatch[i], 0, sizeof(TRANSFER));
+		pBatch[i].Id.ullLow = ++*pullId;
+		pBatch[i].Id.ullHigh = (unsigned long long)nThread + 1;
+		pBatch[i].DebitId.ullLow = 1 + *pullId % 1000;
+		pBatch[i].CreditId.ullLow = 1001 + *pullId % 1000;
+		pBatch[i].ullAmount = 1;
+	}
+}
+
+static void *AppendThread(void *lpParameter)
+{
+
+	THREADSTATS *pStats = (THREADSTATS *)lpParameter;
+	TRANSFER batch[LEDGER_BATCH_MAX];
+	DWORD cbBatch = g_Options.nBatch * sizeof(TRANSFER);
+	unsigned long long ullId = 0;
+	unsigned long long ullOffset = 0;
+	ULONGLONG ullLsn = 0;
+
+	while (!g_bStop)
+	{
+		for (int i = 0; i < g_Options.nPipeline; i++)
+		{
+			FillBatch(batch, (int)(pStats - g_Stats), &ullId);
+			if (g_Options.bSync)
+			{
+				ullOffset = __sync_fetch_and_add(&g_ullOffset, cbBatch);
+				if (pwrite(g_fdSync, batch, cbBatch, (off_t)ullOffset) != (ssize_t)cbBatch)
+					pStats->ullErrors++;
+			}
+			else if ((ullLsn = WalAppend(batch, cbBatch)) == 0)
+				pStats->ullErrors++;
+		}
+
+		if (g_Options.bSync)
+		{
+			if (fdatasync(g_fdSync) != 0)
+				pStats->ullErrors++;
+		}
+		else
+		{
+			pStats->bReleased = false;
+			if (WalWait(&pStats->Waiter, ullLsn))
+			{
+				while (!pStats->bReleased)
+					sched_yield();
+			}
+		}
+		pStats->ullTransfers += (unsigned long long)g_Options.nPipeline * g_Options.nBatch;
+	}
+	return (NULL);
+}
+
+int main(int argc, char *argv[])
+{
+
+	pthread_t threads[MAXTHREADS];
+	unsigned long long ullTransfers = 0;
+	unsigned long long ullErrors = 0;
+	double dStart = 0.0;
+	double dSeconds = 0.0;
+	int fd = -1;
+
+	if (!WalBenchOptions(argc, argv))
+	{
+		printf("Usage:\n  wal [-m:wal|sync] [-f:path] [-t:threads] [-b:batch] [-p:pipeline] [-g:bytes[:microseconds]] [-d:seconds]\n");
+		printf("  -m:mode\twal: group commit through the write-ahead log, sync: pwrite and fdatasync per thread (default: wal)\n");
+		printf("  -f:path\tLog file, truncated first and removed at the end (default: wal.bench)\n");
+		printf("  -t:threads\tAppending threads, 1-%d (default: 64)\n", MAXTHREADS);
+		printf("  -b:batch\tTransfers per append, 1-%d (default: 32)\n", (int)LEDGER_BATCH_MAX);
+		printf("  -p:pipeline\tAppends per thread before it waits for them to be durable (default: 1)\n");
+		printf("  -g:bytes[:us]\tCommit once this much is appended or the oldest append waited this long (default: %d:%d)\n",
+			   WAL_DEFAULT_WINDOW, WAL_DEFAULT_LATENCY);
+		printf("  -d:seconds\tDuration (default: 5)\n");
+		return (1);
+	}
+
+	fd = open(g_Options.szPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		printf("open(%s) failed: %s\n", g_Options.szPath, strerror(errno));
+		return (1);
+	}
+	if (g_Options.bSync)
+		g_fdSync = fd;
+	else
+	{
+		close(fd);
+		if (!WalCreate(g_Options.szPath, BenchReleased))
+			return (1);
+	}
+
+	dStart = Now();
+	for (int i = 0; i < g_Options.nTotalThreads; i++)
+		pthread_create(&threads[i], NULL, AppendThread, &g_Stats[i]);
+
+	sleep(g_Options.nSeconds);
+	g_bStop = true;
+
+	for (int i = 0; i < g_Options.nTotalThreads; i++)
+	{
+		pthread_join(threads[i], NULL);
+		ullTransfers += g_Stats[i].ullTransfers;
+		ullErrors += g_Stats[i].ullErrors;
+	}
+	dSeconds = Now() - dStart;
+
+	printf("mode=%s threads=%d batch=%d pipeline=%d window=%d latency_us=%d seconds=%.2f transfers=%llu errors=%llu durable_mtransfers_per_s=%.3f\n",
+		   g_Options.bSync ? "sync" : "wal", g_Options.nTotalThreads, g_Options.nBatch, g_Options.nPipeline,
+		   g_Options.bSync ? 0 : g_dwWalWindow, g_Options.bSync ? 0 : g_dwWalLatency, dSeconds, ullTransfers,
+		   ullErrors, ullTransfers / dSeconds / 1e6);
+	fflush(stdout);
+
+	if (g_Options.bSync)
+		close(g_fdSync);
+	else
+		WalDestroy();
+	unlink(g_Options.szPath);
+	return (ullErrors == 0 ? 0 : 1);
+}
@@ -0,0 +1,357 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Module:
+//      zerocopy.cpp
+//
+// Abstract:
+//      CPU the echo server spends per GB echoed (Linux), to compare its copy,
+//      zero-copy (-x) and splice (-s) paths.  For every message size in turn,
+//      streams messages of that size over each connection, a few in flight at
+//      a time, and reads the server's user and system CPU time from
+//      /proc/pid/stat before and after.  The report is a line per size with
+//      the CPU milliseconds and cycles (at the nominal clock from
+//      /proc/cpuinfo) per GB echoed.  Run it against a server without -x, with
+//      -x and with -s.
+//
+//  Usage:
+//      zerocopy -p:pid [-n:host] [-e:port] [-c:connections] [-s:bytes,...]
+//               [-w:messages] [-d:seconds]
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAXSIZES 16
+#define MAXCONNECTIONS 1024
+#define IOBUFSIZE (256 * 1024)
+
+typedef struct _OPTIONS
+{
+	char szHostname[64];
+	char szPort[16];
+	int nPid;
+	int nConnections;
+	int nSizes;
+	int nSizeList[MAXSIZES];
+	int nWindow;
+	int nSeconds;
+} OPTIONS;
+
+typedef struct _CONNECTION
+{
+	int sd;
+	unsigned long long ullToSend;
+	bool bWantWrite;
+} CONNECTION;
+
+static OPTIONS g_Options = {"localhost", "5001", 0, 4, 3, {4096, 65536, 1048576}, 4, 5};
+
+static bool ValidOptions(int argc, char *argv[])
+{
+
+	char *pNext = NULL;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (argv[i][0] != '-' || argv[i][1] == '\0')
+			return (false);
+		switch (argv[i][1])
+		{
+		case 'p':
+			if (strlen(argv[i]) > 3)
+				g_Options.nPid = atoi(&argv[i][3]);
+			break;
+		case 'n':
+			if (strlen(argv[i]) > 3)
+				snprintf(g_Options.szHostname, sizeof(g_Options.szHostname), "%s", &argv[i][3]);
+			break;
+		case 'e':
+			if (strlen(argv[i]) > 3)
+				snprintf(g_Options.szPort, sizeof(g_Options.szPort), "%s", &argv[i][3]);
+			break;
+		case 'c':
+			if (strlen(argv[i]) > 3)
+				g_Options.nConnections = atoi(&argv[i][3]);
+			if (g_Options.nConnections < 1 || g_Options.nConnections > MAXCONNECTIONS)
+				return (false);
+			break;
+		case 's':
+			if (strlen(argv[i]) <= 3)
+				return (false);
+			g_Options.nSizes = 0;
+			for (pNext = &argv[i][3]; pNext && g_Options.nSizes < MAXSIZES; pNext = strchr(pNext, ','))
+			{
+				if (*pNext == ',')
+					pNext++;
+				g_Options.nSizeList[g_Options.nSizes] = atoi(pNext);
+				if (g_Options.nSizeList[g_Options.nSizes++] < 1)
+					return (false);
+			}
+			break;
+		case 'w':
+			if (strlen(argv[i]) > 3)
+				g_Options.nWindow = atoi(&argv[i][3]);
+			if (g_Options.nWindow < 1)
+				return (false);
+			break;
+		case 'd':
+			if (strlen(argv[i]) > 3)
+				g_Options.nSeconds = atoi(&argv[i][3]);
+			if (g_Options.nSeconds < 1)
+				return (false);
+			break;
+		default:
+			return (false);
+		}
+	}
+	return (g_Options.nPid > 0);
+}
+
+static double Now(void)
+{
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+//
+// user plus system CPU time of a process in seconds, -1 if it can't be read
+//
+static double ProcessCpuSeconds(int nPid)
+{
+
+	char szPath[64];
+	char szStat[1024];
+	char *pFields = NULL;
+	unsigned long ulUser = 0;
+	unsigned long ulSystem = 0;
+	size_t cbRead = 0;
+	FILE *pFile = NULL;
+
+	snprintf(szPath, sizeof(szPath), "/proc/%d/stat", nPid);
+	pFile = fopen(szPath, "r");
+	if (pFile == NULL)
+		return (-1.0);
+	cbRead = fread(szStat, 1, sizeof(szStat) - 1, pFile);
+	fclose(pFile);
+	szStat[cbRead] = '\0';
+
+	//
+	// the command name may contain spaces; utime and stime are the 12th and
+	// 13th fields after it
+	//
+	pFields = strrchr(szStat, ')');
+	if (pFields == NULL ||
+		sscanf(pFields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &ulUser, &ulSystem) != 2)
+		return (-1.0);
+	return ((double)(ulUser + ulSystem) / sysconf(_SC_CLK_TCK));
+}
+
+//
+// nominal clock of the first CPU in Hz, 0 if /proc/cpuinfo does not say
+//
+static double CpuHz(void)
+{
+
+	char szLine[256];
+	double dMHz = 0.0;
+	FILE *pFile = fopen("/proc/cpuinfo", "r");
+
+	if (pFile == NULL)
+		return (0.0);
+	while (fgets(szLine, sizeof(szLine), pFile))
+	{
+		if (sscanf(szLine, "cpu MHz : %lf", &dMHz) == 1)
+			break;
+	}
+	fclose(pFile);
+	return (dMHz * 1e6);
+}
+
+static bool Connect(struct addrinfo *pAddr, int fdEpoll, CONNECTION *pConn)
+{
+
+	struct epoll_event event;
+	int nOne = 1;
+
+	pConn->sd = socket(pAddr->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (pConn->sd < 0)
+		return (false);
+	setsockopt(pConn->sd, IPPROTO_TCP, TCP_NODELAY, &nOne, sizeof(nOne));
+	if (connect(pConn->sd, pAddr->ai_addr, pAddr->ai_addrlen) != 0)
+		return (false);
+	fcntl(pConn->sd, F_SETFL, fcntl(pConn->sd, F_GETFL, 0) | O_NONBLOCK);
+
+	pConn->bWantWrite = true;
+	event.events = EPOLLIN | EPOLLOUT;
+	event.data.ptr = pConn;
+	return (epoll_ctl(fdEpoll, EPOLL_CTL_ADD, pConn->sd, &event) == 0);
+}
+
+static void SetInterest(int fdEpoll, CONNECTION *pConn, bool bWantWrite)
+{
+
+	struct epoll_event event;
+
+	if (pConn->bWantWrite == bWantWrite)
+		return;
+	pConn->bWantWrite = bWantWrite;
+	event.events = EPOLLIN | (bWantWrite ? EPOLLOUT : 0);
+	event.data.ptr = pConn;
+	epoll_ctl(fdEpoll, EPOLL_CTL_MOD, pConn->sd, &event);
+}
+
+//
+// Echo messages of nSize bytes on every connection for nSeconds, keeping
+// nWindow of them in flight; returns the bytes echoed back, 0 on error.
+//
+static unsigned long long RunSize(struct addrinfo *pAddr, int nSize)
+{
+
+	static CONNECTION Conns[MAXCONNECTIONS];
+	static char buffer[IOBUFSIZE];
+	struct epoll_event events[256];
+	unsigned long long ullEchoed = 0;
+	int fdEpoll = epoll_create1(EPOLL_CLOEXEC);
+	double dEnd = 0.0;
+	ssize_t nRet = 0;
+	int nOne = 1;
+	bool bError = false;
+
+	for (int i = 0; i < g_Options.nConnections && !bError; i++)
+	{
+		Conns[i].ullToSend = (unsigned long long)nSize * g_Options.nWindow;
+		if (!Connect(pAddr, fdEpoll, &Conns[i]))
+		{
+			printf("connect failed: %s\n", strerror(errno));
+			bError = true;
+		}
+	}
+
+	dEnd = Now() + g_Options.nSeconds;
+	while (!bError && Now() < dEnd)
+	{
+		int nEvents = epoll_wait(fdEpoll, events, 256, 100);
+
+		for (int i = 0; i < nEvents; i++)
+		{
+			CONNECTION *pConn = (CONNECTION *)events[i].data.ptr;
+
+			//
+			// every byte echoed back makes room for one more to be sent.  The
+			// ACKs go out right away: the server leaves Nagle on, and on loopback
+			// (64K MSS) every echoed buffer is a small segment it holds back until
+			// the previous one is acknowledged.
+			//
+			if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+			{
+				while ((nRet = recv(pConn->sd, buffer, sizeof(buffer), 0)) > 0)
+				{
+					ullEchoed += nRet;
+					pConn->ullToSend += nRet;
+				}
+				setsockopt(pConn->sd, IPPROTO_TCP, TCP_QUICKACK, &nOne, sizeof(nOne));
+				if (nRet == 0 || (nRet < 0 && errno != EAGAIN))
+				{
+					printf("connection dropped: %s\n", nRet ? strerror(errno) : "closed");
+					bError = true;
+					break;
+				}
+			}
+
+			while (pConn->ullToSend)
+			{
+				nRet = send(pConn->sd, buffer, pConn->ullToSend < sizeof(buffer) ? pConn->ullToSend : sizeof(buffer),
+							MSG_NOSIGNAL);
+				if (nRet <= 0)
+					break;
+				pConn->ullToSend -= nRet;
+			}
+			SetInterest(fdEpoll, pConn, pConn->ullToSend != 0);
+		}
+	}
+
+	for (int i = 0; i < g_Options.nConnections; i++)
+	{
+		if (Conns[i].sd > 0)
+			close(Conns[i].sd);
+		Conns[i].sd = 0;
+	}
+	close(fdEpoll);
+	return (bError ? 0 : ullEchoed);
+}
+
+int main(int argc, char *argv[])
+{
+
+	struct addrinfo hints;
+	struct addrinfo *pAddr = NULL;
+	unsigned long long ullEchoed = 0;
+	double dCpuStart = 0.0;
+	double dCpu = 0.0;
+	double dStart = 0.0;
+	double dSeconds = 0.0;
+	double dGB = 0.0;
+	double dHz = CpuHz();
+	int nRet = 0;
+
+	if (!ValidOptions(argc, argv))
+	{
+		printf("Usage:\n  zerocopy -p:pid [-n:host] [-e:port] [-c:connections] [-s:bytes,...] [-w:messages] [-d:seconds]\n");
+		printf("  -p:pid\tProcess id of the server\n");
+		printf("  -n:host\tServer to connect to (default: localhost)\n");
+		printf("  -e:port\tServer port (default: 5001)\n");
+		printf("  -c:connections\tConnections, 1-%d (default: 4)\n", MAXCONNECTIONS);
+		printf("  -s:bytes,...\tMessage sizes, run one after the other (default: 4096,65536,1048576)\n");
+		printf("  -w:messages\tMessages in flight per connection (default: 4)\n");
+		printf("  -d:seconds\tDuration per size (default: 5)\n");
+		return (1);
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((nRet = getaddrinfo(g_Options.szHostname, g_Options.szPort, &hints, &pAddr)) != 0)
+	{
+		printf("getaddrinfo(%s) failed: %s\n", g_Options.szHostname, gai_strerror(nRet));
+		return (1);
+	}
+
+	for (int i = 0; i < g_Options.nSizes; i++)
+	{
+		dCpuStart = ProcessCpuSeconds(g_Options.nPid);
+		dStart = Now();
+		ullEchoed = RunSize(pAddr, g_Options.nSizeList[i]);
+		dSeconds = Now() - dStart;
+		dCpu = ProcessCpuSeconds(g_Options.nPid) - dCpuStart;
+		if (dCpuStart < 0 || ullEchoed == 0)
+		{
+			printf("size=%d failed\n", g_Options.nSizeList[i]);
+			nRet = 1;
+			continue;
+		}
+
+		dGB = ullEchoed / 1e9;
+		printf("size=%d connections=%d window=%d seconds=%.2f gb=%.2f gb/s=%.2f server_cpu_s=%.2f cpu_ms_per_gb=%.1f cycles_per_gb=%.3g\n",
+			   g_Options.nSizeList[i], g_Options.nConnections, g_Options.nWindow, dSeconds, dGB, dGB / dSeconds,
+			   dCpu, dCpu * 1e3 / dGB, dCpu * dHz / dGB);
+	}
+
+	freeaddrinfo(pAddr);
+	return (nRet);
+}
@@ -2,5 +2,24 @@
 
 FLAGS="-fpermissive -lws2_32 -static-libgcc -static-libstdc++"
 
-i686-w64-mingw32-g++ -Iclient client/iocpclient.cpp -o client.exe $FLAGS
-i686-w64-mingw32-g++ -Iserver server/iocpserver.cpp -o server.exe $FLAGS
+i686-w64-mingw32-g++ -Iclient -Iserver client/iocpclient.cpp server/iocplog.cpp -o client.exe $FLAGS
+i686-w64-mingw32-g++ -Iserver server/*.cpp -o server.exe $FLAGS
+
+# native Linux server, io_uring (needs liburing) and epoll backends
+g++ -O2 -fpermissive -DHAVE_LIBURING -Iserver server/*.cpp -o server -luring -lpthread
+
+# native Linux server, epoll backend only (no liburing)
+# g++ -O2 -fpermissive -Iserver server/*.cpp -o server -lpthread
+
+# benchmarks (Linux)
+g++ -O2 bench/churn.cpp -o churn -lpthread
+g++ -O2 -Iserver bench/cuckoo.cpp server/iocpcuckoo.cpp -o cuckoo
+g++ -O2 bench/echoload.cpp -o echoload -lpthread
+g++ -O2 -fpermissive -Iserver bench/framing.cpp server/iocpframe.cpp server/iocpledger.cpp server/iocpcuckoo.cpp server/iocppool.cpp server/iocplog.cpp server/iocpwal.cpp -o framing -lpthread
+g++ -O2 -Iserver bench/hashmatrix.cpp server/iocpcuckoo.cpp -o hashmatrix
+g++ -O2 bench/idlemem.cpp -o idlemem
+g++ -O2 -fpermissive -Iserver bench/ledger.cpp server/iocpframe.cpp server/iocpledger.cpp server/iocpcuckoo.cpp server/iocppool.cpp server/iocplog.cpp server/iocpwal.cpp -o ledger -lpthread
+g++ -O2 -Iserver bench/timerwheel.cpp server/iocptimer.cpp -o timerwheel
+g++ -O2 -fpermissive -Iserver bench/tuning.cpp server/iocptune.cpp server/iocplog.cpp -o tuning -lpthread
+g++ -O2 -fpermissive -DHAVE_LIBURING -Iserver bench/wal.cpp server/iocpwal.cpp server/iocplog.cpp -o wal -luring -lpthread
+g++ -O2 bench/zerocopy.cpp -o zerocopy
@@ -26,14 +26,16 @@
 //
 //      Another point worth noting is that the Win32 API CreateThread() does not
 //      initialize the C Runtime and therefore, C runtime functions such as
-//      printf() have been avoid or rewritten (see myprintf()) to use just Win32 APIs.
+//      printf() have been avoid or rewritten to use just Win32 APIs.  Output goes
+//      through the server's asynchronous logger (iocplog.h), so the echo threads
+//      don't format or write to the console in their send/recv loop.
 //
 // Entry Points:
 //      main - this is where it all starts
 //
 // Build:
 //      Use the headers and libs from the Jan98 Platform SDK or later.
-//      Link with ws2_32.lib
+//      Link with ws2_32.lib and compile in ..\server\iocplog.cpp
 //
 //
 //
@@ -51,6 +53,8 @@
 #include <strsafe.h>
 #include <algorithm>
 
+#include "iocplog.h"
+
 #define MAXTHREADS 64
 
 #define xmalloc(s) HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, (s))
@@ -66,7 +70,6 @@ typedef struct _OPTIONS
 	char *port;
 	int nTotalThreads;
 	int nBufSize;
-	BOOL bVerbose;
 } OPTIONS;
 
 typedef struct THREADINFO
@@ -75,7 +78,7 @@ typedef struct THREADINFO
 	SOCKET sd[MAXTHREADS];
 } THREADINFO;
 
-static OPTIONS default_options = {"localhost", "5001", 1, 4096, FALSE};
+static OPTIONS default_options = {"localhost", "5001", 1, 4096};
 static OPTIONS g_Options;
 static THREADINFO g_ThreadInfo;
 static BOOL g_bEndClient = FALSE;
@@ -88,7 +91,6 @@ static DWORD WINAPI EchoThread(LPVOID lpParameter);
 static BOOL CreateConnectedSocket(int nThreadNum);
 static BOOL SendBuffer(int nThreadNum, char *outbuf);
 static BOOL RecvBuffer(int nThreadNum, char *inbuf);
-static int myprintf(const char *lpFormat, ...);
 
 int __cdecl main(int argc, char *argv[])
 {
@@ -111,7 +113,7 @@ int __cdecl main(int argc, char *argv[])
 		// Since this application can heavily stress system resources
 		// we decided to limit running it on NT.
 		//
-		myprintf("Please run %s only on NT, thank you\n", argv[0]);
+		LogPrintf(LOG_ERROR, "Please run %s only on NT, thank you\n", argv[0]);
 		return (0);
 	}
 
@@ -127,32 +129,41 @@ int __cdecl main(int argc, char *argv[])
 	if (!ValidOptions(argv, argc))
 		return (1);
 
+	//
+	// log from the echo threads through the asynchronous logger
+	//
+	if (!LogInitialize())
+		LogPrintf(LOG_ERROR, "LogInitialize() failed, logging synchronously\n");
+
 	if ((nRet = WSAStartup(MAKEWORD(2, 2), &WSAData)) != 0)
 	{
-		myprintf("WSAStartup() failed: %d\n", nRet);
+		LogPrintf(LOG_ERROR, "WSAStartup() failed: %d\n", nRet);
+		LogShutdown();
 		return (1);
 	}
-	myprintf("WSAStartup() start\n");
+	LogPrintf(LOG_INFO, "WSAStartup() start\n");
 	if (WSA_INVALID_EVENT == (g_hCleanupEvent[0] = WSACreateEvent()))
 	{
-		myprintf("WSACreateEvent() failed: %d\n", WSAGetLastError());
+		LogPrintf(LOG_ERROR, "WSACreateEvent() failed: %d\n", WSAGetLastError());
 		WSACleanup();
+		LogShutdown();
 		return (1);
 	}
-	myprintf("WSACreateEvent() success\n");
+	LogPrintf(LOG_INFO, "WSACreateEvent() success\n");
 
 	//
 	// be able to gracefully handle CTRL-C and close handles
 	//
 	if (!SetConsoleCtrlHandler(CtrlHandler, TRUE))
 	{
-		myprintf("SetConsoleCtrlHandler() failed: %d\n", GetLastError());
+		LogPrintf(LOG_ERROR, "SetConsoleCtrlHandler() failed: %d\n", GetLastError());
 		if (g_hCleanupEvent[0] != WSA_INVALID_EVENT)
 		{
 			WSACloseEvent(g_hCleanupEvent[0]);
 			g_hCleanupEvent[0] = WSA_INVALID_EVENT;
 		}
 		WSACleanup();
+		LogShutdown();
 		return (1);
 	}
 
@@ -182,7 +193,7 @@ int __cdecl main(int argc, char *argv[])
 			g_ThreadInfo.hThread[i] = CreateThread(NULL, 0, EchoThread, (LPVOID)&nThreadNum[i], 0, &dwThreadId);
 			if (g_ThreadInfo.hThread[i] == NULL)
 			{
-				myprintf("CreateThread(%d) failed: %d\n", i, GetLastError());
+				LogPrintf(LOG_ERROR, "CreateThread(%d) failed: %d\n", i, GetLastError());
 				bInitError = TRUE;
 				break;
 			}
@@ -197,17 +208,17 @@ int __cdecl main(int argc, char *argv[])
 		//
 		dwRet = WaitForMultipleObjects(g_Options.nTotalThreads, g_ThreadInfo.hThread, TRUE, INFINITE);
 		if (dwRet == WAIT_FAILED)
-			myprintf("WaitForMultipleObject(): %d\n", GetLastError());
+			LogPrintf(LOG_ERROR, "WaitForMultipleObject(): %d\n", GetLastError());
 	}
 
 	if (!GenerateConsoleCtrlEvent(CTRL_C_EVENT, 0))
 	{
-		myprintf("GenerateConsoleCtrlEvent() failed: %d\n", GetLastError());
+		LogPrintf(LOG_ERROR, "GenerateConsoleCtrlEvent() failed: %d\n", GetLastError());
 	};
 
 	if (WSAWaitForMultipleEvents(1, g_hCleanupEvent, TRUE, WSA_INFINITE, FALSE) == WSA_WAIT_FAILED)
 	{
-		myprintf("WSAWaitForMultipleEvents() failed: %d\n", WSAGetLastError());
+		LogPrintf(LOG_ERROR, "WSAWaitForMultipleEvents() failed: %d\n", WSAGetLastError());
 	};
 
 	if (g_hCleanupEvent[0] != WSA_INVALID_EVENT)
@@ -224,6 +235,7 @@ int __cdecl main(int argc, char *argv[])
 	SetConsoleCtrlHandler(CtrlHandler, FALSE);
 	SetConsoleCtrlHandler(NULL, FALSE);
 
+	LogShutdown();
 	return (0);
 }
 
@@ -241,7 +253,7 @@ static DWORD WINAPI EchoThread(LPVOID lpParameter)
 	int *pArg = (int *)lpParameter;
 	int nThreadNum = *pArg;
 
-	myprintf("Starting thread %d\n", nThreadNum);
+	LogPrintf(LOG_INFO, "Starting thread %d\n", nThreadNum);
 
 	inbuf = (char *)xmalloc(g_Options.nBufSize);
 	outbuf = (char *)xmalloc(g_Options.nBufSize);
@@ -267,16 +279,15 @@ static DWORD WINAPI EchoThread(LPVOID lpParameter)
 				if ((inbuf[0] == outbuf[0]) &&
 					(inbuf[g_Options.nBufSize - 1] == outbuf[g_Options.nBufSize - 1]))
 				{
-					if (g_Options.bVerbose)
-						myprintf("ack(%d)\n", nThreadNum);
+					LogPrintf(LOG_VERBOSE, "ack(%d)\n", nThreadNum);
 				}
 				else
 				{
-					myprintf("nak(%d) in[0]=%d, out[0]=%d in[%d]=%d out[%d]%d\n",
-							 nThreadNum,
-							 inbuf[0], outbuf[0],
-							 g_Options.nBufSize - 1, inbuf[g_Options.nBufSize - 1],
-							 g_Options.nBufSize - 1, outbuf[g_Options.nBufSize - 1]);
+					LogPrintf(LOG_ERROR, "nak(%d) in[0]=%d, out[0]=%d in[%d]=%d out[%d]%d\n",
+							  nThreadNum,
+							  inbuf[0], outbuf[0],
+							  g_Options.nBufSize - 1, inbuf[g_Options.nBufSize - 1],
+							  g_Options.nBufSize - 1, outbuf[g_Options.nBufSize - 1]);
 					break;
 				}
 			}
@@ -290,6 +301,7 @@ static DWORD WINAPI EchoThread(LPVOID lpParameter)
 	if (outbuf)
 		xfree(outbuf);
 
+	LogReleaseThread();
 	return (TRUE);
 }
 
@@ -315,13 +327,13 @@ static BOOL CreateConnectedSocket(int nThreadNum)
 
 	if (getaddrinfo(g_Options.szHostname, g_Options.port, &hints, &addr_srv) != 0)
 	{
-		myprintf("getaddrinfo() failed with error %d\n", WSAGetLastError());
+		LogPrintf(LOG_ERROR, "getaddrinfo() failed with error %d\n", WSAGetLastError());
 		bRet = FALSE;
 	}
 
 	if (addr_srv == NULL)
 	{
-		myprintf("getaddrinfo() failed to resolve/convert the interface\n");
+		LogPrintf(LOG_ERROR, "getaddrinfo() failed to resolve/convert the interface\n");
 		bRet = FALSE;
 	}
 	else
@@ -329,7 +341,7 @@ static BOOL CreateConnectedSocket(int nThreadNum)
 		g_ThreadInfo.sd[nThreadNum] = socket(addr_srv->ai_family, addr_srv->ai_socktype, addr_srv->ai_protocol);
 		if (g_ThreadInfo.sd[nThreadNum] == INVALID_SOCKET)
 		{
-			myprintf("socket() failed: %d\n", WSAGetLastError());
+			LogPrintf(LOG_ERROR, "socket() failed: %d\n", WSAGetLastError());
 			bRet = FALSE;
 		}
 	}
@@ -339,11 +351,11 @@ static BOOL CreateConnectedSocket(int nThreadNum)
 		nRet = connect(g_ThreadInfo.sd[nThreadNum], addr_srv->ai_addr, (int)addr_srv->ai_addrlen);
 		if (nRet == SOCKET_ERROR)
 		{
-			myprintf("connect(thread %d) failed: %d\n", nThreadNum, WSAGetLastError());
+			LogPrintf(LOG_ERROR, "connect(thread %d) failed: %d\n", nThreadNum, WSAGetLastError());
 			bRet = FALSE;
 		}
 		else
-			myprintf("connected(thread %d)\n", nThreadNum);
+			LogPrintf(LOG_INFO, "connected(thread %d)\n", nThreadNum);
 
 		freeaddrinfo(addr_srv);
 	}
@@ -369,13 +381,13 @@ static BOOL SendBuffer(int nThreadNum, char *outbuf)
 		nSend = send(g_ThreadInfo.sd[nThreadNum], bufp, g_Options.nBufSize - nTotalSend, 0);
 		if (nSend == SOCKET_ERROR)
 		{
-			myprintf("send(thread=%d) failed: %d\n", nThreadNum, WSAGetLastError());
+			LogPrintf(LOG_ERROR, "send(thread=%d) failed: %d\n", nThreadNum, WSAGetLastError());
 			bRet = FALSE;
 			break;
 		}
 		else if (nSend == 0)
 		{
-			myprintf("connection closed\n");
+			LogPrintf(LOG_INFO, "connection closed\n");
 			bRet = FALSE;
 			break;
 		}
@@ -385,7 +397,7 @@ static BOOL SendBuffer(int nThreadNum, char *outbuf)
 			bufp += nSend;
 		}
 	}
-	myprintf("send(thread=%d) finished\n", nThreadNum);
+	LogPrintf(LOG_VERBOSE, "send(thread=%d) finished\n", nThreadNum);
 	return (bRet);
 }
 
@@ -406,13 +418,13 @@ static BOOL RecvBuffer(int nThreadNum, char *inbuf)
 		nRecv = recv(g_ThreadInfo.sd[nThreadNum], bufp, g_Options.nBufSize - nTotalRecv, 0);
 		if (nRecv == SOCKET_ERROR)
 		{
-			myprintf("recv(thread=%d) failed: %d\n", nThreadNum, WSAGetLastError());
+			LogPrintf(LOG_ERROR, "recv(thread=%d) failed: %d\n", nThreadNum, WSAGetLastError());
 			bRet = FALSE;
 			break;
 		}
 		else if (nRecv == 0)
 		{
-			myprintf("connection closed\n");
+			LogPrintf(LOG_INFO, "connection closed\n");
 			bRet = FALSE;
 			break;
 		}
@@ -422,7 +434,7 @@ static BOOL RecvBuffer(int nThreadNum, char *inbuf)
 			bufp += nRecv;
 		}
 	}
-	myprintf("recv(thread=%d) finished %s\n", nThreadNum);
+	LogPrintf(LOG_VERBOSE, "recv(thread=%d) finished\n", nThreadNum);
 	return (bRet);
 }
 
@@ -465,7 +477,18 @@ static BOOL ValidOptions(char *argv[], int argc)
 				break;
 
 			case 'v':
-				g_Options.bVerbose = TRUE;
+				g_dwLogLevel = LOG_VERBOSE;
+				break;
+
+			case 'l':
+				if (lstrlen(argv[i]) > 3)
+					g_dwLogLevel = (DWORD)atoi(&argv[i][3]);
+				if (g_dwLogLevel >= LOG_LEVELS)
+				{
+					g_dwLogLevel = LOG_INFO;
+					Usage(argv[0], &default_options);
+					return (FALSE);
+				}
 				break;
 
 			case '?':
@@ -474,7 +497,7 @@ static BOOL ValidOptions(char *argv[], int argc)
 				break;
 
 			default:
-				myprintf("  unknown options flag %s\n", argv[i]);
+				LogPrintf(LOG_ERROR, "  unknown options flag %s\n", argv[i]);
 				Usage(argv[0], &default_options);
 				return (FALSE);
 				break;
@@ -482,7 +505,7 @@ static BOOL ValidOptions(char *argv[], int argc)
 		}
 		else
 		{
-			myprintf("  unknown option %s\n", argv[i]);
+			LogPrintf(LOG_ERROR, "  unknown option %s\n", argv[i]);
 			Usage(argv[0], &default_options);
 			return (FALSE);
 		}
@@ -498,18 +521,19 @@ static BOOL ValidOptions(char *argv[], int argc)
 static VOID Usage(char *szProgramname, OPTIONS *pOptions)
 {
 
-	myprintf("usage:\n%s [-b:#] [-e:#] [-n:host] [-t:#] [-v]\n",
-			 szProgramname);
-	myprintf("%s -?\n", szProgramname);
-	myprintf("  -?\t\tDisplay this help\n");
-	myprintf("  -b:bufsize\tSize of send/recv buffer; in 1K increments (Def:%d)\n",
-			 pOptions->nBufSize);
-	myprintf("  -e:port\tEndpoint number (port) to use (Def:%d)\n",
-			 pOptions->port);
-	myprintf("  -n:host\tAct as the client and connect to 'host' (Def:%s)\n",
-			 pOptions->szHostname);
-	myprintf("  -t:#\tNumber of threads to use\n");
-	myprintf("  -v\t\tVerbose, print an ack when echo received and verified\n");
+	LogPrintf(LOG_INFO, "usage:\n%s [-b:#] [-e:#] [-n:host] [-t:#] [-l:#] [-v]\n",
+			  szProgramname);
+	LogPrintf(LOG_INFO, "%s -?\n", szProgramname);
+	LogPrintf(LOG_INFO, "  -?\t\tDisplay this help\n");
+	LogPrintf(LOG_INFO, "  -b:bufsize\tSize of send/recv buffer; in 1K increments (Def:%d)\n",
+			  pOptions->nBufSize);
+	LogPrintf(LOG_INFO, "  -e:port\tEndpoint number (port) to use (Def:%s)\n",
+			  pOptions->port);
+	LogPrintf(LOG_INFO, "  -n:host\tAct as the client and connect to 'host' (Def:%s)\n",
+			  pOptions->szHostname);
+	LogPrintf(LOG_INFO, "  -t:#\tNumber of threads to use\n");
+	LogPrintf(LOG_INFO, "  -l:#\t\tLog level: 0 errors, 1 information, 2 verbose (Def:1)\n");
+	LogPrintf(LOG_INFO, "  -v\t\tVerbose, print an ack when echo received and verified (-l:2)\n");
 	return;
 }
 
@@ -527,7 +551,7 @@ static BOOL WINAPI CtrlHandler(DWORD dwEvent)
 	case CTRL_SHUTDOWN_EVENT:
 	case CTRL_CLOSE_EVENT:
 
-		myprintf("Closing handles and sockets\n");
+		LogPrintf(LOG_INFO, "Closing handles and sockets\n");
 
 		//
 		// Temporarily disables processing of CTRL_C_EVENT signal.
@@ -558,7 +582,7 @@ static BOOL WINAPI CtrlHandler(DWORD dwEvent)
 
 					dwRet = WaitForSingleObject(g_ThreadInfo.hThread[i], INFINITE);
 					if (dwRet == WAIT_FAILED)
-						myprintf("WaitForSingleObject(): %d\n", GetLastError());
+						LogPrintf(LOG_ERROR, "WaitForSingleObject(): %d\n", GetLastError());
 
 					CloseHandle(g_ThreadInfo.hThread[i]);
 					g_ThreadInfo.hThread[i] = INVALID_HANDLE_VALUE;
@@ -580,31 +604,3 @@ static BOOL WINAPI CtrlHandler(DWORD dwEvent)
 
 	return (TRUE);
 }
-
-static int myprintf(const char *lpFormat, ...)
-{
-
-	int nLen = 0;
-	int nRet = 0;
-	char cBuffer[512] = {'\0'};
-	va_list arglist;
-	HANDLE hOut = NULL;
-	HRESULT hRet;
-
-	ZeroMemory(cBuffer, sizeof(cBuffer));
-
-	va_start(arglist, lpFormat);
-
-	nLen = lstrlen(lpFormat);
-
-	hRet = StringCchVPrintf(cBuffer, 512, lpFormat, arglist);
-
-	if (nRet >= nLen || GetLastError() == 0)
-	{
-		hOut = GetStdHandle(STD_OUTPUT_HANDLE);
-		if (hOut != INVALID_HANDLE_VALUE)
-			WriteConsole(hOut, cBuffer, lstrlen(cBuffer), (LPDWORD)&nLen, NULL);
-	}
-
-	return nLen;
-}
@@ -0,0 +1,797 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Module:
+//      cq_epoll.cpp
+//
+// Abstract:
+//      Edge-triggered epoll backend for the completion queue abstraction, for
+//      Linux hosts where io_uring is not available.
+//
+//      epoll reports readiness, not completion, so this backend turns one into
+//      the other.  A posted receive or send is attempted right away on the
+//      nonblocking socket; if it transfers data (or fails) a completion is
+//      queued on the shard's ready list.  If it would block, the operation is
+//      parked on the socket context and retried when epoll reports the socket
+//      readable or writable.  Several receives may be parked on one socket; they
+//      are kept in posting order and a new one is only tried inline when none is
+//      parked, so data lands in the buffers in the order they were posted.
+//      A send gathering several buffers is one sendmsg.
+//      Sockets are registered once for EPOLLIN|EPOLLOUT in edge-triggered mode,
+//      so an idle connection costs no epoll_ctl calls.
+//
+//      A receive posted without a buffer takes one from g_BufferPool for each
+//      attempt and keeps it only if data came in.
+//
+//      Each worker owns one epoll instance (a shard).  Posts can come from any
+//      thread, so the attempt-or-park step and the ready list are guarded by the
+//      shard lock, and a post from a thread other than the owner wakes the
+//      owner through the shard's eventfd.
+//
+//      An accept context arms the listening socket in one shard's epoll set
+//      (EPOLLEXCLUSIVE, so a new connection wakes one shard rather than all of
+//      them) and stays armed; every readiness edge drains the accept queue into
+//      one completion per connection.  The listening socket can be armed once
+//      per shard, so at most one accept context per worker is effective.  An
+//      accept that fails for want of descriptors or memory queues one failed
+//      completion and is retried by the shard's worker every
+//      EPOLL_ACCEPT_RETRY_MS, as no new edge may come for the connections
+//      still queued.
+//
+//      A worker takes as many completions off its ready list per call as the
+//      batch allows, and only calls epoll_wait once the list is empty.  Sends
+//      and receives are system calls of their own here, so fnFlush has nothing
+//      to submit.
+//
+//      With -x, a send of at least g_dwZeroCopyThreshold bytes goes out with
+//      MSG_ZEROCOPY on sockets that accepted SO_ZEROCOPY.  The kernel reports
+//      when it is done with the buffers on the socket's error queue (EPOLLERR),
+//      by the sequence numbers it gives each zero-copy send, and only then is
+//      the send's completion queued, so the buffers are not reused while the
+//      kernel can still read them.  If the kernel is out of memory for pinning
+//      them (ENOBUFS) the send is copied instead.
+//
+//      In splice mode the splices between a socket and its connection's pipe
+//      are attempted and parked like receives (out of the socket) and sends
+//      (back into it), with SPLICE_F_NONBLOCK.  The pipe never blocks them: a
+//      connection only splices into its pipe once it is empty, and only out of
+//      it what it holds.
+//
+//      Event data is the socket context for connections, the accept context
+//      with the low bit set for listening sockets, and NULL for the eventfd.
+//
+
+#ifdef __linux__
+
+#include <fcntl.h>
+#include <linux/errqueue.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "iocpserver.h"
+#include "iocpcq.h"
+#include "iocppool.h"
+#include "iocpstats.h"
+
+#define EPOLL_MAX_EVENTS 256
+#define EPOLL_ACCEPT_TAG 1
+#define EPOLL_ACCEPT_RETRY_MS 100 // between accepts retried after running out of descriptors
+
+typedef struct _EPOLL_READY {
+	CQ_COMPLETION Completion;
+} EPOLL_READY, *PEPOLL_READY;
+
+typedef struct _EPOLL_SHARD {
+	int fdEpoll;
+	int fdWake;
+	CRITICAL_SECTION csShard;
+
+	//
+	// completions waiting to be dequeued, a ring that grows on demand
+	//
+	PEPOLL_READY pReady;
+	DWORD dwReadyHead;
+	DWORD dwReadyCount;
+	DWORD dwReadyCapacity;
+
+	//
+	// accept context to retry, and when (ms)
+	//
+	PPER_IO_CONTEXT pAcceptRetry;
+	ULONGLONG ullAcceptRetry;
+} EPOLL_SHARD, *PEPOLL_SHARD;
+
+static PEPOLL_SHARD g_pShards = NULL;
+static DWORD g_dwShards = 0;
+static volatile LONG g_lNextShard = 0;
+static volatile LONG g_lNextAcceptShard = 0;
+static BOOL g_bNoZeroCopy = FALSE;
+
+//
+// index of the shard the calling thread services, -1 for non-worker threads
+//
+static __thread DWORD t_dwShard = (DWORD)-1;
+
+//
+// Queue a completion on a shard whose lock is held.
+//
+static BOOL EpollQueueCompletion(PEPOLL_SHARD pShard, PPER_SOCKET_CONTEXT lpPerSocketContext,
+								 PPER_IO_CONTEXT lpIOContext, DWORD dwIoSize, SOCKET SocketAccept,
+								 int nError)
+{
+
+	PEPOLL_READY pEntry = NULL;
+
+	if (pShard->dwReadyCount == pShard->dwReadyCapacity)
+	{
+		DWORD dwCapacity = pShard->dwReadyCapacity ? pShard->dwReadyCapacity * 2 : 256;
+		PEPOLL_READY pReady = (PEPOLL_READY)malloc(dwCapacity * sizeof(EPOLL_READY));
+
+		if (pReady == NULL)
+		{
+			LogPrintf(LOG_ERROR, "malloc(EPOLL_READY) failed\n");
+			return (FALSE);
+		}
+		for (DWORD i = 0; i < pShard->dwReadyCount; i++)
+			pReady[i] = pShard->pReady[(pShard->dwReadyHead + i) % pShard->dwReadyCapacity];
+		free(pShard->pReady);
+		pShard->pReady = pReady;
+		pShard->dwReadyHead = 0;
+		pShard->dwReadyCapacity = dwCapacity;
+	}
+
+	pEntry = &pShard->pReady[(pShard->dwReadyHead + pShard->dwReadyCount) % pShard->dwReadyCapacity];
+	pEntry->Completion.lpPerSocketContext = lpPerSocketContext;
+	pEntry->Completion.lpIOContext = lpIOContext;
+	pEntry->Completion.dwIoSize = dwIoSize;
+	pEntry->Completion.SocketAccept = SocketAccept;
+	pEntry->Completion.bSuccess = (nError == 0);
+	pEntry->Completion.dwError = (DWORD)nError;
+	pShard->dwReadyCount++;
+	return (TRUE);
+}
+
+//
+// Wake the owner of a shard if the caller is some other thread.
+//
+static VOID EpollWake(DWORD dwShard)
+{
+
+	uint64_t u64One = 1;
+
+	if (t_dwShard != dwShard)
+	{
+		t_pCqStats->llSyscalls++;
+		if (write(g_pShards[dwShard].fdWake, &u64One, sizeof(u64One)) < 0 && errno != EAGAIN)
+			LogPrintf(LOG_ERROR, "write(eventfd) failed: %d\n", errno);
+	}
+}
+
+//
+// Attempt a splice on a shard whose lock is held, like EpollTryIo.
+//
+static BOOL EpollTrySplice(PEPOLL_SHARD pShard, PPER_SOCKET_CONTEXT lpPerSocketContext,
+						   PPER_IO_CONTEXT lpIOContext)
+{
+
+	ssize_t nRet = 0;
+	int nError = 0;
+
+	do
+	{
+		t_pCqStats->llSyscalls++;
+		if (lpIOContext->IOOperation == ClientIoSpliceIn)
+			nRet = splice(lpPerSocketContext->Socket, NULL, lpIOContext->fdSplice, NULL, lpIOContext->cbSplice,
+						  SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		else
+			nRet = splice(lpIOContext->fdSplice, NULL, lpPerSocketContext->Socket, NULL, lpIOContext->cbSplice,
+						  SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	} while (nRet < 0 && errno == EINTR);
+	nError = (nRet < 0) ? errno : 0;
+
+	if (nRet < 0 && (nError == EAGAIN || nError == EWOULDBLOCK))
+		return (FALSE);
+
+	EpollQueueCompletion(pShard, lpPerSocketContext, lpIOContext,
+						 (nRet < 0) ? 0 : (DWORD)nRet, INVALID_SOCKET, nError);
+	return (TRUE);
+}
+
+//
+// Attempt a receive or send on a shard whose lock is held.  Returns TRUE if the
+// operation finished (a completion was queued) and FALSE if it would block.
+//
+static BOOL EpollTryIo(PEPOLL_SHARD pShard, PPER_SOCKET_CONTEXT lpPerSocketContext,
+					   PPER_IO_CONTEXT lpIOContext)
+{
+
+	LPWSABUF lpBuffer = &lpIOContext->wsabufPosted;
+	char *pBuffer = lpBuffer->buf;
+	struct msghdr msg = {0};
+	size_t cbSend = 0;
+	BOOL bZeroCopy = FALSE;
+	ssize_t nRet = 0;
+	int nError = 0;
+
+	if (lpIOContext->IOOperation == ClientIoSpliceIn || lpIOContext->IOOperation == ClientIoSpliceOut)
+		return (EpollTrySplice(pShard, lpPerSocketContext, lpIOContext));
+
+	if (lpIOContext->IOOperation != ClientIoWrite && pBuffer == NULL)
+	{
+		pBuffer = (char *)CtxtPoolAlloc(&g_BufferPool);
+		if (pBuffer == NULL)
+		{
+			EpollQueueCompletion(pShard, lpPerSocketContext, lpIOContext, 0, INVALID_SOCKET, ENOBUFS);
+			return (TRUE);
+		}
+	}
+
+	//
+	// WSABUF is laid out as struct iovec, so a gathered send goes out as is
+	//
+	msg.msg_iov = (struct iovec *)lpIOContext->lpSendBuffers;
+	msg.msg_iovlen = lpIOContext->dwSendBuffers;
+	if (lpIOContext->IOOperation == ClientIoWrite && g_dwZeroCopyThreshold && !g_bNoZeroCopy)
+	{
+		for (DWORD i = 0; i < lpIOContext->dwSendBuffers; i++)
+			cbSend += lpIOContext->lpSendBuffers[i].len;
+		bZeroCopy = (cbSend >= g_dwZeroCopyThreshold);
+	}
+
+	do
+	{
+		t_pCqStats->llSyscalls++;
+		if (lpIOContext->IOOperation == ClientIoWrite)
+			nRet = sendmsg(lpPerSocketContext->Socket, &msg, MSG_NOSIGNAL | (bZeroCopy ? MSG_ZEROCOPY : 0));
+		else
+			nRet = recv(lpPerSocketContext->Socket, pBuffer, lpBuffer->buf ? lpBuffer->len : MAX_BUFF_SIZE, 0);
+		if (nRet < 0 && errno == ENOBUFS && bZeroCopy)
+		{
+			bZeroCopy = FALSE;
+			errno = EINTR;
+		}
+	} while (nRet < 0 && errno == EINTR);
+	nError = (nRet < 0) ? errno : 0;
+
+	//
+	// a zero-copy send completes when the kernel says it is done with it
+	//
+	if (bZeroCopy && nRet >= 0)
+	{
+		lpIOContext->bZeroCopy = TRUE;
+		lpIOContext->nZeroCopyResult = (int)nRet;
+		lpIOContext->dwZeroCopyId = lpPerSocketContext->dwZeroCopyNext++;
+		lpPerSocketContext->pZeroCopyPending = lpIOContext;
+		t_pWorkerStats->llZeroCopySends++;
+		return (TRUE);
+	}
+
+	if (pBuffer != lpBuffer->buf)
+	{
+		if (nRet > 0)
+		{
+			lpIOContext->Buffer = pBuffer;
+			lpIOContext->bProvidedBuffer = TRUE;
+		}
+		else
+			CtxtPoolFree(&g_BufferPool, pBuffer);
+	}
+
+	if (nRet < 0 && (nError == EAGAIN || nError == EWOULDBLOCK))
+		return (FALSE);
+
+	EpollQueueCompletion(pShard, lpPerSocketContext, lpIOContext,
+						 (nRet < 0) ? 0 : (DWORD)nRet, INVALID_SOCKET, nError);
+	return (TRUE);
+}
+
+//
+// Read the zero-copy notifications off a socket's error queue, on a shard whose
+// lock is held, and queue the completion of the send waiting for them once
+// the kernel is done with it.
+//
+static VOID EpollZeroCopyDone(PEPOLL_SHARD pShard, PPER_SOCKET_CONTEXT lpPerSocketContext)
+{
+
+	PPER_IO_CONTEXT lpIOContext = NULL;
+	struct sock_extended_err *pError = NULL;
+	struct cmsghdr *pCmsg = NULL;
+	struct msghdr msg;
+	char Control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+
+	while (TRUE)
+	{
+		ZeroMemory(&msg, sizeof(msg));
+		msg.msg_control = Control;
+		msg.msg_controllen = sizeof(Control);
+		t_pCqStats->llSyscalls++;
+		if (recvmsg(lpPerSocketContext->Socket, &msg, MSG_ERRQUEUE) < 0)
+			break;
+		for (pCmsg = CMSG_FIRSTHDR(&msg); pCmsg; pCmsg = CMSG_NXTHDR(&msg, pCmsg))
+		{
+			pError = (struct sock_extended_err *)CMSG_DATA(pCmsg);
+			if (pError->ee_errno != 0 || pError->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+
+			//
+			// ee_info to ee_data is the range of sends the kernel is done with
+			//
+			if ((int)(pError->ee_data + 1 - lpPerSocketContext->dwZeroCopyDone) > 0)
+				lpPerSocketContext->dwZeroCopyDone = pError->ee_data + 1;
+			if (pError->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				t_pWorkerStats->llZeroCopyCopied += pError->ee_data - pError->ee_info + 1;
+		}
+	}
+
+	lpIOContext = lpPerSocketContext->pZeroCopyPending;
+	if (lpIOContext && (int)(lpPerSocketContext->dwZeroCopyDone - lpIOContext->dwZeroCopyId) > 0)
+	{
+		lpPerSocketContext->pZeroCopyPending = NULL;
+		lpIOContext->bZeroCopy = FALSE;
+		EpollQueueCompletion(pShard, lpPerSocketContext, lpIOContext, (DWORD)lpIOContext->nZeroCopyResult,
+							 INVALID_SOCKET, 0);
+	}
+}
+
+//
+// Accept every pending connection on a shard whose lock is held.  Edge-triggered
+// readiness requires draining the queue until accept4 would block.  If it fails
+// otherwise the connections left queued raise no new edge, so the accept is
+// retried later; only the first failure in a row is queued as a completion.
+//
+static VOID EpollTryAccept(PEPOLL_SHARD pShard, PPER_IO_CONTEXT lpIOContext)
+{
+
+	PPER_SOCKET_CONTEXT lpListenContext = lpIOContext->pSocketContext;
+	SOCKET sdAccept = INVALID_SOCKET;
+
+	while (TRUE)
+	{
+		t_pCqStats->llSyscalls++;
+		sdAccept = accept4(lpIOContext->SocketListen, NULL, NULL, SOCK_CLOEXEC);
+		if (sdAccept != INVALID_SOCKET)
+		{
+			EpollQueueCompletion(pShard, lpListenContext, lpIOContext, 0, sdAccept, 0);
+			continue;
+		}
+		if (errno == EINTR || errno == ECONNABORTED)
+			continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+		{
+			pShard->pAcceptRetry = NULL;
+			break;
+		}
+		if (pShard->pAcceptRetry == NULL)
+			EpollQueueCompletion(pShard, lpListenContext, lpIOContext, 0, INVALID_SOCKET, errno);
+		pShard->pAcceptRetry = lpIOContext;
+		pShard->ullAcceptRetry = GetTickCount64() + EPOLL_ACCEPT_RETRY_MS;
+		break;
+	}
+}
+
+static BOOL EpollCreate(DWORD dwWorkers)
+{
+
+	struct epoll_event event;
+
+	g_pShards = (PEPOLL_SHARD)calloc(dwWorkers, sizeof(EPOLL_SHARD));
+	if (g_pShards == NULL)
+	{
+		LogPrintf(LOG_ERROR, "calloc(EPOLL_SHARD) failed\n");
+		return (FALSE);
+	}
+
+	for (g_dwShards = 0; g_dwShards < dwWorkers; g_dwShards++)
+	{
+		PEPOLL_SHARD pShard = &g_pShards[g_dwShards];
+
+		pShard->fdEpoll = epoll_create1(EPOLL_CLOEXEC);
+		if (pShard->fdEpoll < 0)
+		{
+			LogPrintf(LOG_ERROR, "epoll_create1() failed: %d\n", errno);
+			break;
+		}
+		pShard->fdWake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (pShard->fdWake < 0)
+		{
+			LogPrintf(LOG_ERROR, "eventfd() failed: %d\n", errno);
+			close(pShard->fdEpoll);
+			break;
+		}
+
+		//
+		// the wake eventfd is the only level-triggered registration and the only
+		// one with a NULL data pointer
+		//
+		event.events = EPOLLIN;
+		event.data.ptr = NULL;
+		if (epoll_ctl(pShard->fdEpoll, EPOLL_CTL_ADD, pShard->fdWake, &event) < 0)
+		{
+			LogPrintf(LOG_ERROR, "epoll_ctl(eventfd) failed: %d\n", errno);
+			close(pShard->fdWake);
+			close(pShard->fdEpoll);
+			break;
+		}
+		InitializeCriticalSection(&pShard->csShard);
+	}
+
+	if (g_dwShards < dwWorkers)
+	{
+		while (g_dwShards)
+		{
+			g_dwShards--;
+			close(g_pShards[g_dwShards].fdWake);
+			close(g_pShards[g_dwShards].fdEpoll);
+			DeleteCriticalSection(&g_pShards[g_dwShards].csShard);
+		}
+		free(g_pShards);
+		g_pShards = NULL;
+		return (FALSE);
+	}
+	g_lNextShard = 0;
+	return (TRUE);
+}
+
+static VOID EpollClose(void)
+{
+
+	for (DWORD i = 0; i < g_dwShards; i++)
+	{
+		close(g_pShards[i].fdWake);
+		close(g_pShards[i].fdEpoll);
+		DeleteCriticalSection(&g_pShards[i].csShard);
+		free(g_pShards[i].pReady);
+	}
+	free(g_pShards);
+	g_pShards = NULL;
+	g_dwShards = 0;
+}
+
+static BOOL EpollAssociate(PPER_SOCKET_CONTEXT lpPerSocketContext)
+{
+
+	struct epoll_event event;
+	int nFlags = 0;
+	int nOne = 1;
+
+	if (lpPerSocketContext->dwShard >= g_dwShards)
+		lpPerSocketContext->dwShard = (DWORD)InterlockedIncrement(&g_lNextShard) % g_dwShards;
+	lpPerSocketContext->pRecvPending = NULL;
+	lpPerSocketContext->pSendPending = NULL;
+	lpPerSocketContext->pZeroCopyPending = NULL;
+	lpPerSocketContext->dwZeroCopyNext = 0;
+	lpPerSocketContext->dwZeroCopyDone = 0;
+
+	nFlags = fcntl(lpPerSocketContext->Socket, F_GETFL, 0);
+	if (nFlags < 0 || fcntl(lpPerSocketContext->Socket, F_SETFL, nFlags | O_NONBLOCK) < 0)
+	{
+		LogPrintf(LOG_ERROR, "fcntl(O_NONBLOCK) failed: %d\n", errno);
+		return (FALSE);
+	}
+
+	//
+	// the listening socket is registered per shard by EpollPostAccept
+	//
+	if (lpPerSocketContext->pIOContext->IOOperation == ClientIoAccept)
+		return (TRUE);
+
+	if (g_dwZeroCopyThreshold && !g_bNoZeroCopy &&
+		setsockopt(lpPerSocketContext->Socket, SOL_SOCKET, SO_ZEROCOPY, &nOne, sizeof(nOne)) < 0)
+	{
+		LogPrintf(LOG_INFO, "SO_ZEROCOPY not supported (%d), copying sends\n", errno);
+		g_bNoZeroCopy = TRUE;
+	}
+
+	event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	event.data.ptr = lpPerSocketContext;
+	t_pCqStats->llSyscalls++;
+	if (epoll_ctl(g_pShards[lpPerSocketContext->dwShard].fdEpoll, EPOLL_CTL_ADD,
+				  lpPerSocketContext->Socket, &event) < 0)
+	{
+		LogPrintf(LOG_ERROR, "epoll_ctl(EPOLL_CTL_ADD) failed: %d\n", errno);
+		return (FALSE);
+	}
+	return (TRUE);
+}
+
+static BOOL EpollPost(PPER_SOCKET_CONTEXT lpPerSocketContext, PPER_IO_CONTEXT lpIOContext,
+					  LPWSABUF lpBuffers, DWORD dwBufferCount)
+{
+
+	DWORD dwShard = lpPerSocketContext->dwShard;
+	PEPOLL_SHARD pShard = &g_pShards[dwShard];
+	PPER_IO_CONTEXT *ppPending = NULL;
+	BOOL bCompleted = FALSE;
+
+	if (lpIOContext->IOOperation == ClientIoWrite || lpIOContext->IOOperation == ClientIoSpliceOut)
+		ppPending = &lpPerSocketContext->pSendPending;
+	else
+		ppPending = &lpPerSocketContext->pRecvPending;
+
+	EnterCriticalSection(&pShard->csShard);
+	if (lpIOContext->IOOperation == ClientIoWrite)
+	{
+		lpIOContext->lpSendBuffers = lpBuffers;
+		lpIOContext->dwSendBuffers = dwBufferCount;
+	}
+	else if (lpBuffers)
+		lpIOContext->wsabufPosted = *lpBuffers;
+	else
+	{
+		lpIOContext->wsabufPosted.buf = NULL;
+		lpIOContext->wsabufPosted.len = 0;
+	}
+	lpIOContext->pPendingNext = NULL;
+	if (*ppPending == NULL)
+		bCompleted = EpollTryIo(pShard, lpPerSocketContext, lpIOContext);
+	if (!bCompleted)
+	{
+		while (*ppPending)
+			ppPending = &(*ppPending)->pPendingNext;
+		*ppPending = lpIOContext;
+	}
+	LeaveCriticalSection(&pShard->csShard);
+
+	if (bCompleted)
+		EpollWake(dwShard);
+	return (TRUE);
+}
+
+static BOOL EpollPostRecv(PPER_SOCKET_CONTEXT lpPerSocketContext, PPER_IO_CONTEXT lpIOContext,
+						  LPWSABUF lpBuffer)
+{
+
+	return (EpollPost(lpPerSocketContext, lpIOContext, lpBuffer, 1));
+}
+
+static VOID EpollReleaseBuffer(PPER_IO_CONTEXT lpIOContext)
+{
+
+	CtxtPoolFree(&g_BufferPool, lpIOContext->Buffer);
+	lpIOContext->Buffer = NULL;
+	lpIOContext->bProvidedBuffer = FALSE;
+}
+
+static BOOL EpollPostSend(PPER_SOCKET_CONTEXT lpPerSocketContext, PPER_IO_CONTEXT lpIOContext,
+						  LPWSABUF lpBuffers, DWORD dwBufferCount)
+{
+
+	return (EpollPost(lpPerSocketContext, lpIOContext, lpBuffers, dwBufferCount));
+}
+
+static BOOL EpollPostSplice(PPER_SOCKET_CONTEXT lpPerSocketContext, PPER_IO_CONTEXT lpIOContext,
+							int fdPipe, DWORD dwLength)
+{
+
+	lpIOContext->fdSplice = fdPipe;
+	lpIOContext->cbSplice = dwLength;
+	return (EpollPost(lpPerSocketContext, lpIOContext, NULL, 0));
+}
+
+static BOOL EpollPostAccept(PPER_SOCKET_CONTEXT lpListenContext, PPER_IO_CONTEXT lpIOContext)
+{
+
+	struct epoll_event event;
+	int nFlags = 0;
+
+	UNREFERENCED_PARAMETER(lpListenContext);
+	if (lpIOContext->bAcceptArmed)
+		return (TRUE);
+
+	if (lpIOContext->dwAcceptShard >= g_dwShards)
+		lpIOContext->dwAcceptShard = (DWORD)InterlockedIncrement(&g_lNextAcceptShard) % g_dwShards;
+
+	//
+	// reactors' own listening sockets are never associated, so make them
+	// nonblocking here
+	//
+	nFlags = fcntl(lpIOContext->SocketListen, F_GETFL, 0);
+	if (nFlags < 0 || fcntl(lpIOContext->SocketListen, F_SETFL, nFlags | O_NONBLOCK) < 0)
+	{
+		LogPrintf(LOG_ERROR, "fcntl(O_NONBLOCK, listen) failed: %d\n", errno);
+		return (FALSE);
+	}
+
+	event.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+	event.data.u64 = (uint64_t)(uintptr_t)lpIOContext | EPOLL_ACCEPT_TAG;
+	t_pCqStats->llSyscalls++;
+	if (epoll_ctl(g_pShards[lpIOContext->dwAcceptShard].fdEpoll, EPOLL_CTL_ADD,
+				  lpIOContext->SocketListen, &event) < 0 && errno != EEXIST)
+	{
+		LogPrintf(LOG_ERROR, "epoll_ctl(EPOLL_CTL_ADD, listen) failed: %d\n", errno);
+		return (FALSE);
+	}
+
+	//
+	// Registering reports connections that are already pending, so there is
+	// nothing to try inline.  With EEXIST another accept context is armed on
+	// this shard already and this one stays idle.
+	//
+	lpIOContext->bAcceptArmed = TRUE;
+	return (TRUE);
+}
+
+//
+// Retry the operations parked on a socket after epoll reported it ready.
+//
+static VOID EpollDispatch(PEPOLL_SHARD pShard, struct epoll_event *pEvent)
+{
+
+	PPER_SOCKET_CONTEXT lpPerSocketContext = (PPER_SOCKET_CONTEXT)pEvent->data.ptr;
+	PPER_IO_CONTEXT lpIOContext = NULL;
+
+	EnterCriticalSection(&pShard->csShard);
+	if ((pEvent->events & EPOLLERR) && lpPerSocketContext->pZeroCopyPending)
+		EpollZeroCopyDone(pShard, lpPerSocketContext);
+	if (pEvent->events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+	{
+		while ((lpIOContext = lpPerSocketContext->pRecvPending) != NULL &&
+			   EpollTryIo(pShard, lpPerSocketContext, lpIOContext))
+			lpPerSocketContext->pRecvPending = lpIOContext->pPendingNext;
+	}
+	if (pEvent->events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+	{
+		while ((lpIOContext = lpPerSocketContext->pSendPending) != NULL &&
+			   EpollTryIo(pShard, lpPerSocketContext, lpIOContext))
+			lpPerSocketContext->pSendPending = lpIOContext->pPendingNext;
+	}
+	LeaveCriticalSection(&pShard->csShard);
+}
+
+//
+// Complete every operation parked on a socket that is being closed.
+//
+static VOID EpollCancel(PPER_SOCKET_CONTEXT lpPerSocketContext)
+{
+
+	DWORD dwShard = lpPerSocketContext->dwShard;
+	PEPOLL_SHARD pShard = &g_pShards[dwShard];
+	PPER_IO_CONTEXT lpIOContext = NULL;
+	BOOL bCanceled = FALSE;
+
+	EnterCriticalSection(&pShard->csShard);
+	while ((lpIOContext = lpPerSocketContext->pRecvPending) != NULL)
+	{
+		lpPerSocketContext->pRecvPending = lpIOContext->pPendingNext;
+		EpollQueueCompletion(pShard, lpPerSocketContext, lpIOContext, 0, INVALID_SOCKET, ECANCELED);
+		bCanceled = TRUE;
+	}
+	while ((lpIOContext = lpPerSocketContext->pSendPending) != NULL)
+	{
+		lpPerSocketContext->pSendPending = lpIOContext->pPendingNext;
+		EpollQueueCompletion(pShard, lpPerSocketContext, lpIOContext, 0, INVALID_SOCKET, ECANCELED);
+		bCanceled = TRUE;
+	}
+
+	//
+	// A zero-copy send still waiting for its notification is canceled with the
+	// socket.  Connections are closed abortively, which drops whatever the
+	// kernel still held of its data.
+	//
+	if ((lpIOContext = lpPerSocketContext->pZeroCopyPending) != NULL)
+	{
+		lpPerSocketContext->pZeroCopyPending = NULL;
+		lpIOContext->bZeroCopy = FALSE;
+		EpollQueueCompletion(pShard, lpPerSocketContext, lpIOContext, 0, INVALID_SOCKET, ECANCELED);
+		bCanceled = TRUE;
+	}
+	LeaveCriticalSection(&pShard->csShard);
+
+	if (bCanceled)
+		EpollWake(dwShard);
+}
+
+static BOOL EpollGetCompletions(DWORD dwWorker, PCQ_COMPLETION lpCompletions, DWORD dwCount,
+								LPDWORD lpdwRemoved, DWORD dwMilliseconds)
+{
+
+	PEPOLL_SHARD pShard = &g_pShards[dwWorker];
+	struct epoll_event events[EPOLL_MAX_EVENTS];
+	uint64_t u64Count = 0;
+	ULONGLONG ullNow = 0;
+	DWORD dwRemoved = 0;
+	DWORD dwWait = 0;
+	int nEvents = 0;
+
+	t_dwShard = dwWorker;
+	*lpdwRemoved = 0;
+
+	while (TRUE)
+	{
+		EnterCriticalSection(&pShard->csShard);
+
+		//
+		// an accept waiting to be retried shortens the wait to its time
+		//
+		dwWait = dwMilliseconds;
+		if (pShard->pAcceptRetry)
+		{
+			ullNow = GetTickCount64();
+			if (ullNow >= pShard->ullAcceptRetry)
+				EpollTryAccept(pShard, pShard->pAcceptRetry);
+			if (pShard->pAcceptRetry && pShard->ullAcceptRetry - ullNow < dwWait)
+				dwWait = (DWORD)(pShard->ullAcceptRetry - ullNow);
+		}
+		while (pShard->dwReadyCount && dwRemoved < dwCount)
+		{
+			lpCompletions[dwRemoved++] = pShard->pReady[pShard->dwReadyHead].Completion;
+			pShard->dwReadyHead = (pShard->dwReadyHead + 1) % pShard->dwReadyCapacity;
+			pShard->dwReadyCount--;
+		}
+		LeaveCriticalSection(&pShard->csShard);
+		if (dwRemoved)
+		{
+			*lpdwRemoved = dwRemoved;
+			return (TRUE);
+		}
+
+		t_pCqStats->llSyscalls++;
+		nEvents = epoll_wait(pShard->fdEpoll, events, EPOLL_MAX_EVENTS, (dwWait == INFINITE) ? -1 : (int)dwWait);
+		if (nEvents < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return (FALSE);
+		}
+		if (nEvents == 0 && dwWait == dwMilliseconds)
+			return (TRUE);
+		if (nEvents == 0 && dwMilliseconds != INFINITE)
+			dwMilliseconds -= dwWait;
+
+		for (int i = 0; i < nEvents; i++)
+		{
+			if (events[i].data.ptr == NULL)
+			{
+				t_pCqStats->llSyscalls++;
+				if (read(pShard->fdWake, &u64Count, sizeof(u64Count)) < 0 && errno != EAGAIN)
+					LogPrintf(LOG_ERROR, "read(eventfd) failed: %d\n", errno);
+				continue;
+			}
+			if (events[i].data.u64 & EPOLL_ACCEPT_TAG)
+			{
+				EnterCriticalSection(&pShard->csShard);
+				EpollTryAccept(pShard, (PPER_IO_CONTEXT)(uintptr_t)(events[i].data.u64 & ~(uint64_t)EPOLL_ACCEPT_TAG));
+				LeaveCriticalSection(&pShard->csShard);
+				continue;
+			}
+			EpollDispatch(pShard, &events[i]);
+		}
+	}
+}
+
+static VOID EpollFlush(DWORD dwWorker)
+{
+
+	UNREFERENCED_PARAMETER(dwWorker);
+}
+
+static VOID EpollPostQuit(DWORD dwWorker)
+{
+
+	PEPOLL_SHARD pShard = &g_pShards[dwWorker];
+
+	EnterCriticalSection(&pShard->csShard);
+	EpollQueueCompletion(pShard, NULL, NULL, 0, INVALID_SOCKET, 0);
+	LeaveCriticalSection(&pShard->csShard);
+	EpollWake(dwWorker);
+}
+
+const CQ_BACKEND g_CqEpoll = {
+	"epoll",
+	EpollCreate,
+	EpollClose,
+	EpollAssociate,
+	EpollPostRecv,
+	EpollReleaseBuffer,
+	EpollPostSend,
+	EpollPostSplice,
+	EpollPostAccept,
+	EpollCancel,
+	EpollGetCompletions,
+	EpollFlush,
+	EpollPostQuit,
+};
+
+#endif // __linux__
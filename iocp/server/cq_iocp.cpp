@@ -0,0 +1,454 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Module:
+//      cq_iocp.cpp
+//
+// Abstract:
+//      I/O completion port backend for the completion queue abstraction.  All
+//      worker threads share one port, so the shard index is ignored, except in
+//      reactor mode where every worker has a port of its own.  Completions are
+//      dequeued in batches with GetQueuedCompletionStatusEx.
+//
+//      Windows has no SO_REUSEPORT, so reactors share the one listening socket
+//      and its accepts complete on whichever port it is associated with.  The
+//      accepted connections are still bound to the port of the reactor the
+//      accept context belongs to.
+//
+//      A receive posted without a buffer is a zero byte WSARecv, which completes
+//      once data is available without pinning any memory.  Only then is a buffer
+//      taken from g_BufferPool and filled with a nonblocking recv.  Several such
+//      receives on one socket could have their recv calls race on different
+//      threads, so one at a time is posted; the rest are parked on the socket
+//      and posted, under the socket's csIo, as the one ahead of them completes.
+//
+
+#ifdef _WIN32
+
+#include "iocpserver.h"
+#include "iocpcq.h"
+#include "iocppool.h"
+
+static WSABUF g_wsabufZero = {0, NULL};
+
+static HANDLE *g_phIOCP = NULL;
+static DWORD g_dwPorts = 0;
+static volatile LONG g_lNextPort = 0;
+
+//
+// One port shared by all workers, or one per reactor, each serviced by its
+// own thread only.
+//
+static BOOL IocpCreate(DWORD dwWorkers)
+{
+
+	DWORD dwPorts = g_bReactors ? dwWorkers : 1;
+
+	g_phIOCP = (HANDLE *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, dwPorts * sizeof(HANDLE));
+	if (g_phIOCP == NULL)
+	{
+		LogPrintf(LOG_ERROR, "HeapAlloc() failed: %d\n", GetLastError());
+		return (FALSE);
+	}
+
+	for (g_dwPorts = 0; g_dwPorts < dwPorts; g_dwPorts++)
+	{
+		g_phIOCP[g_dwPorts] = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, g_bReactors ? 1 : 0);
+		if (g_phIOCP[g_dwPorts] == NULL)
+		{
+			LogPrintf(LOG_ERROR, "CreateIoCompletionPort() failed to create I/O completion port: %d\n",
+					  GetLastError());
+			while (g_dwPorts)
+				CloseHandle(g_phIOCP[--g_dwPorts]);
+			HeapFree(GetProcessHeap(), 0, g_phIOCP);
+			g_phIOCP = NULL;
+			return (FALSE);
+		}
+	}
+	g_lNextPort = 0;
+	return (TRUE);
+}
+
+static VOID IocpClose(void)
+{
+
+	if (g_phIOCP)
+	{
+		for (DWORD i = 0; i < g_dwPorts; i++)
+			CloseHandle(g_phIOCP[i]);
+		HeapFree(GetProcessHeap(), 0, g_phIOCP);
+		g_phIOCP = NULL;
+		g_dwPorts = 0;
+	}
+}
+
+static BOOL IocpAssociate(PPER_SOCKET_CONTEXT lpPerSocketContext)
+{
+
+	HANDLE hIOCP;
+
+	if (lpPerSocketContext->dwShard >= g_dwPorts)
+		lpPerSocketContext->dwShard = (DWORD)InterlockedIncrement(&g_lNextPort) % g_dwPorts;
+	lpPerSocketContext->pRecvPending = NULL;
+	lpPerSocketContext->bRecvInFlight = FALSE;
+
+	//
+	// the recv that follows a zero byte receive must not block
+	//
+	if (g_bSharedBuffers)
+	{
+		u_long ulOne = 1;
+
+		if (ioctlsocket(lpPerSocketContext->Socket, FIONBIO, &ulOne) == SOCKET_ERROR)
+		{
+			LogPrintf(LOG_ERROR, "ioctlsocket(FIONBIO) failed: %d\n", WSAGetLastError());
+			return (FALSE);
+		}
+	}
+
+	hIOCP = CreateIoCompletionPort((HANDLE)lpPerSocketContext->Socket, g_phIOCP[lpPerSocketContext->dwShard],
+								   (DWORD_PTR)lpPerSocketContext, 0);
+	if (hIOCP == NULL)
+	{
+		LogPrintf(LOG_ERROR, "CreateIoCompletionPort() failed: %d\n", GetLastError());
+		return (FALSE);
+	}
+	return (TRUE);
+}
+
+static BOOL IocpPostRecv(PPER_SOCKET_CONTEXT lpPerSocketContext, PPER_IO_CONTEXT lpIOContext,
+						 LPWSABUF lpBuffer)
+{
+
+	PPER_IO_CONTEXT *ppPending = &lpPerSocketContext->pRecvPending;
+	DWORD dwRecvNumBytes = 0;
+	DWORD dwFlags = 0;
+	int nRet = 0;
+
+	if (lpBuffer == NULL)
+	{
+
+		//
+		// called with csIo held, so the parked chain needs no lock of its own
+		//
+		if (lpPerSocketContext->bRecvInFlight)
+		{
+			lpIOContext->pPendingNext = NULL;
+			while (*ppPending)
+				ppPending = &(*ppPending)->pPendingNext;
+			*ppPending = lpIOContext;
+			return (TRUE);
+		}
+		lpPerSocketContext->bRecvInFlight = TRUE;
+		lpBuffer = &g_wsabufZero;
+	}
+
+	t_pCqStats->llSyscalls++;
+	nRet = WSARecv(lpPerSocketContext->Socket, lpBuffer, 1, &dwRecvNumBytes, &dwFlags,
+				   &lpIOContext->Overlapped, NULL);
+	if (nRet == SOCKET_ERROR && (ERROR_IO_PENDING != WSAGetLastError()))
+	{
+		LogPrintf(LOG_ERROR, "WSARecv() failed: %d\n", WSAGetLastError());
+		if (lpBuffer == &g_wsabufZero)
+			lpPerSocketContext->bRecvInFlight = FALSE;
+		return (FALSE);
+	}
+	return (TRUE);
+}
+
+static VOID IocpReleaseBuffer(PPER_IO_CONTEXT lpIOContext)
+{
+
+	CtxtPoolFree(&g_BufferPool, lpIOContext->Buffer);
+	lpIOContext->Buffer = NULL;
+	lpIOContext->bProvidedBuffer = FALSE;
+}
+
+//
+// A zero byte receive completed: read what arrived into a pool buffer and post
+// the next parked receive.  Returns FALSE if nothing was there after all, in
+// which case the zero byte receive is posted again and there is no completion.
+//
+static BOOL IocpZeroByteRecvCompleted(PCQ_COMPLETION lpCompletion)
+{
+
+	PPER_SOCKET_CONTEXT lpPerSocketContext = lpCompletion->lpPerSocketContext;
+	PPER_IO_CONTEXT lpIOContext = lpCompletion->lpIOContext;
+	PPER_IO_CONTEXT lpNextContext = NULL;
+	char *pBuffer = NULL;
+	BOOL bCompleted = TRUE;
+	int nRet = 0;
+
+	EnterCriticalSection(&lpPerSocketContext->csIo);
+	lpPerSocketContext->bRecvInFlight = FALSE;
+	if (lpCompletion->bSuccess && !lpPerSocketContext->bClosing)
+	{
+		pBuffer = (char *)CtxtPoolAlloc(&g_BufferPool);
+		if (pBuffer == NULL)
+		{
+			lpCompletion->bSuccess = FALSE;
+			lpCompletion->dwError = WSAENOBUFS;
+		}
+		else
+		{
+			t_pCqStats->llSyscalls++;
+			nRet = recv(lpPerSocketContext->Socket, pBuffer, MAX_BUFF_SIZE, 0);
+			if (nRet > 0)
+			{
+				lpIOContext->Buffer = pBuffer;
+				lpIOContext->bProvidedBuffer = TRUE;
+				lpCompletion->dwIoSize = (DWORD)nRet;
+			}
+			else
+			{
+				CtxtPoolFree(&g_BufferPool, pBuffer);
+				if (nRet == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK)
+				{
+					ZeroMemory(&lpIOContext->Overlapped, sizeof(lpIOContext->Overlapped));
+					bCompleted = !IocpPostRecv(lpPerSocketContext, lpIOContext, NULL);
+				}
+				else if (nRet == SOCKET_ERROR)
+				{
+					lpCompletion->bSuccess = FALSE;
+					lpCompletion->dwError = WSAGetLastError();
+				}
+			}
+		}
+	}
+
+	//
+	// the socket's data so far has been read, the next receive may go out
+	//
+	if (bCompleted && !lpPerSocketContext->bClosing &&
+		(lpNextContext = lpPerSocketContext->pRecvPending) != NULL)
+	{
+		lpPerSocketContext->pRecvPending = lpNextContext->pPendingNext;
+		ZeroMemory(&lpNextContext->Overlapped, sizeof(lpNextContext->Overlapped));
+		if (!IocpPostRecv(lpPerSocketContext, lpNextContext, NULL))
+		{
+			lpNextContext->Overlapped.Internal = 0;
+			PostQueuedCompletionStatus(g_phIOCP[lpPerSocketContext->dwShard], 0, (ULONG_PTR)lpPerSocketContext,
+									   &lpNextContext->Overlapped);
+		}
+	}
+	LeaveCriticalSection(&lpPerSocketContext->csIo);
+	return (bCompleted);
+}
+
+static BOOL IocpPostSend(PPER_SOCKET_CONTEXT lpPerSocketContext, PPER_IO_CONTEXT lpIOContext,
+						 LPWSABUF lpBuffers, DWORD dwBufferCount)
+{
+
+	DWORD dwSendNumBytes = 0;
+	DWORD dwFlags = 0;
+	int nRet = 0;
+
+	t_pCqStats->llSyscalls++;
+	nRet = WSASend(lpPerSocketContext->Socket, lpBuffers, dwBufferCount, &dwSendNumBytes, dwFlags,
+				   &lpIOContext->Overlapped, NULL);
+	if (nRet == SOCKET_ERROR && (ERROR_IO_PENDING != WSAGetLastError()))
+	{
+		LogPrintf(LOG_ERROR, "WSASend() failed: %d\n", WSAGetLastError());
+		return (FALSE);
+	}
+	return (TRUE);
+}
+
+//
+// Post an AcceptEx.  The accept socket is created up front and no data is
+// received with the accept, so the completion fires as soon as the connection
+// is established rather than when the client first sends.
+//
+static BOOL IocpPostAccept(PPER_SOCKET_CONTEXT lpListenContext, PPER_IO_CONTEXT lpIOContext)
+{
+
+	GUID acceptex_guid = WSAID_ACCEPTEX;
+	DWORD dwRecvNumBytes = 0;
+	DWORD bytes = 0;
+	BOOL bRet = FALSE;
+	int nRet = 0;
+
+	if (lpListenContext->fnAcceptEx == NULL)
+	{
+		nRet = WSAIoctl(lpListenContext->Socket, SIO_GET_EXTENSION_FUNCTION_POINTER,
+						&acceptex_guid, sizeof(acceptex_guid),
+						&lpListenContext->fnAcceptEx, sizeof(lpListenContext->fnAcceptEx),
+						&bytes, NULL, NULL);
+		if (nRet == SOCKET_ERROR)
+		{
+			LogPrintf(LOG_ERROR, "failed to load AcceptEx: %d\n", WSAGetLastError());
+			return (FALSE);
+		}
+	}
+
+	lpIOContext->SocketAccept = WSASocket(AF_INET, SOCK_STREAM, IPPROTO_IP, NULL, 0, WSA_FLAG_OVERLAPPED);
+	if (lpIOContext->SocketAccept == INVALID_SOCKET)
+	{
+		LogPrintf(LOG_ERROR, "WSASocket(SocketAccept) failed: %d\n", WSAGetLastError());
+		return (FALSE);
+	}
+
+	ZeroMemory(&lpIOContext->Overlapped, sizeof(lpIOContext->Overlapped));
+	t_pCqStats->llSyscalls++;
+	bRet = lpListenContext->fnAcceptEx(lpIOContext->SocketListen, lpIOContext->SocketAccept,
+									   (LPVOID)(lpIOContext->Buffer), 0,
+									   sizeof(SOCKADDR_STORAGE) + 16, sizeof(SOCKADDR_STORAGE) + 16,
+									   &dwRecvNumBytes, (LPOVERLAPPED)&(lpIOContext->Overlapped));
+	if (!bRet && (WSAGetLastError() != ERROR_IO_PENDING))
+	{
+		LogPrintf(LOG_ERROR, "AcceptEx() failed: %d\n", WSAGetLastError());
+		closesocket(lpIOContext->SocketAccept);
+		lpIOContext->SocketAccept = INVALID_SOCKET;
+		return (FALSE);
+	}
+	return (TRUE);
+}
+
+//
+// closesocket aborts whatever is pending as well; cancelling first just makes
+// it explicit.
+//
+static VOID IocpCancel(PPER_SOCKET_CONTEXT lpPerSocketContext)
+{
+
+	PPER_IO_CONTEXT lpIOContext = NULL;
+
+	t_pCqStats->llSyscalls++;
+	CancelIoEx((HANDLE)lpPerSocketContext->Socket, NULL);
+
+	//
+	// parked receives were never posted; complete them as zero byte receives
+	// (called with csIo held)
+	//
+	while ((lpIOContext = lpPerSocketContext->pRecvPending) != NULL)
+	{
+		lpPerSocketContext->pRecvPending = lpIOContext->pPendingNext;
+		ZeroMemory(&lpIOContext->Overlapped, sizeof(lpIOContext->Overlapped));
+		PostQueuedCompletionStatus(g_phIOCP[lpPerSocketContext->dwShard], 0, (ULONG_PTR)lpPerSocketContext,
+								   &lpIOContext->Overlapped);
+	}
+}
+
+static BOOL IocpGetCompletions(DWORD dwWorker, PCQ_COMPLETION lpCompletions, DWORD dwCount,
+							   LPDWORD lpdwRemoved, DWORD dwMilliseconds)
+{
+
+	OVERLAPPED_ENTRY entries[CQ_MAX_BATCH];
+	ULONG ulRemoved = 0;
+	DWORD dwRemoved = 0;
+	DWORD dwFlags = 0;
+	HANDLE hIOCP = g_phIOCP[dwWorker % g_dwPorts];
+
+	*lpdwRemoved = 0;
+	if (dwCount > CQ_MAX_BATCH)
+		dwCount = CQ_MAX_BATCH;
+
+	//
+	// zero byte receives that find nothing to read are not completions, so a
+	// batch made only of those is dequeued again
+	//
+	while (dwRemoved == 0)
+	{
+		t_pCqStats->llSyscalls++;
+		if (!GetQueuedCompletionStatusEx(hIOCP, entries, dwCount, &ulRemoved, dwMilliseconds, FALSE))
+			return (GetLastError() == WAIT_TIMEOUT);
+
+		for (ULONG i = 0; i < ulRemoved; i++)
+		{
+			PCQ_COMPLETION lpCompletion = &lpCompletions[dwRemoved++];
+
+			lpCompletion->lpPerSocketContext = (PPER_SOCKET_CONTEXT)entries[i].lpCompletionKey;
+			lpCompletion->lpIOContext = (PPER_IO_CONTEXT)entries[i].lpOverlapped;
+			lpCompletion->dwIoSize = entries[i].dwNumberOfBytesTransferred;
+			lpCompletion->SocketAccept = INVALID_SOCKET;
+			lpCompletion->bSuccess = TRUE;
+			lpCompletion->dwError = 0;
+
+			if (lpCompletion->lpIOContext == NULL || lpCompletion->lpPerSocketContext == NULL)
+				continue;
+
+			//
+			// The status of each operation is in its overlapped structure (an
+			// NTSTATUS, negative on failure); only a failed one is worth the call
+			// to turn it into a Winsock error.
+			//
+			if ((LONG)lpCompletion->lpIOContext->Overlapped.Internal < 0)
+			{
+				lpCompletion->bSuccess = WSAGetOverlappedResult(lpCompletion->lpPerSocketContext->Socket,
+																&lpCompletion->lpIOContext->Overlapped,
+																&lpCompletion->dwIoSize, FALSE, &dwFlags);
+				if (!lpCompletion->bSuccess)
+					lpCompletion->dwError = WSAGetLastError();
+			}
+
+			if (lpCompletion->lpIOContext->IOOperation == ClientIoRead && g_bSharedBuffers &&
+				!IocpZeroByteRecvCompleted(lpCompletion))
+			{
+				dwRemoved--;
+				continue;
+			}
+
+			if (lpCompletion->lpIOContext->IOOperation == ClientIoAccept)
+			{
+
+				//
+				// hand the accepted socket over to the completion, after giving it the
+				// properties of the listening socket
+				//
+				lpCompletion->SocketAccept = lpCompletion->lpIOContext->SocketAccept;
+				lpCompletion->lpIOContext->SocketAccept = INVALID_SOCKET;
+				if (lpCompletion->bSuccess)
+				{
+					if (setsockopt(lpCompletion->SocketAccept, SOL_SOCKET, SO_UPDATE_ACCEPT_CONTEXT,
+								   (char *)&lpCompletion->lpIOContext->SocketListen, sizeof(SOCKET)) == SOCKET_ERROR)
+					{
+						LogPrintf(LOG_ERROR, "setsockopt(SO_UPDATE_ACCEPT_CONTEXT) failed: %d\n", WSAGetLastError());
+					}
+				}
+				else if (lpCompletion->SocketAccept != INVALID_SOCKET)
+				{
+					closesocket(lpCompletion->SocketAccept);
+					lpCompletion->SocketAccept = INVALID_SOCKET;
+				}
+			}
+		}
+	}
+
+	*lpdwRemoved = dwRemoved;
+	return (TRUE);
+}
+
+//
+// WSARecv and WSASend are issued as they are posted; there is nothing to batch.
+//
+static VOID IocpFlush(DWORD dwWorker)
+{
+
+	UNREFERENCED_PARAMETER(dwWorker);
+}
+
+static VOID IocpPostQuit(DWORD dwWorker)
+{
+
+	PostQueuedCompletionStatus(g_phIOCP[dwWorker % g_dwPorts], 0, 0, NULL);
+}
+
+const CQ_BACKEND g_CqIocp = {
+	"iocp",
+	IocpCreate,
+	IocpClose,
+	IocpAssociate,
+	IocpPostRecv,
+	IocpReleaseBuffer,
+	IocpPostSend,
+	NULL, // no splice
+	IocpPostAccept,
+	IocpCancel,
+	IocpGetCompletions,
+	IocpFlush,
+	IocpPostQuit,
+};
+
+#endif // _WIN32
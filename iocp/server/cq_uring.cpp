@@ -0,0 +1,875 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Module:
+//      cq_uring.cpp
+//
+// Abstract:
+//      io_uring backend for the completion queue abstraction, built on liburing.
+//
+//      Each worker thread owns one ring (a shard).  Sockets are spread over the
+//      rings round-robin when they are associated.  Only the owning worker reaps
+//      completions from a ring, but receives and sends may be posted from any
+//      thread (the worker that accepts a connection posts its first receive,
+//      usually on another ring), so the submission side of each ring is guarded
+//      by its own lock.
+//
+//      The PER_IO_CONTEXT is the SQE user data; its pSocketContext field gives
+//      back the completion key.  A user data of 0 is the quit packet.
+//
+//      Completions are reaped in batches with io_uring_peek_batch_cqe, entering
+//      the kernel only when the ring is empty.  While a worker handles a batch,
+//      the receives and sends it posts to its own ring are left in the
+//      submission queue and go to the kernel in one io_uring_submit (UringFlush)
+//      after the batch.
+//
+//      A dequeue with a timeout of 0, which is how a worker with a spin budget
+//      (-h) polls, never enters the kernel: an empty ring just returns nothing.
+//      With -h:us:ms the rings are created with IORING_SETUP_SQPOLL, sharing
+//      one kernel thread that picks up submissions until it has been idle ms
+//      milliseconds, so io_uring_submit only enters the kernel to wake it.
+//      SQPOLL needs kernel 5.11+ to run unprivileged.
+//
+//      io_uring does not promise that several receives pending on one socket
+//      get the data in the order they were submitted, so only one receive per
+//      socket is in the kernel at a time.  Further receives are parked on the
+//      socket context and submitted one by one as the receive ahead of them
+//      completes; the buffers still let receiving overlap with sending.
+//
+//      With shared buffers, receives select their buffer from a provided buffer
+//      ring registered on each shard.  The ring is filled with buffers from
+//      g_BufferPool, a few to start with and twice as many whenever a receive
+//      finds it empty, and a buffer goes back into the ring once its data has
+//      been echoed.
+//
+//      Closing a socket does not end the receives pending on it in the ring, so
+//      a socket that is being closed has them canceled first.  The cancel
+//      request only produces a CQE on failure, with user data g_CancelTag, and
+//      such CQEs are dropped.
+//
+//      With -x, a send of at least g_dwZeroCopyThreshold bytes is posted as
+//      IORING_OP_SEND_ZC, or IORING_OP_SENDMSG_ZC when it gathers several
+//      buffers (kernel 6.0/6.1+).  Such a send produces two CQEs: its result,
+//      flagged IORING_CQE_F_MORE, and later a notification (IORING_CQE_F_NOTIF)
+//      once the kernel no longer reads the buffers.  The result is kept in the
+//      I/O context and the completion is delivered with the notification, so
+//      the buffers are not reused for a receive while they are still being
+//      sent.  If the kernel rejects zero-copy sends, sends are copied again.
+//
+//      In splice mode a splice out of the socket is linked behind a one-shot
+//      IORING_OP_POLL_ADD for POLLIN.  io_uring always runs a splice on one of
+//      its worker threads, so without the poll an idle connection would keep a
+//      kernel thread blocked in its splice; with it the splice only starts once
+//      there is data, and closing the socket cancels the poll and the splice
+//      with it.  The poll's CQE is skipped unless it fails, and then it carries
+//      g_CancelTag: the splice completes as canceled either way.  Splices back
+//      out to the socket are posted on their own.
+//
+//      Accepts are multishot (kernel 5.19+): one SQE per accept context keeps
+//      producing a CQE per connection until the kernel drops it (no
+//      IORING_CQE_F_MORE), at which point the next repost arms it again.  Accept
+//      contexts are spread over the rings so every worker accepts.  Kernels
+//      without multishot accept fall back to one-shot accepts.
+//
+
+#if defined(__linux__) && defined(HAVE_LIBURING)
+
+#include <fcntl.h>
+#include <liburing.h>
+
+#include "iocpserver.h"
+#include "iocpcq.h"
+#include "iocppool.h"
+#include "iocpstats.h"
+
+#define URING_ENTRIES 4096
+#define URING_BUF_RING_ENTRIES 4096 // most provided buffers per shard, power of 2
+#define URING_BUF_RING_INITIAL 64
+#define URING_BUF_GROUP 0
+
+typedef struct _URING_SHARD {
+	struct io_uring Ring;
+	CRITICAL_SECTION csSubmit;
+	DWORD dwUnsubmitted; // SQEs queued by the owning worker, submitted by UringFlush
+
+	//
+	// provided buffer ring, with shared buffers only; a buffer's id is its
+	// index in ppBuffers
+	//
+	struct io_uring_buf_ring *pBufRing;
+	char **ppBuffers;
+	DWORD dwBuffers;
+} URING_SHARD, *PURING_SHARD;
+
+static PURING_SHARD g_pShards = NULL;
+static DWORD g_dwShards = 0;
+static volatile LONG g_lNextShard = 0;
+static volatile LONG g_lNextAcceptShard = 0;
+static BOOL g_bSingleShotAccept = FALSE;
+static BOOL g_bNoZeroCopy = FALSE;
+static char g_CancelTag;
+
+//
+// index of the shard the calling thread services, -1 for non-worker threads
+//
+static __thread DWORD t_dwShard = (DWORD)-1;
+
+//
+// Count the io_uring_submit about to be made on a shard as a syscall, unless
+// the submission queue thread is awake and picks the entries up on its own.
+//
+static VOID UringCountSubmit(PURING_SHARD pShard)
+{
+
+	if (!(pShard->Ring.flags & IORING_SETUP_SQPOLL) ||
+		(__atomic_load_n(pShard->Ring.sq.kflags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP))
+		t_pCqStats->llSyscalls++;
+	return;
+}
+
+//
+// Get a submission queue entry on a shard whose lock is held, flushing the
+// submission queue first if it is full.
+//
+static struct io_uring_sqe *UringGetSqe(PURING_SHARD pShard)
+{
+
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&pShard->Ring);
+
+	if (sqe == NULL)
+	{
+		UringCountSubmit(pShard);
+		if (io_uring_submit(&pShard->Ring) >= 0)
+			pShard->dwUnsubmitted = 0;
+		sqe = io_uring_get_sqe(&pShard->Ring);
+	}
+	return (sqe);
+}
+
+static BOOL UringSubmit(PURING_SHARD pShard, const char *szOp)
+{
+
+	int nRet = 0;
+
+	UringCountSubmit(pShard);
+	nRet = io_uring_submit(&pShard->Ring);
+	if (nRet < 0)
+	{
+		LogPrintf(LOG_ERROR, "io_uring_submit(%s) failed: %d\n", szOp, -nRet);
+		errno = -nRet;
+		return (FALSE);
+	}
+	pShard->dwUnsubmitted = 0;
+	return (TRUE);
+}
+
+//
+// Submit an SQE just queued on a shard whose lock is held, unless the caller is
+// the shard's owner, which submits once after the batch it is handling.
+//
+static BOOL UringSubmitOrDefer(PURING_SHARD pShard, const char *szOp)
+{
+
+	if (t_dwShard < g_dwShards && pShard == &g_pShards[t_dwShard])
+	{
+		pShard->dwUnsubmitted++;
+		return (TRUE);
+	}
+	return (UringSubmit(pShard, szOp));
+}
+
+//
+// Put up to dwCount more pool buffers in a shard's provided buffer ring, on a
+// shard whose lock is held.  Returns FALSE if none could be added.
+//
+static BOOL UringAddBuffers(PURING_SHARD pShard, DWORD dwCount)
+{
+
+	DWORD dwAdded = 0;
+	char *pBuffer = NULL;
+
+	if (dwCount > URING_BUF_RING_ENTRIES - pShard->dwBuffers)
+		dwCount = URING_BUF_RING_ENTRIES - pShard->dwBuffers;
+
+	for (dwAdded = 0; dwAdded < dwCount; dwAdded++)
+	{
+		pBuffer = (char *)CtxtPoolAlloc(&g_BufferPool);
+		if (pBuffer == NULL)
+			break;
+		pShard->ppBuffers[pShard->dwBuffers] = pBuffer;
+		io_uring_buf_ring_add(pShard->pBufRing, pBuffer, MAX_BUFF_SIZE, (unsigned short)pShard->dwBuffers,
+							  io_uring_buf_ring_mask(URING_BUF_RING_ENTRIES), dwAdded);
+		pShard->dwBuffers++;
+	}
+	io_uring_buf_ring_advance(pShard->pBufRing, dwAdded);
+	return (dwAdded != 0);
+}
+
+//
+// Put a buffer back in a shard's provided buffer ring, on a shard whose lock
+// is held.
+//
+static VOID UringRecycleBuffer(PURING_SHARD pShard, DWORD dwBufferId)
+{
+
+	io_uring_buf_ring_add(pShard->pBufRing, pShard->ppBuffers[dwBufferId], MAX_BUFF_SIZE,
+						  (unsigned short)dwBufferId, io_uring_buf_ring_mask(URING_BUF_RING_ENTRIES), 0);
+	io_uring_buf_ring_advance(pShard->pBufRing, 1);
+}
+
+static VOID UringShardExit(PURING_SHARD pShard)
+{
+
+	if (pShard->pBufRing)
+	{
+		io_uring_free_buf_ring(&pShard->Ring, pShard->pBufRing, URING_BUF_RING_ENTRIES, URING_BUF_GROUP);
+		for (DWORD i = 0; i < pShard->dwBuffers; i++)
+			CtxtPoolFree(&g_BufferPool, pShard->ppBuffers[i]);
+	}
+	free(pShard->ppBuffers);
+
+	//
+	// io_uring_queue_exit cancels every request still pending on the ring.
+	//
+	io_uring_queue_exit(&pShard->Ring);
+	DeleteCriticalSection(&pShard->csSubmit);
+}
+
+static BOOL UringShardInit(PURING_SHARD pShard)
+{
+
+	struct io_uring_params params;
+	int nRet = 0;
+
+	//
+	// with -h:us:ms a kernel thread polls the submission queues, one thread
+	// for all of them: the first shard's, which the others attach to
+	//
+	ZeroMemory(&params, sizeof(params));
+	if (g_dwUringSqPollIdle)
+	{
+		params.flags = IORING_SETUP_SQPOLL;
+		params.sq_thread_idle = g_dwUringSqPollIdle;
+		if (pShard != &g_pShards[0])
+		{
+			params.flags |= IORING_SETUP_ATTACH_WQ;
+			params.wq_fd = g_pShards[0].Ring.ring_fd;
+		}
+	}
+	nRet = io_uring_queue_init_params(URING_ENTRIES, &pShard->Ring, &params);
+	if (nRet < 0)
+	{
+		LogPrintf(LOG_ERROR, "io_uring_queue_init_params() failed: %d\n", -nRet);
+		return (FALSE);
+	}
+	InitializeCriticalSection(&pShard->csSubmit);
+	if (!g_bSharedBuffers)
+		return (TRUE);
+
+	//
+	// provided buffer rings need kernel 5.19+
+	//
+	pShard->ppBuffers = (char **)calloc(URING_BUF_RING_ENTRIES, sizeof(char *));
+	pShard->pBufRing = io_uring_setup_buf_ring(&pShard->Ring, URING_BUF_RING_ENTRIES, URING_BUF_GROUP, 0, &nRet);
+	if (pShard->ppBuffers == NULL || pShard->pBufRing == NULL ||
+		!UringAddBuffers(pShard, URING_BUF_RING_INITIAL))
+	{
+		LogPrintf(LOG_ERROR, "io_uring_setup_buf_ring() failed: %d\n", -nRet);
+		UringShardExit(pShard);
+		return (FALSE);
+	}
+	return (TRUE);
+}
+
+static BOOL UringCreate(DWORD dwWorkers)
+{
+
+	g_pShards = (PURING_SHARD)calloc(dwWorkers, sizeof(URING_SHARD));
+	if (g_pShards == NULL)
+	{
+		LogPrintf(LOG_ERROR, "calloc(URING_SHARD) failed\n");
+		return (FALSE);
+	}
+
+	for (g_dwShards = 0; g_dwShards < dwWorkers; g_dwShards++)
+	{
+		if (!UringShardInit(&g_pShards[g_dwShards]))
+			break;
+	}
+
+	if (g_dwShards < dwWorkers)
+	{
+		while (g_dwShards)
+			UringShardExit(&g_pShards[--g_dwShards]);
+		free(g_pShards);
+		g_pShards = NULL;
+		return (FALSE);
+	}
+	g_lNextShard = 0;
+	return (TRUE);
+}
+
+static VOID UringClose(void)
+{
+
+	for (DWORD i = 0; i < g_dwShards; i++)
+		UringShardExit(&g_pShards[i]);
+	free(g_pShards);
+	g_pShards = NULL;
+	g_dwShards = 0;
+}
+
+static BOOL UringAssociate(PPER_SOCKET_CONTEXT lpPerSocketContext)
+{
+
+	if (lpPerSocketContext->dwShard >= g_dwShards)
+		lpPerSocketContext->dwShard = (DWORD)InterlockedIncrement(&g_lNextShard) % g_dwShards;
+	lpPerSocketContext->pRecvPending = NULL;
+	lpPerSocketContext->bRecvInFlight = FALSE;
+	return (TRUE);
+}
+
+//
+// Queue a receive on a shard whose lock is held.  A receive without a buffer
+// selects one from the shard's provided buffer ring.
+//
+static BOOL UringPrepRecv(PURING_SHARD pShard, PPER_SOCKET_CONTEXT lpPerSocketContext,
+						  PPER_IO_CONTEXT lpIOContext, LPWSABUF lpBuffer)
+{
+
+	struct io_uring_sqe *sqe = UringGetSqe(pShard);
+
+	if (sqe == NULL)
+	{
+		LogPrintf(LOG_ERROR, "io_uring_get_sqe(recv) failed\n");
+		return (FALSE);
+	}
+	if (lpBuffer == NULL || lpBuffer->buf == NULL)
+	{
+		io_uring_prep_recv(sqe, lpPerSocketContext->Socket, NULL, MAX_BUFF_SIZE, 0);
+		sqe->flags |= IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_BUF_GROUP;
+	}
+	else
+		io_uring_prep_recv(sqe, lpPerSocketContext->Socket, lpBuffer->buf, lpBuffer->len, 0);
+	io_uring_sqe_set_data(sqe, lpIOContext);
+	return (TRUE);
+}
+
+static BOOL UringPostRecv(PPER_SOCKET_CONTEXT lpPerSocketContext, PPER_IO_CONTEXT lpIOContext,
+						  LPWSABUF lpBuffer)
+{
+
+	PURING_SHARD pShard = &g_pShards[lpPerSocketContext->dwShard];
+	PPER_IO_CONTEXT *ppPending = &lpPerSocketContext->pRecvPending;
+	BOOL bRet = FALSE;
+
+	EnterCriticalSection(&pShard->csSubmit);
+	if (lpPerSocketContext->bRecvInFlight)
+	{
+
+		//
+		// wait for the receive ahead of this one
+		//
+		if (lpBuffer)
+			lpIOContext->wsabufPosted = *lpBuffer;
+		else
+		{
+			lpIOContext->wsabufPosted.buf = NULL;
+			lpIOContext->wsabufPosted.len = 0;
+		}
+		lpIOContext->pPendingNext = NULL;
+		while (*ppPending)
+			ppPending = &(*ppPending)->pPendingNext;
+		*ppPending = lpIOContext;
+		bRet = TRUE;
+	}
+	else if (UringPrepRecv(pShard, lpPerSocketContext, lpIOContext, lpBuffer))
+	{
+		lpPerSocketContext->bRecvInFlight = TRUE;
+		bRet = UringSubmitOrDefer(pShard, "recv");
+	}
+	LeaveCriticalSection(&pShard->csSubmit);
+	return (bRet);
+}
+
+//
+// A receive on the socket completed: submit the next parked one.  Called by the
+// shard's owner while it reaps, so the submission goes out with the batch.
+//
+static VOID UringNextRecv(PPER_SOCKET_CONTEXT lpPerSocketContext)
+{
+
+	PURING_SHARD pShard = &g_pShards[lpPerSocketContext->dwShard];
+	PPER_IO_CONTEXT lpIOContext = NULL;
+
+	EnterCriticalSection(&pShard->csSubmit);
+	lpPerSocketContext->bRecvInFlight = FALSE;
+	lpIOContext = lpPerSocketContext->pRecvPending;
+	if (lpIOContext && UringPrepRecv(pShard, lpPerSocketContext, lpIOContext, &lpIOContext->wsabufPosted))
+	{
+		lpPerSocketContext->pRecvPending = lpIOContext->pPendingNext;
+		lpPerSocketContext->bRecvInFlight = TRUE;
+		UringSubmitOrDefer(pShard, "recv");
+	}
+	LeaveCriticalSection(&pShard->csSubmit);
+}
+
+//
+// Attach the provided buffer a receive selected, if it got data, or recycle it.
+// A receive that found the ring empty is posted again once the ring has grown;
+// returns FALSE in that case, as the receive has not completed.
+//
+static BOOL UringRecvBuffer(struct io_uring_cqe *cqe, PPER_IO_CONTEXT lpIOContext)
+{
+
+	PPER_SOCKET_CONTEXT lpPerSocketContext = lpIOContext->pSocketContext;
+	PURING_SHARD pShard = &g_pShards[lpPerSocketContext->dwShard];
+	DWORD dwBufferId = 0;
+	BOOL bCompleted = TRUE;
+
+	EnterCriticalSection(&pShard->csSubmit);
+	if (cqe->flags & IORING_CQE_F_BUFFER)
+	{
+		dwBufferId = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		if (cqe->res > 0)
+		{
+			lpIOContext->Buffer = pShard->ppBuffers[dwBufferId];
+			lpIOContext->dwBufferId = dwBufferId;
+			lpIOContext->bProvidedBuffer = TRUE;
+		}
+		else
+			UringRecycleBuffer(pShard, dwBufferId);
+	}
+	else if (cqe->res == -ENOBUFS && UringAddBuffers(pShard, pShard->dwBuffers) &&
+			 UringPrepRecv(pShard, lpPerSocketContext, lpIOContext, NULL))
+	{
+		UringSubmitOrDefer(pShard, "recv");
+		bCompleted = FALSE;
+	}
+	LeaveCriticalSection(&pShard->csSubmit);
+	return (bCompleted);
+}
+
+//
+// After UringClose the buffers are all back in g_BufferPool already.
+//
+static VOID UringReleaseBuffer(PPER_IO_CONTEXT lpIOContext)
+{
+
+	PURING_SHARD pShard = NULL;
+
+	if (g_pShards)
+	{
+		pShard = &g_pShards[lpIOContext->pSocketContext->dwShard];
+		EnterCriticalSection(&pShard->csSubmit);
+		UringRecycleBuffer(pShard, lpIOContext->dwBufferId);
+		LeaveCriticalSection(&pShard->csSubmit);
+	}
+	lpIOContext->Buffer = NULL;
+	lpIOContext->bProvidedBuffer = FALSE;
+}
+
+//
+// Queue a send on a shard whose lock is held.  A gathered send is a writev:
+// WSABUF is laid out as struct iovec, and unlike sendmsg it needs no msghdr
+// kept alive until the deferred submission.  SIGPIPE is ignored (see
+// SetConsoleCtrlHandler), so the missing MSG_NOSIGNAL is fine.  A zero-copy
+// send gathering several buffers has to be a sendmsg; its msghdr lives in the
+// I/O context.
+//
+static BOOL UringPrepSend(PURING_SHARD pShard, PPER_SOCKET_CONTEXT lpPerSocketContext,
+						  PPER_IO_CONTEXT lpIOContext, LPWSABUF lpBuffers, DWORD dwBufferCount)
+{
+
+	struct io_uring_sqe *sqe = UringGetSqe(pShard);
+	size_t cbTotal = 0;
+
+	if (sqe == NULL)
+	{
+		LogPrintf(LOG_ERROR, "io_uring_get_sqe(send) failed\n");
+		return (FALSE);
+	}
+
+	for (DWORD i = 0; i < dwBufferCount; i++)
+		cbTotal += lpBuffers[i].len;
+	lpIOContext->lpSendBuffers = lpBuffers;
+	lpIOContext->dwSendBuffers = dwBufferCount;
+	lpIOContext->bZeroCopy = g_dwZeroCopyThreshold && cbTotal >= g_dwZeroCopyThreshold && !g_bNoZeroCopy;
+
+	if (lpIOContext->bZeroCopy && dwBufferCount == 1)
+		io_uring_prep_send_zc(sqe, lpPerSocketContext->Socket, lpBuffers->buf, lpBuffers->len, MSG_NOSIGNAL,
+							  IORING_SEND_ZC_REPORT_USAGE);
+	else if (lpIOContext->bZeroCopy)
+	{
+		ZeroMemory(&lpIOContext->ZeroCopyMsg, sizeof(lpIOContext->ZeroCopyMsg));
+		lpIOContext->ZeroCopyMsg.msg_iov = (struct iovec *)lpBuffers;
+		lpIOContext->ZeroCopyMsg.msg_iovlen = dwBufferCount;
+		io_uring_prep_sendmsg_zc(sqe, lpPerSocketContext->Socket, &lpIOContext->ZeroCopyMsg, MSG_NOSIGNAL);
+		sqe->ioprio |= IORING_SEND_ZC_REPORT_USAGE;
+	}
+	else if (dwBufferCount == 1)
+		io_uring_prep_send(sqe, lpPerSocketContext->Socket, lpBuffers->buf, lpBuffers->len, MSG_NOSIGNAL);
+	else
+		io_uring_prep_writev(sqe, lpPerSocketContext->Socket, (const struct iovec *)lpBuffers, dwBufferCount, 0);
+	io_uring_sqe_set_data(sqe, lpIOContext);
+	if (lpIOContext->bZeroCopy)
+		t_pWorkerStats->llZeroCopySends++;
+	return (TRUE);
+}
+
+static BOOL UringPostSend(PPER_SOCKET_CONTEXT lpPerSocketContext, PPER_IO_CONTEXT lpIOContext,
+						  LPWSABUF lpBuffers, DWORD dwBufferCount)
+{
+
+	PURING_SHARD pShard = &g_pShards[lpPerSocketContext->dwShard];
+	BOOL bRet = FALSE;
+
+	EnterCriticalSection(&pShard->csSubmit);
+	if (UringPrepSend(pShard, lpPerSocketContext, lpIOContext, lpBuffers, dwBufferCount))
+		bRet = UringSubmitOrDefer(pShard, "send");
+	LeaveCriticalSection(&pShard->csSubmit);
+	return (bRet);
+}
+
+//
+// Sort out the CQEs of a zero-copy send.  Returns FALSE while the completion
+// has to wait for the notification, or when the send has been posted again
+// as a copy because the kernel does not support zero-copy sends.
+//
+static BOOL UringZeroCopy(struct io_uring_cqe *cqe, PPER_IO_CONTEXT lpIOContext, int *pnRet)
+{
+
+	PPER_SOCKET_CONTEXT lpPerSocketContext = lpIOContext->pSocketContext;
+	PURING_SHARD pShard = &g_pShards[lpPerSocketContext->dwShard];
+
+	if (cqe->flags & IORING_CQE_F_NOTIF)
+	{
+		if ((DWORD)cqe->res & IORING_NOTIF_USAGE_ZC_COPIED)
+			t_pWorkerStats->llZeroCopyCopied++;
+		lpIOContext->bZeroCopy = FALSE;
+		*pnRet = lpIOContext->nZeroCopyResult;
+		return (TRUE);
+	}
+	if (cqe->flags & IORING_CQE_F_MORE)
+	{
+		lpIOContext->nZeroCopyResult = cqe->res;
+		return (FALSE);
+	}
+
+	//
+	// no notification follows a send that failed
+	//
+	lpIOContext->bZeroCopy = FALSE;
+	if ((cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP) && !g_bNoZeroCopy)
+	{
+		LogPrintf(LOG_INFO, "zero-copy send not supported, copying sends\n");
+		g_bNoZeroCopy = TRUE;
+		EnterCriticalSection(&pShard->csSubmit);
+		if (UringPrepSend(pShard, lpPerSocketContext, lpIOContext, lpIOContext->lpSendBuffers,
+						  lpIOContext->dwSendBuffers))
+		{
+			UringSubmitOrDefer(pShard, "send");
+			LeaveCriticalSection(&pShard->csSubmit);
+			return (FALSE);
+		}
+		LeaveCriticalSection(&pShard->csSubmit);
+	}
+	return (TRUE);
+}
+
+static BOOL UringPostSplice(PPER_SOCKET_CONTEXT lpPerSocketContext, PPER_IO_CONTEXT lpIOContext,
+							int fdPipe, DWORD dwLength)
+{
+
+	PURING_SHARD pShard = &g_pShards[lpPerSocketContext->dwShard];
+	struct io_uring_sqe *sqe = NULL;
+	BOOL bRet = FALSE;
+
+	lpIOContext->fdSplice = fdPipe;
+	lpIOContext->cbSplice = dwLength;
+
+	EnterCriticalSection(&pShard->csSubmit);
+
+	//
+	// the poll and the splice linked to it must go to the kernel together
+	//
+	if (lpIOContext->IOOperation == ClientIoSpliceIn)
+	{
+		if (io_uring_sq_space_left(&pShard->Ring) < 2)
+			UringSubmit(pShard, "splice");
+		sqe = UringGetSqe(pShard);
+		if (sqe == NULL)
+		{
+			LogPrintf(LOG_ERROR, "io_uring_get_sqe(poll) failed\n");
+			LeaveCriticalSection(&pShard->csSubmit);
+			return (FALSE);
+		}
+		io_uring_prep_poll_add(sqe, lpPerSocketContext->Socket, POLLIN);
+		sqe->flags |= IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+		io_uring_sqe_set_data(sqe, &g_CancelTag);
+	}
+
+	sqe = UringGetSqe(pShard);
+	if (sqe)
+	{
+		if (lpIOContext->IOOperation == ClientIoSpliceIn)
+			io_uring_prep_splice(sqe, lpPerSocketContext->Socket, -1, fdPipe, -1, dwLength, SPLICE_F_MOVE);
+		else
+			io_uring_prep_splice(sqe, fdPipe, -1, lpPerSocketContext->Socket, -1, dwLength, SPLICE_F_MOVE);
+		io_uring_sqe_set_data(sqe, lpIOContext);
+		bRet = UringSubmitOrDefer(pShard, "splice");
+	}
+	else
+		LogPrintf(LOG_ERROR, "io_uring_get_sqe(splice) failed\n");
+	LeaveCriticalSection(&pShard->csSubmit);
+	return (bRet);
+}
+
+static BOOL UringPostAccept(PPER_SOCKET_CONTEXT lpListenContext, PPER_IO_CONTEXT lpIOContext)
+{
+
+	PURING_SHARD pShard = NULL;
+	struct io_uring_sqe *sqe = NULL;
+	BOOL bRet = FALSE;
+
+	if (lpIOContext->bAcceptArmed)
+		return (TRUE);
+
+	if (lpIOContext->dwAcceptShard >= g_dwShards)
+		lpIOContext->dwAcceptShard = (DWORD)InterlockedIncrement(&g_lNextAcceptShard) % g_dwShards;
+	pShard = &g_pShards[lpIOContext->dwAcceptShard];
+
+	EnterCriticalSection(&pShard->csSubmit);
+	sqe = UringGetSqe(pShard);
+	if (sqe)
+	{
+		if (g_bSingleShotAccept)
+			io_uring_prep_accept(sqe, lpIOContext->SocketListen, NULL, NULL, SOCK_CLOEXEC);
+		else
+			io_uring_prep_multishot_accept(sqe, lpIOContext->SocketListen, NULL, NULL, SOCK_CLOEXEC);
+		io_uring_sqe_set_data(sqe, lpIOContext);
+		lpIOContext->bAcceptArmed = TRUE;
+		bRet = UringSubmitOrDefer(pShard, "accept");
+		if (!bRet)
+			lpIOContext->bAcceptArmed = FALSE;
+	}
+	else
+		LogPrintf(LOG_ERROR, "io_uring_get_sqe(accept) failed\n");
+	LeaveCriticalSection(&pShard->csSubmit);
+	return (bRet);
+}
+
+static VOID UringCancel(PPER_SOCKET_CONTEXT lpPerSocketContext)
+{
+
+	PURING_SHARD pShard = &g_pShards[lpPerSocketContext->dwShard];
+	PPER_IO_CONTEXT lpIOContext = NULL;
+	struct io_uring_sqe *sqe = NULL;
+
+	//
+	// submitted right away: the socket is closed as soon as this returns
+	//
+	EnterCriticalSection(&pShard->csSubmit);
+
+	//
+	// parked receives never reached the kernel; a NOP completes each of them
+	// as a zero byte receive
+	//
+	while ((lpIOContext = lpPerSocketContext->pRecvPending) != NULL &&
+		   (sqe = UringGetSqe(pShard)) != NULL)
+	{
+		lpPerSocketContext->pRecvPending = lpIOContext->pPendingNext;
+		io_uring_prep_nop(sqe);
+		io_uring_sqe_set_data(sqe, lpIOContext);
+	}
+
+	sqe = UringGetSqe(pShard);
+	if (sqe)
+	{
+		io_uring_prep_cancel_fd(sqe, lpPerSocketContext->Socket, IORING_ASYNC_CANCEL_ALL);
+		sqe->flags |= IOSQE_CQE_SKIP_SUCCESS;
+		io_uring_sqe_set_data(sqe, &g_CancelTag);
+		UringSubmit(pShard, "cancel");
+	}
+	else
+		LogPrintf(LOG_ERROR, "io_uring_get_sqe(cancel) failed\n");
+	LeaveCriticalSection(&pShard->csSubmit);
+}
+
+//
+// Turn a CQE into a completion packet.  Returns FALSE for CQEs that are not
+// completions of posted operations.
+//
+static BOOL UringTranslate(struct io_uring_cqe *cqe, PCQ_COMPLETION lpCompletion)
+{
+
+	int nRet = cqe->res;
+
+	lpCompletion->lpPerSocketContext = NULL;
+	lpCompletion->lpIOContext = (PPER_IO_CONTEXT)io_uring_cqe_get_data(cqe);
+	lpCompletion->dwIoSize = 0;
+	lpCompletion->SocketAccept = INVALID_SOCKET;
+	lpCompletion->bSuccess = TRUE;
+	lpCompletion->dwError = 0;
+
+	if (lpCompletion->lpIOContext == (PPER_IO_CONTEXT)&g_CancelTag)
+		return (FALSE);
+
+	if (lpCompletion->lpIOContext == NULL)
+	{
+
+		//
+		// quit packet
+		//
+		return (TRUE);
+	}
+
+	if (lpCompletion->lpIOContext->IOOperation == ClientIoRead)
+	{
+		if (g_bSharedBuffers && !UringRecvBuffer(cqe, lpCompletion->lpIOContext))
+			return (FALSE);
+		UringNextRecv(lpCompletion->lpIOContext->pSocketContext);
+	}
+
+	if (lpCompletion->lpIOContext->IOOperation == ClientIoWrite && lpCompletion->lpIOContext->bZeroCopy &&
+		!UringZeroCopy(cqe, lpCompletion->lpIOContext, &nRet))
+		return (FALSE);
+
+	if (lpCompletion->lpIOContext->IOOperation == ClientIoAccept)
+	{
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			lpCompletion->lpIOContext->bAcceptArmed = FALSE;
+		if (nRet == -EINVAL && !g_bSingleShotAccept)
+		{
+			LogPrintf(LOG_INFO, "multishot accept not supported, using one-shot accepts\n");
+			g_bSingleShotAccept = TRUE;
+		}
+		if (nRet >= 0)
+		{
+			lpCompletion->SocketAccept = nRet;
+			nRet = 0;
+		}
+	}
+
+	lpCompletion->lpPerSocketContext = lpCompletion->lpIOContext->pSocketContext;
+	if (nRet < 0)
+	{
+		lpCompletion->bSuccess = FALSE;
+		lpCompletion->dwError = (DWORD)-nRet;
+	}
+	else
+		lpCompletion->dwIoSize = (DWORD)nRet;
+	return (TRUE);
+}
+
+static BOOL UringGetCompletions(DWORD dwWorker, PCQ_COMPLETION lpCompletions, DWORD dwCount,
+								LPDWORD lpdwRemoved, DWORD dwMilliseconds)
+{
+
+	struct io_uring *ring = &g_pShards[dwWorker].Ring;
+	struct io_uring_cqe *cqes[CQ_MAX_BATCH];
+	struct io_uring_cqe *cqe = NULL;
+	struct __kernel_timespec ts;
+	unsigned nCount = 0;
+	DWORD dwRemoved = 0;
+	int nRet = 0;
+
+	t_dwShard = dwWorker;
+	*lpdwRemoved = 0;
+	if (dwCount > CQ_MAX_BATCH)
+		dwCount = CQ_MAX_BATCH;
+
+	while (dwRemoved == 0)
+	{
+
+		//
+		// only enter the kernel when there is nothing to reap
+		//
+		nCount = io_uring_peek_batch_cqe(ring, cqes, dwCount);
+		if (nCount == 0 && dwMilliseconds == 0)
+			return (TRUE);
+		if (nCount == 0)
+		{
+			t_pCqStats->llSyscalls++;
+			do
+			{
+				if (dwMilliseconds == INFINITE)
+					nRet = io_uring_wait_cqe(ring, &cqe);
+				else
+				{
+					ts.tv_sec = dwMilliseconds / 1000;
+					ts.tv_nsec = (long long)(dwMilliseconds % 1000) * 1000000LL;
+					nRet = io_uring_wait_cqe_timeout(ring, &cqe, &ts);
+				}
+			} while (nRet == -EINTR);
+
+			if (nRet == -ETIME)
+				return (TRUE);
+			if (nRet < 0)
+			{
+				errno = -nRet;
+				return (FALSE);
+			}
+			nCount = io_uring_peek_batch_cqe(ring, cqes, dwCount);
+		}
+
+		for (unsigned i = 0; i < nCount; i++)
+		{
+			if (UringTranslate(cqes[i], &lpCompletions[dwRemoved]))
+				dwRemoved++;
+		}
+		io_uring_cq_advance(ring, nCount);
+	}
+
+	*lpdwRemoved = dwRemoved;
+	return (TRUE);
+}
+
+static VOID UringFlush(DWORD dwWorker)
+{
+
+	PURING_SHARD pShard = &g_pShards[dwWorker];
+
+	EnterCriticalSection(&pShard->csSubmit);
+	if (pShard->dwUnsubmitted)
+		UringSubmit(pShard, "batch");
+	LeaveCriticalSection(&pShard->csSubmit);
+}
+
+static VOID UringPostQuit(DWORD dwWorker)
+{
+
+	PURING_SHARD pShard = &g_pShards[dwWorker];
+	struct io_uring_sqe *sqe = NULL;
+
+	EnterCriticalSection(&pShard->csSubmit);
+	sqe = UringGetSqe(pShard);
+	if (sqe)
+	{
+		io_uring_prep_nop(sqe);
+		io_uring_sqe_set_data(sqe, NULL);
+		UringSubmit(pShard, "nop");
+	}
+	LeaveCriticalSection(&pShard->csSubmit);
+}
+
+const CQ_BACKEND g_CqUring = {
+	"uring",
+	UringCreate,
+	UringClose,
+	UringAssociate,
+	UringPostRecv,
+	UringReleaseBuffer,
+	UringPostSend,
+	UringPostSplice,
+	UringPostAccept,
+	UringCancel,
+	UringGetCompletions,
+	UringFlush,
+	UringPostQuit,
+};
+
+#endif // __linux__ && HAVE_LIBURING
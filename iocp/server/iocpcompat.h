@@ -0,0 +1,583 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Module:
+//      iocpcompat.h
+//
+// Abstract:
+//      The echo server state machine is written against the Win32 and Winsock
+//      APIs.  On Windows this header just pulls in the platform headers.  On
+//      Linux it supplies the small subset of Win32 types and calls the server
+//      uses (threads, critical sections, heap, console output) on top of POSIX,
+//      so that iocpserver.cpp compiles unchanged and only the completion queue
+//      backend differs between platforms.
+//
+
+#ifndef IOCPCOMPAT_H
+#define IOCPCOMPAT_H
+
+#ifdef _WIN32
+
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <mswsock.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strsafe.h>
+
+#else // !_WIN32
+
+#include <ctype.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+//
+// basic Win32 types
+//
+typedef int BOOL;
+typedef uint32_t DWORD, *PDWORD, *LPDWORD;
+typedef uint16_t WORD;
+typedef uint8_t BYTE;
+typedef uint32_t ULONG;
+typedef int32_t LONG;
+typedef int64_t LONG64;
+typedef uint64_t ULONGLONG;
+typedef long HRESULT;
+typedef char CHAR;
+typedef uintptr_t ULONG_PTR, DWORD_PTR, *PDWORD_PTR;
+typedef void VOID, *LPVOID, *HANDLE;
+typedef int SOCKET;
+
+#ifndef TRUE
+#define TRUE 1
+#endif
+#ifndef FALSE
+#define FALSE 0
+#endif
+
+#define WINAPI
+#define __cdecl
+#define INFINITE            0xFFFFFFFF
+#define INVALID_HANDLE_VALUE ((HANDLE)(intptr_t)-1)
+#define INVALID_SOCKET      (-1)
+#define SOCKET_ERROR        (-1)
+#define S_OK                ((HRESULT)0)
+#define SUCCEEDED(hr)       (((HRESULT)(hr)) >= 0)
+#define WAIT_OBJECT_0       0
+#define WAIT_FAILED         0xFFFFFFFF
+#define MAXIMUM_WAIT_OBJECTS 64
+#define STD_OUTPUT_HANDLE   ((DWORD)-11)
+#define HEAP_ZERO_MEMORY    0x00000008
+#define WSA_FLAG_OVERLAPPED 0x01
+#define MAKEWORD(a, b)      ((unsigned short)(((a) & 0xff) | (((b) & 0xff) << 8)))
+#define UNREFERENCED_PARAMETER(P) ((void)(P))
+
+#define CTRL_C_EVENT        0
+#define CTRL_BREAK_EVENT    1
+#define CTRL_CLOSE_EVENT    2
+#define CTRL_LOGOFF_EVENT   5
+#define CTRL_SHUTDOWN_EVENT 6
+
+//
+// The overlapped structure is only meaningful to the IOCP backend, but it stays
+// the first member of PER_IO_CONTEXT on every platform so the layout and the
+// context initialization code are shared.
+//
+typedef struct _WSAOVERLAPPED {
+    ULONG_PTR Internal;
+    ULONG_PTR InternalHigh;
+    DWORD Offset;
+    DWORD OffsetHigh;
+    HANDLE hEvent;
+} WSAOVERLAPPED, OVERLAPPED, *LPWSAOVERLAPPED, *LPOVERLAPPED;
+
+#define HasOverlappedIoCompleted(lpOverlapped) (TRUE)
+
+//
+// WSABUF has the same layout as struct iovec so an array of them can be handed
+// to writev/sendmsg directly.
+//
+typedef struct _WSABUF {
+    CHAR *buf;
+    size_t len;
+} WSABUF, *LPWSABUF;
+
+typedef void *LPFN_ACCEPTEX;
+typedef struct linger LINGER;
+
+typedef struct _WSADATA {
+    int iUnused;
+} WSADATA;
+
+typedef struct _SYSTEM_INFO {
+    DWORD dwNumberOfProcessors;
+} SYSTEM_INFO;
+
+typedef DWORD(WINAPI *LPTHREAD_START_ROUTINE)(LPVOID lpThreadParameter);
+typedef BOOL(WINAPI *PHANDLER_ROUTINE)(DWORD dwCtrlType);
+
+//
+// errors
+//
+static inline DWORD GetLastError(void) { return ((DWORD)errno); }
+static inline int WSAGetLastError(void) { return (errno); }
+static inline void WSASetLastError(int iError) { errno = iError; }
+
+//
+// memory
+//
+#define ZeroMemory(p, n) memset((p), 0, (n))
+#define CopyMemory(d, s, n) memcpy((d), (s), (n))
+
+static inline HANDLE GetProcessHeap(void) { return (NULL); }
+
+static inline LPVOID HeapAlloc(HANDLE hHeap, DWORD dwFlags, size_t dwBytes)
+{
+    (void)hHeap;
+    return ((dwFlags & HEAP_ZERO_MEMORY) ? calloc(1, dwBytes) : malloc(dwBytes));
+}
+
+static inline BOOL HeapFree(HANDLE hHeap, DWORD dwFlags, LPVOID lpMem)
+{
+    (void)hHeap;
+    (void)dwFlags;
+    free(lpMem);
+    return (TRUE);
+}
+
+//
+// critical sections
+//
+typedef pthread_mutex_t CRITICAL_SECTION, *LPCRITICAL_SECTION;
+
+static inline void InitializeCriticalSection(LPCRITICAL_SECTION lpcs)
+{
+    pthread_mutexattr_t attr;
+
+    //
+    // Win32 critical sections are recursive; CtxtListFree relies on that.
+    //
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(lpcs, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+static inline void DeleteCriticalSection(LPCRITICAL_SECTION lpcs) { pthread_mutex_destroy(lpcs); }
+static inline void EnterCriticalSection(LPCRITICAL_SECTION lpcs) { pthread_mutex_lock(lpcs); }
+static inline void LeaveCriticalSection(LPCRITICAL_SECTION lpcs) { pthread_mutex_unlock(lpcs); }
+
+//
+// interlocked operations
+//
+static inline LONG InterlockedIncrement(LONG volatile *lpAddend) { return (__sync_add_and_fetch(lpAddend, 1)); }
+static inline LONG InterlockedDecrement(LONG volatile *lpAddend) { return (__sync_sub_and_fetch(lpAddend, 1)); }
+static inline LONG InterlockedExchangeAdd(LONG volatile *lpAddend, LONG lValue) { return (__sync_fetch_and_add(lpAddend, lValue)); }
+static inline LONG InterlockedCompareExchange(LONG volatile *lpDest, LONG lExchange, LONG lComperand) { return (__sync_val_compare_and_swap(lpDest, lComperand, lExchange)); }
+static inline LONG64 InterlockedCompareExchange64(LONG64 volatile *lpDest, LONG64 llExchange, LONG64 llComperand) { return (__sync_val_compare_and_swap(lpDest, llComperand, llExchange)); }
+static inline LONG64 InterlockedExchange64(LONG64 volatile *lpTarget, LONG64 llValue) { return (__sync_lock_test_and_set(lpTarget, llValue)); }
+#define MemoryBarrier() __sync_synchronize()
+
+//
+// threads
+//
+typedef struct _COMPAT_THREAD {
+    pthread_t Thread;
+    LPTHREAD_START_ROUTINE lpStartAddress;
+    LPVOID lpParameter;
+} COMPAT_THREAD, *PCOMPAT_THREAD;
+
+static inline DWORD GetCurrentThreadId(void) { return ((DWORD)syscall(SYS_gettid)); }
+
+static inline void Sleep(DWORD dwMilliseconds)
+{
+    struct timespec ts;
+
+    ts.tv_sec = dwMilliseconds / 1000;
+    ts.tv_nsec = (long)(dwMilliseconds % 1000) * 1000000L;
+    nanosleep(&ts, NULL);
+}
+
+static inline void *CompatThreadStart(void *lpParameter)
+{
+    PCOMPAT_THREAD pThread = (PCOMPAT_THREAD)lpParameter;
+    sigset_t set;
+
+    //
+    // Console control "events" are delivered as signals; keep them on the main
+    // thread the way Windows runs the control handler outside the workers.
+    //
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGQUIT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    return ((void *)(uintptr_t)pThread->lpStartAddress(pThread->lpParameter));
+}
+
+static inline HANDLE CreateThread(void *lpThreadAttributes, size_t dwStackSize,
+                                  LPTHREAD_START_ROUTINE lpStartAddress, LPVOID lpParameter,
+                                  DWORD dwCreationFlags, LPDWORD lpThreadId)
+{
+    PCOMPAT_THREAD pThread;
+
+    (void)lpThreadAttributes;
+    (void)dwStackSize;
+    (void)dwCreationFlags;
+
+    pThread = (PCOMPAT_THREAD)calloc(1, sizeof(COMPAT_THREAD));
+    if (pThread == NULL)
+        return (NULL);
+    pThread->lpStartAddress = lpStartAddress;
+    pThread->lpParameter = lpParameter;
+    if (pthread_create(&pThread->Thread, NULL, CompatThreadStart, pThread) != 0)
+    {
+        free(pThread);
+        return (NULL);
+    }
+    if (lpThreadId)
+        *lpThreadId = 0;
+    return ((HANDLE)pThread);
+}
+
+static inline DWORD WaitForMultipleObjects(DWORD nCount, const HANDLE *lpHandles,
+                                           BOOL bWaitAll, DWORD dwMilliseconds)
+{
+    struct timespec ts;
+
+    (void)bWaitAll;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += dwMilliseconds / 1000;
+    ts.tv_nsec += (long)(dwMilliseconds % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L)
+    {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+
+    for (DWORD i = 0; i < nCount; i++)
+    {
+        PCOMPAT_THREAD pThread = (PCOMPAT_THREAD)lpHandles[i];
+
+        if (pThread == NULL || lpHandles[i] == INVALID_HANDLE_VALUE)
+            continue;
+        if (dwMilliseconds == INFINITE)
+        {
+            if (pthread_join(pThread->Thread, NULL) != 0)
+                return (WAIT_FAILED);
+        }
+        else if (pthread_timedjoin_np(pThread->Thread, NULL, &ts) != 0)
+            return (WAIT_FAILED);
+        pThread->Thread = 0;
+    }
+    return (WAIT_OBJECT_0);
+}
+
+static inline BOOL CloseHandle(HANDLE hObject)
+{
+    PCOMPAT_THREAD pThread = (PCOMPAT_THREAD)hObject;
+
+    if (pThread->Thread)
+        pthread_detach(pThread->Thread);
+    free(pThread);
+    return (TRUE);
+}
+
+static inline void GetSystemInfo(SYSTEM_INFO *lpSystemInfo)
+{
+    long nCpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    lpSystemInfo->dwNumberOfProcessors = (nCpus > 0) ? (DWORD)nCpus : 1;
+}
+
+//
+// performance counter, in nanoseconds of CLOCK_MONOTONIC
+//
+typedef union _LARGE_INTEGER {
+    LONG64 QuadPart;
+} LARGE_INTEGER;
+
+static inline BOOL QueryPerformanceCounter(LARGE_INTEGER *lpPerformanceCount)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    lpPerformanceCount->QuadPart = (LONG64)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    return (TRUE);
+}
+
+static inline BOOL QueryPerformanceFrequency(LARGE_INTEGER *lpFrequency)
+{
+    lpFrequency->QuadPart = 1000000000LL;
+    return (TRUE);
+}
+
+static inline ULONGLONG GetTickCount64(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ((ULONGLONG)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+//
+// processor groups: the online CPUs numbered in order, split into groups of
+// as many processors as a KAFFINITY mask has bits, like Windows does on
+// machines with more than 64 logical processors
+//
+typedef uint64_t KAFFINITY;
+
+typedef struct _GROUP_AFFINITY {
+    KAFFINITY Mask;
+    WORD Group;
+    WORD Reserved[3];
+} GROUP_AFFINITY, *PGROUP_AFFINITY;
+
+#define ALL_PROCESSOR_GROUPS 0xffff
+#define COMPAT_GROUP_SIZE   (sizeof(KAFFINITY) * 8)
+
+static inline DWORD GetActiveProcessorCount(WORD GroupNumber)
+{
+    SYSTEM_INFO si;
+
+    GetSystemInfo(&si);
+    if (GroupNumber == ALL_PROCESSOR_GROUPS)
+        return (si.dwNumberOfProcessors);
+    if ((DWORD)GroupNumber * COMPAT_GROUP_SIZE >= si.dwNumberOfProcessors)
+        return (0);
+    si.dwNumberOfProcessors -= (DWORD)GroupNumber * COMPAT_GROUP_SIZE;
+    return (si.dwNumberOfProcessors < COMPAT_GROUP_SIZE ? si.dwNumberOfProcessors : (DWORD)COMPAT_GROUP_SIZE);
+}
+
+static inline WORD GetActiveProcessorGroupCount(void)
+{
+    return ((WORD)((GetActiveProcessorCount(ALL_PROCESSOR_GROUPS) + COMPAT_GROUP_SIZE - 1) / COMPAT_GROUP_SIZE));
+}
+
+static inline BOOL SetThreadGroupAffinity(HANDLE hThread, const GROUP_AFFINITY *GroupAffinity,
+                                          PGROUP_AFFINITY PreviousGroupAffinity)
+{
+    PCOMPAT_THREAD pThread = (PCOMPAT_THREAD)hThread;
+    cpu_set_t set;
+    int nRet;
+
+    (void)PreviousGroupAffinity;
+
+    CPU_ZERO(&set);
+    for (DWORD i = 0; i < COMPAT_GROUP_SIZE; i++)
+    {
+        if (GroupAffinity->Mask & ((KAFFINITY)1 << i))
+            CPU_SET(GroupAffinity->Group * COMPAT_GROUP_SIZE + i, &set);
+    }
+    if ((nRet = pthread_setaffinity_np(pThread->Thread, sizeof(set), &set)) != 0)
+    {
+        errno = nRet;
+        return (FALSE);
+    }
+    return (TRUE);
+}
+
+//
+// console control handler, mapped onto SIGINT (CTRL-C), SIGQUIT (CTRL-BRK),
+// SIGTERM (shutdown) and SIGHUP (close)
+//
+static PHANDLER_ROUTINE g_pfnCompatCtrlHandler = NULL;
+
+static inline void CompatSignalHandler(int nSignal)
+{
+    DWORD dwEvent = CTRL_C_EVENT;
+
+    switch (nSignal)
+    {
+    case SIGQUIT:
+        dwEvent = CTRL_BREAK_EVENT;
+        break;
+    case SIGTERM:
+        dwEvent = CTRL_SHUTDOWN_EVENT;
+        break;
+    case SIGHUP:
+        dwEvent = CTRL_CLOSE_EVENT;
+        break;
+    }
+    if (g_pfnCompatCtrlHandler)
+        g_pfnCompatCtrlHandler(dwEvent);
+}
+
+static inline BOOL SetConsoleCtrlHandler(PHANDLER_ROUTINE HandlerRoutine, BOOL Add)
+{
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    g_pfnCompatCtrlHandler = Add ? HandlerRoutine : NULL;
+    sa.sa_handler = Add ? CompatSignalHandler : SIG_DFL;
+    sigemptyset(&sa.sa_mask);
+
+    //
+    // no SA_RESTART: a blocking accept in the main thread must see EINTR
+    //
+    if (sigaction(SIGINT, &sa, NULL) != 0 || sigaction(SIGQUIT, &sa, NULL) != 0 ||
+        sigaction(SIGTERM, &sa, NULL) != 0 || sigaction(SIGHUP, &sa, NULL) != 0)
+        return (FALSE);
+
+    //
+    // a peer that resets the connection must not kill the server on send
+    //
+    signal(SIGPIPE, Add ? SIG_IGN : SIG_DFL);
+    return (TRUE);
+}
+
+//
+// console output
+//
+static inline HANDLE GetStdHandle(DWORD nStdHandle)
+{
+    (void)nStdHandle;
+    return ((HANDLE)(intptr_t)STDOUT_FILENO);
+}
+
+static inline BOOL WriteConsole(HANDLE hConsoleOutput, const void *lpBuffer, DWORD nNumberOfCharsToWrite,
+                                LPDWORD lpNumberOfCharsWritten, LPVOID lpReserved)
+{
+    ssize_t nWritten;
+
+    (void)lpReserved;
+    nWritten = write((int)(intptr_t)hConsoleOutput, lpBuffer, nNumberOfCharsToWrite);
+    if (lpNumberOfCharsWritten)
+        *lpNumberOfCharsWritten = (nWritten > 0) ? (DWORD)nWritten : 0;
+    return (nWritten >= 0);
+}
+
+#define lstrlen(s) ((int)strlen(s))
+
+static inline HRESULT StringCchVPrintf(char *pszDest, size_t cchDest, const char *pszFormat, va_list argList)
+{
+    int nLen = vsnprintf(pszDest, cchDest, pszFormat, argList);
+
+    return ((nLen < 0 || (size_t)nLen >= cchDest) ? (HRESULT)-1 : S_OK);
+}
+
+//
+// Winsock
+//
+static inline int WSAStartup(unsigned short wVersionRequested, WSADATA *lpWSAData)
+{
+    (void)wVersionRequested;
+    (void)lpWSAData;
+    return (0);
+}
+
+static inline int WSACleanup(void) { return (0); }
+
+static inline SOCKET WSASocket(int af, int type, int protocol, void *lpProtocolInfo,
+                               unsigned int g, DWORD dwFlags)
+{
+    (void)lpProtocolInfo;
+    (void)g;
+    (void)dwFlags;
+    return (socket(af, type | SOCK_CLOEXEC, protocol));
+}
+
+static inline SOCKET WSAAccept(SOCKET s, struct sockaddr *addr, socklen_t *addrlen,
+                               void *lpfnCondition, DWORD_PTR dwCallbackData)
+{
+    (void)lpfnCondition;
+    (void)dwCallbackData;
+    return (accept4(s, addr, addrlen, SOCK_CLOEXEC));
+}
+
+static inline int closesocket(SOCKET s) { return (close(s)); }
+
+#define SD_BOTH             SHUT_RDWR
+
+//
+// WSA events, backed by an eventfd so that WSASetEvent is safe to call from the
+// console control (signal) handler
+//
+typedef HANDLE WSAEVENT;
+
+#define WSA_INVALID_EVENT   ((WSAEVENT)NULL)
+#define WSA_INFINITE        INFINITE
+#define WSA_WAIT_EVENT_0    0
+#define WSA_WAIT_TIMEOUT    0x102
+#define WSA_WAIT_FAILED     0xFFFFFFFF
+
+static inline WSAEVENT WSACreateEvent(void)
+{
+    int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    //
+    // store fd + 1 so that descriptor 0 is not mistaken for WSA_INVALID_EVENT
+    //
+    return ((fd < 0) ? WSA_INVALID_EVENT : (WSAEVENT)(intptr_t)(fd + 1));
+}
+
+static inline BOOL WSASetEvent(WSAEVENT hEvent)
+{
+    uint64_t u64One = 1;
+
+    return (write((int)(intptr_t)hEvent - 1, &u64One, sizeof(u64One)) == sizeof(u64One));
+}
+
+static inline BOOL WSAResetEvent(WSAEVENT hEvent)
+{
+    uint64_t u64Count = 0;
+
+    while (read((int)(intptr_t)hEvent - 1, &u64Count, sizeof(u64Count)) > 0)
+        ;
+    return (TRUE);
+}
+
+static inline BOOL WSACloseEvent(WSAEVENT hEvent) { return (close((int)(intptr_t)hEvent - 1) == 0); }
+
+static inline DWORD WSAWaitForMultipleEvents(DWORD cEvents, const WSAEVENT *lphEvents, BOOL fWaitAll,
+                                             DWORD dwTimeout, BOOL fAlertable)
+{
+    struct pollfd pfd;
+    int nRet = 0;
+
+    (void)cEvents;
+    (void)fWaitAll;
+    (void)fAlertable;
+
+    pfd.fd = (int)(intptr_t)lphEvents[0] - 1;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    do
+    {
+        nRet = poll(&pfd, 1, (dwTimeout == WSA_INFINITE) ? -1 : (int)dwTimeout);
+    } while (nRet < 0 && errno == EINTR);
+
+    if (nRet < 0)
+        return (WSA_WAIT_FAILED);
+    return ((nRet == 0) ? WSA_WAIT_TIMEOUT : WSA_WAIT_EVENT_0);
+}
+
+#endif // _WIN32
+
+#endif
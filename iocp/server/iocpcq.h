@@ -0,0 +1,215 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Module:
+//      iocpcq.h
+//
+// Abstract:
+//      Completion queue abstraction used by the echo server state machine.
+//
+//      The interface follows the IOCP model: a socket is associated with the
+//      queue once, receives and sends are posted against a PER_IO_CONTEXT, and
+//      each posted operation produces exactly one completion carrying the
+//      PER_SOCKET_CONTEXT (the completion key), the PER_IO_CONTEXT (the
+//      overlapped structure) and the number of bytes transferred.  A completion
+//      with a NULL socket context tells a worker thread to exit.
+//
+//      Accepts are posted against the listening socket's context and one of its
+//      accept PER_IO_CONTEXTs (IOOperation ClientIoAccept); the accepted socket
+//      is returned in the completion.  Backends with multishot or readiness based
+//      accept may deliver several completions for one posted accept context, and
+//      treat reposting an accept that is still armed as a no-op.
+//
+//      Backends:
+//          iocp    - I/O completion ports (Windows), cq_iocp.cpp
+//          uring   - io_uring through liburing (Linux), cq_uring.cpp
+//          epoll   - edge-triggered epoll readiness (Linux), cq_epoll.cpp
+//
+//      Backends that cannot share one queue between threads keep one queue per
+//      worker thread (a shard).  A socket is bound to a shard when it is
+//      associated, and every worker only reaps completions from its own shard.
+//      The shard is the socket context's dwShard if the server chose one (as
+//      reactors do, see below), otherwise the backend picks one.
+//
+//      In reactor mode (-r) every worker is a reactor pinned to its own CPU,
+//      with its own shard, even on IOCP, and on Linux its own SO_REUSEPORT
+//      listening socket.  Accept contexts carry the listening socket they are
+//      posted on (SocketListen) and the shard to arm them on (dwAcceptShard),
+//      and the connections they accept are bound to the same shard, so a
+//      connection is accepted, served and closed on one thread.
+//
+//      With shared buffers (-z) receives are posted without a buffer.  The
+//      backend attaches one when data arrives (a provided buffer ring on
+//      io_uring, a pool buffer taken at readiness on epoll, a zero byte
+//      WSARecv followed by a nonblocking recv on IOCP), so idle connections
+//      hold no data buffer.
+//
+//      A connection has one send in flight at a time.  The server gathers the
+//      data of every receive waiting to be echoed into that send, so the
+//      backends post it as one vectored operation (WSASend with several WSABUFs,
+//      writev on io_uring, sendmsg on epoll).
+//
+//      In splice mode (-s) a connection's data goes from the socket into a pipe
+//      and back out with splice, one operation at a time, and is never copied
+//      to user memory (IORING_OP_SPLICE behind a linked poll on io_uring, a
+//      nonblocking splice on epoll readiness).  Backends without splice (IOCP)
+//      leave fnPostSplice NULL and the server echoes through buffers.
+//
+//      Workers dequeue completions in batches.  Receives and sends a worker
+//      posts to its own shard while handling a batch may be held back and
+//      submitted together by fnFlush, which the worker calls after each batch.
+//
+
+#ifndef IOCPCQ_H
+#define IOCPCQ_H
+
+#include "iocpserver.h"
+
+#define CQ_DEFAULT_BATCH    32
+#define CQ_MAX_BATCH        256
+#define CQ_ANY_SHARD        ((DWORD)-1)
+
+//
+// one dequeued completion packet; dwError is set when bSuccess is FALSE
+//
+typedef struct _CQ_COMPLETION {
+    PPER_SOCKET_CONTEXT         lpPerSocketContext;
+    PPER_IO_CONTEXT             lpIOContext;
+    DWORD                       dwIoSize;
+    SOCKET                      SocketAccept;
+    BOOL                        bSuccess;
+    DWORD                       dwError;
+} CQ_COMPLETION, *PCQ_COMPLETION;
+
+//
+// per-worker queue counters, on their own cache line.  Backends count the
+// system calls they make on behalf of the calling thread.
+//
+typedef struct alignas(64) _CQ_STATS {
+    LONG64                      llCompletions;  // completions dequeued
+    LONG64                      llDequeues;     // batches dequeued
+    LONG64                      llSyscalls;     // waits, submissions and per-operation calls
+} CQ_STATS, *PCQ_STATS;
+
+typedef struct _CQ_BACKEND {
+    const char                  *szName;
+
+    //
+    // create the queue with one shard per worker thread
+    //
+    BOOL                        (*fnCreate)(DWORD dwWorkers);
+
+    //
+    // release the queue; called after all worker threads have exited and before
+    // the contexts are freed, so in-flight operations must be quiesced here
+    //
+    VOID                        (*fnClose)(void);
+
+    //
+    // bind a socket to the queue; lpPerSocketContext becomes the completion key
+    //
+    BOOL                        (*fnAssociate)(PPER_SOCKET_CONTEXT lpPerSocketContext);
+
+    //
+    // post a receive into lpBuffer; completes with the number of bytes received
+    // (0 when the peer closed the connection).  With a NULL lpBuffer the backend
+    // attaches a MAX_BUFF_SIZE buffer of its own to lpIOContext->Buffer, only if
+    // the receive completes with data.
+    //
+    BOOL                        (*fnPostRecv)(PPER_SOCKET_CONTEXT lpPerSocketContext,
+                                              PPER_IO_CONTEXT lpIOContext,
+                                              LPWSABUF lpBuffer);
+
+    //
+    // give back a buffer the backend attached to a receive; may be called after
+    // fnClose, when the contexts are freed
+    //
+    VOID                        (*fnReleaseBuffer)(PPER_IO_CONTEXT lpIOContext);
+
+    //
+    // post one send gathering dwBufferCount buffers, in order; completes with
+    // the number of bytes sent, which may be less than requested.  The array
+    // must stay valid until the send completes.
+    //
+    BOOL                        (*fnPostSend)(PPER_SOCKET_CONTEXT lpPerSocketContext,
+                                              PPER_IO_CONTEXT lpIOContext,
+                                              LPWSABUF lpBuffers,
+                                              DWORD dwBufferCount);
+
+    //
+    // post a splice of up to dwLength bytes between the socket and fdPipe, an
+    // end of a pipe: from the socket into the pipe when lpIOContext->IOOperation
+    // is ClientIoSpliceIn (completing with 0 when the peer closed the
+    // connection), from the pipe out to the socket for ClientIoSpliceOut.  NULL
+    // where the platform has no splice.
+    //
+    BOOL                        (*fnPostSplice)(PPER_SOCKET_CONTEXT lpPerSocketContext,
+                                                PPER_IO_CONTEXT lpIOContext,
+                                                int fdPipe,
+                                                DWORD dwLength);
+
+    //
+    // post an accept on lpIOContext->SocketListen, a listening socket associated
+    // through lpListenContext; completes with SocketAccept set
+    //
+    BOOL                        (*fnPostAccept)(PPER_SOCKET_CONTEXT lpListenContext,
+                                                PPER_IO_CONTEXT lpIOContext);
+
+    //
+    // make every operation still pending on a socket that is being closed
+    // complete, with an error if need be, so its contexts can be freed
+    //
+    VOID                        (*fnCancel)(PPER_SOCKET_CONTEXT lpPerSocketContext);
+
+    //
+    // dequeue up to dwCount completions for worker dwWorker, waiting up to
+    // dwMilliseconds for the first one.  Returns TRUE with none dequeued when
+    // the wait times out and FALSE when the queue failed; the status of each
+    // operation is in its completion.
+    //
+    BOOL                        (*fnGetCompletions)(DWORD dwWorker,
+                                                    PCQ_COMPLETION lpCompletions,
+                                                    DWORD dwCount,
+                                                    LPDWORD lpdwRemoved,
+                                                    DWORD dwMilliseconds);
+
+    //
+    // submit whatever worker dwWorker posted while handling its last batch
+    //
+    VOID                        (*fnFlush)(DWORD dwWorker);
+
+    //
+    // queue a completion with a NULL key to make worker dwWorker exit
+    //
+    VOID                        (*fnPostQuit)(DWORD dwWorker);
+} CQ_BACKEND, *PCQ_BACKEND;
+
+#ifdef _WIN32
+extern const CQ_BACKEND g_CqIocp;
+#endif
+
+#ifdef HAVE_LIBURING
+extern const CQ_BACKEND g_CqUring;
+#endif
+
+#ifdef __linux__
+extern const CQ_BACKEND g_CqEpoll;
+#endif
+
+//
+// backends built into this binary, in order of preference, NULL terminated
+//
+extern const CQ_BACKEND *g_CqBackends[];
+
+extern const CQ_BACKEND *g_pCq;
+extern PCQ_STATS g_pCqStats;    // per worker
+
+//
+// counters of the calling thread: a worker's own slot, or a shared slot for
+// the main thread
+//
+extern thread_local PCQ_STATS t_pCqStats;
+
+#endif
@@ -0,0 +1,323 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Module:
+//      iocpcuckoo.cpp
+//
+// Abstract:
+//      Cuckoo hash table with per-bucket bloom filters.  See iocpcuckoo.h.
+//
+
+#include "iocpcuckoo.h"
+
+#define CUCKOO_BYTES_01         0x0101010101010101ULL
+#define CUCKOO_BYTES_80         0x8080808080808080ULL
+#define CUCKOO_SLOTS_80         (CUCKOO_BYTES_80 >> (64 - 8 * CUCKOO_SLOTS))    // the tags in use
+
+//
+// a bucket on the insert's search: the slot of the parent bucket whose key
+// would move into it
+//
+typedef struct _CUCKOO_STEP {
+    DWORD dwBucket;
+    int nParent;
+    int nSlot;
+} CUCKOO_STEP;
+
+static inline BOOL CuckooKeyEqual(const U128 *pA, const U128 *pB)
+{
+
+	return (((pA->ullLow ^ pB->ullLow) | (pA->ullHigh ^ pB->ullHigh)) == 0);
+}
+
+//
+// 64 well mixed bits of the key (the finalizer of MurmurHash3), so sequential
+// ids spread over the buckets
+//
+static inline ULONGLONG CuckooHash(const U128 *pKey)
+{
+
+	ULONGLONG ullHash = pKey->ullLow ^ (pKey->ullHigh * 0xC2B2AE3D27D4EB4FULL);
+
+	ullHash ^= ullHash >> 33;
+	ullHash *= 0xFF51AFD7ED558CCDULL;
+	ullHash ^= ullHash >> 33;
+	ullHash *= 0xC4CEB9FE1A85EC53ULL;
+	ullHash ^= ullHash >> 33;
+	return (ullHash);
+}
+
+//
+// The two buckets, from the high and low halves of the hash scaled to the
+// bucket count, and never the same one.  The tag and the filter bit come from
+// the low bits, which the scaling all but ignores.
+//
+static inline VOID CuckooBuckets(PCUCKOO_TABLE pTable, ULONGLONG ullHash, DWORD *pdwFirst, DWORD *pdwSecond)
+{
+
+	*pdwFirst = (DWORD)(((ullHash >> 32) * pTable->dwBuckets) >> 32);
+	*pdwSecond = (DWORD)(((ullHash & 0xFFFFFFFF) * pTable->dwBuckets) >> 32);
+	if (*pdwSecond == *pdwFirst)
+		*pdwSecond = (*pdwFirst + 1 == pTable->dwBuckets) ? 0 : *pdwFirst + 1;
+}
+
+static inline BYTE CuckooTag(ULONGLONG ullHash)
+{
+
+	BYTE bTag = (BYTE)ullHash;
+
+	return (bTag ? bTag : 1);
+}
+
+static inline ULONGLONG CuckooBloomBit(ULONGLONG ullHash)
+{
+
+	return (1ULL << ((ullHash >> 8) & 63));
+}
+
+//
+// a bit set in the top of every byte of the bucket's tags equal to bTag, but
+// for the unused last one
+//
+static inline ULONGLONG CuckooMatch(const CUCKOO_BUCKET *pBucket, BYTE bTag)
+{
+
+	ULONGLONG ullTags;
+	ULONGLONG ullDiff;
+
+	memcpy(&ullTags, pBucket->Tags, sizeof(ullTags));
+	ullDiff = ullTags ^ (CUCKOO_BYTES_01 * bTag);
+	return ((ullDiff - CUCKOO_BYTES_01) & ~ullDiff & CUCKOO_SLOTS_80);
+}
+
+//
+// slot of the bucket holding pKey, -1 if none
+//
+static inline int CuckooFindSlot(PCUCKOO_TABLE pTable, DWORD dwBucket, BYTE bTag, const U128 *pKey)
+{
+
+	ULONGLONG ullMatch = CuckooMatch(&pTable->pBuckets[dwBucket], bTag);
+	int nSlot = 0;
+
+	while (ullMatch)
+	{
+		nSlot = __builtin_ctzll(ullMatch) / 8;
+		if (CuckooKeyEqual(&pTable->pBuckets[dwBucket].Keys[nSlot], pKey))
+			return (nSlot);
+		ullMatch &= ullMatch - 1;
+	}
+	return (-1);
+}
+
+static inline int CuckooFreeSlot(PCUCKOO_TABLE pTable, DWORD dwBucket)
+{
+
+	ULONGLONG ullFree = CuckooMatch(&pTable->pBuckets[dwBucket], 0);
+
+	return (ullFree ? __builtin_ctzll(ullFree) / 8 : -1);
+}
+
+static inline LPVOID CuckooValue(PCUCKOO_TABLE pTable, DWORD dwBucket, int nSlot)
+{
+
+	if (pTable->pValues == NULL)
+		return (NULL);
+	return (pTable->pValues + ((size_t)dwBucket * CUCKOO_SLOTS + nSlot) * pTable->cbValue);
+}
+
+//
+// Put the key in the slot; a key in its second bucket is recorded in its
+// first bucket's filter.
+//
+static inline VOID CuckooPlace(PCUCKOO_TABLE pTable, DWORD dwBucket, int nSlot, const U128 *pKey, ULONGLONG ullHash)
+{
+
+	DWORD dwFirst = 0;
+	DWORD dwSecond = 0;
+
+	CuckooBuckets(pTable, ullHash, &dwFirst, &dwSecond);
+	pTable->pBuckets[dwBucket].Tags[nSlot] = CuckooTag(ullHash);
+	pTable->pBuckets[dwBucket].Keys[nSlot] = *pKey;
+	if (dwBucket != dwFirst)
+		pTable->pBuckets[dwFirst].ullBloom |= CuckooBloomBit(ullHash);
+}
+
+BOOL CuckooCreate(PCUCKOO_TABLE pTable, DWORD dwCapacity, DWORD cbValue)
+{
+
+	ULONGLONG ullBuckets = ((ULONGLONG)dwCapacity * 100 + CUCKOO_SLOTS * CUCKOO_LOAD_MAX - 1) /
+						   (CUCKOO_SLOTS * CUCKOO_LOAD_MAX);
+	size_t cbBuckets = 0;
+	size_t cbValues = 0;
+
+	ZeroMemory(pTable, sizeof(CUCKOO_TABLE));
+	if (ullBuckets < 2)
+		ullBuckets = 2;
+	if (ullBuckets > 0xFFFFFFFF / CUCKOO_SLOTS)
+		return (FALSE);
+	cbBuckets = (size_t)ullBuckets * sizeof(CUCKOO_BUCKET);
+	cbValues = (size_t)ullBuckets * CUCKOO_SLOTS * cbValue;
+
+	//
+	// buckets first, on a 128-byte boundary so each is a pair of lines the
+	// adjacent line prefetcher fetches together
+	//
+	pTable->pBuffer = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, 128 + cbBuckets + cbValues);
+	if (pTable->pBuffer == NULL)
+		return (FALSE);
+	pTable->pBuckets = (PCUCKOO_BUCKET)(((ULONG_PTR)pTable->pBuffer + 127) & ~(ULONG_PTR)127);
+	pTable->pValues = cbValue ? (char *)pTable->pBuckets + cbBuckets : NULL;
+	pTable->dwBuckets = (DWORD)ullBuckets;
+	pTable->cbValue = cbValue;
+	pTable->dwCapacity = dwCapacity;
+	pTable->dwCount = 0;
+	return (TRUE);
+}
+
+VOID CuckooDestroy(PCUCKOO_TABLE pTable)
+{
+
+	if (pTable->pBuffer)
+		HeapFree(GetProcessHeap(), 0, pTable->pBuffer);
+	ZeroMemory(pTable, sizeof(CUCKOO_TABLE));
+}
+
+VOID CuckooReset(PCUCKOO_TABLE pTable)
+{
+
+	for (DWORD i = 0; i < pTable->dwBuckets; i++)
+	{
+		ZeroMemory(pTable->pBuckets[i].Tags, sizeof(pTable->pBuckets[i].Tags));
+		pTable->pBuckets[i].ullBloom = 0;
+	}
+	pTable->dwCount = 0;
+}
+
+BOOL CuckooFind(PCUCKOO_TABLE pTable, const U128 *pKey, LPVOID *ppValue)
+{
+
+	ULONGLONG ullHash = CuckooHash(pKey);
+	BYTE bTag = CuckooTag(ullHash);
+	DWORD dwFirst = 0;
+	DWORD dwSecond = 0;
+	int nSlot = 0;
+
+	CuckooBuckets(pTable, ullHash, &dwFirst, &dwSecond);
+	if ((nSlot = CuckooFindSlot(pTable, dwFirst, bTag, pKey)) >= 0)
+	{
+		*ppValue = CuckooValue(pTable, dwFirst, nSlot);
+		return (TRUE);
+	}
+	if ((pTable->pBuckets[dwFirst].ullBloom & CuckooBloomBit(ullHash)) == 0)
+		return (FALSE);
+	if ((nSlot = CuckooFindSlot(pTable, dwSecond, bTag, pKey)) >= 0)
+	{
+		*ppValue = CuckooValue(pTable, dwSecond, nSlot);
+		return (TRUE);
+	}
+	return (FALSE);
+}
+
+DWORD CuckooProbeLength(PCUCKOO_TABLE pTable, const U128 *pKey)
+{
+
+	ULONGLONG ullHash = CuckooHash(pKey);
+	DWORD dwFirst = 0;
+	DWORD dwSecond = 0;
+
+	CuckooBuckets(pTable, ullHash, &dwFirst, &dwSecond);
+	if (CuckooFindSlot(pTable, dwFirst, CuckooTag(ullHash), pKey) >= 0 ||
+		(pTable->pBuckets[dwFirst].ullBloom & CuckooBloomBit(ullHash)) == 0)
+		return (1);
+	return (2);
+}
+
+VOID CuckooPrefetch(PCUCKOO_TABLE pTable, const U128 *pKey)
+{
+
+	DWORD dwFirst = 0;
+	DWORD dwSecond = 0;
+
+	CuckooBuckets(pTable, CuckooHash(pKey), &dwFirst, &dwSecond);
+	__builtin_prefetch(&pTable->pBuckets[dwFirst]);
+	__builtin_prefetch(&pTable->pBuckets[dwFirst].Keys[CUCKOO_SLOTS - 1]);
+}
+
+DWORD CuckooInsert(PCUCKOO_TABLE pTable, const U128 *pKey, LPVOID *ppValue)
+{
+
+	CUCKOO_STEP Steps[CUCKOO_SEARCH_MAX];
+	ULONGLONG ullHash = CuckooHash(pKey);
+	ULONGLONG ullMoved = 0;
+	DWORD dwFirst = 0;
+	DWORD dwSecond = 0;
+	DWORD dwMovedFirst = 0;
+	DWORD dwMovedSecond = 0;
+	DWORD dwOther = 0;
+	DWORD dwSteps = 0;
+	DWORD dwFrom = 0;
+	DWORD i = 0;
+	int nSlot = -1;
+	int nAncestor = 0;
+
+	if (CuckooFind(pTable, pKey, ppValue))
+		return (CUCKOO_EXISTS);
+	if (pTable->dwCount >= pTable->dwCapacity)
+		return (CUCKOO_FULL);
+
+	//
+	// Search breadth first from both buckets for one with a free slot; every
+	// step is the other bucket of one of the keys in the bucket before it,
+	// leaving out buckets already on the way there.
+	//
+	CuckooBuckets(pTable, ullHash, &dwFirst, &dwSecond);
+	Steps[0].dwBucket = dwFirst;
+	Steps[0].nParent = -1;
+	Steps[1].dwBucket = dwSecond;
+	Steps[1].nParent = -1;
+	dwSteps = 2;
+	for (i = 0; i < dwSteps; i++)
+	{
+		if ((nSlot = CuckooFreeSlot(pTable, Steps[i].dwBucket)) >= 0)
+			break;
+		for (int j = 0; j < CUCKOO_SLOTS && dwSteps < CUCKOO_SEARCH_MAX; j++)
+		{
+			ullMoved = CuckooHash(&pTable->pBuckets[Steps[i].dwBucket].Keys[j]);
+			CuckooBuckets(pTable, ullMoved, &dwMovedFirst, &dwMovedSecond);
+			dwOther = (Steps[i].dwBucket == dwMovedFirst) ? dwMovedSecond : dwMovedFirst;
+			for (nAncestor = (int)i; nAncestor >= 0 && Steps[nAncestor].dwBucket != dwOther;)
+				nAncestor = Steps[nAncestor].nParent;
+			if (nAncestor >= 0)
+				continue;
+			Steps[dwSteps].dwBucket = dwOther;
+			Steps[dwSteps].nParent = (int)i;
+			Steps[dwSteps].nSlot = j;
+			dwSteps++;
+		}
+	}
+	if (nSlot < 0)
+		return (CUCKOO_FULL);
+
+	//
+	// then move the keys along the chain, the last first, into the slot freed
+	// by the one after it
+	//
+	while (Steps[i].nParent >= 0)
+	{
+		dwFrom = Steps[Steps[i].nParent].dwBucket;
+		ullMoved = CuckooHash(&pTable->pBuckets[dwFrom].Keys[Steps[i].nSlot]);
+		CuckooPlace(pTable, Steps[i].dwBucket, nSlot, &pTable->pBuckets[dwFrom].Keys[Steps[i].nSlot], ullMoved);
+		if (pTable->pValues)
+			memcpy(CuckooValue(pTable, Steps[i].dwBucket, nSlot), CuckooValue(pTable, dwFrom, Steps[i].nSlot),
+				   pTable->cbValue);
+		nSlot = Steps[i].nSlot;
+		i = (DWORD)Steps[i].nParent;
+	}
+
+	CuckooPlace(pTable, Steps[i].dwBucket, nSlot, pKey, ullHash);
+	pTable->dwCount++;
+	*ppValue = CuckooValue(pTable, Steps[i].dwBucket, nSlot);
+	return (CUCKOO_INSERTED);
+}
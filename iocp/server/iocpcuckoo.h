@@ -0,0 +1,147 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Module:
+//      iocpcuckoo.h
+//
+// Abstract:
+//      Cuckoo hash table keyed by 128-bit ids, after the design of
+//      @ronomon/hash-table that net_demo/hash_table measures: every key has
+//      two candidate buckets of CUCKOO_SLOTS slots, so a lookup touches at
+//      most two buckets however full the table is.
+//
+//      A bucket is a tag byte per slot (zero for a free slot), a 64-bit bloom
+//      filter and the slots' keys, 128 bytes: two cache lines, aligned so the
+//      adjacent line prefetcher fetches them together, the first holding the
+//      tags, the filter and three keys.  Keys are placed in their first bucket
+//      when it has room; a key that ends up in its second bucket sets a bit in
+//      its first bucket's filter.  A lookup scans the first bucket's tags and
+//      only goes to the second bucket when the filter says the key may have
+//      been moved there.  Tags are compared all at once; a key is read only on
+//      a matching tag.
+//
+//      So a lookup that ends in the first bucket, a hit there or a miss the
+//      filter stops, reads at most its two lines, and a hit in one of the
+//      first three slots or a miss whose tag matches nothing reads only the
+//      first.  A key in its second bucket, or a miss that a filter false
+//      positive sends there, reads the second bucket as well: four lines at
+//      worst.  At 90% load about one key in seven is in its second bucket.
+//      A value, when there is one, is a line of its own besides.
+//
+//      An insert into two full buckets searches breadth first, over at most
+//      CUCKOO_SEARCH_MAX buckets, for a chain of keys that can each move to
+//      their other bucket and end at a free slot, then moves them from the
+//      far end, so the table is consistent at every step and an insert that
+//      finds no chain changes nothing.
+//
+//      Buckets and fixed-size values live in one buffer allocated when the
+//      table is created, sized for its capacity at CUCKOO_LOAD_MAX
+//      percent; the table never resizes and an insert beyond the capacity
+//      fails.  A table is not thread safe; the caller serializes access.
+//
+
+#ifndef IOCPCUCKOO_H
+#define IOCPCUCKOO_H
+
+#include "iocpcompat.h"
+
+#define CUCKOO_SLOTS            7       // per bucket, so the bucket is two cache lines
+#define CUCKOO_LOAD_MAX         90      // percent of the slots filled at capacity
+#define CUCKOO_SEARCH_MAX       256     // buckets an insert's search visits
+
+//
+// CuckooInsert results
+//
+#define CUCKOO_INSERTED         0
+#define CUCKOO_EXISTS           1
+#define CUCKOO_FULL             2
+
+#pragma pack(push, 1)
+
+typedef struct _U128 {
+    ULONGLONG                   ullLow;
+    ULONGLONG                   ullHigh;
+} U128, *PU128;
+
+#pragma pack(pop)
+
+typedef struct alignas(64) _CUCKOO_BUCKET {
+    BYTE                        Tags[CUCKOO_SLOTS + 1];     // the last one unused
+    ULONGLONG                   ullBloom;   // keys of this bucket placed in their second
+    U128                        Keys[CUCKOO_SLOTS];
+} CUCKOO_BUCKET, *PCUCKOO_BUCKET;
+
+static_assert(sizeof(CUCKOO_BUCKET) == 128, "a bucket is two cache lines");
+
+typedef struct _CUCKOO_TABLE {
+    PCUCKOO_BUCKET              pBuckets;
+    char                        *pValues;   // cbValue bytes per key, NULL when 0
+    LPVOID                      pBuffer;    // the one allocation both live in
+    DWORD                       dwBuckets;
+    DWORD                       cbValue;
+    DWORD                       dwCapacity;
+    DWORD                       dwCount;
+} CUCKOO_TABLE, *PCUCKOO_TABLE;
+
+//
+// allocate an empty table for up to dwCapacity keys with cbValue bytes of
+// value each
+//
+BOOL CuckooCreate(
+    PCUCKOO_TABLE pTable,
+    DWORD dwCapacity,
+    DWORD cbValue
+    );
+
+VOID CuckooDestroy(
+    PCUCKOO_TABLE pTable
+    );
+
+//
+// empty the table, keeping its buffer; only the tags and filters are cleared
+//
+VOID CuckooReset(
+    PCUCKOO_TABLE pTable
+    );
+
+//
+// Look pKey up.  Returns TRUE if it is there, and with ppValue where its
+// value is.
+//
+BOOL CuckooFind(
+    PCUCKOO_TABLE pTable,
+    const U128 *pKey,
+    LPVOID *ppValue
+    );
+
+//
+// buckets a CuckooFind of pKey reads, 1 or 2
+//
+DWORD CuckooProbeLength(
+    PCUCKOO_TABLE pTable,
+    const U128 *pKey
+    );
+
+//
+// start loading pKey's first bucket, ahead of a lookup or insert of it
+//
+VOID CuckooPrefetch(
+    PCUCKOO_TABLE pTable,
+    const U128 *pKey
+    );
+
+//
+// Add pKey unless it is there already.  Returns CUCKOO_INSERTED with ppValue
+// where the new key's value goes (zero filled the first time a slot is used,
+// stale after that), CUCKOO_EXISTS with ppValue at the value it has, or
+// CUCKOO_FULL when the table is at capacity or no slot could be freed.
+//
+DWORD CuckooInsert(
+    PCUCKOO_TABLE pTable,
+    const U128 *pKey,
+    LPVOID *ppValue
+    );
+
+#endif
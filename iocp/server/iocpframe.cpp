@@ -0,0 +1,367 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Module:
+//      iocpframe.cpp
+//
+// Abstract:
+//      Length-prefixed framing of the echoed stream.  See iocpframe.h.
+//
+
+#include "iocpserver.h"
+#include "iocpframe.h"
+#include "iocppool.h"
+#include "iocpledger.h"
+
+const FRAME_HANDLER_ENTRY g_FrameHandlers[] = {
+	{"echo", FrameEcho, NULL, NULL, NULL},
+	{"ledger", LedgerHandle, LedgerHandleBatch, LedgerCreate, LedgerDestroy},
+	{NULL, NULL, NULL, NULL, NULL}};
+
+#define FRAME_INCOMPLETE ((DWORD)-2) // the split frame needs another receive
+
+//
+// payload length of the frame whose header starts at pHeader, which need not
+// be aligned; FRAME_CLOSE if it would not fit in FRAME_MAX_SIZE
+//
+static inline DWORD FrameLength(const char *pHeader)
+{
+
+	const unsigned char *p = (const unsigned char *)pHeader;
+	DWORD cbPayload = (DWORD)p[0] | ((DWORD)p[1] << 8) | ((DWORD)p[2] << 16) | ((DWORD)p[3] << 24);
+
+	return (cbPayload > FRAME_MAX_SIZE - FRAME_HEADER_SIZE ? FRAME_CLOSE : cbPayload);
+}
+
+static inline VOID FrameSetLength(char *pHeader, DWORD cbPayload)
+{
+
+	unsigned char *p = (unsigned char *)pHeader;
+
+	p[0] = (unsigned char)cbPayload;
+	p[1] = (unsigned char)(cbPayload >> 8);
+	p[2] = (unsigned char)(cbPayload >> 16);
+	p[3] = (unsigned char)(cbPayload >> 24);
+}
+
+//
+// Hand the frame at pFrame, cbPayload bytes after its header, to the handler
+// and write the reply's header over the frame's.  Returns the reply's length
+// with its header, or FRAME_CLOSE.
+//
+static inline DWORD FrameHandle(char *pFrame, DWORD cbPayload, PFRAME_HANDLER pfnHandler, LPVOID lpParam)
+{
+
+	FRAME_VIEW view;
+	DWORD cbReply = 0;
+
+	view.pData = pFrame + FRAME_HEADER_SIZE;
+	view.cbData = cbPayload;
+	cbReply = pfnHandler(&view, lpParam);
+	if (cbReply > cbPayload)
+		return (FRAME_CLOSE);
+	FrameSetLength(pFrame, cbReply);
+	return (FRAME_HEADER_SIZE + cbReply);
+}
+
+//
+// Continue the frame split across receives with the start of pBuffer, header
+// first, moving *pdwPos past what was copied.  Returns the frame's payload
+// length once it is whole, FRAME_INCOMPLETE while it is not, or FRAME_CLOSE if
+// it is malformed.
+//
+static DWORD FrameAssemble(PFRAME_STATE pState, char *pBuffer, DWORD cbBuffer, DWORD *pdwPos)
+{
+
+	DWORD cbPayload = 0;
+	DWORD cbCopy = 0;
+
+	if (pState->cbAssembly < FRAME_HEADER_SIZE)
+	{
+		cbCopy = FRAME_HEADER_SIZE - pState->cbAssembly;
+		if (cbCopy > cbBuffer)
+			cbCopy = cbBuffer;
+		memcpy(pState->pAssembly + pState->cbAssembly, pBuffer, cbCopy);
+		pState->cbAssembly += cbCopy;
+		*pdwPos += cbCopy;
+		if (pState->cbAssembly < FRAME_HEADER_SIZE)
+			return (FRAME_INCOMPLETE);
+	}
+	cbPayload = FrameLength(pState->pAssembly);
+	if (cbPayload == FRAME_CLOSE)
+		return (FRAME_CLOSE);
+	cbCopy = FRAME_HEADER_SIZE + cbPayload - pState->cbAssembly;
+	if (cbCopy > cbBuffer - *pdwPos)
+		cbCopy = cbBuffer - *pdwPos;
+	memcpy(pState->pAssembly + pState->cbAssembly, pBuffer + *pdwPos, cbCopy);
+	pState->cbAssembly += cbCopy;
+	*pdwPos += cbCopy;
+	return (pState->cbAssembly < FRAME_HEADER_SIZE + cbPayload ? FRAME_INCOMPLETE : cbPayload);
+}
+
+//
+// keep the cbRest bytes at pRest, the start of the frame the next receive
+// continues, in a fresh assembly buffer
+//
+static BOOL FrameKeep(PFRAME_STATE pState, const char *pRest, DWORD cbRest)
+{
+
+	pState->pAssembly = (char *)CtxtPoolAlloc(&g_BufferPool);
+	if (pState->pAssembly == NULL)
+		return (FALSE);
+	memcpy(pState->pAssembly, pRest, cbRest);
+	pState->cbAssembly = cbRest;
+	return (TRUE);
+}
+
+BOOL FrameReceive(PFRAME_STATE pState, char *pBuffer, DWORD cbBuffer, PFRAME_HANDLER pfnHandler, LPVOID lpParam,
+				  PFRAME_OUTPUT pOutput)
+{
+
+	DWORD dwPos = 0;
+	DWORD dwOut = 0;
+	DWORD cbPayload = 0;
+	DWORD cbReply = 0;
+	BOOL bClose = FALSE;
+
+	ZeroMemory(pOutput, sizeof(FRAME_OUTPUT));
+
+	//
+	// first finish the frame split across receives
+	//
+	if (pState->pAssembly)
+	{
+		cbPayload = FrameAssemble(pState, pBuffer, cbBuffer, &dwPos);
+		if (cbPayload == FRAME_CLOSE)
+			return (FALSE);
+		if (cbPayload == FRAME_INCOMPLETE)
+		{
+			pOutput->dwOffset = cbBuffer;
+			return (TRUE);
+		}
+
+		cbReply = FrameHandle(pState->pAssembly, cbPayload, pfnHandler, lpParam);
+		if (cbReply == FRAME_CLOSE)
+			return (FALSE);
+		pOutput->pCarry = pState->pAssembly;
+		pOutput->cbCarry = cbReply;
+		pOutput->dwFrames++;
+		pState->pAssembly = NULL;
+		pState->cbAssembly = 0;
+	}
+
+	//
+	// then every frame that lies whole in the buffer, where it lies, packing
+	// the replies from the first one on
+	//
+	pOutput->dwOffset = dwPos;
+	dwOut = dwPos;
+	while (cbBuffer - dwPos >= FRAME_HEADER_SIZE)
+	{
+		cbPayload = FrameLength(pBuffer + dwPos);
+		if (cbPayload == FRAME_CLOSE)
+		{
+			bClose = TRUE;
+			break;
+		}
+		if (cbBuffer - dwPos - FRAME_HEADER_SIZE < cbPayload)
+			break;
+		cbReply = FrameHandle(pBuffer + dwPos, cbPayload, pfnHandler, lpParam);
+		if (cbReply == FRAME_CLOSE)
+		{
+			bClose = TRUE;
+			break;
+		}
+		if (dwOut != dwPos)
+			memmove(pBuffer + dwOut, pBuffer + dwPos, cbReply);
+		dwOut += cbReply;
+		dwPos += FRAME_HEADER_SIZE + cbPayload;
+		pOutput->dwFrames++;
+	}
+	pOutput->cbReplies = dwOut - pOutput->dwOffset;
+
+	//
+	// and keep the start of the frame the next receive continues
+	//
+	if (!bClose && dwPos < cbBuffer)
+		bClose = !FrameKeep(pState, pBuffer + dwPos, cbBuffer - dwPos);
+
+	//
+	// a connection that is to be closed is handed nothing
+	//
+	if (bClose && pOutput->pCarry)
+	{
+		CtxtPoolFree(&g_BufferPool, pOutput->pCarry);
+		pOutput->pCarry = NULL;
+	}
+	return (!bClose);
+}
+
+static inline VOID FrameBatchAdd(PFRAME_BATCH pBatch, char *pPayload, DWORD cbPayload, LPVOID lpParam)
+{
+
+	PFRAME_VIEW pView = &pBatch->pViews[pBatch->dwViews++];
+
+	pView->pData = pPayload;
+	pView->cbData = cbPayload;
+	pView->cbReply = FRAME_CLOSE;
+	pView->lpParam = lpParam;
+}
+
+BOOL FrameCollect(PFRAME_STATE pState, char *pBuffer, DWORD cbBuffer, LPVOID lpParam, PFRAME_BATCH pBatch,
+				  PFRAME_OUTPUT pOutput)
+{
+
+	DWORD dwPos = 0;
+	DWORD cbPayload = 0;
+	BOOL bClose = FALSE;
+
+	ZeroMemory(pOutput, sizeof(FRAME_OUTPUT));
+	pOutput->dwFirstView = pBatch->dwViews;
+	if (pBatch->dwCapacity - pBatch->dwViews < FRAME_RECEIVE_MAX(cbBuffer))
+		return (FALSE);
+
+	//
+	// the frame split across receives, if this one completes it, is handled
+	// in its assembly buffer, which becomes the carry
+	//
+	if (pState->pAssembly)
+	{
+		cbPayload = FrameAssemble(pState, pBuffer, cbBuffer, &dwPos);
+		if (cbPayload == FRAME_CLOSE)
+			return (FALSE);
+		if (cbPayload == FRAME_INCOMPLETE)
+		{
+			pOutput->dwOffset = cbBuffer;
+			return (TRUE);
+		}
+		FrameBatchAdd(pBatch, pState->pAssembly + FRAME_HEADER_SIZE, cbPayload, lpParam);
+		pOutput->pCarry = pState->pAssembly;
+		pOutput->dwFrames++;
+		pState->pAssembly = NULL;
+		pState->cbAssembly = 0;
+	}
+
+	pOutput->dwOffset = dwPos;
+	while (cbBuffer - dwPos >= FRAME_HEADER_SIZE)
+	{
+		cbPayload = FrameLength(pBuffer + dwPos);
+		if (cbPayload == FRAME_CLOSE)
+		{
+			bClose = TRUE;
+			break;
+		}
+		if (cbBuffer - dwPos - FRAME_HEADER_SIZE < cbPayload)
+			break;
+		FrameBatchAdd(pBatch, pBuffer + dwPos + FRAME_HEADER_SIZE, cbPayload, lpParam);
+		dwPos += FRAME_HEADER_SIZE + cbPayload;
+		pOutput->dwFrames++;
+	}
+
+	if (!bClose && dwPos < cbBuffer)
+		bClose = !FrameKeep(pState, pBuffer + dwPos, cbBuffer - dwPos);
+
+	if (bClose)
+	{
+		pBatch->dwViews = pOutput->dwFirstView;
+		if (pOutput->pCarry)
+			CtxtPoolFree(&g_BufferPool, pOutput->pCarry);
+		pOutput->pCarry = NULL;
+	}
+	return (!bClose);
+}
+
+BOOL FramePack(PFRAME_BATCH pBatch, char *pBuffer, PFRAME_OUTPUT pOutput)
+{
+
+	PFRAME_VIEW pView = &pBatch->pViews[pOutput->dwFirstView];
+	PFRAME_VIEW pEnd = pView + pOutput->dwFrames;
+	char *pFrame = NULL;
+	DWORD dwOut = pOutput->dwOffset;
+	BOOL bClose = FALSE;
+
+	//
+	// the replies are written over their frames in order, so a reply moved
+	// down never lands on a frame not packed yet
+	//
+	for (; pView < pEnd; pView++)
+	{
+		if (pView->cbReply > pView->cbData)
+		{
+			bClose = TRUE;
+			break;
+		}
+		pFrame = pView->pData - FRAME_HEADER_SIZE;
+		FrameSetLength(pFrame, pView->cbReply);
+		if (pFrame == pOutput->pCarry)
+			pOutput->cbCarry = FRAME_HEADER_SIZE + pView->cbReply;
+		else
+		{
+			if (pFrame != pBuffer + dwOut)
+				memmove(pBuffer + dwOut, pFrame, FRAME_HEADER_SIZE + pView->cbReply);
+			dwOut += FRAME_HEADER_SIZE + pView->cbReply;
+		}
+	}
+	pOutput->cbReplies = dwOut - pOutput->dwOffset;
+
+	if (bClose && pOutput->pCarry)
+	{
+		CtxtPoolFree(&g_BufferPool, pOutput->pCarry);
+		pOutput->pCarry = NULL;
+		pOutput->cbCarry = 0;
+	}
+	return (!bClose);
+}
+
+BOOL FrameBatchCreate(PFRAME_BATCH pBatch, DWORD cbReceive, DWORD dwTarget)
+{
+
+	pBatch->dwCapacity = FRAME_BATCH_MAX + FRAME_RECEIVE_MAX(cbReceive);
+	pBatch->pViews = (PFRAME_VIEW)HeapAlloc(GetProcessHeap(), 0, pBatch->dwCapacity * sizeof(FRAME_VIEW));
+	pBatch->dwViews = 0;
+	pBatch->dwTarget = dwTarget < FRAME_BATCH_MIN ? FRAME_BATCH_MIN : dwTarget > FRAME_BATCH_MAX ? FRAME_BATCH_MAX : dwTarget;
+	return (pBatch->pViews != NULL);
+}
+
+VOID FrameBatchDestroy(PFRAME_BATCH pBatch)
+{
+
+	if (pBatch->pViews)
+		HeapFree(GetProcessHeap(), 0, pBatch->pViews);
+	pBatch->pViews = NULL;
+	pBatch->dwCapacity = 0;
+	pBatch->dwViews = 0;
+}
+
+VOID FrameBatchTune(PFRAME_BATCH pBatch, LONG64 llMicroseconds, DWORD dwBudget)
+{
+
+	//
+	// Multiplicative both ways: an overload is backed off from within a few
+	// steps, and a step that came out short of the target says nothing about
+	// what a fuller one would cost.
+	//
+	if (llMicroseconds > (LONG64)dwBudget)
+		pBatch->dwTarget = pBatch->dwTarget / 2 < FRAME_BATCH_MIN ? FRAME_BATCH_MIN : pBatch->dwTarget / 2;
+	else if (pBatch->dwViews >= pBatch->dwTarget && llMicroseconds < (LONG64)dwBudget / 2)
+		pBatch->dwTarget = pBatch->dwTarget * 2 > FRAME_BATCH_MAX ? FRAME_BATCH_MAX : pBatch->dwTarget * 2;
+	pBatch->dwViews = 0;
+}
+
+VOID FrameStateFree(PFRAME_STATE pState)
+{
+
+	if (pState->pAssembly)
+		CtxtPoolFree(&g_BufferPool, pState->pAssembly);
+	pState->pAssembly = NULL;
+	pState->cbAssembly = 0;
+}
+
+DWORD FrameEcho(PFRAME_VIEW pFrame, LPVOID lpParam)
+{
+
+	UNREFERENCED_PARAMETER(lpParam);
+	return (pFrame->cbData);
+}
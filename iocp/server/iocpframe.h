@@ -0,0 +1,218 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Module:
+//      iocpframe.h
+//
+// Abstract:
+//      Length-prefixed framing between the completion handling and the
+//      application.  With -f:handler the stream is a sequence of frames, each
+//      a 32-bit little-endian payload length followed by the payload, and
+//      every frame is handed to the handler, which answers it with a frame of
+//      its own.
+//
+//      Frames are parsed straight out of the receive buffer: the handler gets
+//      a view of the payload where it lies, and writes its reply over it, so
+//      a reply is never longer than the frame it answers.  Replies are packed
+//      one after the other from where the first frame began, which moves
+//      nothing unless a reply came out shorter, and the echo path sends them
+//      from the receive buffer like it sends plain echoes.
+//
+//      A frame split across receives (its header, or its payload) is copied
+//      into the connection's assembly buffer, a MAX_BUFF_SIZE buffer from
+//      g_BufferPool taken only while a frame is split, so a frame is at most
+//      FRAME_MAX_SIZE bytes with its header.  The receive that completes it
+//      has it handled there and takes the buffer over with the reply in it
+//      (the carry), to be sent ahead of its own replies; the next split frame
+//      takes a fresh buffer.  Only split frames are copied, once.
+//
+//      A handler with a batch routine can be handed the frames of many
+//      receives, from any connections, at once (FRAME_BATCH): FrameCollect
+//      parses a receive's frames into the batch without handling them, the
+//      batch routine handles them all in one call, and FramePack then packs
+//      each receive's replies as FrameReceive would have.  The frames of a
+//      receive stay where they lie in its buffer until it is packed.
+//
+
+#ifndef IOCPFRAME_H
+#define IOCPFRAME_H
+
+#include "iocpcompat.h"
+
+#define FRAME_HEADER_SIZE       4
+#define FRAME_MAX_SIZE          MAX_BUFF_SIZE   // header included
+
+//
+// a frame's payload, where it lies in the receive (or assembly) buffer; in a
+// batch also the connection it came on and, once handled, its reply's length
+//
+typedef struct _FRAME_VIEW {
+    char                        *pData;
+    DWORD                       cbData;
+    DWORD                       cbReply;
+    LPVOID                      lpParam;
+} FRAME_VIEW, *PFRAME_VIEW;
+
+//
+// Handle one frame: write the reply payload over pFrame->pData, at most
+// pFrame->cbData bytes, and return its length.  lpParam is the connection's
+// socket context.  Returning (DWORD)-1 closes the connection.
+//
+typedef DWORD (*PFRAME_HANDLER)(PFRAME_VIEW pFrame, LPVOID lpParam);
+
+#define FRAME_CLOSE             ((DWORD)-1)
+
+//
+// Handle dwFrames frames, in order, setting each one's cbReply as
+// PFRAME_HANDLER would return it.  A frame answered FRAME_CLOSE closes its
+// own connection only.
+//
+typedef VOID (*PFRAME_BATCH_HANDLER)(PFRAME_VIEW pFrames, DWORD dwFrames);
+
+//
+// a handler -f can select, with its batch routine (NULL if it has none) and
+// the state it keeps across connections set up once at startup and torn down
+// at exit (NULL for none)
+//
+typedef struct _FRAME_HANDLER_ENTRY {
+    const char                  *szName;
+    PFRAME_HANDLER              pfnHandler;
+    PFRAME_BATCH_HANDLER        pfnBatch;
+    BOOL                        (*pfnCreate)(void);
+    VOID                        (*pfnDestroy)(void);
+} FRAME_HANDLER_ENTRY, *PFRAME_HANDLER_ENTRY;
+
+//
+// the handlers, NULL terminated
+//
+extern const FRAME_HANDLER_ENTRY g_FrameHandlers[];
+
+//
+// per connection: the frame split across receives so far, if any
+//
+typedef struct _FRAME_STATE {
+    char                        *pAssembly;
+    DWORD                       cbAssembly;
+} FRAME_STATE, *PFRAME_STATE;
+
+//
+// what one receive buffer came to: the carry (a buffer the caller now owns and
+// gives back to g_BufferPool once sent), then cbReplies bytes of replies from
+// the buffer's dwOffset on.  Collected into a batch, its frames are the
+// dwFrames views from dwFirstView on, the carry's first.
+//
+typedef struct _FRAME_OUTPUT {
+    char                        *pCarry;
+    DWORD                       cbCarry;
+    DWORD                       dwOffset;
+    DWORD                       cbReplies;
+    DWORD                       dwFrames;
+    DWORD                       dwFirstView;
+} FRAME_OUTPUT, *PFRAME_OUTPUT;
+
+#define FRAME_BATCH_MIN         16      // frames a step is never held below
+#define FRAME_BATCH_MAX         4096    // nor grown above
+
+//
+// Frames collected from any number of receives, to be handled together.
+// dwTarget is how many a step takes before it is handled: halved when a step
+// takes longer than the latency budget, grown again while full steps take
+// well under it, between FRAME_BATCH_MIN and FRAME_BATCH_MAX.  pViews has
+// room for the target and one more receive.
+//
+typedef struct _FRAME_BATCH {
+    PFRAME_VIEW                 pViews;
+    DWORD                       dwViews;
+    DWORD                       dwCapacity;
+    DWORD                       dwTarget;
+} FRAME_BATCH, *PFRAME_BATCH;
+
+//
+// most frames a receive of cbBuffer bytes holds, the one it completes included
+//
+#define FRAME_RECEIVE_MAX(cbBuffer) ((cbBuffer) / FRAME_HEADER_SIZE + 1)
+
+//
+// Parse the cbBuffer bytes received into pBuffer, in order after those of the
+// connection's previous receives.  Returns FALSE on a malformed frame, when a
+// handler asks to close, or when no assembly buffer is left; the connection
+// is to be closed then.
+//
+BOOL FrameReceive(
+    PFRAME_STATE pState,
+    char *pBuffer,
+    DWORD cbBuffer,
+    PFRAME_HANDLER pfnHandler,
+    LPVOID lpParam,
+    PFRAME_OUTPUT pOutput
+    );
+
+//
+// Parse a receive like FrameReceive, but add its frames to pBatch, with
+// lpParam, rather than handle them.  Returns FALSE, adding nothing, on a
+// malformed frame, when no assembly buffer is left or when the batch has no
+// room for the receive; the connection is to be closed then.
+//
+BOOL FrameCollect(
+    PFRAME_STATE pState,
+    char *pBuffer,
+    DWORD cbBuffer,
+    LPVOID lpParam,
+    PFRAME_BATCH pBatch,
+    PFRAME_OUTPUT pOutput
+    );
+
+//
+// Once the batch has been handled, pack the replies to a receive's frames
+// into pBuffer (and the carry) and fill in the rest of pOutput.  Returns
+// FALSE, giving the carry back, if a frame was answered FRAME_CLOSE.
+//
+BOOL FramePack(
+    PFRAME_BATCH pBatch,
+    char *pBuffer,
+    PFRAME_OUTPUT pOutput
+    );
+
+//
+// allocate room for FRAME_BATCH_MAX frames and receives of up to cbReceive
+// bytes, starting at dwTarget frames a step
+//
+BOOL FrameBatchCreate(
+    PFRAME_BATCH pBatch,
+    DWORD cbReceive,
+    DWORD dwTarget
+    );
+
+VOID FrameBatchDestroy(
+    PFRAME_BATCH pBatch
+    );
+
+//
+// a step of pBatch->dwViews frames was handled and packed in llMicroseconds;
+// move the target towards what fits in dwBudget microseconds and empty the
+// batch
+//
+VOID FrameBatchTune(
+    PFRAME_BATCH pBatch,
+    LONG64 llMicroseconds,
+    DWORD dwBudget
+    );
+
+//
+// give back a connection's assembly buffer
+//
+VOID FrameStateFree(
+    PFRAME_STATE pState
+    );
+
+//
+// reply with the frame itself
+//
+DWORD FrameEcho(
+    PFRAME_VIEW pFrame,
+    LPVOID lpParam
+    );
+
+#endif
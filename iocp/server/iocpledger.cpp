@@ -0,0 +1,282 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Module:
+//      iocpledger.cpp
+//
+// Abstract:
+//      In-memory ledger applying batches of transfers.  See iocpledger.h.
+//
+
+#include "iocpserver.h"
+#include "iocpledger.h"
+
+#define LEDGER_PREFETCH 8 // transfers ahead whose ids' buckets are loaded
+
+typedef struct _LEDGER {
+	CRITICAL_SECTION csLedger; // serializes frames
+	PLEDGER_ACCOUNT pAccounts; // LEDGER_ACCOUNT_SLOTS slots
+	DWORD dwAccounts;		   // slots in use
+	CUCKOO_TABLE Transfers[2]; // ids applied, by generation
+	DWORD dwCurrent;		   // generation new ids go into
+	LONG64 llTransfers;		   // handled
+	LONG64 llRejected;
+	LONG64 llRotations;		   // times the generations were swapped
+} LEDGER;
+
+static LEDGER g_Ledger;
+
+static inline BOOL U128Equal(const U128 *pA, const U128 *pB)
+{
+
+	return (((pA->ullLow ^ pB->ullLow) | (pA->ullHigh ^ pB->ullHigh)) == 0);
+}
+
+static inline BOOL U128Zero(const U128 *pA)
+{
+
+	return ((pA->ullLow | pA->ullHigh) == 0);
+}
+
+//
+// The slot of the account with id pId, or if there is none yet the empty slot
+// it would be opened in, with nothing on it.
+//
+static PLEDGER_ACCOUNT LedgerAccount(const U128 *pId)
+{
+
+	ULONGLONG ullHash = (pId->ullLow ^ (pId->ullHigh * 0xC2B2AE3D27D4EB4FULL)) * 0x9E3779B97F4A7C15ULL;
+	DWORD dwSlot = (DWORD)(ullHash >> (64 - LEDGER_ACCOUNT_BITS));
+	PLEDGER_ACCOUNT pAccount = NULL;
+
+	for (;;)
+	{
+		pAccount = &g_Ledger.pAccounts[dwSlot];
+		if (U128Equal(&pAccount->Id, pId) || U128Zero(&pAccount->Id))
+			return (pAccount);
+		dwSlot = (dwSlot + 1) & (LEDGER_ACCOUNT_SLOTS - 1);
+	}
+}
+
+//
+// Open the account with id pId in its empty slot pAccount.
+//
+static inline VOID LedgerOpen(PLEDGER_ACCOUNT pAccount, const U128 *pId)
+{
+
+	pAccount->Id = *pId;
+	g_Ledger.dwAccounts++;
+}
+
+//
+// Record the transfer's id, as long as it has not been seen.  Once the current
+// generation holds LEDGER_TRANSFERS_MAX ids the older one is emptied and takes
+// its place, so every id stays for at least that many transfers after it; an
+// id that finds no slot before then is rejected rather than forgotten.
+//
+static BYTE LedgerRecord(const U128 *pId)
+{
+
+	PCUCKOO_TABLE pCurrent = &g_Ledger.Transfers[g_Ledger.dwCurrent];
+	PCUCKOO_TABLE pPrevious = &g_Ledger.Transfers[g_Ledger.dwCurrent ^ 1];
+	LPVOID pValue = NULL;
+	DWORD dwResult = CUCKOO_INSERTED;
+
+	if (pCurrent->dwCount >= LEDGER_TRANSFERS_MAX)
+	{
+		CuckooReset(pPrevious);
+		g_Ledger.dwCurrent ^= 1;
+		g_Ledger.llRotations++;
+		LogPrintf(LOG_INFO, "ledger: transfer ids rotated after %lld transfers, %d ids kept\n",
+				  g_Ledger.llTransfers, pCurrent->dwCount);
+		pPrevious = pCurrent;
+		pCurrent = &g_Ledger.Transfers[g_Ledger.dwCurrent];
+	}
+	if (pPrevious->dwCount && CuckooFind(pPrevious, pId, &pValue))
+		return (LEDGER_EXISTS);
+	dwResult = CuckooInsert(pCurrent, pId, &pValue);
+	return (dwResult == CUCKOO_EXISTS ? LEDGER_EXISTS : dwResult == CUCKOO_FULL ? LEDGER_TRANSFERS_FULL : LEDGER_OK);
+}
+
+static BYTE LedgerApply(const TRANSFER *pTransfer)
+{
+
+	PLEDGER_ACCOUNT pDebit = NULL;
+	PLEDGER_ACCOUNT pCredit = NULL;
+	ULONGLONG ullAmount = pTransfer->ullAmount;
+	BYTE bResult = LEDGER_OK;
+
+	if (U128Zero(&pTransfer->Id))
+		return (LEDGER_ID_ZERO);
+	if (U128Zero(&pTransfer->DebitId) || U128Zero(&pTransfer->CreditId))
+		return (LEDGER_ACCOUNT_ZERO);
+	if (U128Equal(&pTransfer->DebitId, &pTransfer->CreditId))
+		return (LEDGER_ACCOUNTS_SAME);
+	if (ullAmount == 0)
+		return (LEDGER_AMOUNT_ZERO);
+
+	//
+	// the accounts are looked up but not opened until the transfer is sure to
+	// be applied, so a rejected one takes no slot; one not opened yet has
+	// nothing on it
+	//
+	pDebit = LedgerAccount(&pTransfer->DebitId);
+	pCredit = LedgerAccount(&pTransfer->CreditId);
+	if (g_Ledger.dwAccounts + U128Zero(&pDebit->Id) + U128Zero(&pCredit->Id) > LEDGER_ACCOUNTS_MAX)
+		return (LEDGER_ACCOUNTS_FULL);
+	if (pDebit->ullDebits + ullAmount < ullAmount || pCredit->ullCredits + ullAmount < ullAmount)
+		return (LEDGER_OVERFLOW);
+	bResult = LedgerRecord(&pTransfer->Id);
+	if (bResult != LEDGER_OK)
+		return (bResult);
+
+	if (U128Zero(&pDebit->Id))
+		LedgerOpen(pDebit, &pTransfer->DebitId);
+	if (!U128Equal(&pCredit->Id, &pTransfer->CreditId))
+	{
+		//
+		// the debit account may just have been opened in the slot found
+		// for this one
+		//
+		pCredit = LedgerAccount(&pTransfer->CreditId);
+		LedgerOpen(pCredit, &pTransfer->CreditId);
+	}
+	pDebit->ullDebits += ullAmount;
+	pCredit->ullCredits += ullAmount;
+	return (LEDGER_OK);
+}
+
+BOOL LedgerCreate()
+{
+
+	g_Ledger.pAccounts = (PLEDGER_ACCOUNT)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY,
+													LEDGER_ACCOUNT_SLOTS * sizeof(LEDGER_ACCOUNT));
+	if (g_Ledger.pAccounts == NULL)
+		return (FALSE);
+	if (!CuckooCreate(&g_Ledger.Transfers[0], LEDGER_TRANSFERS_MAX, 0) ||
+		!CuckooCreate(&g_Ledger.Transfers[1], LEDGER_TRANSFERS_MAX, 0))
+	{
+		CuckooDestroy(&g_Ledger.Transfers[0]);
+		HeapFree(GetProcessHeap(), 0, g_Ledger.pAccounts);
+		g_Ledger.pAccounts = NULL;
+		return (FALSE);
+	}
+	InitializeCriticalSection(&g_Ledger.csLedger);
+	g_Ledger.dwCurrent = 0;
+	g_Ledger.dwAccounts = 0;
+	g_Ledger.llTransfers = 0;
+	g_Ledger.llRejected = 0;
+	g_Ledger.llRotations = 0;
+	return (TRUE);
+}
+
+VOID LedgerDestroy()
+{
+
+	if (g_Ledger.pAccounts == NULL)
+		return;
+	LogPrintf(LOG_INFO, "ledger: %lld transfers, %lld rejected, %d accounts, %lld id rotations\n",
+			  g_Ledger.llTransfers, g_Ledger.llRejected, g_Ledger.dwAccounts, g_Ledger.llRotations);
+	DeleteCriticalSection(&g_Ledger.csLedger);
+	CuckooDestroy(&g_Ledger.Transfers[0]);
+	CuckooDestroy(&g_Ledger.Transfers[1]);
+	HeapFree(GetProcessHeap(), 0, g_Ledger.pAccounts);
+	g_Ledger.pAccounts = NULL;
+}
+
+//
+// Prefetch the id buckets of the transfer *pdwNext of frame *pdwFrame, the
+// cursor running LEDGER_PREFETCH transfers ahead of the one being applied, and
+// move the cursor on, into the next frame at the end of one.  A frame's
+// cbReply holds its transfer count until it is answered.
+//
+static inline VOID LedgerPrefetchNext(const FRAME_VIEW *pFrames, DWORD dwFrames, DWORD *pdwFrame, DWORD *pdwNext)
+{
+
+	const TRANSFER *pTransfer = NULL;
+
+	while (*pdwFrame < dwFrames &&
+		   (pFrames[*pdwFrame].cbReply == FRAME_CLOSE || *pdwNext >= pFrames[*pdwFrame].cbReply))
+	{
+		(*pdwFrame)++;
+		*pdwNext = 0;
+	}
+	if (*pdwFrame == dwFrames)
+		return;
+	pTransfer = (const TRANSFER *)pFrames[*pdwFrame].pData + (*pdwNext)++;
+	CuckooPrefetch(&g_Ledger.Transfers[0], &pTransfer->Id);
+	CuckooPrefetch(&g_Ledger.Transfers[1], &pTransfer->Id);
+}
+
+VOID LedgerHandleBatch(PFRAME_VIEW pFrames, DWORD dwFrames)
+{
+
+	const TRANSFER *pTransfers = NULL;
+	DWORD dwTransfers = 0;
+	BYTE bResult = LEDGER_OK;
+	TRANSFER logged[LEDGER_BATCH_MAX];
+	DWORD dwLogged = 0;
+	BOOL bLog = WalEnabled();
+	ULONGLONG ullLsn = 0;
+	DWORD dwAhead = 0;
+	DWORD dwAheadNext = 0;
+
+	for (DWORD f = 0; f < dwFrames; f++)
+	{
+		pFrames[f].cbReply = pFrames[f].cbData / sizeof(TRANSFER);
+		if (pFrames[f].cbData % sizeof(TRANSFER) != 0 || g_Ledger.pAccounts == NULL)
+			pFrames[f].cbReply = FRAME_CLOSE;
+	}
+
+	//
+	// Result i lands on byte i of the payload, inside transfer i / 128, which
+	// has been applied by then.  The transfers applied are copied aside for
+	// the write-ahead log before their results overwrite them, and logged
+	// under the lock, a frame at a time, so the log has them in the order they
+	// were applied.  One lock and one prefetch stream cover every frame.
+	//
+	EnterCriticalSection(&g_Ledger.csLedger);
+	for (DWORD i = 0; i < LEDGER_PREFETCH; i++)
+		LedgerPrefetchNext(pFrames, dwFrames, &dwAhead, &dwAheadNext);
+	for (DWORD f = 0; f < dwFrames; f++)
+	{
+		if (pFrames[f].cbReply == FRAME_CLOSE)
+			continue;
+		pTransfers = (const TRANSFER *)pFrames[f].pData;
+		dwTransfers = pFrames[f].cbReply;
+		dwLogged = 0;
+		for (DWORD i = 0; i < dwTransfers; i++)
+		{
+			LedgerPrefetchNext(pFrames, dwFrames, &dwAhead, &dwAheadNext);
+			bResult = LedgerApply(&pTransfers[i]);
+			g_Ledger.llRejected += (bResult != LEDGER_OK);
+			if (bLog && bResult == LEDGER_OK)
+				memcpy(&logged[dwLogged++], &pTransfers[i], sizeof(TRANSFER));
+			pFrames[f].pData[i] = (char)bResult;
+		}
+		g_Ledger.llTransfers += dwTransfers;
+
+		//
+		// the reply waits for the log; if it failed it is never sent
+		//
+		if (dwLogged)
+		{
+			ullLsn = WalAppend(logged, dwLogged * sizeof(TRANSFER));
+			if (ullLsn == 0)
+				pFrames[f].cbReply = FRAME_CLOSE;
+			else if (pFrames[f].lpParam)
+				((PPER_SOCKET_CONTEXT)pFrames[f].lpParam)->ullWalLsn = ullLsn;
+		}
+	}
+	LeaveCriticalSection(&g_Ledger.csLedger);
+}
+
+DWORD LedgerHandle(PFRAME_VIEW pFrame, LPVOID lpParam)
+{
+
+	pFrame->lpParam = lpParam;
+	LedgerHandleBatch(pFrame, 1);
+	return (pFrame->cbReply);
+}
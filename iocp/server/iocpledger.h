@@ -0,0 +1,145 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Module:
+//      iocpledger.h
+//
+// Abstract:
+//      In-memory ledger behind the ledger frame handler (-f:ledger).  Every
+//      frame's payload is an array of transfers in the 128-byte wire layout of
+//      net_demo/bitcast, which the handler reads where it lies in the receive
+//      buffer: TRANSFER is packed and pinned below, so the payload is cast, not
+//      decoded.  Each transfer moves its amount from the debit account to the
+//      credit account, and the reply is one result byte per transfer, written
+//      over the start of the frame.
+//
+//      Accounts are opened by the first transfer applied that names them, in
+//      an open addressing table of LEDGER_ACCOUNT_SLOTS preallocated slots that
+//      is never resized; a rejected transfer opens none.  A frame is applied
+//      as a whole under the ledger's lock, so frames from different
+//      connections never interleave.  Flags, the custom fields, the timeout
+//      and the timestamp are carried, not interpreted.
+//
+//      The ids of applied transfers go into a cuckoo table (iocpcuckoo.h), and
+//      a transfer whose id is there is answered LEDGER_EXISTS, most of the
+//      time after one cache miss for a new id.  The table takes
+//      LEDGER_TRANSFERS_MAX ids; once it has that many it becomes the previous
+//      generation, still looked up, and the one before that is emptied to take
+//      the new ids, so an id is remembered for at least the
+//      LEDGER_TRANSFERS_MAX transfers after it.  Each such rotation is logged.
+//      An id the table finds no slot for before then is answered
+//      LEDGER_TRANSFERS_FULL and the transfer is not applied.
+//
+//      LedgerHandleBatch applies the frames of many connections under one
+//      taking of the lock, prefetching the id buckets of the transfers ahead
+//      across the frames' boundaries; LedgerHandle is a batch of one.
+//
+//      With a write-ahead log (-j, iocpwal.h) the transfers a frame applied are
+//      appended to it, still under the lock, and the frame's reply waits until
+//      the log is durable up to them.
+//
+
+#ifndef IOCPLEDGER_H
+#define IOCPLEDGER_H
+
+#include <stddef.h>
+
+#include "iocpcompat.h"
+#include "iocpcuckoo.h"
+#include "iocpframe.h"
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "TRANSFER is cast from little-endian wire data"
+#endif
+
+#define LEDGER_ACCOUNT_BITS     20
+#define LEDGER_ACCOUNT_SLOTS    (1 << LEDGER_ACCOUNT_BITS)
+#define LEDGER_ACCOUNTS_MAX     (LEDGER_ACCOUNT_SLOTS / 8 * 7)  // keeps probes short
+#define LEDGER_TRANSFERS_MAX    (1 << 21)                       // ids per generation
+#define LEDGER_BATCH_MAX        ((FRAME_MAX_SIZE - FRAME_HEADER_SIZE) / sizeof(TRANSFER))  // per frame
+
+//
+// result codes, one byte per transfer in the reply
+//
+#define LEDGER_OK               0
+#define LEDGER_ID_ZERO          1       // the transfer's id is zero
+#define LEDGER_ACCOUNT_ZERO     2       // the debit or credit account id is zero
+#define LEDGER_ACCOUNTS_SAME    3
+#define LEDGER_AMOUNT_ZERO      4
+#define LEDGER_ACCOUNTS_FULL    5       // no slot left to open an account in
+#define LEDGER_OVERFLOW         6       // an account's debits or credits would wrap
+#define LEDGER_EXISTS           7       // a transfer with this id was applied already
+#define LEDGER_TRANSFERS_FULL   8       // no slot left to remember the transfer's id in
+
+#pragma pack(push, 1)
+
+typedef struct _TRANSFER {
+    U128                        Id;
+    U128                        DebitId;
+    U128                        CreditId;
+    U128                        Custom1;
+    U128                        Custom2;
+    U128                        Custom3;
+    ULONGLONG                   ullFlags;
+    ULONGLONG                   ullAmount;
+    ULONGLONG                   ullTimeout;
+    ULONGLONG                   ullTimestamp;
+} TRANSFER, *PTRANSFER;
+
+#pragma pack(pop)
+
+//
+// the wire layout: any change here breaks every client
+//
+static_assert(sizeof(TRANSFER) == 128, "TRANSFER is 128 bytes on the wire");
+static_assert(alignof(TRANSFER) == 1, "TRANSFER is cast from any offset in a buffer");
+static_assert(offsetof(TRANSFER, Id) == 0, "TRANSFER.Id");
+static_assert(offsetof(TRANSFER, DebitId) == 16, "TRANSFER.DebitId");
+static_assert(offsetof(TRANSFER, CreditId) == 32, "TRANSFER.CreditId");
+static_assert(offsetof(TRANSFER, Custom1) == 48, "TRANSFER.Custom1");
+static_assert(offsetof(TRANSFER, Custom2) == 64, "TRANSFER.Custom2");
+static_assert(offsetof(TRANSFER, Custom3) == 80, "TRANSFER.Custom3");
+static_assert(offsetof(TRANSFER, ullFlags) == 96, "TRANSFER.ullFlags");
+static_assert(offsetof(TRANSFER, ullAmount) == 104, "TRANSFER.ullAmount");
+static_assert(offsetof(TRANSFER, ullTimeout) == 112, "TRANSFER.ullTimeout");
+static_assert(offsetof(TRANSFER, ullTimestamp) == 120, "TRANSFER.ullTimestamp");
+
+typedef struct _LEDGER_ACCOUNT {
+    U128                        Id;         // zero while the slot is free
+    ULONGLONG                   ullDebits;
+    ULONGLONG                   ullCredits;
+} LEDGER_ACCOUNT, *PLEDGER_ACCOUNT;
+
+//
+// allocate the account and transfer tables; until they are, every ledger
+// frame closes its connection
+//
+BOOL LedgerCreate(
+    );
+
+//
+// log the totals and free the tables
+//
+VOID LedgerDestroy(
+    );
+
+//
+// Apply the frame's transfers in order and reply with their result codes.
+// A payload that is not a whole number of transfers closes the connection.
+//
+DWORD LedgerHandle(
+    PFRAME_VIEW pFrame,
+    LPVOID lpParam
+    );
+
+//
+// LedgerHandle for every frame, in order, each with its own lpParam
+//
+VOID LedgerHandleBatch(
+    PFRAME_VIEW pFrames,
+    DWORD dwFrames
+    );
+
+#endif
@@ -0,0 +1,566 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Module:
+//      iocplog.cpp
+//
+// Abstract:
+//      Per-thread lock-free log rings with deferred formatting and a flusher
+//      thread.  See iocplog.h.
+//
+
+#include <stddef.h>
+
+#include "iocplog.h"
+
+#define LOG_OUTPUT_SIZE (64 * 1024)
+#define LOG_MAX_SPEC    32
+
+//
+// argument slot: integers and pointers widened to 64 bits, doubles as they are,
+// and strings as the offset of their copy in the record (0 for a NULL string)
+//
+typedef union _LOG_ARG {
+	LONG64 ll;
+	double d;
+	const void *p;
+} LOG_ARG;
+
+typedef struct _LOG_RECORD {
+	DWORD dwSize;		  // whole record, a multiple of 8
+	DWORD dwArgs;		  // argument slots
+	const char *lpFormat; // NULL when the record holds text formatted by the caller
+	LOG_ARG Args[1];	  // then the bytes of the strings
+} LOG_RECORD, *PLOG_RECORD;
+
+typedef enum _LOG_ARG_KIND {
+	LogArgNone, // %%
+	LogArgInt,
+	LogArgLong,
+	LogArgLongLong,
+	LogArgSize,
+	LogArgDouble,
+	LogArgString,
+	LogArgPointer,
+	LogArgUnsupported
+} LOG_ARG_KIND;
+
+//
+// One thread's ring.  The owner only moves lHead and the flusher only moves
+// lTail, each on its own cache line; both count bytes since the ring was
+// created and are masked into Data.
+//
+typedef struct _LOG_RING {
+	volatile LONG lHead;
+	LONG lDropped;
+	BOOL bWriting;
+	char Pad1[64 - 2 * sizeof(LONG) - sizeof(BOOL)];
+	volatile LONG lTail;
+	LONG lReported;
+	char Pad2[64 - 2 * sizeof(LONG)];
+	volatile LONG lOwned;
+	struct _LOG_RING *pNext;
+	char Data[LOG_RING_SIZE];
+} LOG_RING, *PLOG_RING;
+
+volatile DWORD g_dwLogLevel = LOG_INFO;
+
+static PLOG_RING volatile g_pLogRings = NULL; // only ever pushed onto until LogShutdown
+static CRITICAL_SECTION g_csLogRings;		  // guards handing rings to threads
+static HANDLE g_hLogFlusher = NULL;
+static volatile BOOL g_bLogRunning = FALSE;
+static volatile BOOL g_bLogStop = FALSE;
+static char g_szLogOutput[LOG_OUTPUT_SIZE]; // flusher only
+static DWORD g_cbLogOutput = 0;
+static thread_local PLOG_RING t_pLogRing = NULL;
+
+static VOID LogWriteConsole(const char *lpBuffer, DWORD cbBuffer)
+{
+
+	HANDLE hOut = GetStdHandle(STD_OUTPUT_HANDLE);
+	DWORD dwWritten = 0;
+
+	if (hOut != INVALID_HANDLE_VALUE && cbBuffer)
+		WriteConsole(hOut, lpBuffer, cbBuffer, &dwWritten, NULL);
+}
+
+//
+// Parse the conversion that starts just past a '%': returns the character after
+// it, the number of '*' fields it takes and the kind of its argument.
+//
+static const char *LogParseSpec(const char *lpSpec, LPDWORD lpdwStars, LOG_ARG_KIND *pKind)
+{
+
+	const char *p = lpSpec;
+	int nSize = 0; // 1 long, 2 long long, 3 size_t
+
+	*lpdwStars = 0;
+	while (*p && strchr("-+ #0", *p))
+		p++;
+	if (*p == '*')
+	{
+		(*lpdwStars)++;
+		p++;
+	}
+	else
+		while (*p >= '0' && *p <= '9')
+			p++;
+	if (*p == '.')
+	{
+		p++;
+		if (*p == '*')
+		{
+			(*lpdwStars)++;
+			p++;
+		}
+		else
+			while (*p >= '0' && *p <= '9')
+				p++;
+	}
+
+	if (*p == 'h')
+		p += (p[1] == 'h') ? 2 : 1;
+	else if (*p == 'l')
+	{
+		nSize = (p[1] == 'l') ? 2 : 1;
+		p += nSize;
+	}
+	else if (*p == 'z')
+	{
+		nSize = 3;
+		p++;
+	}
+	else if (p[0] == 'I' && p[1] == '6' && p[2] == '4')
+	{
+		nSize = 2;
+		p += 3;
+	}
+
+	switch (*p)
+	{
+	case 'd':
+	case 'i':
+	case 'u':
+	case 'o':
+	case 'x':
+	case 'X':
+		*pKind = (nSize == 1) ? LogArgLong : (nSize == 2) ? LogArgLongLong : (nSize == 3) ? LogArgSize : LogArgInt;
+		break;
+	case 'c':
+		*pKind = nSize ? LogArgUnsupported : LogArgInt;
+		break;
+	case 'e':
+	case 'E':
+	case 'f':
+	case 'g':
+	case 'G':
+		*pKind = (nSize > 1) ? LogArgUnsupported : LogArgDouble;
+		break;
+	case 's':
+		*pKind = nSize ? LogArgUnsupported : LogArgString;
+		break;
+	case 'p':
+		*pKind = LogArgPointer;
+		break;
+	case '%':
+		*pKind = (p == lpSpec) ? LogArgNone : LogArgUnsupported;
+		break;
+	default:
+		*pKind = LogArgUnsupported;
+		return (p);
+	}
+	return (p + 1);
+}
+
+//
+// Copy the arguments lpFormat takes into a record.  Returns FALSE, without
+// touching arglist, if the format has a conversion the flusher can't replay or
+// more arguments than fit in a record.
+//
+static BOOL LogEncode(PLOG_RECORD pRecord, const char *lpFormat, va_list arglist)
+{
+
+	const DWORD dwMaxArgs = (LOG_MAX_RECORD - offsetof(LOG_RECORD, Args)) / sizeof(LOG_ARG);
+	const char *p = NULL;
+	const char *lpString = NULL;
+	LOG_ARG_KIND Kind = LogArgNone;
+	DWORD dwStars = 0;
+	DWORD dwArgs = 0;
+	DWORD dwOffset = 0;
+	size_t cbString = 0;
+
+	for (p = strchr(lpFormat, '%'); p; p = strchr(p, '%'))
+	{
+		p = LogParseSpec(p + 1, &dwStars, &Kind);
+		if (Kind == LogArgUnsupported)
+			return (FALSE);
+		dwArgs += dwStars + (Kind != LogArgNone);
+	}
+	if (dwArgs > dwMaxArgs)
+		return (FALSE);
+
+	pRecord->lpFormat = lpFormat;
+	pRecord->dwArgs = dwArgs;
+	dwOffset = (DWORD)offsetof(LOG_RECORD, Args) + dwArgs * sizeof(LOG_ARG);
+	dwArgs = 0;
+	for (p = strchr(lpFormat, '%'); p; p = strchr(p, '%'))
+	{
+		p = LogParseSpec(p + 1, &dwStars, &Kind);
+		while (dwStars--)
+			pRecord->Args[dwArgs++].ll = va_arg(arglist, int);
+		switch (Kind)
+		{
+		case LogArgInt:
+			pRecord->Args[dwArgs++].ll = va_arg(arglist, int);
+			break;
+		case LogArgLong:
+			pRecord->Args[dwArgs++].ll = va_arg(arglist, long);
+			break;
+		case LogArgLongLong:
+			pRecord->Args[dwArgs++].ll = va_arg(arglist, long long);
+			break;
+		case LogArgSize:
+			pRecord->Args[dwArgs++].ll = (LONG64)va_arg(arglist, size_t);
+			break;
+		case LogArgDouble:
+			pRecord->Args[dwArgs++].d = va_arg(arglist, double);
+			break;
+		case LogArgPointer:
+			pRecord->Args[dwArgs++].p = va_arg(arglist, void *);
+			break;
+		case LogArgString:
+
+			//
+			// copied, truncated to what is left of the record
+			//
+			lpString = va_arg(arglist, const char *);
+			pRecord->Args[dwArgs++].ll = 0;
+			if (lpString && dwOffset < LOG_MAX_RECORD)
+			{
+				cbString = strlen(lpString);
+				if (cbString > LOG_MAX_RECORD - dwOffset - 1)
+					cbString = LOG_MAX_RECORD - dwOffset - 1;
+				CopyMemory((char *)pRecord + dwOffset, lpString, cbString);
+				((char *)pRecord)[dwOffset + cbString] = '\0';
+				pRecord->Args[dwArgs - 1].ll = dwOffset;
+				dwOffset += (DWORD)cbString + 1;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+	pRecord->dwSize = (dwOffset + 7) & ~7;
+	return (TRUE);
+}
+
+//
+// Format a record into lpOutput, at most LOG_MAX_RECORD bytes.  Returns the
+// length of the text.
+//
+static DWORD LogFormat(PLOG_RECORD pRecord, char *lpOutput)
+{
+
+	char szSpec[LOG_MAX_SPEC];
+	const char *p = pRecord->lpFormat;
+	const char *lpEnd = NULL;
+	const char *lpString = NULL;
+	LOG_ARG_KIND Kind = LogArgNone;
+	DWORD dwStars = 0;
+	DWORD dwArg = 0;
+	DWORD cbOutput = 0;
+	DWORD cbSpec = 0;
+	int nLen = 0;
+
+	if (p == NULL)
+	{
+		nLen = lstrlen((char *)pRecord->Args);
+		CopyMemory(lpOutput, pRecord->Args, nLen);
+		return ((DWORD)nLen);
+	}
+
+	while (*p && cbOutput < LOG_MAX_RECORD - 1)
+	{
+		if (*p != '%')
+		{
+			lpOutput[cbOutput++] = *p++;
+			continue;
+		}
+
+		//
+		// rebuild the conversion with any '*' replaced by its value, and print
+		// the one argument it takes
+		//
+		lpEnd = LogParseSpec(p + 1, &dwStars, &Kind);
+		for (cbSpec = 0; p < lpEnd && cbSpec < LOG_MAX_SPEC - 12; p++)
+		{
+			if (*p == '*')
+				cbSpec += snprintf(&szSpec[cbSpec], LOG_MAX_SPEC - cbSpec, "%d", (int)pRecord->Args[dwArg++].ll);
+			else
+				szSpec[cbSpec++] = *p;
+		}
+		szSpec[cbSpec] = '\0';
+		p = lpEnd;
+
+		switch (Kind)
+		{
+		case LogArgInt:
+			nLen = snprintf(&lpOutput[cbOutput], LOG_MAX_RECORD - cbOutput, szSpec, (int)pRecord->Args[dwArg++].ll);
+			break;
+		case LogArgLong:
+			nLen = snprintf(&lpOutput[cbOutput], LOG_MAX_RECORD - cbOutput, szSpec, (long)pRecord->Args[dwArg++].ll);
+			break;
+		case LogArgLongLong:
+			nLen = snprintf(&lpOutput[cbOutput], LOG_MAX_RECORD - cbOutput, szSpec, (long long)pRecord->Args[dwArg++].ll);
+			break;
+		case LogArgSize:
+			nLen = snprintf(&lpOutput[cbOutput], LOG_MAX_RECORD - cbOutput, szSpec, (size_t)pRecord->Args[dwArg++].ll);
+			break;
+		case LogArgDouble:
+			nLen = snprintf(&lpOutput[cbOutput], LOG_MAX_RECORD - cbOutput, szSpec, pRecord->Args[dwArg++].d);
+			break;
+		case LogArgPointer:
+			nLen = snprintf(&lpOutput[cbOutput], LOG_MAX_RECORD - cbOutput, szSpec, pRecord->Args[dwArg++].p);
+			break;
+		case LogArgString:
+			lpString = pRecord->Args[dwArg].ll ? (const char *)pRecord + pRecord->Args[dwArg].ll : "(null)";
+			dwArg++;
+			nLen = snprintf(&lpOutput[cbOutput], LOG_MAX_RECORD - cbOutput, szSpec, lpString);
+			break;
+		default:
+			lpOutput[cbOutput] = '%';
+			nLen = 1;
+			break;
+		}
+		if (nLen > 0)
+			cbOutput += ((DWORD)nLen < LOG_MAX_RECORD - cbOutput) ? (DWORD)nLen : LOG_MAX_RECORD - 1 - cbOutput;
+	}
+	return (cbOutput);
+}
+
+//
+// Write the calling thread's record to the end of its ring, or count it as
+// dropped if the flusher hasn't made room for it yet.
+//
+static VOID LogPut(PLOG_RING pRing, PLOG_RECORD pRecord)
+{
+
+	DWORD dwHead = (DWORD)pRing->lHead;
+	DWORD dwPos = dwHead & (LOG_RING_SIZE - 1);
+	DWORD dwFirst = LOG_RING_SIZE - dwPos;
+
+	if (LOG_RING_SIZE - (dwHead - (DWORD)pRing->lTail) < pRecord->dwSize)
+	{
+		pRing->lDropped++;
+		return;
+	}
+
+	if (dwFirst > pRecord->dwSize)
+		dwFirst = pRecord->dwSize;
+	CopyMemory(&pRing->Data[dwPos], pRecord, dwFirst);
+	CopyMemory(pRing->Data, (char *)pRecord + dwFirst, pRecord->dwSize - dwFirst);
+
+	//
+	// the record must be in place before the flusher can see it
+	//
+	MemoryBarrier();
+	pRing->lHead = (LONG)(dwHead + pRecord->dwSize);
+}
+
+//
+// Give the calling thread a ring: one a thread that exited released, or a new
+// one.
+//
+static PLOG_RING LogAttachThread(void)
+{
+
+	PLOG_RING pRing = NULL;
+
+	EnterCriticalSection(&g_csLogRings);
+	for (pRing = g_pLogRings; pRing && pRing->lOwned; pRing = pRing->pNext)
+		;
+	if (pRing == NULL)
+	{
+		pRing = (PLOG_RING)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(LOG_RING));
+		if (pRing)
+		{
+			pRing->pNext = g_pLogRings;
+			MemoryBarrier();
+			g_pLogRings = pRing;
+		}
+	}
+	if (pRing)
+		pRing->lOwned = TRUE;
+	LeaveCriticalSection(&g_csLogRings);
+
+	t_pLogRing = pRing;
+	return (pRing);
+}
+
+VOID LogWrite(DWORD dwLevel, const char *lpFormat, ...)
+{
+
+	LOG_ARG record[LOG_MAX_RECORD / sizeof(LOG_ARG)];
+	PLOG_RECORD pRecord = (PLOG_RECORD)record;
+	PLOG_RING pRing = t_pLogRing;
+	char *lpText = (char *)pRecord->Args;
+	va_list arglist;
+
+	UNREFERENCED_PARAMETER(dwLevel);
+
+	va_start(arglist, lpFormat);
+	if (!g_bLogRunning || (pRing == NULL && (pRing = LogAttachThread()) == NULL))
+	{
+		lpText = (char *)record;
+		StringCchVPrintf(lpText, LOG_MAX_RECORD, lpFormat, arglist);
+		LogWriteConsole(lpText, lstrlen(lpText));
+	}
+
+	//
+	// A control handler that runs on this thread while it is in the middle of
+	// a record (a signal, on Linux) must not touch the ring.
+	//
+	else if (pRing->bWriting)
+		pRing->lDropped++;
+	else
+	{
+		pRing->bWriting = TRUE;
+		if (!LogEncode(pRecord, lpFormat, arglist))
+		{
+			pRecord->lpFormat = NULL;
+			pRecord->dwArgs = 0;
+			StringCchVPrintf(lpText, LOG_MAX_RECORD - offsetof(LOG_RECORD, Args), lpFormat, arglist);
+			pRecord->dwSize = ((DWORD)offsetof(LOG_RECORD, Args) + lstrlen(lpText) + 1 + 7) & ~7;
+		}
+		LogPut(pRing, pRecord);
+		pRing->bWriting = FALSE;
+	}
+	va_end(arglist);
+}
+
+static VOID LogFlushOutput(void)
+{
+
+	LogWriteConsole(g_szLogOutput, g_cbLogOutput);
+	g_cbLogOutput = 0;
+}
+
+//
+// One flusher pass: format everything queued on every ring, then write it out.
+//
+static VOID LogFlush(void)
+{
+
+	LOG_ARG record[LOG_MAX_RECORD / sizeof(LOG_ARG)];
+	PLOG_RECORD pRecord = (PLOG_RECORD)record;
+	PLOG_RING pRing = NULL;
+	DWORD dwHead = 0;
+	DWORD dwTail = 0;
+	DWORD dwPos = 0;
+	DWORD dwFirst = 0;
+	DWORD dwSize = 0;
+	LONG lDropped = 0;
+
+	for (pRing = g_pLogRings; pRing; pRing = pRing->pNext)
+	{
+		dwHead = (DWORD)pRing->lHead;
+		MemoryBarrier();
+		for (dwTail = (DWORD)pRing->lTail; dwTail != dwHead; dwTail += dwSize)
+		{
+			dwPos = dwTail & (LOG_RING_SIZE - 1);
+			dwSize = *(DWORD *)&pRing->Data[dwPos];
+			dwFirst = (LOG_RING_SIZE - dwPos < dwSize) ? LOG_RING_SIZE - dwPos : dwSize;
+			CopyMemory(pRecord, &pRing->Data[dwPos], dwFirst);
+			CopyMemory((char *)pRecord + dwFirst, pRing->Data, dwSize - dwFirst);
+
+			//
+			// the record is copied out, the owner may reuse its space
+			//
+			MemoryBarrier();
+			pRing->lTail = (LONG)(dwTail + dwSize);
+
+			if (g_cbLogOutput + LOG_MAX_RECORD > LOG_OUTPUT_SIZE)
+				LogFlushOutput();
+			g_cbLogOutput += LogFormat(pRecord, &g_szLogOutput[g_cbLogOutput]);
+		}
+
+		lDropped += pRing->lDropped - pRing->lReported;
+		pRing->lReported += pRing->lDropped - pRing->lReported;
+	}
+
+	if (lDropped)
+	{
+		if (g_cbLogOutput + LOG_MAX_RECORD > LOG_OUTPUT_SIZE)
+			LogFlushOutput();
+		g_cbLogOutput += snprintf(&g_szLogOutput[g_cbLogOutput], LOG_MAX_RECORD,
+								  "log: %d records dropped\n", lDropped);
+	}
+	LogFlushOutput();
+}
+
+static DWORD WINAPI LogFlusherThread(LPVOID lpParameter)
+{
+
+	UNREFERENCED_PARAMETER(lpParameter);
+
+	while (!g_bLogStop)
+	{
+		LogFlush();
+		Sleep(LOG_FLUSH_INTERVAL);
+	}
+	LogFlush();
+	return (0);
+}
+
+BOOL LogInitialize()
+{
+
+	DWORD dwThreadId = 0;
+
+	InitializeCriticalSection(&g_csLogRings);
+	g_bLogStop = FALSE;
+	g_hLogFlusher = CreateThread(NULL, 0, LogFlusherThread, NULL, 0, &dwThreadId);
+	if (g_hLogFlusher == NULL)
+	{
+		DeleteCriticalSection(&g_csLogRings);
+		return (FALSE);
+	}
+	g_bLogRunning = TRUE;
+	return (TRUE);
+}
+
+VOID LogShutdown()
+{
+
+	PLOG_RING pRing = NULL;
+
+	if (!g_bLogRunning)
+		return;
+
+	g_bLogStop = TRUE;
+	WaitForMultipleObjects(1, &g_hLogFlusher, TRUE, INFINITE);
+	CloseHandle(g_hLogFlusher);
+	g_hLogFlusher = NULL;
+	g_bLogRunning = FALSE;
+
+	while ((pRing = g_pLogRings) != NULL)
+	{
+		g_pLogRings = pRing->pNext;
+		HeapFree(GetProcessHeap(), 0, pRing);
+	}
+	t_pLogRing = NULL;
+	DeleteCriticalSection(&g_csLogRings);
+}
+
+VOID LogReleaseThread()
+{
+
+	if (t_pLogRing)
+	{
+		MemoryBarrier();
+		t_pLogRing->lOwned = FALSE;
+		t_pLogRing = NULL;
+	}
+}
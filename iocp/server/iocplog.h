@@ -0,0 +1,80 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Module:
+//      iocplog.h
+//
+// Abstract:
+//      Asynchronous logger used by the server and the client in place of a
+//      synchronous printf.
+//
+//      LogPrintf first checks the record's level against g_dwLogLevel, so a
+//      disabled record costs one compare.  An enabled one is not formatted on
+//      the calling thread: the format string pointer and the raw arguments
+//      (strings by value) are copied into a ring buffer owned by that thread.
+//      A flusher thread drains all the rings every LOG_FLUSH_INTERVAL ms,
+//      formats the records and writes them to the console in one call per
+//      pass.  Each ring has a single producer and a single consumer, so
+//      neither side takes a lock.
+//
+//      A record that does not fit in its ring is dropped and counted rather
+//      than waited for; the flusher reports how many were lost.  Records from
+//      different threads are written in the order the flusher finds them, not
+//      strictly in time order.  Before LogInitialize and after LogShutdown
+//      records are formatted and written right away.
+//
+//      Format strings must outlive the call (string literals) and use the
+//      conversions d i u o x X c s p e E f g G, with h, l, ll, z or I64 sizes
+//      and * widths; anything else is formatted on the calling thread.
+//
+
+#ifndef IOCPLOG_H
+#define IOCPLOG_H
+
+#include "iocpcompat.h"
+
+#define LOG_RING_SIZE       (64 * 1024)     // per thread, power of 2
+#define LOG_MAX_RECORD      512             // bytes per record, and per formatted line
+#define LOG_FLUSH_INTERVAL  10              // milliseconds between flusher passes
+
+typedef enum _LOG_LEVEL {
+    LOG_ERROR,          // failures
+    LOG_INFO,           // startup, shutdown and statistics (default)
+    LOG_VERBOSE,        // every connection and operation (-v)
+    LOG_LEVELS
+} LOG_LEVEL;
+
+extern volatile DWORD g_dwLogLevel;
+
+#define LogPrintf(dwLevel, ...) \
+    ((DWORD)(dwLevel) <= g_dwLogLevel ? LogWrite((dwLevel), __VA_ARGS__) : (VOID)0)
+
+VOID LogWrite(
+    DWORD dwLevel,
+    const char *lpFormat,
+    ...
+    );
+
+//
+// start the flusher thread; until then records are written synchronously
+//
+BOOL LogInitialize(
+    );
+
+//
+// write out whatever is still queued and stop the flusher; called once the
+// other threads have exited
+//
+VOID LogShutdown(
+    );
+
+//
+// hand the calling thread's ring over to the next thread that logs; called by
+// threads that exit while the logger lives on
+//
+VOID LogReleaseThread(
+    );
+
+#endif
@@ -0,0 +1,105 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Module:
+//      iocppipe.cpp
+//
+// Abstract:
+//      Per-thread pools of the pipes connections splice their echo through.
+//      See iocppipe.h.
+//
+
+#include "iocpserver.h"
+#include "iocppipe.h"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#endif
+
+//
+// per-thread private free list
+//
+static thread_local PSPLICE_PIPE t_pPipeFree = NULL;
+static thread_local DWORD t_dwPipeFree = 0;
+
+static VOID PipeClose(PSPLICE_PIPE pPipe)
+{
+
+#ifdef __linux__
+	close(pPipe->fdRead);
+	close(pPipe->fdWrite);
+#endif
+	HeapFree(GetProcessHeap(), 0, pPipe);
+}
+
+//
+// Take a pipe off the calling thread's free list, or create one.
+//
+PSPLICE_PIPE PipeAlloc()
+{
+
+#ifdef __linux__
+	PSPLICE_PIPE pPipe = t_pPipeFree;
+	int fdPipe[2];
+
+	if (pPipe)
+	{
+		t_pPipeFree = pPipe->pNext;
+		t_dwPipeFree--;
+		return (pPipe);
+	}
+
+	pPipe = (PSPLICE_PIPE)HeapAlloc(GetProcessHeap(), 0, sizeof(SPLICE_PIPE));
+	if (pPipe == NULL)
+		return (NULL);
+	if (pipe2(fdPipe, O_NONBLOCK | O_CLOEXEC) != 0)
+	{
+		LogPrintf(LOG_ERROR, "pipe2() failed: %d\n", errno);
+		HeapFree(GetProcessHeap(), 0, pPipe);
+		return (NULL);
+	}
+	pPipe->fdRead = fdPipe[0];
+	pPipe->fdWrite = fdPipe[1];
+	pPipe->pNext = NULL;
+	return (pPipe);
+#else
+	return (NULL);
+#endif
+}
+
+//
+// Give a pipe back to the calling thread's free list, unless data was left in
+// it or the list is full.
+//
+VOID PipeFree(PSPLICE_PIPE pPipe)
+{
+
+#ifdef __linux__
+	int nPending = 0;
+
+	if (t_dwPipeFree < PIPE_CACHE_MAX && ioctl(pPipe->fdRead, FIONREAD, &nPending) == 0 && nPending == 0)
+	{
+		pPipe->pNext = t_pPipeFree;
+		t_pPipeFree = pPipe;
+		t_dwPipeFree++;
+		return;
+	}
+#endif
+	PipeClose(pPipe);
+}
+
+VOID PipePoolFlushThread()
+{
+
+	PSPLICE_PIPE pPipe = NULL;
+
+	while ((pPipe = t_pPipeFree) != NULL)
+	{
+		t_pPipeFree = pPipe->pNext;
+		PipeClose(pPipe);
+	}
+	t_dwPipeFree = 0;
+}
@@ -0,0 +1,51 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Module:
+//      iocppipe.h
+//
+// Abstract:
+//      Pipes for the splice echo mode (Linux).  A connection that echoes with
+//      splice moves the data from its socket into a pipe and from the pipe back
+//      out to the socket, so the bytes stay in kernel pages and never reach a
+//      user buffer.
+//
+//      Creating a pipe is a system call and closing it another, so pipes are
+//      recycled: every thread keeps a private free list of up to PIPE_CACHE_MAX
+//      of them, with no lock, and only calls pipe2 when it runs empty.  A pipe
+//      is taken by the worker that accepts a connection and given back by the
+//      one that frees it, and goes back on the list only if it is empty;
+//      otherwise (the connection closed with data in flight) it is closed.
+//
+//      Elsewhere PipeAlloc always fails, and connections echo through buffers.
+//
+
+#ifndef IOCPPIPE_H
+#define IOCPPIPE_H
+
+#include "iocpcompat.h"
+
+#define PIPE_CACHE_MAX          256     // free pipes a thread keeps
+
+typedef struct _SPLICE_PIPE {
+    int                         fdRead;
+    int                         fdWrite;
+    struct _SPLICE_PIPE         *pNext;     // free list link while the pipe is free
+} SPLICE_PIPE, *PSPLICE_PIPE;
+
+PSPLICE_PIPE PipeAlloc(
+    );
+
+VOID PipeFree(
+    PSPLICE_PIPE pPipe
+    );
+
+//
+// close the calling thread's free pipes; called by threads that exit
+//
+VOID PipePoolFlushThread(
+    );
+
+#endif
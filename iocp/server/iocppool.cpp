@@ -0,0 +1,394 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Module:
+//      iocppool.cpp
+//
+// Abstract:
+//      Per-thread cached, lock-free object pools for the socket and I/O contexts
+//      and the data buffers.  See iocppool.h.
+//
+
+#include <stddef.h>
+
+#include "iocpserver.h"
+#include "iocppool.h"
+
+#define CTXT_SLOT_ALIGN 64
+
+CTXT_POOL g_SocketContextPool;
+CTXT_POOL g_IoContextPool;
+CTXT_POOL g_BufferPool;
+static CTXT_POOL g_BufferClassPools[BUFFER_CLASSES]; // all but the default class's
+PCTXT_POOL g_pBufferPools[BUFFER_CLASSES];
+
+static const char *g_szBufferClasses[BUFFER_CLASSES] = {"2K buffer", "4K buffer", "buffer", "16K buffer",
+														 "32K buffer", "64K buffer", "128K buffer", "256K buffer"};
+
+static_assert(BUFFER_CLASS_SIZE(BUFFER_CLASS_DEFAULT) == MAX_BUFF_SIZE, "g_BufferPool is not the default class");
+
+//
+// per-thread private free lists, one per pool
+//
+typedef struct _CTXT_CACHE {
+	DWORD dwHead;
+	DWORD dwCount;
+} CTXT_CACHE;
+
+#define CTXT_CACHE_EMPTY {CTXT_POOL_NONE, 0}
+
+static_assert(CtxtPoolKinds == 11, "t_Cache needs one empty list per pool kind");
+static thread_local CTXT_CACHE t_Cache[CtxtPoolKinds] = {CTXT_CACHE_EMPTY, CTXT_CACHE_EMPTY, CTXT_CACHE_EMPTY,
+														 CTXT_CACHE_EMPTY, CTXT_CACHE_EMPTY, CTXT_CACHE_EMPTY,
+														 CTXT_CACHE_EMPTY, CTXT_CACHE_EMPTY, CTXT_CACHE_EMPTY,
+														 CTXT_CACHE_EMPTY, CTXT_CACHE_EMPTY};
+static thread_local DWORD t_dwCacheMax = CTXT_CACHE_MAX;
+
+static inline PCTXT_SLOT CtxtPoolSlot(PCTXT_POOL pPool, DWORD dwIndex)
+{
+
+	return ((PCTXT_SLOT)(pPool->pChunks[dwIndex / pPool->dwChunkSlots] +
+						 (size_t)(dwIndex % pPool->dwChunkSlots) * pPool->dwSlotSize));
+}
+
+//
+// the pool a kind of per-thread cache belongs to, NULL for the default buffer
+// class's kind, which g_BufferPool's CtxtPoolBuffer stands for
+//
+static PCTXT_POOL CtxtPoolOfKind(int Kind)
+{
+
+	switch (Kind)
+	{
+	case CtxtPoolSocket:
+		return (&g_SocketContextPool);
+	case CtxtPoolIo:
+		return (&g_IoContextPool);
+	case CtxtPoolBuffer:
+		return (&g_BufferPool);
+	default:
+		if (Kind - CtxtPoolBufferClass == BUFFER_CLASS_DEFAULT)
+			return (NULL);
+		return (&g_BufferClassPools[Kind - CtxtPoolBufferClass]);
+	}
+}
+
+static inline LPVOID CtxtPoolSlotObject(PCTXT_SLOT pSlot)
+{
+
+	return ((char *)pSlot + CTXT_SLOT_ALIGN);
+}
+
+static inline PCTXT_SLOT CtxtPoolObjectSlot(LPVOID pObject)
+{
+
+	return ((PCTXT_SLOT)((char *)pObject - CTXT_SLOT_ALIGN));
+}
+
+//
+// Push the chain dwFirst..pLast onto the pool-wide free stack.
+//
+static VOID CtxtPoolPush(PCTXT_POOL pPool, DWORD dwFirst, PCTXT_SLOT pLast)
+{
+
+	LONG64 llOld, llNew;
+
+	do
+	{
+		llOld = pPool->llFree;
+		pLast->dwNext = (DWORD)(llOld & 0xFFFFFFFF);
+		llNew = (LONG64)((((unsigned long long)llOld >> 32) + 1) << 32) | dwFirst;
+	} while (InterlockedCompareExchange64(&pPool->llFree, llNew, llOld) != llOld);
+}
+
+//
+// Pop one slot off the pool-wide free stack.  Reading dwNext of a slot that
+// another thread pops and reuses concurrently is harmless: the tag changes and
+// the compare-exchange fails.  Chunks are never freed while the pool is live.
+//
+static DWORD CtxtPoolPop(PCTXT_POOL pPool)
+{
+
+	LONG64 llOld, llNew;
+	DWORD dwIndex;
+
+	do
+	{
+		llOld = pPool->llFree;
+		dwIndex = (DWORD)(llOld & 0xFFFFFFFF);
+		if (dwIndex == CTXT_POOL_NONE)
+			return (CTXT_POOL_NONE);
+		llNew = (LONG64)((((unsigned long long)llOld >> 32) + 1) << 32) |
+				CtxtPoolSlot(pPool, dwIndex)->dwNext;
+	} while (InterlockedCompareExchange64(&pPool->llFree, llNew, llOld) != llOld);
+
+	return (dwIndex);
+}
+
+//
+// Allocate one more chunk and put its slots on the calling thread's free list
+// (bLocal) or on the pool-wide list.
+//
+static BOOL CtxtPoolGrow(PCTXT_POOL pPool, BOOL bLocal)
+{
+
+	CTXT_CACHE *pCache = &t_Cache[pPool->Kind];
+	DWORD dwChunk = 0;
+	DWORD dwFirst = 0;
+	char *pChunk = NULL;
+
+	EnterCriticalSection(&pPool->csGrow);
+	dwChunk = (DWORD)pPool->lChunks;
+	if (dwChunk >= CTXT_POOL_MAX_CHUNKS)
+	{
+		LeaveCriticalSection(&pPool->csGrow);
+		LogPrintf(LOG_ERROR, "%s pool exhausted\n", pPool->szName);
+		return (FALSE);
+	}
+
+	//
+	// Zeroing the chunk up front also faults its pages in now rather than on
+	// the first connections that use them.
+	//
+	pChunk = (char *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY,
+							   (size_t)pPool->dwChunkSlots * pPool->dwSlotSize + CTXT_SLOT_ALIGN);
+	if (pChunk == NULL)
+	{
+		LeaveCriticalSection(&pPool->csGrow);
+		LogPrintf(LOG_ERROR, "HeapAlloc() %s chunk failed: %d\n", pPool->szName, GetLastError());
+		return (FALSE);
+	}
+	pPool->pChunks[dwChunk] = (char *)(((DWORD_PTR)pChunk + CTXT_SLOT_ALIGN - 1) & ~(DWORD_PTR)(CTXT_SLOT_ALIGN - 1));
+	dwFirst = dwChunk * pPool->dwChunkSlots;
+	for (DWORD i = 0; i < pPool->dwChunkSlots; i++)
+	{
+		PCTXT_SLOT pSlot = CtxtPoolSlot(pPool, dwFirst + i);
+
+		pSlot->dwIndex = dwFirst + i;
+		pSlot->dwNext = (i + 1 < pPool->dwChunkSlots) ? dwFirst + i + 1 : CTXT_POOL_NONE;
+	}
+
+	//
+	// keep the unaligned base in the spare space before the first slot header
+	// so CtxtPoolDestroy can free it
+	//
+	*(char **)(pPool->pChunks[dwChunk] + CTXT_SLOT_ALIGN - sizeof(char *)) = pChunk;
+	InterlockedIncrement(&pPool->lChunks);
+	LeaveCriticalSection(&pPool->csGrow);
+
+	if (bLocal)
+	{
+		CtxtPoolSlot(pPool, dwFirst + pPool->dwChunkSlots - 1)->dwNext = pCache->dwHead;
+		pCache->dwHead = dwFirst;
+		pCache->dwCount += pPool->dwChunkSlots;
+	}
+	else
+		CtxtPoolPush(pPool, dwFirst, CtxtPoolSlot(pPool, dwFirst + pPool->dwChunkSlots - 1));
+	return (TRUE);
+}
+
+static VOID CtxtPoolInit(PCTXT_POOL pPool, const char *szName, CTXT_POOL_KIND Kind, size_t dwObjectSize)
+{
+
+	ZeroMemory(pPool, sizeof(CTXT_POOL));
+	pPool->szName = szName;
+	pPool->Kind = Kind;
+	pPool->dwSlotSize = (DWORD)((CTXT_SLOT_ALIGN + dwObjectSize + CTXT_SLOT_ALIGN - 1) & ~(size_t)(CTXT_SLOT_ALIGN - 1));
+	pPool->dwChunkSlots = CTXT_POOL_CHUNK_BYTES / pPool->dwSlotSize;
+	if (pPool->dwChunkSlots > CTXT_POOL_CHUNK)
+		pPool->dwChunkSlots = CTXT_POOL_CHUNK;
+	pPool->dwCacheMax = pPool->dwChunkSlots < CTXT_CACHE_MAX ? pPool->dwChunkSlots : 0xFFFFFFFF;
+	pPool->llFree = CTXT_POOL_NONE;
+	InitializeCriticalSection(&pPool->csGrow);
+}
+
+//
+// Create the pools with room for dwPreallocate connections and dwBuffers data
+// buffers.  The chunk slots are laid out so that slot headers never share the
+// first cache line of an object, hence the extra CTXT_SLOT_ALIGN bytes per slot.
+//
+BOOL CtxtPoolCreate(DWORD dwPreallocate, DWORD dwBuffers)
+{
+
+	DWORD dwChunks = (dwPreallocate + CTXT_POOL_CHUNK - 1) / CTXT_POOL_CHUNK;
+	DWORD dwBufferChunks = (dwBuffers + CTXT_POOL_CHUNK - 1) / CTXT_POOL_CHUNK;
+
+	CtxtPoolInit(&g_SocketContextPool, "PER_SOCKET_CONTEXT", CtxtPoolSocket, sizeof(PER_SOCKET_CONTEXT));
+	CtxtPoolInit(&g_IoContextPool, "PER_IO_CONTEXT", CtxtPoolIo, sizeof(PER_IO_CONTEXT));
+	CtxtPoolInit(&g_BufferPool, g_szBufferClasses[BUFFER_CLASS_DEFAULT], CtxtPoolBuffer, MAX_BUFF_SIZE);
+	for (DWORD i = 0; i < BUFFER_CLASSES; i++)
+	{
+		if (i == BUFFER_CLASS_DEFAULT)
+			g_pBufferPools[i] = &g_BufferPool;
+		else
+		{
+			CtxtPoolInit(&g_BufferClassPools[i], g_szBufferClasses[i], (CTXT_POOL_KIND)(CtxtPoolBufferClass + i),
+						 BUFFER_CLASS_SIZE(i));
+			g_pBufferPools[i] = &g_BufferClassPools[i];
+		}
+	}
+
+	for (DWORD i = 0; i < dwChunks || i < dwBufferChunks; i++)
+	{
+		if ((i < dwChunks && (!CtxtPoolGrow(&g_SocketContextPool, FALSE) || !CtxtPoolGrow(&g_IoContextPool, FALSE))) ||
+			(i < dwBufferChunks && !CtxtPoolGrow(&g_BufferPool, FALSE)))
+		{
+			CtxtPoolDestroy();
+			return (FALSE);
+		}
+	}
+	return (TRUE);
+}
+
+VOID CtxtPoolDestroy()
+{
+
+	PCTXT_POOL pPool = NULL;
+
+	for (int i = 0; i < CtxtPoolKinds; i++)
+	{
+		if ((pPool = CtxtPoolOfKind(i)) == NULL)
+			continue;
+		for (LONG j = 0; j < pPool->lChunks; j++)
+			HeapFree(GetProcessHeap(), 0, *(char **)(pPool->pChunks[j] + CTXT_SLOT_ALIGN - sizeof(char *)));
+		DeleteCriticalSection(&pPool->csGrow);
+		pPool->lChunks = 0;
+		pPool->llFree = CTXT_POOL_NONE;
+		t_Cache[i].dwHead = CTXT_POOL_NONE;
+		t_Cache[i].dwCount = 0;
+	}
+}
+
+LPVOID CtxtPoolAlloc(PCTXT_POOL pPool)
+{
+
+	CTXT_CACHE *pCache = &t_Cache[pPool->Kind];
+	PCTXT_SLOT pSlot = NULL;
+	DWORD dwIndex = 0;
+
+	if (pCache->dwCount == 0)
+	{
+
+		//
+		// refill the private list from the pool-wide list, growing the pool
+		// only when that is empty too
+		//
+		while (pCache->dwCount < CTXT_CACHE_REFILL && pCache->dwCount < pPool->dwCacheMax / 2 &&
+			   (dwIndex = CtxtPoolPop(pPool)) != CTXT_POOL_NONE)
+		{
+			CtxtPoolSlot(pPool, dwIndex)->dwNext = pCache->dwHead;
+			pCache->dwHead = dwIndex;
+			pCache->dwCount++;
+		}
+		if (pCache->dwCount == 0 && !CtxtPoolGrow(pPool, TRUE))
+			return (NULL);
+	}
+
+	pSlot = CtxtPoolSlot(pPool, pCache->dwHead);
+	pCache->dwHead = pSlot->dwNext;
+	pCache->dwCount--;
+	return (CtxtPoolSlotObject(pSlot));
+}
+
+VOID CtxtPoolFree(PCTXT_POOL pPool, LPVOID pObject)
+{
+
+	CTXT_CACHE *pCache = &t_Cache[pPool->Kind];
+	PCTXT_SLOT pSlot = CtxtPoolObjectSlot(pObject);
+	PCTXT_SLOT pLast = NULL;
+	DWORD dwFirst = 0;
+	DWORD dwCacheMax = t_dwCacheMax < pPool->dwCacheMax ? t_dwCacheMax : pPool->dwCacheMax;
+
+	pSlot->dwNext = pCache->dwHead;
+	pCache->dwHead = pSlot->dwIndex;
+	pCache->dwCount++;
+
+	if (pCache->dwCount > dwCacheMax)
+	{
+
+		//
+		// Connections are accepted on one thread and closed on another, so a
+		// thread that mostly closes would hoard slots; give half back.
+		//
+		dwFirst = pCache->dwHead;
+		pLast = CtxtPoolSlot(pPool, dwFirst);
+		for (DWORD i = 1; i < dwCacheMax / 2; i++)
+			pLast = CtxtPoolSlot(pPool, pLast->dwNext);
+		pCache->dwHead = pLast->dwNext;
+		pCache->dwCount -= dwCacheMax / 2;
+		CtxtPoolPush(pPool, dwFirst, pLast);
+	}
+}
+
+VOID CtxtPoolSetThreadCacheMax(DWORD dwCacheMax)
+{
+
+	t_dwCacheMax = (dwCacheMax < CTXT_CACHE_MAX) ? CTXT_CACHE_MAX : dwCacheMax;
+}
+
+VOID CtxtPoolFlushThread()
+{
+
+	for (int i = 0; i < CtxtPoolKinds; i++)
+	{
+		CTXT_CACHE *pCache = &t_Cache[i];
+		PCTXT_POOL pPool = CtxtPoolOfKind(i);
+		PCTXT_SLOT pLast = NULL;
+
+		if (pCache->dwCount == 0)
+			continue;
+		pLast = CtxtPoolSlot(pPool, pCache->dwHead);
+		while (pLast->dwNext != CTXT_POOL_NONE)
+			pLast = CtxtPoolSlot(pPool, pLast->dwNext);
+		CtxtPoolPush(pPool, pCache->dwHead, pLast);
+		pCache->dwHead = CTXT_POOL_NONE;
+		pCache->dwCount = 0;
+	}
+}
+
+DWORD CtxtPoolIndex(LPVOID pObject)
+{
+
+	return (CtxtPoolObjectSlot(pObject)->dwIndex);
+}
+
+LPVOID CtxtPoolObject(PCTXT_POOL pPool, DWORD dwIndex)
+{
+
+	if (dwIndex / pPool->dwChunkSlots >= (DWORD)pPool->lChunks)
+		return (NULL);
+	return (CtxtPoolSlotObject(CtxtPoolSlot(pPool, dwIndex)));
+}
+
+DWORD BufferClass(DWORD cbSize)
+{
+
+	DWORD dwClass = 0;
+
+	while (dwClass + 1 < BUFFER_CLASSES && BUFFER_CLASS_SIZE(dwClass) < cbSize)
+		dwClass++;
+	return (dwClass);
+}
+
+BOOL BufferClassReserve(DWORD dwClass, DWORD dwBuffers)
+{
+
+	PCTXT_POOL pPool = g_pBufferPools[dwClass];
+
+	while ((DWORD)pPool->lChunks * pPool->dwChunkSlots < dwBuffers)
+	{
+		if (!CtxtPoolGrow(pPool, FALSE))
+			return (FALSE);
+	}
+	return (TRUE);
+}
+
+DWORD BufferClassCapacity(DWORD dwClass)
+{
+
+	if (g_pBufferPools[dwClass] == NULL)
+		return (0);
+	return ((DWORD)g_pBufferPools[dwClass]->lChunks * g_pBufferPools[dwClass]->dwChunkSlots);
+}
@@ -0,0 +1,155 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Module:
+//      iocppool.h
+//
+// Abstract:
+//      Fixed-size object pools for PER_SOCKET_CONTEXT, PER_IO_CONTEXT and the
+//      data buffers the I/O contexts point at, one pool per buffer size class
+//      (2 KB doubling up to 256 KB).  g_BufferPool is the MAX_BUFF_SIZE class.
+//
+//      Slots are carved out of large chunks that are allocated up front (and
+//      only grown, never released, if a pool runs dry) so accepting and closing
+//      connections never touches the process heap.  Every thread keeps a small
+//      private free list; it only reaches for the pool-wide free list, a
+//      lock-free stack with an ABA tag, when its own list runs empty or grows
+//      past CTXT_CACHE_MAX (or the limit the thread set for itself).  Slots
+//      keep a stable index for the life of the process, which doubles as a
+//      connection id.
+//
+//      Chunks hold CTXT_POOL_CHUNK slots, or as many as fit in
+//      CTXT_POOL_CHUNK_BYTES for the larger buffer classes, which also cache
+//      no more than a chunk's worth per thread.
+//
+//      Objects handed out by CtxtPoolAlloc are NOT zeroed; callers initialize
+//      the fields they use (in particular the I/O data buffer is left as is).
+//
+
+#ifndef IOCPPOOL_H
+#define IOCPPOOL_H
+
+#include "iocpcompat.h"
+
+#define CTXT_POOL_CHUNK         1024    // slots per chunk
+#define CTXT_POOL_CHUNK_BYTES   (16 * 1024 * 1024)  // but no more than this per chunk
+#define CTXT_POOL_MAX_CHUNKS    4096    // at most 4M slots per pool
+#define CTXT_CACHE_MAX          256     // per-thread free slots before giving half back
+#define CTXT_CACHE_REFILL       32      // slots taken from the pool-wide list at once
+#define CTXT_POOL_NONE          0xFFFFFFFF
+
+#define BUFFER_CLASSES          8       // 2 KB, 4 KB, ... 256 KB
+#define BUFFER_CLASS_MIN_SIZE   2048
+#define BUFFER_CLASS_DEFAULT    2       // MAX_BUFF_SIZE, g_BufferPool's
+#define BUFFER_CLASS_SIZE(c)    ((DWORD)BUFFER_CLASS_MIN_SIZE << (c))
+
+//
+// pool kinds index the per-thread caches; buffer class c is
+// CtxtPoolBufferClass + c, except the default class, which is CtxtPoolBuffer
+//
+typedef enum _CTXT_POOL_KIND {
+    CtxtPoolSocket,
+    CtxtPoolIo,
+    CtxtPoolBuffer,
+    CtxtPoolBufferClass,
+    CtxtPoolKinds = CtxtPoolBufferClass + BUFFER_CLASSES
+} CTXT_POOL_KIND;
+
+//
+// header in front of every slot
+//
+typedef struct _CTXT_SLOT {
+    DWORD                       dwIndex;
+    DWORD                       dwNext;     // free list link while the slot is free
+} CTXT_SLOT, *PCTXT_SLOT;
+
+typedef struct _CTXT_POOL {
+    const char                  *szName;
+    CTXT_POOL_KIND              Kind;
+    DWORD                       dwSlotSize;     // header + object, cache line aligned
+    DWORD                       dwChunkSlots;
+    DWORD                       dwCacheMax;     // per thread, at most
+    volatile LONG               lChunks;
+    volatile LONG64             llFree;         // slot index (low 32 bits) | ABA tag
+    CRITICAL_SECTION            csGrow;         // serializes chunk allocation only
+    char                        *pChunks[CTXT_POOL_MAX_CHUNKS];
+} CTXT_POOL, *PCTXT_POOL;
+
+extern CTXT_POOL g_SocketContextPool;
+extern CTXT_POOL g_IoContextPool;
+extern CTXT_POOL g_BufferPool;
+extern PCTXT_POOL g_pBufferPools[BUFFER_CLASSES];  // by size class
+
+//
+// dwPreallocate connections (one socket and one I/O context each) and
+// dwBuffers data buffers are allocated up front
+//
+BOOL CtxtPoolCreate(
+    DWORD dwPreallocate,
+    DWORD dwBuffers
+    );
+
+VOID CtxtPoolDestroy(
+    );
+
+LPVOID CtxtPoolAlloc(
+    PCTXT_POOL pPool
+    );
+
+VOID CtxtPoolFree(
+    PCTXT_POOL pPool,
+    LPVOID pObject
+    );
+
+//
+// let the calling thread keep up to dwCacheMax free slots of each pool (at
+// least CTXT_CACHE_MAX) before it gives any back.  A reactor that accepts,
+// serves and closes its own connections sets it to its share of the pool, so
+// the slots it frees stay its own.
+//
+VOID CtxtPoolSetThreadCacheMax(
+    DWORD dwCacheMax
+    );
+
+//
+// return the calling thread's cached slots to the pool-wide lists; called by
+// threads that exit while the pools live on
+//
+VOID CtxtPoolFlushThread(
+    );
+
+DWORD CtxtPoolIndex(
+    LPVOID pObject
+    );
+
+LPVOID CtxtPoolObject(
+    PCTXT_POOL pPool,
+    DWORD dwIndex
+    );
+
+//
+// the smallest buffer class that holds cbSize bytes (the largest class if none
+// does)
+//
+DWORD BufferClass(
+    DWORD cbSize
+    );
+
+//
+// allocate room for dwBuffers buffers of class dwClass up front
+//
+BOOL BufferClassReserve(
+    DWORD dwClass,
+    DWORD dwBuffers
+    );
+
+//
+// buffers of class dwClass the pool holds, in use or free
+//
+DWORD BufferClassCapacity(
+    DWORD dwClass
+    );
+
+#endif
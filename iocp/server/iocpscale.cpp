@@ -0,0 +1,280 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Module:
+//      iocpscale.cpp
+//
+// Abstract:
+//      Worker pool controller.  See iocpscale.h.
+//
+
+#include "iocpserver.h"
+#include "iocpcq.h"
+#include "iocpstats.h"
+#include "iocpscale.h"
+
+BOOL g_bScale = FALSE;
+DWORD g_dwScaleMin = 1;
+DWORD g_dwScaleMax = 0; // 0 for the thread count
+DWORD g_dwScaleTarget = 0;
+BOOL g_bScaleShared = FALSE;
+volatile LONG g_lScaleActive = 0x7fffffff;
+
+typedef struct _SCALE_CONTROL {
+	WSAEVENT *phPark; // per worker, set while it is active
+	DWORD dwWorkers;
+	HANDLE hThread;
+	volatile BOOL bStop;
+	volatile LONG lNextShard;
+	DWORD dwQuiet;	   // quiet samples in a row
+	LONG64 llGrows;	   // times workers were added
+	LONG64 llParks;	   // times one was parked
+	LONG64 llSamples;
+	LONG64 llActiveSum; // of the active count at each sample, for the average
+	LONG64 llLast;		// timestamp of the last sample
+	LONG64 *pllWaitLast; // per worker, its wait and poll ticks at the last sample
+	LONG64 llCompletionsLast;
+	LONG64 llDequeuesLast;
+} SCALE_CONTROL, *PSCALE_CONTROL;
+
+static SCALE_CONTROL g_Scale;
+
+//
+// totals at the last sample and now, for the latency of the interval between
+//
+static WORKER_STATS g_ScaleThen;
+static WORKER_STATS g_ScaleNow;
+
+BOOL ScaleCreate(DWORD dwWorkers)
+{
+
+	ZeroMemory(&g_Scale, sizeof(g_Scale));
+	g_Scale.phPark = (WSAEVENT *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, dwWorkers * sizeof(WSAEVENT));
+	g_Scale.pllWaitLast = (LONG64 *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, dwWorkers * sizeof(LONG64));
+	if (g_Scale.phPark == NULL || g_Scale.pllWaitLast == NULL)
+	{
+		ScaleDestroy();
+		return (FALSE);
+	}
+	for (g_Scale.dwWorkers = 0; g_Scale.dwWorkers < dwWorkers; g_Scale.dwWorkers++)
+	{
+		g_Scale.phPark[g_Scale.dwWorkers] = WSACreateEvent();
+		if (g_Scale.phPark[g_Scale.dwWorkers] == WSA_INVALID_EVENT)
+		{
+			LogPrintf(LOG_ERROR, "WSACreateEvent() failed: %d\n", WSAGetLastError());
+			ScaleDestroy();
+			return (FALSE);
+		}
+		WSASetEvent(g_Scale.phPark[g_Scale.dwWorkers]);
+	}
+	return (TRUE);
+}
+
+VOID ScaleDestroy()
+{
+
+	while (g_Scale.phPark && g_Scale.dwWorkers)
+		WSACloseEvent(g_Scale.phPark[--g_Scale.dwWorkers]);
+	if (g_Scale.phPark)
+		HeapFree(GetProcessHeap(), 0, g_Scale.phPark);
+	if (g_Scale.pllWaitLast)
+		HeapFree(GetProcessHeap(), 0, g_Scale.pllWaitLast);
+	g_Scale.phPark = NULL;
+	g_Scale.pllWaitLast = NULL;
+	return;
+}
+
+//
+// make the first lActive workers the active ones
+//
+static VOID ScaleSetActive(LONG lActive)
+{
+
+	LONG lOld = g_lScaleActive;
+
+	//
+	// a worker's event is reset before it counts as parked and set after it
+	// counts as active, so a worker that finds itself parked and waits
+	// sleeps until it is active again
+	//
+	for (LONG i = lActive; i < lOld && i < (LONG)g_Scale.dwWorkers; i++)
+		WSAResetEvent(g_Scale.phPark[i]);
+	g_lScaleActive = lActive;
+	MemoryBarrier();
+	for (LONG i = lOld; i < lActive && i < (LONG)g_Scale.dwWorkers; i++)
+		WSASetEvent(g_Scale.phPark[i]);
+	return;
+}
+
+//
+// Take a sample and move the active count: up by half again under load, down
+// by one after SCALE_PARK_INTERVALS quiet samples.
+//
+static VOID ScaleSample(double dTicksPerUs)
+{
+
+	LONG lActive = g_lScaleActive;
+	LONG64 llNow = StatsTimestamp();
+	LONG64 llElapsed = llNow - g_Scale.llLast;
+	LONG64 llCompletions = 0;
+	LONG64 llDequeues = 0;
+	LONG64 llWait = 0;
+	LONG64 llIdle = 0;
+	LONG64 llLatencies = 0;
+	DWORD dwBusy = 0;
+	DWORD dwFill = 0;
+	double dP99 = 0;
+	BOOL bLoaded = FALSE;
+	BOOL bQuiet = FALSE;
+
+	for (DWORD i = 0; i < g_Scale.dwWorkers; i++)
+	{
+		llWait = g_pWorkerStats[i].llWaitTicks + g_pWorkerStats[i].llSpinTicks;
+		if ((LONG)i < lActive)
+			llIdle += llWait - g_Scale.pllWaitLast[i];
+		g_Scale.pllWaitLast[i] = llWait;
+		llCompletions += g_pCqStats[i].llCompletions;
+		llDequeues += g_pCqStats[i].llDequeues;
+	}
+	if (llElapsed > 0)
+	{
+		llIdle = llIdle < llElapsed * lActive ? llIdle : llElapsed * lActive;
+		dwBusy = (DWORD)(100 - llIdle * 100 / (llElapsed * lActive));
+	}
+	if (llDequeues > g_Scale.llDequeuesLast)
+		dwFill = (DWORD)((llCompletions - g_Scale.llCompletionsLast) * 100 /
+						 ((llDequeues - g_Scale.llDequeuesLast) * g_dwCompletionBatch));
+	g_Scale.llCompletionsLast = llCompletions;
+	g_Scale.llDequeuesLast = llDequeues;
+	g_Scale.llLast = llNow;
+
+	StatsTotal(&g_ScaleNow);
+	for (DWORD i = 0; i < STATS_HIST_BUCKETS; i++)
+		llLatencies += g_ScaleNow.llHistogram[i] - g_ScaleThen.llHistogram[i];
+	if (llLatencies >= SCALE_MIN_LATENCIES)
+		dP99 = StatsPercentileSince(&g_ScaleNow, &g_ScaleThen, 0.99) / dTicksPerUs;
+	CopyMemory(&g_ScaleThen, &g_ScaleNow, sizeof(WORKER_STATS));
+
+	bLoaded = dwBusy >= SCALE_BUSY_HIGH || dwFill >= SCALE_FILL_HIGH ||
+			  (g_dwScaleTarget && dP99 > g_dwScaleTarget);
+	bQuiet = dwBusy < SCALE_BUSY_LOW && dwFill < SCALE_FILL_LOW &&
+			 (g_dwScaleTarget == 0 || dP99 < g_dwScaleTarget / 2);
+	g_Scale.llSamples++;
+	g_Scale.llActiveSum += lActive;
+
+	if (bLoaded && lActive < (LONG)g_dwScaleMax)
+	{
+		g_Scale.dwQuiet = 0;
+		g_Scale.llGrows++;
+		ScaleSetActive(lActive + (lActive / 2 ? lActive / 2 : 1) < (LONG)g_dwScaleMax
+						   ? lActive + (lActive / 2 ? lActive / 2 : 1)
+						   : (LONG)g_dwScaleMax);
+	}
+	else if (bQuiet && lActive > (LONG)g_dwScaleMin)
+	{
+		if (++g_Scale.dwQuiet < SCALE_PARK_INTERVALS)
+			return;
+		g_Scale.dwQuiet = 0;
+		g_Scale.llParks++;
+		ScaleSetActive(lActive - 1);
+	}
+	else
+	{
+		g_Scale.dwQuiet = 0;
+		return;
+	}
+	LogPrintf(LOG_VERBOSE, "workers %d -> %d: busy %u%% fill %u%% p99 %.1f us\n", lActive, g_lScaleActive,
+			  dwBusy, dwFill, dP99);
+	return;
+}
+
+static DWORD WINAPI ScaleThread(LPVOID lpParameter)
+{
+
+	double dTicksPerUs = StatsTicksPerSecond() / 1e6;
+
+	UNREFERENCED_PARAMETER(lpParameter);
+	g_Scale.llLast = StatsTimestamp();
+	StatsTotal(&g_ScaleThen);
+	while (!g_Scale.bStop)
+	{
+		Sleep(SCALE_INTERVAL_MS);
+		ScaleSample(dTicksPerUs);
+	}
+	LogReleaseThread();
+	return (0);
+}
+
+BOOL ScaleStart(BOOL bShared)
+{
+
+	DWORD dwThreadId = 0;
+	DWORD dwStart = 0;
+
+	//
+	// start with one worker per CPU, within the bounds
+	//
+	dwStart = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+	dwStart = dwStart < g_dwScaleMin ? g_dwScaleMin : dwStart > g_dwScaleMax ? g_dwScaleMax : dwStart;
+
+	g_bScaleShared = bShared;
+	g_Scale.bStop = FALSE;
+	g_Scale.dwQuiet = 0;
+	g_Scale.llGrows = g_Scale.llParks = g_Scale.llSamples = g_Scale.llActiveSum = 0;
+	g_Scale.llCompletionsLast = g_Scale.llDequeuesLast = 0;
+	ZeroMemory(g_Scale.pllWaitLast, g_Scale.dwWorkers * sizeof(LONG64));
+	g_lScaleActive = (LONG)g_Scale.dwWorkers;
+	ScaleSetActive((LONG)dwStart);
+
+	g_Scale.hThread = CreateThread(NULL, 0, ScaleThread, NULL, 0, &dwThreadId);
+	if (g_Scale.hThread == NULL)
+	{
+		LogPrintf(LOG_ERROR, "CreateThread() failed to create the worker controller: %d\n", GetLastError());
+		ScaleSetActive((LONG)g_Scale.dwWorkers);
+		return (FALSE);
+	}
+	LogPrintf(LOG_INFO, "Worker controller started: %u active of %u to %u, p99 target %u us\n", dwStart,
+			  g_dwScaleMin, g_dwScaleMax, g_dwScaleTarget);
+	return (TRUE);
+}
+
+VOID ScaleStop()
+{
+
+	if (g_Scale.hThread == NULL)
+		return;
+	g_Scale.bStop = TRUE;
+	WaitForMultipleObjects(1, &g_Scale.hThread, TRUE, INFINITE);
+	CloseHandle(g_Scale.hThread);
+	g_Scale.hThread = NULL;
+
+	LogPrintf(LOG_INFO, "workers: %d active at the end, %.1f on average, grown %lld times, parked %lld times\n",
+			  g_lScaleActive, g_Scale.llSamples ? (double)g_Scale.llActiveSum / g_Scale.llSamples : (double)g_lScaleActive,
+			  (long long)g_Scale.llGrows, (long long)g_Scale.llParks);
+	ScaleSetActive(0x7fffffff);
+	g_bScaleShared = FALSE;
+	return;
+}
+
+VOID ScaleWait(DWORD dwWorker, DWORD dwMilliseconds)
+{
+
+	LONG64 llStart = StatsTimestamp();
+
+	WSAWaitForMultipleEvents(1, &g_Scale.phPark[dwWorker], TRUE, dwMilliseconds, FALSE);
+	t_pWorkerStats->llWaitTicks += StatsTimestamp() - llStart;
+	return;
+}
+
+DWORD ScaleShard(DWORD dwShard)
+{
+
+	LONG lActive = g_lScaleActive;
+
+	if (!g_bScale || g_bScaleShared || lActive >= (LONG)g_Scale.dwWorkers ||
+		(dwShard != CQ_ANY_SHARD && (LONG)dwShard < lActive))
+		return (dwShard);
+	return ((DWORD)InterlockedIncrement(&g_Scale.lNextShard) % (DWORD)lActive);
+}
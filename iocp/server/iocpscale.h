@@ -0,0 +1,107 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Module:
+//      iocpscale.h
+//
+// Abstract:
+//      Worker pool controller (-n:min:max[:us]).  The server starts max
+//      workers; the controller keeps the first g_lScaleActive of them taking
+//      work and parks the rest, and moves that count between min and max.
+//
+//      Every SCALE_INTERVAL_MS a controller thread samples, since its last
+//      sample, how busy the active workers were (the share of their time not
+//      spent blocked in a dequeue, polling or parked), how full their dequeued
+//      batches were (a full batch means more was queued behind it) and the p99
+//      of the receive to send latency.  Busy workers, full batches or a p99
+//      above the target add workers, half again as many as are active, so a
+//      burst is met within an interval or two.  Idle workers with small
+//      batches and the p99 well under the target park one worker at a time,
+//      after SCALE_PARK_INTERVALS such samples in a row.
+//
+//      How a worker parks depends on the queue.  Where all workers share one
+//      (IOCP without -r), a parked worker stops dequeuing and waits on an event
+//      of its own, waking every timer tick to advance its timing wheel; the
+//      port's concurrency value (one per CPU) still caps how many of the active
+//      workers run at once, so the controller decides how many wait on the port
+//      and the port how many of those run.  Where every worker has a shard of
+//      its own (reactors, io_uring, epoll), a parked worker keeps serving the
+//      connections it already has, but new connections go to the active
+//      workers' shards, including those it accepts itself, so it falls idle as
+//      its connections close.
+//
+
+#ifndef IOCPSCALE_H
+#define IOCPSCALE_H
+
+#include "iocpcompat.h"
+
+#define SCALE_INTERVAL_MS       100     // between samples
+#define SCALE_PARK_INTERVALS    10      // quiet samples in a row before a worker is parked
+#define SCALE_BUSY_HIGH         75      // percent busy that adds workers
+#define SCALE_BUSY_LOW          25      // and below which they may be parked
+#define SCALE_FILL_HIGH         50      // percent of a dequeue batch that adds workers
+#define SCALE_FILL_LOW          10      // and below which they may be parked
+#define SCALE_MIN_LATENCIES     64      // fewer in a sample say nothing about the p99
+
+extern BOOL g_bScale;
+extern DWORD g_dwScaleMin;
+extern DWORD g_dwScaleMax;
+extern DWORD g_dwScaleTarget;           // p99 in microseconds, 0 for none
+extern BOOL g_bScaleShared;             // the workers share one queue, so the parked ones wait
+
+//
+// workers [0, g_lScaleActive) take work, the others are parked; all of them
+// while the controller is off
+//
+extern volatile LONG g_lScaleActive;
+
+static inline BOOL ScaleParked(DWORD dwWorker)
+{
+    return ((LONG)dwWorker >= g_lScaleActive);
+}
+
+//
+// a park event per worker, for dwWorkers workers
+//
+BOOL ScaleCreate(
+    DWORD dwWorkers
+    );
+
+VOID ScaleDestroy(
+    );
+
+//
+// start the controller with the workers running; bShared says whether they
+// share one queue
+//
+BOOL ScaleStart(
+    BOOL bShared
+    );
+
+//
+// stop it, wake every parked worker and log what it did
+//
+VOID ScaleStop(
+    );
+
+//
+// wait up to dwMilliseconds while the calling worker is parked
+//
+VOID ScaleWait(
+    DWORD dwWorker,
+    DWORD dwMilliseconds
+    );
+
+//
+// the shard for a new connection that would go to dwShard (CQ_ANY_SHARD for
+// the backend's choice): dwShard itself, unless the workers have shards of
+// their own and dwShard is parked, then an active one in turn
+//
+DWORD ScaleShard(
+    DWORD dwShard
+    );
+
+#endif
@@ -57,7 +57,14 @@
 
 //      Another point worth noting is that the Win32 API CreateThread() does not
 //      initialize the C Runtime and therefore, C runtime functions such as
-//      printf() have been avoid or rewritten (see myprintf()) to use just Win32 APIs.
+//      printf() have been avoid or rewritten to use just Win32 APIs.  Output goes
+//      through the asynchronous logger in iocplog.h (LogPrintf()), so worker
+//      threads never format or write to the console themselves.
+//
+//      The completion port itself is reached through the completion queue
+//      abstraction in iocpcq.h.  On Windows the IOCP backend (cq_iocp.cpp) is used;
+//      on Linux the same state machine runs on io_uring (cq_uring.cpp), with the
+//      Win32 calls it relies on supplied by iocpcompat.h.
 //
 //  Usage:
 //      Start the server and wait for connections on port 6001
@@ -66,6 +73,7 @@
 //  Build:
 //      Use the headers and libs from the April98 Platform SDK or later.
 //      Link with ws2_32.lib
+//      On Linux build with -DHAVE_LIBURING and link with liburing (see build_linux.sh).
 //
 //
 //
@@ -76,77 +84,197 @@
 #pragma warning(disable : 4267)
 #endif
 
-#ifndef WIN32_LEAN_AND_MEAN
-#define WIN32_LEAN_AND_MEAN
-#endif
-
-#define xmalloc(s) HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, (s))
-#define xfree(p) HeapFree(GetProcessHeap(), 0, (p))
-
-#include <winsock2.h>
-#include <ws2tcpip.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <strsafe.h>
+#include <stddef.h>
 
 #include "iocpserver.h"
+#include "iocpcq.h"
+#include "iocpledger.h"
+#include "iocppipe.h"
+#include "iocppool.h"
+#include "iocpscale.h"
+#include "iocpstats.h"
+#include "iocptune.h"
 
 char *g_Port = DEFAULT_PORT;
 BOOL g_bEndServer = FALSE; // set to TRUE on CTRL-C
 BOOL g_bRestart = TRUE;	   // set to TRUE to CTRL-BRK
-BOOL g_bVerbose = FALSE;
-DWORD g_dwThreadCount = 0; //worker thread count
-HANDLE g_hIOCP = INVALID_HANDLE_VALUE;
-SOCKET g_sdListen = INVALID_SOCKET;
-HANDLE g_ThreadHandles[MAX_WORKER_THREAD];
-PPER_SOCKET_CONTEXT g_pCtxtList = NULL; // linked list of context info structures
-										// maintained to allow the the cleanup
-										// handler to cleanly close all sockets and
-										// free resources.
+DWORD g_dwThreadCount = 0; //worker thread count, 0 means the default
+BOOL g_bReactors = FALSE;	//one pinned reactor per CPU, each with its own shard and listening socket
+#if !defined(_WIN32) && !defined(__linux__)
+#error "no completion queue backend for this platform"
+#endif
+const CQ_BACKEND *g_CqBackends[] = {
+#ifdef _WIN32
+	&g_CqIocp,
+#endif
+#ifdef HAVE_LIBURING
+	&g_CqUring,
+#endif
+#ifdef __linux__
+	&g_CqEpoll,
+#endif
+	NULL};
+const CQ_BACKEND *g_pCq = NULL; // completion queue backend, NULL selects the first that works
+BOOL g_bCqCreated = FALSE;
+SOCKET *g_psdListen = NULL; // listening sockets, one per reactor where SO_REUSEPORT is available
+DWORD g_dwListenSockets = 0;
+PPER_SOCKET_CONTEXT g_pCtxtListenSocket = NULL; // listening socket context, owns the accept contexts
+DWORD g_dwAcceptPosted = 0;						 // accepts kept outstanding, 0 means one per worker
+DWORD g_dwPoolPreallocate = DEFAULT_POOL_PREALLOCATE; // connection contexts allocated up front
+DWORD g_dwCompletionBatch = CQ_DEFAULT_BATCH;		   // completions dequeued at once
+DWORD g_dwIoDepth = DEFAULT_IO_DEPTH;				   // receives in flight per connection
+DWORD g_dwSendHighWater = DEFAULT_SEND_HIGH_WATER;	   // bytes waiting to be echoed that hold receives back, 0 for never
+DWORD g_dwSendLowWater = DEFAULT_SEND_LOW_WATER;	   // bytes waiting to be echoed that let them go again
+BOOL g_bSharedBuffers = FALSE;						   // receive buffers attached only when data arrives
+DWORD g_dwRecvClassMin = 0;							   // receive buffer size classes a connection moves between
+DWORD g_dwRecvClassMax = BUFFER_CLASSES - 1;
+DWORD g_dwRecvClassStart = BUFFER_CLASS_DEFAULT;	   // and the one it starts with
+DWORD g_dwZeroCopyThreshold = 0;					   // sends of at least this many bytes go zero-copy, 0 for never
+BOOL g_bSplice = FALSE;								   // echo through a pipe with splice where the backend can
+PFRAME_HANDLER g_pfnFrameHandler = NULL;			   // handles length-prefixed frames, NULL for a plain echo
+const FRAME_HANDLER_ENTRY *g_pFrameHandlerEntry = NULL; // the -f entry g_pfnFrameHandler comes from
+PFRAME_BATCH_HANDLER g_pfnFrameBatch = NULL;		   // its batch routine, NULL to handle frames per receive
+DWORD g_dwFrameBudget = DEFAULT_FRAME_BUDGET;		   // microseconds a batch step aims to take, 0 for no steps
+char *g_szWalPath = NULL;							   // write-ahead log of the ledger's transfers, NULL for none
+const TUNE_PROFILE *g_pTuneProfile = &g_TuneProfiles[0]; // socket options of the listening sockets and connections
+DWORD g_dwSpinBudget = 0;							   // microseconds a worker polls its queue before it blocks, 0 for never
+DWORD g_dwUringSqPollIdle = 0;						   // milliseconds io_uring's submission thread polls before it sleeps, 0 for none
+char *g_StatsPort = NULL;							   // admin port serving metrics, NULL for none
+DWORD g_dwIdleTimeout = 0;							   // seconds without I/O before a connection is closed, 0 for none
+DWORD g_dwReadTimeout = 0;							   // seconds from accept to the first data, 0 for none
+PTIMER_SHARD g_pTimerShards = NULL;					   // per worker
+LPVOID g_pTimerShardsAlloc = NULL;
+static thread_local DWORD t_dwWorker = TIMER_SHARD_NONE;
+PCQ_STATS g_pCqStats = NULL;						   // per worker
+LPVOID g_pCqStatsAlloc = NULL;
+CQ_STATS g_CqStatsShared;							   // for the other threads
+thread_local PCQ_STATS t_pCqStats = &g_CqStatsShared;
+WSAEVENT g_hCleanupEvent[1];					 // set by the control handler to stop the server
+HANDLE *g_ThreadHandles = NULL;
+CTXT_LIST_SHARD g_CtxtListShards[CTXT_LIST_SHARDS]; // lists of context info structures
+													 // maintained to allow the the cleanup
+													 // handler to cleanly close all sockets and
+													 // free resources, sharded by connection id.
+
+CRITICAL_SECTION g_CriticalSection; // guard access to the listening socket's accept contexts
 
-CRITICAL_SECTION g_CriticalSection; // guard access to the global context list
+//
+// a receive whose frames wait in its worker's batch step
+//
+typedef struct _FRAME_STEP_RECEIVE {
+	PPER_SOCKET_CONTEXT lpPerSocketContext;
+	PPER_IO_CONTEXT lpIOContext;
+	FRAME_OUTPUT Output;
+} FRAME_STEP_RECEIVE, *PFRAME_STEP_RECEIVE;
 
-int myprintf(const char *lpFormat, ...);
+//
+// A worker's batch step (-f with a batch handler): the frames of the receives
+// it completed, from all their connections, handled in one call once they
+// reach the batch's target or the completion batch is done.  Only its worker
+// uses it.
+//
+typedef struct _FRAME_STEP {
+	FRAME_BATCH Batch;
+	FRAME_STEP_RECEIVE Receives[CQ_MAX_BATCH];
+	DWORD dwReceives;
+	LONG64 llFrequency; // of the performance counter steps are timed with
+} FRAME_STEP, *PFRAME_STEP;
 
 int __cdecl main(int argc, char *argv[])
 {
 
 	SYSTEM_INFO systemInfo;
 	WSADATA wsaData;
-	SOCKET sdAccept = INVALID_SOCKET;
-	PPER_SOCKET_CONTEXT lpPerSocketContext = NULL;
-	DWORD dwRecvNumBytes = 0;
-	DWORD dwFlags = 0;
+	DWORD dwWait = 0;
 	int nRet = 0;
 
-	for (int i = 0; i < MAX_WORKER_THREAD; i++)
+	g_hCleanupEvent[0] = WSA_INVALID_EVENT;
+
+	if (!ValidOptions(argc, argv))
+		return (1);
+
+	//
+	// The decision to create 2 worker threads per CPU in the system is a
+	// heuristic.  Reactors are pinned one per CPU, across all processor groups.
+	// With the worker controller (-n) that many are only the most it makes
+	// active; all of them are started and the controller parks the ones it
+	// does not need.
+	//
+	GetSystemInfo(&systemInfo);
+	if (g_dwThreadCount == 0)
+		g_dwThreadCount = g_bReactors ? GetActiveProcessorCount(ALL_PROCESSOR_GROUPS) : systemInfo.dwNumberOfProcessors * 2;
+	if (g_bScale)
 	{
-		g_ThreadHandles[i] = INVALID_HANDLE_VALUE;
+		if (g_dwScaleMax)
+			g_dwThreadCount = g_dwScaleMax;
+		g_dwScaleMax = g_dwThreadCount;
+		if (g_dwScaleMin > g_dwScaleMax)
+			g_dwScaleMin = g_dwScaleMax;
 	}
+	if (g_dwAcceptPosted == 0)
+		g_dwAcceptPosted = g_dwThreadCount;
 
-	if (!ValidOptions(argc, argv))
-		return;
+	//
+	// Each reactor listens on a socket of its own, which the kernel balances
+	// new connections across.  Without SO_REUSEPORT (Windows) they share one.
+	//
+	g_dwListenSockets = 1;
+#ifdef SO_REUSEPORT
+	if (g_bReactors)
+		g_dwListenSockets = g_dwThreadCount;
+#endif
 
-	if (!SetConsoleCtrlHandler(CtrlHandler, TRUE))
+	//
+	// per-worker state is sized by the worker count; the counters each get a
+	// cache line of their own
+	//
+	g_ThreadHandles = (HANDLE *)HeapAlloc(GetProcessHeap(), 0, g_dwThreadCount * sizeof(HANDLE));
+	g_psdListen = (SOCKET *)HeapAlloc(GetProcessHeap(), 0, g_dwListenSockets * sizeof(SOCKET));
+	g_pCqStatsAlloc = HeapAlloc(GetProcessHeap(), 0, (g_dwThreadCount + 1) * sizeof(CQ_STATS));
+	g_pTimerShardsAlloc = HeapAlloc(GetProcessHeap(), 0, (g_dwThreadCount + 1) * sizeof(TIMER_SHARD));
+	if (g_ThreadHandles == NULL || g_psdListen == NULL || g_pCqStatsAlloc == NULL || g_pTimerShardsAlloc == NULL ||
+		!StatsCreate(g_dwThreadCount) || (g_bScale && !ScaleCreate(g_dwThreadCount)))
 	{
-		myprintf("SetConsoleCtrlHandler() failed to install console handler: %d\n",
-				 GetLastError());
-		return;
+		LogPrintf(LOG_ERROR, "HeapAlloc() failed for %d workers\n", g_dwThreadCount);
+		return (1);
 	}
+	g_pCqStats = (PCQ_STATS)(((ULONG_PTR)g_pCqStatsAlloc + sizeof(CQ_STATS) - 1) & ~(ULONG_PTR)(sizeof(CQ_STATS) - 1));
+	g_pTimerShards = (PTIMER_SHARD)(((ULONG_PTR)g_pTimerShardsAlloc + alignof(TIMER_SHARD) - 1) &
+									~(ULONG_PTR)(alignof(TIMER_SHARD) - 1));
+	for (DWORD i = 0; i < g_dwThreadCount; i++)
+		g_ThreadHandles[i] = INVALID_HANDLE_VALUE;
+	for (DWORD i = 0; i < g_dwListenSockets; i++)
+		g_psdListen[i] = INVALID_SOCKET;
 
-	GetSystemInfo(&systemInfo);
-	g_dwThreadCount = systemInfo.dwNumberOfProcessors * 2;
+	if (!SetConsoleCtrlHandler(CtrlHandler, TRUE))
+	{
+		LogPrintf(LOG_ERROR, "SetConsoleCtrlHandler() failed to install console handler: %d\n",
+				  GetLastError());
+		return (1);
+	}
 
 	if ((nRet = WSAStartup(MAKEWORD(2, 2), &wsaData)) != 0)
 	{
-		myprintf("WSAStartup() failed: %d\n", nRet);
+		LogPrintf(LOG_ERROR, "WSAStartup() failed: %d\n", nRet);
 		SetConsoleCtrlHandler(CtrlHandler, FALSE);
-		return;
+		return (1);
+	}
+
+	if (WSA_INVALID_EVENT == (g_hCleanupEvent[0] = WSACreateEvent()))
+	{
+		LogPrintf(LOG_ERROR, "WSACreateEvent() failed: %d\n", WSAGetLastError());
+		WSACleanup();
+		SetConsoleCtrlHandler(CtrlHandler, FALSE);
+		return (1);
 	}
 
 	//__try
 	{
 		InitializeCriticalSection(&g_CriticalSection);
+		for (int i = 0; i < CTXT_LIST_SHARDS; i++)
+			InitializeCriticalSection(&g_CtxtListShards[i].CriticalSection);
+		for (DWORD i = 0; i < g_dwThreadCount; i++)
+			InitializeCriticalSection(&g_pTimerShards[i].CriticalSection);
 	}
 	// __except (EXCEPTION_EXECUTE_HANDLER)
 	// {
@@ -154,6 +282,55 @@ int __cdecl main(int argc, char *argv[])
 	// 	return;
 	// }
 
+	//
+	// Allocate the socket and I/O contexts for g_dwPoolPreallocate connections
+	// now, so accepting and closing connections never goes to the heap.  Each
+	// receive owns a data buffer, of the size class connections start with,
+	// unless buffers are shared, in which case only the connections that have
+	// data in flight hold one.
+	//
+	if (!CtxtPoolCreate(g_dwPoolPreallocate, g_bSharedBuffers ? CTXT_POOL_CHUNK : g_dwAcceptPosted) ||
+		(!g_bSharedBuffers && !BufferClassReserve(g_dwRecvClassStart, g_dwPoolPreallocate * g_dwIoDepth)))
+	{
+		LogPrintf(LOG_ERROR, "CtxtPoolCreate() failed\n");
+		for (int i = 0; i < CTXT_LIST_SHARDS; i++)
+			DeleteCriticalSection(&g_CtxtListShards[i].CriticalSection);
+		for (DWORD i = 0; i < g_dwThreadCount; i++)
+			DeleteCriticalSection(&g_pTimerShards[i].CriticalSection);
+		DeleteCriticalSection(&g_CriticalSection);
+		WSACloseEvent(g_hCleanupEvent[0]);
+		WSACleanup();
+		SetConsoleCtrlHandler(CtrlHandler, FALSE);
+		return (1);
+	}
+
+	//
+	// From here on the worker threads log through per-thread rings drained by
+	// the logger's flusher thread; errors above were written synchronously.
+	//
+	if (!LogInitialize())
+		LogPrintf(LOG_ERROR, "LogInitialize() failed, logging synchronously\n");
+
+	//
+	// the metrics outlive restarts, so the admin port is opened once
+	//
+	if (g_StatsPort && !StatsStartAdmin(g_StatsPort))
+		LogPrintf(LOG_ERROR, "StatsStartAdmin() failed\n");
+
+	//
+	// and so is what the frame handler keeps, e.g. the ledger's accounts
+	//
+	if (g_pFrameHandlerEntry && g_pFrameHandlerEntry->pfnCreate && !g_pFrameHandlerEntry->pfnCreate())
+		LogPrintf(LOG_ERROR, "%s handler failed to start\n", g_pFrameHandlerEntry->szName);
+
+	//
+	// and the write-ahead log the ledger's replies wait for
+	//
+	if (g_szWalPath && g_pfnFrameHandler != LedgerHandle)
+		LogPrintf(LOG_INFO, "the write-ahead log only logs ledger transfers (-f:ledger)\n");
+	else if (g_szWalPath && !WalCreate(g_szWalPath, WalReleased))
+		LogPrintf(LOG_ERROR, "WalCreate() failed, replies are sent without logging\n");
+
 	while (g_bRestart)
 	{
 		g_bRestart = FALSE;
@@ -161,102 +338,100 @@ int __cdecl main(int argc, char *argv[])
 
 		// __try
 		{
-			g_hIOCP = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
-			if (g_hIOCP == NULL)
+			if (g_pCq)
+				g_bCqCreated = g_pCq->fnCreate(g_dwThreadCount);
+			else
+			{
+
+				//
+				// No backend was asked for: take the first one the host supports,
+				// e.g. fall back to epoll where io_uring is disabled by policy.
+				//
+				for (int i = 0; g_CqBackends[i] && !g_bCqCreated; i++)
+				{
+					g_pCq = g_CqBackends[i];
+					g_bCqCreated = g_pCq->fnCreate(g_dwThreadCount);
+				}
+			}
+			if (!g_bCqCreated)
 			{
-				myprintf("CreateIoCompletionPort() failed to create I/O completion port: %d\n",
-						 GetLastError());
+				LogPrintf(LOG_ERROR, "Failed to create %s completion queue\n", g_pCq->szName);
 				break; //__leave;
 			}
-			myprintf("CreateIoCompletionPort() success\n");
+			LogPrintf(LOG_INFO, "Create %s completion queue success\n", g_pCq->szName);
+			if (g_bSplice && g_pCq->fnPostSplice == NULL)
+				LogPrintf(LOG_INFO, "%s has no splice, echoing through buffers\n", g_pCq->szName);
+			else if (g_bSplice && g_pfnFrameHandler)
+				LogPrintf(LOG_INFO, "frames are handled in user memory, echoing through buffers\n");
+			ZeroMemory(g_pCqStats, g_dwThreadCount * sizeof(CQ_STATS));
+			ZeroMemory(&g_CqStatsShared, sizeof(g_CqStatsShared));
+			StatsReset();
+			for (DWORD i = 0; i < g_dwThreadCount; i++)
+				TimerWheelInitialize(&g_pTimerShards[i].Wheel, GetTickCount64() / TIMER_TICK_MS);
 			for (DWORD dwCPU = 0; dwCPU < g_dwThreadCount; dwCPU++)
 			{
 
 				//
-				// Create worker threads to service the overlapped I/O requests.  The decision
-				// to create 2 worker threads per CPU in the system is a heuristic.  Also,
-				// note that thread handles are closed right away, because we will not need them
-				// and the worker threads will continue to execute.
+				// Create worker threads to service the overlapped I/O requests.  Each
+				// worker is handed its index, which selects the completion queue shard it
+				// services on backends that keep one queue per thread.  Reactors are
+				// pinned to the CPU of the same index.
 				//
 				HANDLE hThread = INVALID_HANDLE_VALUE;
 				DWORD dwThreadId = 0;
 
-				hThread = CreateThread(NULL, 0, WorkerThread, g_hIOCP, 0, &dwThreadId);
+				hThread = CreateThread(NULL, 0, WorkerThread, (LPVOID)(DWORD_PTR)dwCPU, 0, &dwThreadId);
 				if (hThread == NULL)
 				{
-					myprintf("CreateThread() failed to create worker thread: %d\n",
-							 GetLastError());
+					LogPrintf(LOG_ERROR, "CreateThread() failed to create worker thread: %d\n",
+							  GetLastError());
 					break; //__leave;
 				}
+				if (g_bReactors && !SetReactorAffinity(hThread, dwCPU))
+					LogPrintf(LOG_ERROR, "SetReactorAffinity() failed for reactor %d: %d\n", dwCPU, GetLastError());
 				g_ThreadHandles[dwCPU] = hThread;
 				hThread = INVALID_HANDLE_VALUE;
 			}
-			myprintf("Create worker threads success\n");
+			LogPrintf(LOG_INFO, "Create %d %s success\n", g_dwThreadCount, g_bReactors ? "reactors" : "worker threads");
+
+			//
+			// Workers park by leaving the queue alone only where they share it,
+			// the IOCP port without reactors; elsewhere a parked worker keeps its
+			// shard and its connections but gets no new ones.
+			//
+#ifdef _WIN32
+			if (g_bScale)
+				ScaleStart(g_pCq == &g_CqIocp && !g_bReactors);
+#else
+			if (g_bScale)
+				ScaleStart(FALSE);
+#endif
 
 			if (!CreateListenSocket())
 			{
-				myprintf("CreateListenSocket() failed: %d\n",
-						 GetLastError());
+				LogPrintf(LOG_ERROR, "CreateListenSocket() failed: %d\n",
+						  GetLastError());
 				break; //__leave;
 			}
 
-			while (TRUE)
+			//
+			// Keep g_dwAcceptPosted accepts outstanding on the listening socket.  The
+			// worker threads service accept completions like any other I/O and repost
+			// the accept right away, so the main thread only waits for shutdown.
+			//
+			for (DWORD i = 0; i < g_dwAcceptPosted; i++)
 			{
-
-				//
-				// Loop forever accepting connections from clients until console shuts down.
-				//
-				sdAccept = WSAAccept(g_sdListen, NULL, NULL, NULL, 0);
-				if (sdAccept == SOCKET_ERROR)
-				{
-
-					//
-					// If user hits Ctrl+C or Ctrl+Brk or console window is closed, the control
-					// handler will close the g_sdListen socket. The above WSAAccept call will
-					// fail and we thus break out the loop,
-					//
-					myprintf("WSAAccept() failed: %d\n", WSAGetLastError());
-					break; //__leave;
-				}
-				myprintf("WSAAccept success\n");
-
-				//
-				// we add the just returned socket descriptor to the IOCP along with its
-				// associated key data.  Also the global list of context structures
-				// (the key data) gets added to a global list.
-				//
-				lpPerSocketContext = UpdateCompletionPort(sdAccept, ClientIoRead, TRUE);
-				if (lpPerSocketContext == NULL)
-				{
-					myprintf("UpdateCompletionPort failed\n");
-					break; //__leave;
-				}
-				myprintf("UpdateCompletionPort success\n");
-				//
-				// if a CTRL-C was pressed "after" WSAAccept returns, the CTRL-C handler
-				// will have set this flag and we can break out of the loop here before
-				// we go ahead and post another read (but after we have added it to the
-				// list of sockets to close).
-				//
-				if (g_bEndServer)
+				if (!CreateAcceptSocket(i == 0, g_bReactors ? i % g_dwThreadCount : CQ_ANY_SHARD))
 				{
-					myprintf("end server\n");
+					LogPrintf(LOG_ERROR, "CreateAcceptSocket() failed\n");
 					break;
 				}
+			}
+			if (g_pCtxtListenSocket == NULL)
+				break; //__leave;
+			LogPrintf(LOG_INFO, "%d accepts posted\n", g_dwAcceptPosted);
 
-				//
-				// post initial receive on this socket
-				//
-				nRet = WSARecv(sdAccept, &(lpPerSocketContext->pIOContext->wsabuf),
-							   1, &dwRecvNumBytes, &dwFlags,
-							   &(lpPerSocketContext->pIOContext->Overlapped), NULL);
-				if (nRet == SOCKET_ERROR && (ERROR_IO_PENDING != WSAGetLastError()))
-				{
-					myprintf("WSARecv() Failed: %d\n", WSAGetLastError());
-					CloseClient(lpPerSocketContext, FALSE);
-				}
-				myprintf("WSARecv success\n");
-			} //while
+			WSAWaitForMultipleEvents(1, g_hCleanupEvent, TRUE, WSA_INFINITE, TRUE);
 		}
 
 		//__finally
@@ -265,19 +440,24 @@ int __cdecl main(int argc, char *argv[])
 			g_bEndServer = TRUE;
 
 			//
-			// Cause worker threads to exit
+			// Cause worker threads to exit, the parked ones woken first
 			//
-			if (g_hIOCP)
+			ScaleStop();
+			if (g_bCqCreated)
 			{
 				for (DWORD i = 0; i < g_dwThreadCount; i++)
-					PostQueuedCompletionStatus(g_hIOCP, 0, 0, NULL);
+					g_pCq->fnPostQuit(i);
 			}
 
 			//
-			//Make sure worker threads exits.
+			//Make sure worker threads exits, MAXIMUM_WAIT_OBJECTS at a time.
 			//
-			if (WAIT_OBJECT_0 != WaitForMultipleObjects(g_dwThreadCount, g_ThreadHandles, TRUE, 1000))
-				myprintf("WaitForMultipleObjects() failed: %d\n", GetLastError());
+			dwWait = WAIT_OBJECT_0;
+			for (DWORD i = 0; i < g_dwThreadCount && dwWait == WAIT_OBJECT_0; i += MAXIMUM_WAIT_OBJECTS)
+				dwWait = WaitForMultipleObjects(g_dwThreadCount - i < MAXIMUM_WAIT_OBJECTS ? g_dwThreadCount - i : MAXIMUM_WAIT_OBJECTS,
+												&g_ThreadHandles[i], TRUE, 1000);
+			if (WAIT_OBJECT_0 != dwWait)
+				LogPrintf(LOG_ERROR, "WaitForMultipleObjects() failed: %d\n", GetLastError());
 			else
 				for (DWORD i = 0; i < g_dwThreadCount; i++)
 				{
@@ -286,40 +466,73 @@ int __cdecl main(int argc, char *argv[])
 					g_ThreadHandles[i] = INVALID_HANDLE_VALUE;
 				}
 
-			CtxtListFree();
+			//
+			// connections whose replies wait for the write-ahead log are
+			// closed below like the others, so the committer must let go of
+			// them first
+			//
+			WalCancelWaiters();
 
-			if (g_hIOCP)
+			//
+			// Close the completion queue before freeing the contexts: the backend
+			// cancels whatever I/O is still outstanding on the queue.
+			//
+			if (g_bCqCreated)
 			{
-				CloseHandle(g_hIOCP);
-				g_hIOCP = NULL;
+				g_pCq->fnClose();
+				g_bCqCreated = FALSE;
 			}
 
-			if (g_sdListen != INVALID_SOCKET)
-			{
-				closesocket(g_sdListen);
-				g_sdListen = INVALID_SOCKET;
-			}
+			CtxtListFree();
+
+			if (g_pCq)
+				PrintCqStats();
+			StatsPrint();
 
-			if (sdAccept != INVALID_SOCKET)
+			for (DWORD i = 0; i < g_dwListenSockets; i++)
 			{
-				closesocket(sdAccept);
-				sdAccept = INVALID_SOCKET;
+				if (g_psdListen[i] != INVALID_SOCKET)
+				{
+					closesocket(g_psdListen[i]);
+					g_psdListen[i] = INVALID_SOCKET;
+				}
 			}
 
+			WSAResetEvent(g_hCleanupEvent[0]);
+
 		} //finally
 
 		if (g_bRestart)
 		{
-			myprintf("\niocpserver is restarting...\n");
+			LogPrintf(LOG_INFO, "\niocpserver is restarting...\n");
 		}
 		else
-			myprintf("\niocpserver is exiting...\n");
+			LogPrintf(LOG_INFO, "\niocpserver is exiting...\n");
 
 	} //while (g_bRestart)
 
+	WalDestroy();
+	if (g_pFrameHandlerEntry && g_pFrameHandlerEntry->pfnDestroy)
+		g_pFrameHandlerEntry->pfnDestroy();
+	CtxtPoolDestroy();
+	PipePoolFlushThread();
+	for (int i = 0; i < CTXT_LIST_SHARDS; i++)
+		DeleteCriticalSection(&g_CtxtListShards[i].CriticalSection);
+	for (DWORD i = 0; i < g_dwThreadCount; i++)
+		DeleteCriticalSection(&g_pTimerShards[i].CriticalSection);
 	DeleteCriticalSection(&g_CriticalSection);
+	WSACloseEvent(g_hCleanupEvent[0]);
 	WSACleanup();
 	SetConsoleCtrlHandler(CtrlHandler, FALSE);
+	HeapFree(GetProcessHeap(), 0, g_ThreadHandles);
+	HeapFree(GetProcessHeap(), 0, g_psdListen);
+	HeapFree(GetProcessHeap(), 0, g_pCqStatsAlloc);
+	HeapFree(GetProcessHeap(), 0, g_pTimerShardsAlloc);
+	StatsStopAdmin();
+	StatsDestroy();
+	ScaleDestroy();
+	LogShutdown();
+	return (0);
 } //main
 
 //
@@ -342,19 +555,278 @@ BOOL ValidOptions(int argc, char *argv[])
 				break;
 
 			case 'v':
-				g_bVerbose = TRUE;
+				g_dwLogLevel = LOG_VERBOSE;
+				break;
+
+			case 'l':
+				if (strlen(argv[i]) > 3)
+					g_dwLogLevel = (DWORD)atoi(&argv[i][3]);
+				if (g_dwLogLevel >= LOG_LEVELS)
+				{
+					g_dwLogLevel = LOG_INFO;
+					LogPrintf(LOG_ERROR, "Log level must be between 0 and %d\n", LOG_LEVELS - 1);
+					bRet = FALSE;
+				}
+				break;
+
+			case 'a':
+				if (strlen(argv[i]) > 3)
+					g_dwAcceptPosted = (DWORD)atoi(&argv[i][3]);
+				if (g_dwAcceptPosted < 1 || g_dwAcceptPosted > MAX_ACCEPT_POSTED)
+				{
+					LogPrintf(LOG_ERROR, "Accepts posted must be between 1 and %d\n", MAX_ACCEPT_POSTED);
+					bRet = FALSE;
+				}
+				break;
+
+			case 'c':
+				if (strlen(argv[i]) > 3)
+					g_dwPoolPreallocate = (DWORD)atoi(&argv[i][3]);
+				break;
+
+			case 'd':
+				if (strlen(argv[i]) > 3)
+					g_dwIoDepth = (DWORD)atoi(&argv[i][3]);
+				if (g_dwIoDepth < 1 || g_dwIoDepth > MAX_IO_DEPTH)
+				{
+					LogPrintf(LOG_ERROR, "I/O depth must be between 1 and %d\n", MAX_IO_DEPTH);
+					bRet = FALSE;
+				}
+				break;
+
+			case 'z':
+				g_bSharedBuffers = TRUE;
+				break;
+
+			case 'u':
+				if (strlen(argv[i]) > 3)
+				{
+					DWORD cbMin = (DWORD)atoi(&argv[i][3]);
+					DWORD cbMax = strchr(&argv[i][3], ':') ? (DWORD)atoi(strchr(&argv[i][3], ':') + 1) : cbMin;
+
+					if (cbMin < BUFFER_CLASS_SIZE(0) || cbMax > BUFFER_CLASS_SIZE(BUFFER_CLASSES - 1) || cbMin > cbMax)
+					{
+						LogPrintf(LOG_ERROR, "Receive buffer sizes must be between %d and %d bytes, the smallest first\n",
+								  BUFFER_CLASS_SIZE(0), BUFFER_CLASS_SIZE(BUFFER_CLASSES - 1));
+						bRet = FALSE;
+						break;
+					}
+					g_dwRecvClassMin = BufferClass(cbMin);
+					g_dwRecvClassMax = BufferClass(cbMax);
+					g_dwRecvClassStart = BUFFER_CLASS_DEFAULT < g_dwRecvClassMin   ? g_dwRecvClassMin
+										 : BUFFER_CLASS_DEFAULT > g_dwRecvClassMax ? g_dwRecvClassMax
+																				   : BUFFER_CLASS_DEFAULT;
+				}
+				break;
+
+			case 'x':
+				if (strlen(argv[i]) > 3)
+					g_dwZeroCopyThreshold = (DWORD)atoi(&argv[i][3]);
+				break;
+
+			case 's':
+				g_bSplice = TRUE;
+				break;
+
+			case 'f':
+				g_pfnFrameHandler = NULL;
+				for (int j = 0; strlen(argv[i]) > 3 && g_FrameHandlers[j].szName; j++)
+				{
+					if (strcmp(&argv[i][3], g_FrameHandlers[j].szName) == 0)
+					{
+						g_pFrameHandlerEntry = &g_FrameHandlers[j];
+						g_pfnFrameHandler = g_FrameHandlers[j].pfnHandler;
+						g_pfnFrameBatch = g_FrameHandlers[j].pfnBatch;
+					}
+				}
+				if (g_pfnFrameHandler == NULL)
+				{
+					LogPrintf(LOG_ERROR, "Unknown frame handler %s\n", argv[i]);
+					bRet = FALSE;
+				}
+				break;
+
+			case 'k':
+				if (strlen(argv[i]) > 3)
+					g_dwFrameBudget = (DWORD)atoi(&argv[i][3]);
+				break;
+
+			case 'j':
+				if (strlen(argv[i]) > 3)
+					g_szWalPath = &argv[i][3];
+				break;
+
+			case 'g':
+				if (strlen(argv[i]) > 3)
+				{
+					g_dwWalWindow = (DWORD)atoi(&argv[i][3]);
+					if (strchr(&argv[i][3], ':'))
+						g_dwWalLatency = (DWORD)atoi(strchr(&argv[i][3], ':') + 1);
+				}
+				if (g_dwWalWindow < 1 || g_dwWalWindow > WAL_BUFFER_SIZE / 2)
+				{
+					LogPrintf(LOG_ERROR, "Group commit window must be between 1 and %d bytes\n", WAL_BUFFER_SIZE / 2);
+					bRet = FALSE;
+				}
+				break;
+
+			case 'w':
+				if (strlen(argv[i]) > 3)
+				{
+					g_dwSendHighWater = (DWORD)atoi(&argv[i][3]);
+					g_dwSendLowWater = g_dwSendHighWater / 4;
+					if (strchr(&argv[i][3], ':'))
+						g_dwSendLowWater = (DWORD)atoi(strchr(&argv[i][3], ':') + 1);
+				}
+				if (g_dwSendLowWater > g_dwSendHighWater)
+				{
+					LogPrintf(LOG_ERROR, "Send low watermark must not be above the high watermark\n");
+					bRet = FALSE;
+				}
+				break;
+
+			case 'y':
+				g_pTuneProfile = strlen(argv[i]) > 3 ? TuneProfileFind(&argv[i][3]) : NULL;
+				if (g_pTuneProfile == NULL)
+				{
+					g_pTuneProfile = &g_TuneProfiles[0];
+					LogPrintf(LOG_ERROR, "Unknown tuning profile %s\n", argv[i]);
+					bRet = FALSE;
+				}
+				break;
+
+			case 'n':
+				g_bScale = TRUE;
+				if (strlen(argv[i]) > 3)
+				{
+					char *pszField = &argv[i][3];
+
+					g_dwScaleMin = (DWORD)atoi(pszField);
+					if ((pszField = strchr(pszField, ':')) != NULL)
+					{
+						g_dwScaleMax = (DWORD)atoi(++pszField);
+						if ((pszField = strchr(pszField, ':')) != NULL)
+							g_dwScaleTarget = (DWORD)atoi(++pszField);
+					}
+				}
+				if (g_dwScaleMin < 1 || (g_dwScaleMax && g_dwScaleMax < g_dwScaleMin))
+				{
+					LogPrintf(LOG_ERROR, "Workers must be at least 1, the fewest first\n");
+					bRet = FALSE;
+				}
+				break;
+
+			case 'h':
+				if (strlen(argv[i]) > 3)
+				{
+					g_dwSpinBudget = (DWORD)atoi(&argv[i][3]);
+					if (strchr(&argv[i][3], ':'))
+						g_dwUringSqPollIdle = (DWORD)atoi(strchr(&argv[i][3], ':') + 1);
+				}
+				break;
+
+			case 'm':
+				if (strlen(argv[i]) > 3)
+					g_StatsPort = &argv[i][3];
+				break;
+
+			case 'i':
+				if (strlen(argv[i]) > 3)
+					g_dwIdleTimeout = (DWORD)atoi(&argv[i][3]);
+				break;
+
+			case 'o':
+				if (strlen(argv[i]) > 3)
+					g_dwReadTimeout = (DWORD)atoi(&argv[i][3]);
+				break;
+
+			case 't':
+				if (strlen(argv[i]) > 3)
+					g_dwThreadCount = (DWORD)atoi(&argv[i][3]);
+				if (g_dwThreadCount < 1)
+				{
+					LogPrintf(LOG_ERROR, "Worker threads must be at least 1\n");
+					bRet = FALSE;
+				}
+				break;
+
+			case 'r':
+				g_bReactors = TRUE;
+				break;
+
+			case 'b':
+				if (strlen(argv[i]) > 3)
+					g_dwCompletionBatch = (DWORD)atoi(&argv[i][3]);
+				if (g_dwCompletionBatch < 1 || g_dwCompletionBatch > CQ_MAX_BATCH)
+				{
+					LogPrintf(LOG_ERROR, "Completion batch must be between 1 and %d\n", CQ_MAX_BATCH);
+					bRet = FALSE;
+				}
+				break;
+
+			case 'q':
+				g_pCq = NULL;
+				for (int j = 0; strlen(argv[i]) > 3 && g_CqBackends[j]; j++)
+				{
+					if (strcmp(&argv[i][3], g_CqBackends[j]->szName) == 0)
+						g_pCq = g_CqBackends[j];
+				}
+				if (g_pCq == NULL)
+				{
+					LogPrintf(LOG_ERROR, "Unknown completion queue backend %s\n", argv[i]);
+					bRet = FALSE;
+				}
 				break;
 
 			case '?':
-				myprintf("Usage:\n  iocpserver [-p:port] [-v] [-?]\n");
-				myprintf("  -e:port\tSpecify echoing port number\n");
-				myprintf("  -v\t\tVerbose\n");
-				myprintf("  -?\t\tDisplay this help\n");
+				LogPrintf(LOG_INFO, "Usage:\n  iocpserver [-p:port] [-q:backend] [-a:accepts] [-c:connections] [-b:batch] [-d:depth] [-z] [-u:min[:max]] [-w:high[:low]] [-x:bytes] [-s] [-f:handler] [-k:us] [-j:path] [-g:bytes[:us]] [-t:threads] [-n:min[:max[:us]]] [-r] [-y:profile] [-h:us[:ms]] [-i:seconds] [-o:seconds] [-m:port] [-l:level] [-v] [-?]\n");
+				LogPrintf(LOG_INFO, "  -e:port\tSpecify echoing port number\n");
+				LogPrintf(LOG_INFO, "  -q:backend\tSpecify completion queue backend:");
+				for (int j = 0; g_CqBackends[j]; j++)
+					LogPrintf(LOG_INFO, " %s", g_CqBackends[j]->szName);
+				LogPrintf(LOG_INFO, " (default: first available)\n");
+				LogPrintf(LOG_INFO, "  -a:accepts\tSpecify number of accepts kept posted (default: one per worker)\n");
+				LogPrintf(LOG_INFO, "  -c:connections\tSpecify number of connection contexts preallocated (default: %d)\n",
+						  DEFAULT_POOL_PREALLOCATE);
+				LogPrintf(LOG_INFO, "  -b:batch\tSpecify number of completions dequeued at once (default: %d)\n",
+						  CQ_DEFAULT_BATCH);
+				LogPrintf(LOG_INFO, "  -d:depth\tSpecify number of receives in flight per connection (default: %d)\n",
+						  DEFAULT_IO_DEPTH);
+				LogPrintf(LOG_INFO, "  -z\t\tReceive into buffers shared by all connections, attached when data arrives\n");
+				LogPrintf(LOG_INFO, "  -u:min[:max]\tGrow and shrink each connection's receive buffers between these sizes, by powers of 2 (default: %d:%d)\n",
+						  DEFAULT_RECV_MIN_SIZE, DEFAULT_RECV_MAX_SIZE);
+				LogPrintf(LOG_INFO, "  -w:high[:low]\tHold receives back while more than high bytes wait to be echoed, until low (default: %d:%d, 0 never)\n",
+						  DEFAULT_SEND_HIGH_WATER, DEFAULT_SEND_LOW_WATER);
+				LogPrintf(LOG_INFO, "  -x:bytes\tSend zero-copy when a send is at least this long, Linux only (default: 0, never)\n");
+				LogPrintf(LOG_INFO, "  -s\t\tEcho through a pipe with splice, never copying the data to user memory, Linux only\n");
+				LogPrintf(LOG_INFO, "  -f:handler\tParse the stream into length-prefixed frames and answer each with handler:");
+				for (int j = 0; g_FrameHandlers[j].szName; j++)
+					LogPrintf(LOG_INFO, " %s", g_FrameHandlers[j].szName);
+				LogPrintf(LOG_INFO, "\n");
+				LogPrintf(LOG_INFO, "  -k:us\t\tHandle a worker's frames from all its connections in steps of about this long, where the handler can (default: %d, 0 per receive)\n",
+						  DEFAULT_FRAME_BUDGET);
+				LogPrintf(LOG_INFO, "  -j:path\tAppend the ledger's transfers to a write-ahead log, replying once it is durable\n");
+				LogPrintf(LOG_INFO, "  -g:bytes[:us]\tCommit the log once this much is appended or the oldest append waited this long (default: %d:%d)\n",
+						  WAL_DEFAULT_WINDOW, WAL_DEFAULT_LATENCY);
+				LogPrintf(LOG_INFO, "  -t:threads\tSpecify number of worker threads (default: 2 per CPU, 1 per CPU with -r)\n");
+				LogPrintf(LOG_INFO, "  -n:min[:max[:us]]\tKeep between min and max workers active as load, batch fill and p99 latency (target us) need (default: 1:threads:0, no target)\n");
+				LogPrintf(LOG_INFO, "  -r\t\tRun one reactor per worker, pinned to a CPU, with its own queue and listening socket\n");
+				LogPrintf(LOG_INFO, "  -y:profile\tApply a socket tuning profile:");
+				for (int j = 0; g_TuneProfiles[j].szName; j++)
+					LogPrintf(LOG_INFO, " %s", g_TuneProfiles[j].szName);
+				LogPrintf(LOG_INFO, " (default: %s)\n", g_TuneProfiles[0].szName);
+				LogPrintf(LOG_INFO, "  -h:us[:ms]\tPoll the completion queue this long before blocking, and with io_uring have a kernel thread poll submissions, sleeping after ms idle (default: 0, never)\n");
+				LogPrintf(LOG_INFO, "  -i:seconds\tClose connections with no I/O for this long (default: 0, never)\n");
+				LogPrintf(LOG_INFO, "  -o:seconds\tClose connections that send no data this long after accept (default: 0, never)\n");
+				LogPrintf(LOG_INFO, "  -m:port\tServe per-worker metrics and latency histograms on 127.0.0.1:port\n");
+				LogPrintf(LOG_INFO, "  -l:level\tSpecify log level: 0 errors, 1 information, 2 verbose (default: 1)\n");
+				LogPrintf(LOG_INFO, "  -v\t\tVerbose, same as -l:2\n");
+				LogPrintf(LOG_INFO, "  -?\t\tDisplay this help\n");
 				bRet = FALSE;
 				break;
 
 			default:
-				myprintf("Unknown options flag %s\n", argv[i]);
+				LogPrintf(LOG_ERROR, "Unknown options flag %s\n", argv[i]);
 				bRet = FALSE;
 				break;
 			}
@@ -364,6 +836,29 @@ BOOL ValidOptions(int argc, char *argv[])
 	return (bRet);
 }
 
+//
+//  Print the completion queue counters, summed over all threads.  Messages are
+//  completions, so syscalls per completion is what batching brings down.
+//
+VOID PrintCqStats(void)
+{
+
+	CQ_STATS total = {0};
+
+	total = g_CqStatsShared;
+	for (DWORD i = 0; i < g_dwThreadCount; i++)
+	{
+		total.llCompletions += g_pCqStats[i].llCompletions;
+		total.llDequeues += g_pCqStats[i].llDequeues;
+		total.llSyscalls += g_pCqStats[i].llSyscalls;
+	}
+
+	LogPrintf(LOG_INFO, "%s: %lld completions in %lld batches (batch size %d), %lld syscalls, %.3f syscalls/completion\n",
+			  g_pCq->szName, (long long)total.llCompletions, (long long)total.llDequeues,
+			  g_dwCompletionBatch, (long long)total.llSyscalls,
+			  total.llCompletions ? (double)total.llSyscalls / (double)total.llCompletions : 0.0);
+}
+
 //
 //  Intercept CTRL-C or CTRL-BRK events and cause the server to initiate shutdown.
 //  CTRL-BRK resets the restart flag, and after cleanup the server restarts.
@@ -381,22 +876,25 @@ BOOL WINAPI CtrlHandler(DWORD dwEvent)
 	case CTRL_LOGOFF_EVENT:
 	case CTRL_SHUTDOWN_EVENT:
 	case CTRL_CLOSE_EVENT:
-		if (g_bVerbose)
-			myprintf("CtrlHandler: closing listening socket\n");
+		LogPrintf(LOG_VERBOSE, "CtrlHandler: closing listening socket\n");
 
 		//
-		// cause the accept in the main thread loop to fail
+		// cause the accepts posted on the listening sockets to fail
 		//
+		g_bEndServer = TRUE;
+		for (DWORD i = 0; g_psdListen && i < g_dwListenSockets; i++)
+		{
+			sockTemp = g_psdListen[i];
+			g_psdListen[i] = INVALID_SOCKET;
+			if (sockTemp != INVALID_SOCKET)
+				closesocket(sockTemp);
+		}
+		sockTemp = INVALID_SOCKET;
 
 		//
-		//We want to make closesocket the last call in the handler because it will
-		//cause the WSAAccept to return in the main thread
+		// wake the main thread, which is waiting for this event
 		//
-		sockTemp = g_sdListen;
-		g_sdListen = INVALID_SOCKET;
-		g_bEndServer = TRUE;
-		closesocket(sockTemp);
-		sockTemp = INVALID_SOCKET;
+		WSASetEvent(g_hCleanupEvent[0]);
 		break;
 
 	default:
@@ -407,13 +905,15 @@ BOOL WINAPI CtrlHandler(DWORD dwEvent)
 }
 
 //
-//  Create a listening socket.
+//  Create the listening sockets: one, or one per reactor bound to the same port
+//  with SO_REUSEPORT so the kernel spreads new connections across them.
 //
 BOOL CreateListenSocket(void)
 {
 
 	int nRet = 0;
-	int nZero = 0;
+	int nOne = 1;
+	SOCKET sdListen = INVALID_SOCKET;
 	struct addrinfo hints = {0};
 	struct addrinfo *addrlocal = NULL;
 
@@ -427,261 +927,1287 @@ BOOL CreateListenSocket(void)
 
 	if (getaddrinfo(NULL, g_Port, &hints, &addrlocal) != 0)
 	{
-		myprintf("getaddrinfo() failed with error %d\n", WSAGetLastError());
+		LogPrintf(LOG_ERROR, "getaddrinfo() failed with error %d\n", WSAGetLastError());
 		return (FALSE);
 	}
 
 	if (addrlocal == NULL)
 	{
-		myprintf("getaddrinfo() failed to resolve/convert the interface\n");
+		LogPrintf(LOG_ERROR, "getaddrinfo() failed to resolve/convert the interface\n");
 		return (FALSE);
 	}
 
-	g_sdListen = WSASocket(addrlocal->ai_family, addrlocal->ai_socktype, addrlocal->ai_protocol,
-						   NULL, 0, WSA_FLAG_OVERLAPPED);
-	if (g_sdListen == INVALID_SOCKET)
+	for (DWORD i = 0; i < g_dwListenSockets; i++)
 	{
-		myprintf("WSASocket(g_sdListen) failed: %d\n", WSAGetLastError());
-		return (FALSE);
-	}
+		sdListen = WSASocket(addrlocal->ai_family, addrlocal->ai_socktype, addrlocal->ai_protocol,
+							 NULL, 0, WSA_FLAG_OVERLAPPED);
+		if (sdListen == INVALID_SOCKET)
+		{
+			LogPrintf(LOG_ERROR, "WSASocket(sdListen) failed: %d\n", WSAGetLastError());
+			return (FALSE);
+		}
+		g_psdListen[i] = sdListen;
 
-	nRet = bind(g_sdListen, addrlocal->ai_addr, (int)addrlocal->ai_addrlen);
-	if (nRet == SOCKET_ERROR)
-	{
-		myprintf("bind() failed: %d\n", WSAGetLastError());
-		return (FALSE);
-	}
+#ifdef SO_REUSEPORT
+		if (g_dwListenSockets > 1)
+		{
+			nRet = setsockopt(sdListen, SOL_SOCKET, SO_REUSEPORT, (char *)&nOne, sizeof(nOne));
+			if (nRet == SOCKET_ERROR)
+			{
+				LogPrintf(LOG_ERROR, "setsockopt(SO_REUSEPORT) failed: %d\n", WSAGetLastError());
+				return (FALSE);
+			}
+		}
+#endif
 
-	nRet = listen(g_sdListen, 5);
-	if (nRet == SOCKET_ERROR)
-	{
-		myprintf("listen() failed: %d\n", WSAGetLastError());
-		return (FALSE);
-	}
+		nRet = bind(sdListen, addrlocal->ai_addr, (int)addrlocal->ai_addrlen);
+		if (nRet == SOCKET_ERROR)
+		{
+			LogPrintf(LOG_ERROR, "bind() failed: %d\n", WSAGetLastError());
+			return (FALSE);
+		}
 
-	//
-	// Disable send buffering on the socket.  Setting SO_SNDBUF
-	// to 0 causes winsock to stop buffering sends and perform
-	// sends directly from our buffers, thereby reducing CPU usage.
-	//
-	// However, this does prevent the socket from ever filling the
-	// send pipeline. This can lead to packets being sent that are
-	// not full (i.e. the overhead of the IP and TCP headers is
-	// great compared to the amount of data being carried).
-	//
-	// Disabling the send buffer has less serious repercussions
-	// than disabling the receive buffer.
-	//
-	nZero = 0;
-	nRet = setsockopt(g_sdListen, SOL_SOCKET, SO_SNDBUF, (char *)&nZero, sizeof(nZero));
-	if (nRet == SOCKET_ERROR)
-	{
-		myprintf("setsockopt(SNDBUF) failed: %d\n", WSAGetLastError());
-		return (FALSE);
-	}
+		//
+		// Size the socket buffers as the tuning profile says, before listening
+		// so the connections' window scale allows for them.  On Windows the
+		// default profile disables send buffering: setting SO_SNDBUF to 0
+		// causes winsock to stop buffering sends and perform sends directly
+		// from our buffers, thereby reducing CPU usage.
+		//
+		// However, this does prevent the socket from ever filling the
+		// send pipeline. This can lead to packets being sent that are
+		// not full (i.e. the overhead of the IP and TCP headers is
+		// great compared to the amount of data being carried).
+		//
+		// Disabling the send buffer has less serious repercussions
+		// than disabling the receive buffer.
+		//
+		// The profile's other options are set on every accepted connection;
+		// setting them here first rejects the ones the system refuses at
+		// startup.
+		//
+		if (!TuneSocketBuffers(sdListen, g_pTuneProfile) || !TuneSocket(sdListen, g_pTuneProfile))
+		{
+			LogPrintf(LOG_ERROR, "tuning profile %s failed\n", g_pTuneProfile->szName);
+			return (FALSE);
+		}
 
-	//
-	// Don't disable receive buffering. This will cause poor network
-	// performance since if no receive is posted and no receive buffers,
-	// the TCP stack will set the window size to zero and the peer will
-	// no longer be allowed to send data.
-	//
+		nRet = listen(sdListen, SOMAXCONN);
+		if (nRet == SOCKET_ERROR)
+		{
+			LogPrintf(LOG_ERROR, "listen() failed: %d\n", WSAGetLastError());
+			return (FALSE);
+		}
 
+		//
+		// Don't disable receive buffering. This will cause poor network
+		// performance since if no receive is posted and no receive buffers,
+		// the TCP stack will set the window size to zero and the peer will
+		// no longer be allowed to send data.
+		//
+
+		//
+		// Do not set a linger value...especially don't set it to an abortive
+		// close. If you set abortive close and there happens to be a bit of
+		// data remaining to be transfered (or data that has not been
+		// acknowledged by the peer), the connection will be forcefully reset
+		// and will lead to a loss of data (i.e. the peer won't get the last
+		// bit of data). This is BAD. If you are worried about malicious
+		// clients connecting and then not sending or receiving, the server
+		// should maintain a timer on each connection. If after some point,
+		// the server deems a connection is "stale" it can then set linger
+		// to be abortive and close the connection.
+		//
+
+		/*
+		LINGER lingerStruct;
+
+		lingerStruct.l_onoff = 1;
+		lingerStruct.l_linger = 0;
+
+		nRet = setsockopt(sdListen, SOL_SOCKET, SO_LINGER,
+						  (char *)&lingerStruct, sizeof(lingerStruct) );
+		if( nRet == SOCKET_ERROR ) {
+			LogPrintf(LOG_ERROR, "setsockopt(SO_LINGER) failed: %d\n", WSAGetLastError());
+			return(FALSE);
+		}
+	    */
+	}
+
+	freeaddrinfo(addrlocal);
+
+	return (TRUE);
+}
+
+//
+//  Post one more accept on the listening socket.  With fUpdateIOCP the listening
+//  socket is first added to the completion queue, creating g_pCtxtListenSocket and
+//  its first accept context.  Later calls chain a new accept context onto it, so
+//  every outstanding accept has its own PER_IO_CONTEXT.  An accept for a reactor
+//  is armed on its shard and posted on its own listening socket, if it has one.
+//
+BOOL CreateAcceptSocket(BOOL fUpdateIOCP, DWORD dwReactor)
+{
+
+	PPER_IO_CONTEXT lpIOContext = NULL;
+
+	if (fUpdateIOCP)
+	{
+		g_pCtxtListenSocket = UpdateCompletionPort(g_psdListen[0], ClientIoAccept, FALSE, CQ_ANY_SHARD);
+		if (g_pCtxtListenSocket == NULL)
+		{
+			LogPrintf(LOG_ERROR, "failed to update listen socket to completion queue\n");
+			return (FALSE);
+		}
+		lpIOContext = g_pCtxtListenSocket->pIOContext;
+	}
+	else
+	{
+		lpIOContext = CtxtIoAllocate(g_pCtxtListenSocket, ClientIoAccept);
+		if (lpIOContext == NULL)
+			return (FALSE);
+
+		EnterCriticalSection(&g_CriticalSection);
+		lpIOContext->pIOContextForward = g_pCtxtListenSocket->pIOContext->pIOContextForward;
+		g_pCtxtListenSocket->pIOContext->pIOContextForward = lpIOContext;
+		LeaveCriticalSection(&g_CriticalSection);
+	}
+
+	lpIOContext->SocketAccept = INVALID_SOCKET;
+	lpIOContext->SocketListen = g_psdListen[g_dwListenSockets > 1 ? dwReactor : 0];
+	lpIOContext->dwAcceptShard = dwReactor;
+	lpIOContext->bAcceptArmed = FALSE;
+
+	return (g_pCq->fnPostAccept(g_pCtxtListenSocket, lpIOContext));
+}
+
+//
+//  Whether new connections echo through a pipe with splice rather than through
+//  buffers: only where the backend can splice, and only as long as nothing has
+//  to look at the data on its way back.
+//
+static BOOL SpliceEcho(void)
+{
+
+	return (g_bSplice && g_pCq->fnPostSplice != NULL && g_pfnFrameHandler == NULL);
+}
+
+//
+//  Handle a completed accept: add the new connection to the completion queue, post
+//  its first receive, and repost the accept.
+//
+VOID AcceptCompleted(PPER_IO_CONTEXT lpIOContext, SOCKET sdAccept, BOOL bSuccess)
+{
+
+	PPER_SOCKET_CONTEXT lpPerSocketContext = NULL;
+	PPER_IO_CONTEXT lpRecvContext = NULL;
+	PSPLICE_PIPE pPipe = NULL;
+	BOOL bPosted = TRUE;
+
+	if (!bSuccess || sdAccept == INVALID_SOCKET)
+		LogPrintf(LOG_ERROR, "accept failed: %d\n", WSAGetLastError());
+	else
+	{
+		LogPrintf(LOG_VERBOSE, "WorkerThread %d: Socket(%d) accepted\n", GetCurrentThreadId(), sdAccept);
+		t_pWorkerStats->llAccepts++;
+
+		//
+		// the tuning profile's per-connection options; a socket they fail on
+		// is served untuned
+		//
+		TuneSocket(sdAccept, g_pTuneProfile);
+
+		//
+		// we add the just returned socket descriptor to the completion queue along
+		// with its associated key data.  Also the global list of context structures
+		// (the key data) gets added to a global list.  A reactor keeps the
+		// connections it accepts on its own shard.  A connection that echoes with
+		// splice gets a pipe instead of receive buffers, and echoes through
+		// buffers after all if no pipe can be had.
+		//
+		if (SpliceEcho())
+			pPipe = PipeAlloc();
+		lpPerSocketContext = UpdateCompletionPort(sdAccept, pPipe ? ClientIoSpliceIn : ClientIoRead, TRUE,
+												  ScaleShard(g_bReactors ? lpIOContext->dwAcceptShard : CQ_ANY_SHARD));
+		if (lpPerSocketContext == NULL)
+		{
+			LogPrintf(LOG_ERROR, "UpdateCompletionPort failed\n");
+			closesocket(sdAccept);
+			if (pPipe)
+				PipeFree(pPipe);
+		}
+		else if (pPipe)
+		{
+			lpPerSocketContext->pPipe = pPipe;
+			TimerShardArm(lpPerSocketContext);
+			EnterCriticalSection(&lpPerSocketContext->csIo);
+			bPosted = PostSplice(lpPerSocketContext, lpPerSocketContext->pIOContext, ClientIoSpliceIn, SPLICE_CHUNK);
+			LeaveCriticalSection(&lpPerSocketContext->csIo);
+
+			if (!bPosted)
+				CloseClient(lpPerSocketContext, FALSE);
+		}
+
+		//
+		// start its timeout, then post the initial receives on this socket,
+		// g_dwIoDepth of them, each with its own I/O context
+		//
+		else
+		{
+			TimerShardArm(lpPerSocketContext);
+			for (DWORD i = 1; i < g_dwIoDepth; i++)
+			{
+				lpRecvContext = CtxtIoAllocate(lpPerSocketContext, ClientIoRead);
+				if (lpRecvContext == NULL)
+					break;
+				lpRecvContext->pIOContextForward = lpPerSocketContext->pIOContext->pIOContextForward;
+				lpPerSocketContext->pIOContext->pIOContextForward = lpRecvContext;
+			}
+
+			EnterCriticalSection(&lpPerSocketContext->csIo);
+			for (lpRecvContext = lpPerSocketContext->pIOContext; lpRecvContext && bPosted;
+				 lpRecvContext = lpRecvContext->pIOContextForward)
+				bPosted = PostRecv(lpPerSocketContext, lpRecvContext);
+			LeaveCriticalSection(&lpPerSocketContext->csIo);
+
+			if (!bPosted)
+				CloseClient(lpPerSocketContext, FALSE);
+		}
+	}
+
+	//
+	// Keep the accept outstanding.  Multishot and readiness based backends keep
+	// it armed on their own, in which case this is a no-op.
+	//
+	if (!g_bEndServer && !g_pCq->fnPostAccept(g_pCtxtListenSocket, lpIOContext))
+		LogPrintf(LOG_ERROR, "failed to repost accept\n");
+}
+
+//
+//  Post a receive into an I/O context's buffer, numbering it so its data is echoed
+//  in order.  With shared buffers the receive is posted without one.  A buffer
+//  of another size class than the connection's now is swapped for one of its
+//  class first, or kept if that pool is out of buffers.
+//
+BOOL PostRecv(PPER_SOCKET_CONTEXT lpPerSocketContext, PPER_IO_CONTEXT lpIOContext)
+{
+
+	WSABUF buffRecv;
+	char *pBuffer = NULL;
+
+	if (!g_bSharedBuffers && lpIOContext->dwBufferClass != lpPerSocketContext->dwBufferClass &&
+		(pBuffer = (char *)CtxtPoolAlloc(g_pBufferPools[lpPerSocketContext->dwBufferClass])) != NULL)
+	{
+		CtxtPoolFree(g_pBufferPools[lpIOContext->dwBufferClass], lpIOContext->Buffer);
+		lpIOContext->Buffer = pBuffer;
+		lpIOContext->dwBufferClass = lpPerSocketContext->dwBufferClass;
+	}
+
+	lpIOContext->IOOperation = ClientIoRead;
+	lpIOContext->dwSequence = lpPerSocketContext->dwRecvSequence++;
+	buffRecv.buf = lpIOContext->Buffer;
+	buffRecv.len = BUFFER_CLASS_SIZE(lpIOContext->dwBufferClass);
+
+	lpPerSocketContext->lIoPending++;
+	if (!g_pCq->fnPostRecv(lpPerSocketContext, lpIOContext, g_bSharedBuffers ? NULL : &buffRecv))
+	{
+		lpPerSocketContext->lIoPending--;
+		return (FALSE);
+	}
+	return (TRUE);
+}
+
+//
+//  Move up to dwLength bytes from the socket into the connection's pipe
+//  (ClientIoSpliceIn), or from the pipe back out to the socket
+//  (ClientIoSpliceOut).  The connection has this one operation in flight.
+//
+BOOL PostSplice(PPER_SOCKET_CONTEXT lpPerSocketContext, PPER_IO_CONTEXT lpIOContext, IO_OPERATION SpliceOp,
+				DWORD dwLength)
+{
+
+	PSPLICE_PIPE pPipe = lpPerSocketContext->pPipe;
+
+	lpIOContext->IOOperation = SpliceOp;
+	lpPerSocketContext->lIoPending++;
+	if (!g_pCq->fnPostSplice(lpPerSocketContext, lpIOContext,
+							 SpliceOp == ClientIoSpliceIn ? pPipe->fdWrite : pPipe->fdRead, dwLength))
+	{
+		lpPerSocketContext->lIoPending--;
+		return (FALSE);
+	}
+	return (TRUE);
+}
+
+//
+//  Collect the I/O contexts whose data is still to be echoed, in receive order
+//  from the next one due, up to the first that has not been received yet and at
+//  most MAX_SEND_BUFFERS of them, or to the first whose replies wait for the
+//  write-ahead log, which is then left in apIOContext.  Those of the send in
+//  flight (ClientIoWrite) come first.  apIOContext must be zeroed by the caller.
+//
+static DWORD SendGather(PPER_SOCKET_CONTEXT lpPerSocketContext, PPER_IO_CONTEXT *apIOContext)
+{
+
+	PPER_IO_CONTEXT lpIOContext = NULL;
+	DWORD dwOffset = 0;
+	DWORD dwCount = 0;
+
+	for (lpIOContext = lpPerSocketContext->pIOContext; lpIOContext;
+		 lpIOContext = lpIOContext->pIOContextForward)
+	{
+		if (lpIOContext->IOOperation != ClientIoQueued && lpIOContext->IOOperation != ClientIoWrite)
+			continue;
+		dwOffset = lpIOContext->dwSequence - lpPerSocketContext->dwSendSequence;
+		if (dwOffset < MAX_SEND_BUFFERS)
+			apIOContext[dwOffset] = lpIOContext;
+	}
+
+	//
+	// replies are not gathered before the write-ahead log is durable up to them
+	//
+	while (dwCount < MAX_SEND_BUFFERS && apIOContext[dwCount] &&
+		   (apIOContext[dwCount]->ullWalLsn == 0 || apIOContext[dwCount]->IOOperation == ClientIoWrite ||
+			apIOContext[dwCount]->ullWalLsn <= WalDurable()))
+		dwCount++;
+	return (dwCount);
+}
+
+//
+//  A receive's data has been echoed in full: give back the buffers it was
+//  lent, and post it again, or hold it while receives are held back.
+//
+static BOOL SendRetire(PPER_SOCKET_CONTEXT lpPerSocketContext, PPER_IO_CONTEXT lpIOContext)
+{
+
+	StatsRecordLatency(lpIOContext->llRecvTime);
+	if (lpIOContext->bProvidedBuffer)
+		g_pCq->fnReleaseBuffer(lpIOContext);
+	if (lpIOContext->pCarry)
+	{
+		CtxtPoolFree(&g_BufferPool, lpIOContext->pCarry);
+		lpIOContext->pCarry = NULL;
+		lpIOContext->cbCarry = 0;
+	}
+	lpPerSocketContext->dwSendSequence++;
+	if (lpPerSocketContext->bRecvPaused)
+	{
+		lpIOContext->IOOperation = ClientIoHeld;
+		return (TRUE);
+	}
+	return (PostRecv(lpPerSocketContext, lpIOContext));
+}
+
+//
+//  Echo everything received so far in one send, in receive order, unless a send
+//  is already in flight.  Keeping a single send in flight is what keeps the
+//  echoed stream in order across partial sends; what arrives meanwhile goes out
+//  with the next one.  The send completes on the first I/O context it gathers.
+//
+BOOL PostNextSend(PPER_SOCKET_CONTEXT lpPerSocketContext)
+{
+
+	PPER_IO_CONTEXT apIOContext[MAX_SEND_BUFFERS] = {0};
+	PPER_IO_CONTEXT lpIOContext = NULL;
+	LPWSABUF lpBuffer = lpPerSocketContext->wsabufSend;
+	DWORD dwContexts = 0;
+	DWORD dwSent = 0;
+
+	if (lpPerSocketContext->bSending)
+		return (TRUE);
+
+	//
+	// a receive that came to nothing to echo (the start of a frame) is done
+	// as soon as its turn comes
+	//
+	dwContexts = SendGather(lpPerSocketContext, apIOContext);
+	while (dwContexts && apIOContext[0]->nTotalBytes == 0)
+	{
+		if (!SendRetire(lpPerSocketContext, apIOContext[0]))
+			return (FALSE);
+		ZeroMemory(apIOContext, sizeof(apIOContext));
+		dwContexts = SendGather(lpPerSocketContext, apIOContext);
+	}
+
+	//
+	// Replies held back by the write-ahead log are sent by WalReleased once it
+	// is durable; the registration counts as an operation in flight.  If the
+	// log got there in the meantime they go now.
 	//
-	// Do not set a linger value...especially don't set it to an abortive
-	// close. If you set abortive close and there happens to be a bit of
-	// data remaining to be transfered (or data that has not been
-	// acknowledged by the peer), the connection will be forcefully reset
-	// and will lead to a loss of data (i.e. the peer won't get the last
-	// bit of data). This is BAD. If you are worried about malicious
-	// clients connecting and then not sending or receiving, the server
-	// should maintain a timer on each connection. If after some point,
-	// the server deems a connection is "stale" it can then set linger
-	// to be abortive and close the connection.
+	if (dwContexts == 0 && apIOContext[0] && !lpPerSocketContext->WalWaiter.bWaiting)
+	{
+		if (WalWait(&lpPerSocketContext->WalWaiter, apIOContext[0]->ullWalLsn))
+		{
+			lpPerSocketContext->lIoPending++;
+			return (TRUE);
+		}
+		ZeroMemory(apIOContext, sizeof(apIOContext));
+		dwContexts = SendGather(lpPerSocketContext, apIOContext);
+	}
+	if (dwContexts == 0)
+		return (TRUE);
+
 	//
+	// the carry goes ahead of the replies in the buffer; the bytes sent so
+	// far count from the start of the carry
+	//
+	for (DWORD i = 0; i < dwContexts; i++)
+	{
+		lpIOContext = apIOContext[i];
+		lpIOContext->IOOperation = ClientIoWrite;
+		dwSent = lpIOContext->nSentBytes;
+		if (dwSent < lpIOContext->cbCarry)
+		{
+			lpBuffer->buf = lpIOContext->pCarry + dwSent;
+			lpBuffer->len = lpIOContext->cbCarry - dwSent;
+			lpBuffer++;
+			dwSent = lpIOContext->cbCarry;
+		}
+		if (dwSent < (DWORD)lpIOContext->nTotalBytes)
+		{
+			lpBuffer->buf = lpIOContext->Buffer + lpIOContext->dwReplyOffset + dwSent - lpIOContext->cbCarry;
+			lpBuffer->len = lpIOContext->nTotalBytes - dwSent;
+			lpBuffer++;
+		}
+	}
+	lpPerSocketContext->bSending = TRUE;
+	t_pWorkerStats->llSends++;
+	t_pWorkerStats->llSendBuffers += lpBuffer - lpPerSocketContext->wsabufSend;
+
+	lpPerSocketContext->lIoPending++;
+	if (!g_pCq->fnPostSend(lpPerSocketContext, apIOContext[0], lpPerSocketContext->wsabufSend,
+						   (DWORD)(lpBuffer - lpPerSocketContext->wsabufSend)))
+	{
+		lpPerSocketContext->lIoPending--;
+		return (FALSE);
+	}
+	return (TRUE);
+}
 
-	/*
-	LINGER lingerStruct;
+//
+//  The write-ahead log is durable up to the replies a connection was holding
+//  back, or has failed, in which case the connection is closed unanswered.
+//  Runs on the log's committer thread.
+//
+VOID WalReleased(PWAL_WAITER pWaiter, BOOL bDurable)
+{
+
+	PPER_SOCKET_CONTEXT lpPerSocketContext =
+		(PPER_SOCKET_CONTEXT)((char *)pWaiter - offsetof(PER_SOCKET_CONTEXT, WalWaiter));
+	BOOL bClose = FALSE;
+	BOOL bFree = FALSE;
+
+	EnterCriticalSection(&lpPerSocketContext->csIo);
+	lpPerSocketContext->lIoPending--;
+	if (lpPerSocketContext->bClosing || g_bEndServer)
+	{
+
+		//
+		// at shutdown the main thread closes the connection
+		//
+		bFree = (lpPerSocketContext->bClosing && lpPerSocketContext->lIoPending == 0);
+		LeaveCriticalSection(&lpPerSocketContext->csIo);
+		if (bFree)
+			CtxtListDeleteFrom(lpPerSocketContext);
+		return;
+	}
+	bClose = !bDurable || !PostNextSend(lpPerSocketContext);
+	LeaveCriticalSection(&lpPerSocketContext->csIo);
+	if (bClose)
+		CloseClient(lpPerSocketContext, FALSE);
+}
+
+//
+//  Post the receives held back by the high watermark again, once the data
+//  waiting to be echoed has fallen to the low watermark.
+//
+static BOOL RecvResume(PPER_SOCKET_CONTEXT lpPerSocketContext)
+{
+
+	PPER_IO_CONTEXT lpIOContext = NULL;
+	BOOL bPosted = TRUE;
+
+	if (!lpPerSocketContext->bRecvPaused || lpPerSocketContext->lSendQueued > (LONG)g_dwSendLowWater)
+		return (TRUE);
+
+	lpPerSocketContext->bRecvPaused = FALSE;
+	for (lpIOContext = lpPerSocketContext->pIOContext; lpIOContext && bPosted;
+		 lpIOContext = lpIOContext->pIOContextForward)
+	{
+		if (lpIOContext->IOOperation == ClientIoHeld)
+			bPosted = PostRecv(lpPerSocketContext, lpIOContext);
+	}
+	return (bPosted);
+}
+
+//
+//  Move the connection's receive buffers to the next size class up once
+//  receives keep filling them, down once they keep using a quarter at most, and
+//  to the smallest after a quiet spell.  The receives take the new class as
+//  they are posted again.
+//
+static VOID RecvSizeClass(PPER_SOCKET_CONTEXT lpPerSocketContext, PPER_IO_CONTEXT lpIOContext, DWORD dwIoSize,
+						  ULONGLONG ullNow)
+{
 
-	lingerStruct.l_onoff = 1;
-	lingerStruct.l_linger = 0;
+	DWORD cbBuffer = BUFFER_CLASS_SIZE(lpIOContext->dwBufferClass);
+	ULONGLONG ullLastRecv = lpPerSocketContext->ullLastRecv;
 
-	nRet = setsockopt(g_sdListen, SOL_SOCKET, SO_LINGER,
-					  (char *)&lingerStruct, sizeof(lingerStruct) );
-	if( nRet == SOCKET_ERROR ) {
-		myprintf("setsockopt(SO_LINGER) failed: %d\n", WSAGetLastError());
-		return(FALSE);
+	t_pWorkerStats->llRecvClasses[lpIOContext->dwBufferClass]++;
+	lpPerSocketContext->ullLastRecv = ullNow;
+	if (g_bSharedBuffers || g_dwRecvClassMin == g_dwRecvClassMax)
+		return;
+
+	if (ullLastRecv && ullNow - ullLastRecv >= RECV_QUIET_MS)
+	{
+		lpPerSocketContext->dwRecvsFull = 0;
+		lpPerSocketContext->dwRecvsSmall = 0;
+		if (lpPerSocketContext->dwBufferClass > g_dwRecvClassMin)
+		{
+			lpPerSocketContext->dwBufferClass = g_dwRecvClassMin;
+			t_pWorkerStats->llRecvShrinks++;
+		}
+	}
+	else if (dwIoSize == cbBuffer)
+	{
+
+		//
+		// a smaller buffer posted before the last growth says nothing more
+		//
+		lpPerSocketContext->dwRecvsSmall = 0;
+		if (lpIOContext->dwBufferClass >= lpPerSocketContext->dwBufferClass &&
+			++lpPerSocketContext->dwRecvsFull >= RECV_GROW_FULL &&
+			lpPerSocketContext->dwBufferClass < g_dwRecvClassMax)
+		{
+			lpPerSocketContext->dwBufferClass++;
+			lpPerSocketContext->dwRecvsFull = 0;
+			t_pWorkerStats->llRecvGrows++;
+		}
 	}
-    */
+	else if (dwIoSize <= cbBuffer / 4)
+	{
+		lpPerSocketContext->dwRecvsFull = 0;
+		if (++lpPerSocketContext->dwRecvsSmall >= RECV_SHRINK_SMALL &&
+			lpPerSocketContext->dwBufferClass > g_dwRecvClassMin)
+		{
+			lpPerSocketContext->dwBufferClass--;
+			lpPerSocketContext->dwRecvsSmall = 0;
+			t_pWorkerStats->llRecvShrinks++;
+		}
+	}
+	else
+	{
+		lpPerSocketContext->dwRecvsFull = 0;
+		lpPerSocketContext->dwRecvsSmall = 0;
+	}
+	return;
+}
+
+//
+//  A receive's data (or the replies to its frames) is ready to be echoed: hold
+//  receives back if too much now waits, and send it when its turn comes.
+//
+static BOOL RecvQueued(PPER_SOCKET_CONTEXT lpPerSocketContext, PPER_IO_CONTEXT lpIOContext)
+{
+
+	//
+	// a peer that sends faster than it reads gets its receives held back once
+	// too much is waiting to be echoed
+	//
+	lpPerSocketContext->lSendQueued += lpIOContext->nTotalBytes;
+	if (g_dwSendHighWater && !lpPerSocketContext->bRecvPaused &&
+		lpPerSocketContext->lSendQueued >= (LONG)g_dwSendHighWater)
+	{
+		lpPerSocketContext->bRecvPaused = TRUE;
+		t_pWorkerStats->llRecvPauses++;
+	}
+	return (PostNextSend(lpPerSocketContext));
+}
+
+static BOOL FrameFailed(PPER_SOCKET_CONTEXT lpPerSocketContext)
+{
+
+	LogPrintf(LOG_VERBOSE, "WorkerThread %d: Socket(%d) framing failed\n", GetCurrentThreadId(),
+			  lpPerSocketContext->Socket);
+	return (FALSE);
+}
+
+//
+//  Frame the connection's receives that are due, in the order they were
+//  posted: with a batch step the next one only, whose frames then wait in the
+//  step, otherwise every one in turn that has completed, queueing its replies.
+//  Called with the connection's lock held.  Returns FALSE if the connection
+//  is to be closed.
+//
+static BOOL FrameNext(PPER_SOCKET_CONTEXT lpPerSocketContext, PFRAME_STEP pStep)
+{
+
+	PPER_IO_CONTEXT lpIOContext = NULL;
+	PFRAME_STEP_RECEIVE pReceive = NULL;
+	FRAME_OUTPUT output;
+
+	while (!lpPerSocketContext->bFramePending)
+	{
+		for (lpIOContext = lpPerSocketContext->pIOContext; lpIOContext;
+			 lpIOContext = lpIOContext->pIOContextForward)
+		{
+			if (lpIOContext->IOOperation == ClientIoReceived &&
+				lpIOContext->dwSequence == lpPerSocketContext->dwFrameSequence)
+				break;
+		}
+		if (lpIOContext == NULL)
+			return (TRUE);
+
+		//
+		// the frames are handled with the rest of the step; until then the
+		// receive counts as in flight
+		//
+		if (pStep)
+		{
+			pReceive = &pStep->Receives[pStep->dwReceives];
+			if (!FrameCollect(&lpPerSocketContext->Frame, lpIOContext->Buffer, lpIOContext->nTotalBytes,
+							  lpPerSocketContext, &pStep->Batch, &pReceive->Output))
+				return (FrameFailed(lpPerSocketContext));
+			pReceive->lpPerSocketContext = lpPerSocketContext;
+			pReceive->lpIOContext = lpIOContext;
+			pStep->dwReceives++;
+			lpIOContext->IOOperation = ClientIoFramed;
+			lpPerSocketContext->lIoPending++;
+			lpPerSocketContext->bFramePending = TRUE;
+			return (TRUE);
+		}
+
+		if (!FrameReceive(&lpPerSocketContext->Frame, lpIOContext->Buffer, lpIOContext->nTotalBytes,
+						  g_pfnFrameHandler, lpPerSocketContext, &output))
+			return (FrameFailed(lpPerSocketContext));
+		lpPerSocketContext->dwFrameSequence++;
+		lpIOContext->pCarry = output.pCarry;
+		lpIOContext->cbCarry = output.cbCarry;
+		lpIOContext->dwReplyOffset = output.dwOffset;
+		lpIOContext->nTotalBytes = output.cbCarry + output.cbReplies;
+		lpIOContext->ullWalLsn = lpPerSocketContext->ullWalLsn;
+		lpIOContext->IOOperation = ClientIoQueued;
+		t_pWorkerStats->llFrames += output.dwFrames;
+		if (!RecvQueued(lpPerSocketContext, lpIOContext))
+			return (FALSE);
+		LogPrintf(LOG_VERBOSE, "WorkerThread %d: Socket(%d) Recv %d framed\n",
+				  GetCurrentThreadId(), lpPerSocketContext->Socket, lpIOContext->dwSequence);
+	}
+	return (TRUE);
+}
+
+//
+//  Handle the frames of the receives in a worker's batch step, whatever
+//  connections they came on, in one call to the batch handler, then pack each
+//  receive's replies and queue them as the receive would have on its own.  A
+//  receive in the step counted as an operation in flight on its connection,
+//  which may have been closed in the meantime.  The step's time tunes how many
+//  frames the next one takes.
+//
+static VOID FrameStepRun(PFRAME_STEP pStep)
+{
+
+	PFRAME_STEP_RECEIVE pReceive = NULL;
+	PPER_SOCKET_CONTEXT lpPerSocketContext = NULL;
+	PPER_IO_CONTEXT lpIOContext = NULL;
+	LARGE_INTEGER liStart;
+	LARGE_INTEGER liEnd;
+	BOOL bClose = FALSE;
+	BOOL bFree = FALSE;
+
+	QueryPerformanceCounter(&liStart);
+	if (pStep->Batch.dwViews)
+		g_pfnFrameBatch(pStep->Batch.pViews, pStep->Batch.dwViews);
+
+	for (DWORD i = 0; i < pStep->dwReceives; i++)
+	{
+		pReceive = &pStep->Receives[i];
+		lpPerSocketContext = pReceive->lpPerSocketContext;
+		lpIOContext = pReceive->lpIOContext;
+		EnterCriticalSection(&lpPerSocketContext->csIo);
+		lpPerSocketContext->lIoPending--;
+		if (lpPerSocketContext->bClosing || g_bEndServer)
+		{
+			if (pReceive->Output.pCarry)
+				CtxtPoolFree(&g_BufferPool, pReceive->Output.pCarry);
+			bFree = (lpPerSocketContext->bClosing && lpPerSocketContext->lIoPending == 0);
+			LeaveCriticalSection(&lpPerSocketContext->csIo);
+			if (bFree)
+				CtxtListDeleteFrom(lpPerSocketContext);
+			continue;
+		}
+
+		bClose = !FramePack(&pStep->Batch, lpIOContext->Buffer, &pReceive->Output);
+		if (bClose)
+		{
+			LogPrintf(LOG_VERBOSE, "WorkerThread %d: Socket(%d) frame handler closed the connection\n",
+					  GetCurrentThreadId(), lpPerSocketContext->Socket);
+		}
+		else
+		{
+			lpIOContext->pCarry = pReceive->Output.pCarry;
+			lpIOContext->cbCarry = pReceive->Output.cbCarry;
+			lpIOContext->dwReplyOffset = pReceive->Output.dwOffset;
+			lpIOContext->nTotalBytes = pReceive->Output.cbCarry + pReceive->Output.cbReplies;
+			lpIOContext->ullWalLsn = lpPerSocketContext->ullWalLsn;
+			t_pWorkerStats->llFrames += pReceive->Output.dwFrames;
+			lpIOContext->IOOperation = ClientIoQueued;
+			lpPerSocketContext->bFramePending = FALSE;
+			lpPerSocketContext->dwFrameSequence++;
+			bClose = !RecvQueued(lpPerSocketContext, lpIOContext);
+
+			//
+			// receives of the connection that completed meanwhile are framed
+			// now, on their own, as the step has been handled
+			//
+			if (!bClose)
+				bClose = !FrameNext(lpPerSocketContext, NULL);
+		}
+		LeaveCriticalSection(&lpPerSocketContext->csIo);
+		if (bClose)
+			CloseClient(lpPerSocketContext, FALSE);
+	}
+
+	QueryPerformanceCounter(&liEnd);
+	t_pWorkerStats->llFrameSteps++;
+	pStep->dwReceives = 0;
+	FrameBatchTune(&pStep->Batch, (liEnd.QuadPart - liStart.QuadPart) * 1000000 / pStep->llFrequency,
+				   g_dwFrameBudget);
+}
+
+//
+// Report a completion that failed.  On a connection already being closed it
+// is one of its operations cancelled, which is no error.
+//
+static VOID CompletionFailed(PCQ_COMPLETION lpCompletion, BOOL bClosing)
+{
+
+	if (bClosing)
+	{
+		LogPrintf(LOG_VERBOSE, "%s completion failed on a closing connection: %d\n", g_pCq->szName,
+				  lpCompletion->dwError);
+		return;
+	}
+	LogPrintf(LOG_ERROR, "%s completion failed: %d\n", g_pCq->szName, lpCompletion->dwError);
+	t_pWorkerStats->llErrors++;
+}
+
+//
+// Poll the worker's queue without blocking for up to llBudget ticks, so a
+// completion that arrives meanwhile costs no wakeup.  Returns FALSE if the
+// queue failed; *lpdwRemoved is 0 if the budget ran out first.
+//
+static BOOL WorkerSpin(DWORD dwWorker, PCQ_COMPLETION lpCompletions, LPDWORD lpdwRemoved, LONG64 llBudget)
+{
+
+	LONG64 llStart = StatsTimestamp();
+	LONG64 llNow = llStart;
+
+	do
+	{
+		if (!g_pCq->fnGetCompletions(dwWorker, lpCompletions, g_dwCompletionBatch, lpdwRemoved, 0))
+			return (FALSE);
+		llNow = StatsTimestamp();
+		if (*lpdwRemoved)
+		{
+			t_pWorkerStats->llSpinHits++;
+			break;
+		}
+		t_pWorkerStats->llSpinPolls++;
+#ifdef STATS_TSC
+		_mm_pause();
+#endif
+	} while (llNow - llStart < llBudget && !g_bEndServer);
+
+	t_pWorkerStats->llSpinTicks += llNow - llStart;
+	return (TRUE);
+}
+
+//
+// Worker thread that handles all I/O requests on any socket handle added to the
+// completion queue.
+//
+DWORD WINAPI WorkerThread(LPVOID WorkThreadContext)
+{
+
+	DWORD dwWorker = (DWORD)(DWORD_PTR)WorkThreadContext;
+	BOOL bSuccess = FALSE;
+	BOOL bExit = FALSE;
+	BOOL bClose = FALSE;
+	BOOL bFree = FALSE;
+	CQ_COMPLETION completions[CQ_MAX_BATCH];
+	DWORD dwRemoved = 0;
+	PPER_SOCKET_CONTEXT lpPerSocketContext = NULL;
+	PPER_IO_CONTEXT lpIOContext = NULL;
+	PPER_IO_CONTEXT apIOContext[MAX_SEND_BUFFERS];
+	PPER_IO_CONTEXT lpSentContext = NULL;
+	PFRAME_STEP pStep = NULL;
+	LARGE_INTEGER liFrequency;
+	DWORD dwIoSize = 0;
+	DWORD dwBuffers = 0;
+	DWORD dwSent = 0;
+	ULONGLONG ullNow = 0;
+	LONG64 llSpinBudget = 0;
+	LONG64 llWaitStart = 0;
+
+	t_pCqStats = &g_pCqStats[dwWorker];
+	t_pWorkerStats = &g_pWorkerStats[dwWorker];
+	t_dwWorker = dwWorker;
+
+	//
+	// A reactor allocates and frees the contexts of its connections itself, so
+	// it keeps its share of the preallocated contexts rather than handing them
+	// back to the other threads.
+	//
+	if (g_bReactors)
+		CtxtPoolSetThreadCacheMax(g_dwPoolPreallocate / g_dwThreadCount);
+
+	//
+	// A handler that takes frames in batches gets those of all the worker's
+	// connections at once, a step at a time.  Steps start small; under load
+	// they grow as long as they stay within the budget.
+	//
+	if (g_pfnFrameBatch && g_dwFrameBudget)
+	{
+		pStep = (PFRAME_STEP)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(FRAME_STEP));
+		if (pStep && !FrameBatchCreate(&pStep->Batch, g_bSharedBuffers ? MAX_BUFF_SIZE : BUFFER_CLASS_SIZE(g_dwRecvClassMax),
+									   FRAME_BATCH_MIN))
+		{
+			HeapFree(GetProcessHeap(), 0, pStep);
+			pStep = NULL;
+		}
+		if (pStep == NULL)
+			LogPrintf(LOG_ERROR, "WorkerThread %d: no memory for batch steps, handling frames per receive\n",
+					  GetCurrentThreadId());
+		QueryPerformanceFrequency(&liFrequency);
+		if (pStep)
+			pStep->llFrequency = liFrequency.QuadPart;
+	}
+
+	//
+	// With a spin budget the worker polls its queue for that long before it
+	// blocks, trading CPU time for the wakeup a blocking dequeue pays.
+	//
+	if (g_dwSpinBudget)
+		llSpinBudget = (LONG64)(StatsTicksPerSecond() / 1e6 * g_dwSpinBudget);
+
+	while (!bExit)
+	{
+
+		//
+		// continually loop to service io completion packets, up to
+		// g_dwCompletionBatch of them per dequeue
+		//
+		dwRemoved = 0;
+		if (g_bScaleShared && ScaleParked(dwWorker) && !g_bEndServer)
+		{
+
+			//
+			// A parked worker that shares the queue leaves it to the active
+			// ones, still advancing its timing wheel every tick.
+			//
+			ScaleWait(dwWorker, TIMER_TICK_MS);
+			bSuccess = TRUE;
+		}
+		else
+		{
+			bSuccess = llSpinBudget ? WorkerSpin(dwWorker, completions, &dwRemoved, llSpinBudget) : TRUE;
+			if (bSuccess && dwRemoved == 0)
+			{
+				t_pWorkerStats->llBlockingWaits++;
+				llWaitStart = StatsTimestamp();
+				bSuccess = g_pCq->fnGetCompletions(dwWorker, completions, g_dwCompletionBatch, &dwRemoved,
+												   (g_dwIdleTimeout || g_dwReadTimeout) ? TIMER_TICK_MS : INFINITE);
+				t_pWorkerStats->llWaitTicks += StatsTimestamp() - llWaitStart;
+			}
+		}
+		if (!bSuccess)
+		{
+			LogPrintf(LOG_ERROR, "%s dequeue failed: %d\n", g_pCq->szName, GetLastError());
+			break;
+		}
+		ullNow = GetTickCount64();
+		if (dwRemoved)
+			t_pCqStats->llDequeues++;
+		t_pCqStats->llCompletions += dwRemoved;
+		t_pWorkerStats->llCompletions += dwRemoved;
+
+		for (DWORD i = 0; i < dwRemoved; i++)
+		{
+			lpPerSocketContext = completions[i].lpPerSocketContext;
+			dwIoSize = completions[i].dwIoSize;
+			bSuccess = completions[i].bSuccess;
+
+			if (lpPerSocketContext == NULL)
+			{
+
+				//
+				// CTRL-C handler used PostQueuedCompletionStatus to post an I/O packet with
+				// a NULL CompletionKey (or if we get one for any reason).  It is time to exit,
+				// once the rest of the batch has been dealt with.
+				//
+				bExit = TRUE;
+				continue;
+			}
+
+			if (g_bEndServer)
+			{
+
+				//
+				// main thread will do all cleanup needed - see finally block
+				//
+				if (completions[i].SocketAccept != INVALID_SOCKET)
+					closesocket(completions[i].SocketAccept);
+				bExit = TRUE;
+				continue;
+			}
+
+			//
+			// accepts complete on the listening socket's context, and a zero byte
+			// accept completion does not mean the connection dropped
+			//
+			if (completions[i].lpIOContext && completions[i].lpIOContext->IOOperation == ClientIoAccept)
+			{
+				if (!bSuccess)
+					CompletionFailed(&completions[i], FALSE);
+				AcceptCompleted(completions[i].lpIOContext, completions[i].SocketAccept, bSuccess);
+				continue;
+			}
+
+			lpIOContext = completions[i].lpIOContext;
+			EnterCriticalSection(&lpPerSocketContext->csIo);
+			lpPerSocketContext->lIoPending--;
+			lpPerSocketContext->ullLastActive = ullNow;
+			if (lpPerSocketContext->bClosing)
+			{
+
+				//
+				// the connection was closed while this operation was in flight; the
+				// last operation to come back frees the context
+				//
+				if (!bSuccess)
+					CompletionFailed(&completions[i], TRUE);
+				bFree = (lpPerSocketContext->lIoPending == 0);
+				LeaveCriticalSection(&lpPerSocketContext->csIo);
+				if (bFree)
+					CtxtListDeleteFrom(lpPerSocketContext);
+				continue;
+			}
+
+			if (!bSuccess)
+				CompletionFailed(&completions[i], FALSE);
+			if (!bSuccess || (bSuccess && (dwIoSize == 0)))
+			{
+
+				//
+				// client connection dropped, continue to service remaining (and possibly
+				// new) client connections
+				//
+				LeaveCriticalSection(&lpPerSocketContext->csIo);
+				CloseClient(lpPerSocketContext, FALSE);
+				continue;
+			}
+
+			//
+			// determine what type of IO packet has completed by checking the PER_IO_CONTEXT
+			// associated with this socket.  This will determine what action to take.
+			//
+			bClose = FALSE;
+			switch (lpIOContext->IOOperation)
+			{
+			case ClientIoRead:
+
+				//
+				// a read operation has completed, echo the data back to the client from
+				// the same data buffer once the data received before it has been sent.
+				//
+				lpIOContext->IOOperation = ClientIoQueued;
+				lpIOContext->nTotalBytes = dwIoSize;
+				lpIOContext->nSentBytes = 0;
+				lpIOContext->llRecvTime = StatsTimestamp();
+				lpIOContext->ullWalLsn = 0;
+				t_pWorkerStats->llBytesIn += dwIoSize;
+				lpPerSocketContext->bReceived = TRUE;
+				RecvSizeClass(lpPerSocketContext, lpIOContext, dwIoSize, ullNow);
+
+				//
+				// With framing, what is echoed is the replies to the frames.
+				// Receives are framed in the order they were posted, and a
+				// connection's receives may complete on different workers in
+				// any order, so one that comes early waits for those before it.
+				//
+				if (g_pfnFrameHandler)
+				{
+					lpIOContext->IOOperation = ClientIoReceived;
+					bClose = !FrameNext(lpPerSocketContext, pStep);
+					break;
+				}
+
+				bClose = !RecvQueued(lpPerSocketContext, lpIOContext);
+				if (!bClose)
+				{
+					LogPrintf(LOG_VERBOSE, "WorkerThread %d: Socket(%d) Recv %d completed (%d bytes)\n",
+							  GetCurrentThreadId(), lpPerSocketContext->Socket, lpIOContext->dwSequence, dwIoSize);
+				}
+				break;
+
+			case ClientIoWrite:
+
+				//
+				// a write operation has completed: hand the bytes sent to the buffers
+				// it gathered, in order.  Every buffer sent in full is reused (or a
+				// shared one given back) for another recv, unless receives are held
+				// back; what is left of a buffer sent in part goes out first with the
+				// next send.
+				//
+				t_pWorkerStats->llBytesOut += dwIoSize;
+				lpPerSocketContext->lSendQueued -= dwIoSize;
+				ZeroMemory(apIOContext, sizeof(apIOContext));
+				dwBuffers = SendGather(lpPerSocketContext, apIOContext);
+				dwSent = dwIoSize;
+				for (DWORD j = 0; j < dwBuffers && !bClose; j++)
+				{
+					lpSentContext = apIOContext[j];
+					if (lpSentContext->IOOperation != ClientIoWrite)
+						break;
+					if (dwSent < (DWORD)(lpSentContext->nTotalBytes - lpSentContext->nSentBytes))
+					{
+						lpSentContext->nSentBytes += dwSent;
+						t_pWorkerStats->llPartialSends++;
+						break;
+					}
+					dwSent -= lpSentContext->nTotalBytes - lpSentContext->nSentBytes;
+					lpSentContext->nSentBytes = lpSentContext->nTotalBytes;
+					bClose = !SendRetire(lpPerSocketContext, lpSentContext);
+				}
+				lpPerSocketContext->bSending = FALSE;
+				bClose = bClose || !RecvResume(lpPerSocketContext) || !PostNextSend(lpPerSocketContext);
+				if (!bClose)
+				{
+					LogPrintf(LOG_VERBOSE, "WorkerThread %d: Socket(%d) Send completed (%d bytes)\n",
+							  GetCurrentThreadId(), lpPerSocketContext->Socket, dwIoSize);
+				}
+				break;
+
+			case ClientIoSpliceIn:
+
+				//
+				// the data is in the connection's pipe; splice it back out to the client
+				//
+				lpIOContext->nTotalBytes = dwIoSize;
+				lpIOContext->nSentBytes = 0;
+				lpIOContext->llRecvTime = StatsTimestamp();
+				t_pWorkerStats->llBytesIn += dwIoSize;
+				t_pWorkerStats->llSplices++;
+				lpPerSocketContext->bReceived = TRUE;
+				bClose = !PostSplice(lpPerSocketContext, lpIOContext, ClientIoSpliceOut, dwIoSize);
+				if (!bClose)
+				{
+					LogPrintf(LOG_VERBOSE, "WorkerThread %d: Socket(%d) Splice in completed (%d bytes)\n",
+							  GetCurrentThreadId(), lpPerSocketContext->Socket, dwIoSize);
+				}
+				break;
+
+			case ClientIoSpliceOut:
+
+				//
+				// once the pipe is drained, splice the next data into it
+				//
+				t_pWorkerStats->llBytesOut += dwIoSize;
+				lpIOContext->nSentBytes += dwIoSize;
+				if (lpIOContext->nSentBytes < lpIOContext->nTotalBytes)
+				{
+					t_pWorkerStats->llPartialSends++;
+					bClose = !PostSplice(lpPerSocketContext, lpIOContext, ClientIoSpliceOut,
+										 lpIOContext->nTotalBytes - lpIOContext->nSentBytes);
+				}
+				else
+				{
+					StatsRecordLatency(lpIOContext->llRecvTime);
+					bClose = !PostSplice(lpPerSocketContext, lpIOContext, ClientIoSpliceIn, SPLICE_CHUNK);
+				}
+				if (!bClose)
+				{
+					LogPrintf(LOG_VERBOSE, "WorkerThread %d: Socket(%d) Splice out completed (%d bytes)\n",
+							  GetCurrentThreadId(), lpPerSocketContext->Socket, dwIoSize);
+				}
+				break;
+
+			default:
+				break;
+			} //switch
+
+			LeaveCriticalSection(&lpPerSocketContext->csIo);
+			if (bClose)
+				CloseClient(lpPerSocketContext, FALSE);
+
+			//
+			// a step that reached its target is handled now, and its sends go
+			// out rather than wait for the rest of the completion batch
+			//
+			if (pStep && pStep->Batch.dwViews >= pStep->Batch.dwTarget)
+			{
+				FrameStepRun(pStep);
+				g_pCq->fnFlush(dwWorker);
+			}
+		}	  //for
+
+		//
+		// handle what the step holds, close the connections whose timeout
+		// passed, then the receives and sends posted for the whole batch go out
+		// together
+		//
+		if (pStep && pStep->dwReceives)
+			FrameStepRun(pStep);
+		TimerShardAdvance(dwWorker);
+		g_pCq->fnFlush(dwWorker);
+	} //while
+
+	if (pStep)
+	{
+		FrameBatchDestroy(&pStep->Batch);
+		HeapFree(GetProcessHeap(), 0, pStep);
+	}
+	CtxtPoolFlushThread();
+	PipePoolFlushThread();
+	LogReleaseThread();
+	return (0);
+}
+
+//
+// Timeout of a connection in ticks: the read timeout until data first arrives
+// (when there is one), the idle timeout after that.  0 means none.
+//
+static ULONGLONG TimerTimeout(PPER_SOCKET_CONTEXT lpPerSocketContext)
+{
 
-	freeaddrinfo(addrlocal);
+	DWORD dwSeconds = (lpPerSocketContext->bReceived || g_dwReadTimeout == 0) ? g_dwIdleTimeout : g_dwReadTimeout;
 
-	return (TRUE);
+	return (((ULONGLONG)dwSeconds * 1000 + TIMER_TICK_MS - 1) / TIMER_TICK_MS);
 }
 
 //
-// Worker thread that handles all I/O requests on any socket handle added to the IOCP.
+// Put a new connection on the calling worker's timing wheel.  Called before its
+// first receive is posted, so nothing can close it concurrently yet.
 //
-DWORD WINAPI WorkerThread(LPVOID WorkThreadContext)
+VOID TimerShardArm(PPER_SOCKET_CONTEXT lpPerSocketContext)
 {
 
-	HANDLE hIOCP = (HANDLE)WorkThreadContext;
-	BOOL bSuccess = FALSE;
-	int nRet = 0;
-	LPWSAOVERLAPPED lpOverlapped = NULL;
-	PPER_SOCKET_CONTEXT lpPerSocketContext = NULL;
-	PPER_IO_CONTEXT lpIOContext = NULL;
-	WSABUF buffRecv;
-	WSABUF buffSend;
-	DWORD dwRecvNumBytes = 0;
-	DWORD dwSendNumBytes = 0;
-	DWORD dwFlags = 0;
-	DWORD dwIoSize = 0;
+	PTIMER_SHARD pShard = NULL;
+	ULONGLONG ullTimeout = TimerTimeout(lpPerSocketContext);
 
-	while (TRUE)
-	{
+	if (ullTimeout == 0 || t_dwWorker == TIMER_SHARD_NONE)
+		return;
 
-		//
-		// continually loop to service io completion packets
-		//
-		bSuccess = GetQueuedCompletionStatus(hIOCP, &dwIoSize,
-											 (PDWORD_PTR)&lpPerSocketContext,
-											 (LPOVERLAPPED *)&lpOverlapped,
-											 INFINITE);
-		if (!bSuccess)
-			myprintf("GetQueuedCompletionStatus() failed: %d\n", GetLastError());
+	pShard = &g_pTimerShards[t_dwWorker];
+	lpPerSocketContext->ullLastActive = GetTickCount64();
+	lpPerSocketContext->dwTimerShard = t_dwWorker;
+	EnterCriticalSection(&pShard->CriticalSection);
+	TimerSet(&pShard->Wheel, &lpPerSocketContext->Timer, lpPerSocketContext->ullLastActive / TIMER_TICK_MS + ullTimeout);
+	LeaveCriticalSection(&pShard->CriticalSection);
+	return;
+}
 
-		if (lpPerSocketContext == NULL)
-		{
+VOID TimerShardCancel(PPER_SOCKET_CONTEXT lpPerSocketContext)
+{
 
-			//
-			// CTRL-C handler used PostQueuedCompletionStatus to post an I/O packet with
-			// a NULL CompletionKey (or if we get one for any reason).  It is time to exit.
-			//
-			return (0);
-		}
+	PTIMER_SHARD pShard = NULL;
 
-		if (g_bEndServer)
-		{
+	if (lpPerSocketContext->dwTimerShard == TIMER_SHARD_NONE)
+		return;
 
-			//
-			// main thread will do all cleanup needed - see finally block
-			//
-			return (0);
-		}
+	pShard = &g_pTimerShards[lpPerSocketContext->dwTimerShard];
+	EnterCriticalSection(&pShard->CriticalSection);
+	TimerCancel(&pShard->Wheel, &lpPerSocketContext->Timer);
+	LeaveCriticalSection(&pShard->CriticalSection);
+	lpPerSocketContext->dwTimerShard = TIMER_SHARD_NONE;
+	return;
+}
 
-		if (!bSuccess || (bSuccess && (dwIoSize == 0)))
-		{
+//
+// Fire the worker's timers that are due.  The wheel's lock is held while they
+// fire, so a connection being closed on another thread waits in
+// TimerShardCancel and its context stays valid.
+//
+VOID TimerShardAdvance(DWORD dwWorker)
+{
 
-			//
-			// client connection dropped, continue to service remaining (and possibly
-			// new) client connections
-			//
-			CloseClient(lpPerSocketContext, FALSE);
-			continue;
-		}
+	PTIMER_SHARD pShard = &g_pTimerShards[dwWorker];
+	ULONGLONG ullTick = GetTickCount64() / TIMER_TICK_MS;
 
-		//
-		// determine what type of IO packet has completed by checking the PER_IO_CONTEXT
-		// associated with this socket.  This will determine what action to take.
-		//
-		lpIOContext = (PPER_IO_CONTEXT)lpOverlapped;
-		switch (lpIOContext->IOOperation)
-		{
-		case ClientIoRead:
+	if (pShard->Wheel.ullNow > ullTick)
+		return;
 
-			//
-			// a read operation has completed, post a write operation to echo the
-			// data back to the client using the same data buffer.
-			//
-			lpIOContext->IOOperation = ClientIoWrite;
-			lpIOContext->nTotalBytes = dwIoSize;
-			lpIOContext->nSentBytes = 0;
-			lpIOContext->wsabuf.len = dwIoSize;
-			dwFlags = 0;
-
-			nRet = WSASend(lpPerSocketContext->Socket, &lpIOContext->wsabuf, 1,
-						   &dwSendNumBytes, dwFlags, &(lpIOContext->Overlapped), NULL);
-			if (nRet == SOCKET_ERROR && (ERROR_IO_PENDING != WSAGetLastError()))
-			{
-				myprintf("WSASend() failed: %d\n", WSAGetLastError());
-				CloseClient(lpPerSocketContext, FALSE);
-			}
-			else if (g_bVerbose)
-			{
-				myprintf("WorkerThread %d: Socket(%d) Recv completed (%d bytes), Send posted\n",
-						 GetCurrentThreadId(), lpPerSocketContext->Socket, dwIoSize);
-			}
-			break;
+	EnterCriticalSection(&pShard->CriticalSection);
+	TimerWheelAdvance(&pShard->Wheel, ullTick, TimerExpired, pShard);
+	LeaveCriticalSection(&pShard->CriticalSection);
+	return;
+}
 
-		case ClientIoWrite:
+//
+// A connection's timer fired.  If it saw I/O since the timer was set, move the
+// timer to the new deadline; otherwise the client is stale and the connection
+// is reset.
+//
+VOID TimerExpired(PTIMER_ENTRY pTimer, LPVOID lpParam)
+{
 
-			//
-			// a write operation has completed, determine if all the data intended to be
-			// sent actually was sent.
-			//
-			lpIOContext->IOOperation = ClientIoWrite;
-			lpIOContext->nSentBytes += dwIoSize;
-			dwFlags = 0;
-			if (lpIOContext->nSentBytes < lpIOContext->nTotalBytes)
-			{
+	PTIMER_SHARD pShard = (PTIMER_SHARD)lpParam;
+	PPER_SOCKET_CONTEXT lpPerSocketContext =
+		(PPER_SOCKET_CONTEXT)((char *)pTimer - offsetof(PER_SOCKET_CONTEXT, Timer));
+	ULONGLONG ullTimeout = TimerTimeout(lpPerSocketContext);
+	ULONGLONG ullDeadline = lpPerSocketContext->ullLastActive / TIMER_TICK_MS + ullTimeout;
 
-				//
-				// the previous write operation didn't send all the data,
-				// post another send to complete the operation
-				//
-				buffSend.buf = lpIOContext->Buffer + lpIOContext->nSentBytes;
-				buffSend.len = lpIOContext->nTotalBytes - lpIOContext->nSentBytes;
-				nRet = WSASend(lpPerSocketContext->Socket, &buffSend, 1,
-							   &dwSendNumBytes, dwFlags, &(lpIOContext->Overlapped), NULL);
-				if (nRet == SOCKET_ERROR && (ERROR_IO_PENDING != WSAGetLastError()))
-				{
-					myprintf("WSASend() failed: %d\n", WSAGetLastError());
-					CloseClient(lpPerSocketContext, FALSE);
-				}
-				else if (g_bVerbose)
-				{
-					myprintf("WorkerThread %d: Socket(%d) Send partially completed (%d bytes), Recv posted\n",
-							 GetCurrentThreadId(), lpPerSocketContext->Socket, dwIoSize);
-				}
-			}
-			else
-			{
+	if (lpPerSocketContext->bClosing || ullTimeout == 0)
+		return;
 
-				//
-				// previous write operation completed for this socket, post another recv
-				//
-				lpIOContext->IOOperation = ClientIoRead;
-				dwRecvNumBytes = 0;
-				dwFlags = 0;
-				buffRecv.buf = lpIOContext->Buffer,
-				buffRecv.len = MAX_BUFF_SIZE;
-				nRet = WSARecv(lpPerSocketContext->Socket, &buffRecv, 1,
-							   &dwRecvNumBytes, &dwFlags, &lpIOContext->Overlapped, NULL);
-				if (nRet == SOCKET_ERROR && (ERROR_IO_PENDING != WSAGetLastError()))
-				{
-					myprintf("WSARecv() failed: %d\n", WSAGetLastError());
-					CloseClient(lpPerSocketContext, FALSE);
-				}
-				else if (g_bVerbose)
-				{
-					myprintf("WorkerThread %d: Socket(%d) Send completed (%d bytes), Recv posted\n",
-							 GetCurrentThreadId(), lpPerSocketContext->Socket, dwIoSize);
-				}
-			}
-			break;
+	if (ullDeadline >= pShard->Wheel.ullNow)
+	{
+		TimerSet(&pShard->Wheel, pTimer, ullDeadline);
+		return;
+	}
 
-		} //switch
-	}	  //while
-	return (0);
+	LogPrintf(LOG_VERBOSE, "TimerExpired: Socket(%d) timed out (%s)\n", lpPerSocketContext->Socket,
+			  lpPerSocketContext->bReceived ? "idle" : "no data");
+	t_pWorkerStats->llTimeouts++;
+	CloseClient(lpPerSocketContext, FALSE);
+	return;
+}
+
+//
+//  Pin a reactor to one logical processor, counting across processor groups and
+//  wrapping around when there are more reactors than processors.
+//
+BOOL SetReactorAffinity(HANDLE hThread, DWORD dwReactor)
+{
+
+	GROUP_AFFINITY affinity;
+	DWORD dwProcessor = dwReactor % GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+	DWORD dwGroupProcessors = 0;
+	WORD wGroups = GetActiveProcessorGroupCount();
+
+	ZeroMemory(&affinity, sizeof(affinity));
+	for (WORD wGroup = 0; wGroup < wGroups; wGroup++)
+	{
+		dwGroupProcessors = GetActiveProcessorCount(wGroup);
+		if (dwProcessor < dwGroupProcessors)
+		{
+			affinity.Group = wGroup;
+			affinity.Mask = (KAFFINITY)1 << dwProcessor;
+			return (SetThreadGroupAffinity(hThread, &affinity, NULL));
+		}
+		dwProcessor -= dwGroupProcessors;
+	}
+	return (FALSE);
 }
 
 //
-//  Allocate a context structures for the socket and add the socket to the IOCP.
-//  Additionally, add the context structure to the global list of context structures.
+//  Allocate a context structures for the socket and add the socket to the completion
+//  queue.  Additionally, add the context structure to the global list of context
+//  structures.
 //
 PPER_SOCKET_CONTEXT UpdateCompletionPort(SOCKET sd, IO_OPERATION ClientIo,
-										 BOOL bAddToList)
+										 BOOL bAddToList, DWORD dwShard)
 {
 
 	PPER_SOCKET_CONTEXT lpPerSocketContext;
@@ -689,14 +2215,11 @@ PPER_SOCKET_CONTEXT UpdateCompletionPort(SOCKET sd, IO_OPERATION ClientIo,
 	lpPerSocketContext = CtxtAllocate(sd, ClientIo);
 	if (lpPerSocketContext == NULL)
 		return (NULL);
+	lpPerSocketContext->dwShard = dwShard;
 
-	g_hIOCP = CreateIoCompletionPort((HANDLE)sd, g_hIOCP, (DWORD_PTR)lpPerSocketContext, 0);
-	if (g_hIOCP == NULL)
+	if (!g_pCq->fnAssociate(lpPerSocketContext))
 	{
-		myprintf("CreateIoCompletionPort() failed: %d\n", GetLastError());
-		if (lpPerSocketContext->pIOContext)
-			xfree(lpPerSocketContext->pIOContext);
-		xfree(lpPerSocketContext);
+		CtxtFree(lpPerSocketContext);
 		return (NULL);
 	}
 
@@ -707,8 +2230,8 @@ PPER_SOCKET_CONTEXT UpdateCompletionPort(SOCKET sd, IO_OPERATION ClientIo,
 	if (bAddToList)
 		CtxtListAddTo(lpPerSocketContext);
 
-	if (g_bVerbose)
-		myprintf("UpdateCompletionPort: Socket(%d) added to IOCP\n", lpPerSocketContext->Socket);
+	LogPrintf(LOG_VERBOSE, "UpdateCompletionPort: Socket(%d) added to %s completion queue\n",
+			  lpPerSocketContext->Socket, g_pCq->szName);
 
 	return (lpPerSocketContext);
 }
@@ -716,124 +2239,163 @@ PPER_SOCKET_CONTEXT UpdateCompletionPort(SOCKET sd, IO_OPERATION ClientIo,
 //
 //  Close down a connection with a client.  This involves closing the socket (when
 //  initiated as a result of a CTRL-C the socket closure is not graceful).  Additionally,
-//  any context data associated with that socket is free'd.
+//  any context data associated with that socket is free'd, right away if no operation
+//  is in flight on it and otherwise when the last one comes back.
 //
 VOID CloseClient(PPER_SOCKET_CONTEXT lpPerSocketContext,
 				 BOOL bGraceful)
 {
 
-	// __try
-	{
-		EnterCriticalSection(&g_CriticalSection);
-	}
-	// __except (EXCEPTION_EXECUTE_HANDLER)
-	// {
-	// 	myprintf("EnterCriticalSection raised an exception.\n");
-	// 	return;
-	// }
+	BOOL bClosed = FALSE;
+	BOOL bFree = FALSE;
 
 	if (lpPerSocketContext)
 	{
-		if (g_bVerbose)
-			myprintf("CloseClient: Socket(%d) connection closing (graceful=%s)\n",
-					 lpPerSocketContext->Socket, (bGraceful ? "TRUE" : "FALSE"));
-		if (!bGraceful)
+		EnterCriticalSection(&lpPerSocketContext->csIo);
+		if (!lpPerSocketContext->bClosing)
 		{
+			LogPrintf(LOG_VERBOSE, "CloseClient: Socket(%d) connection closing (graceful=%s)\n",
+					  lpPerSocketContext->Socket, (bGraceful ? "TRUE" : "FALSE"));
+			lpPerSocketContext->bClosing = TRUE;
+			bClosed = TRUE;
+			t_pWorkerStats->llCloses++;
 
 			//
-			// force the subsequent closesocket to be abortative.
+			// have the operations still in flight complete
 			//
-			LINGER lingerStruct;
+			if (g_bCqCreated && lpPerSocketContext->lIoPending)
+				g_pCq->fnCancel(lpPerSocketContext);
+
+			if (!bGraceful)
+			{
+
+				//
+				// force the subsequent closesocket to be abortative.
+				//
+				LINGER lingerStruct;
 
-			lingerStruct.l_onoff = 1;
-			lingerStruct.l_linger = 0;
-			setsockopt(lpPerSocketContext->Socket, SOL_SOCKET, SO_LINGER,
-					   (char *)&lingerStruct, sizeof(lingerStruct));
+				lingerStruct.l_onoff = 1;
+				lingerStruct.l_linger = 0;
+				setsockopt(lpPerSocketContext->Socket, SOL_SOCKET, SO_LINGER,
+						   (char *)&lingerStruct, sizeof(lingerStruct));
+			}
+			closesocket(lpPerSocketContext->Socket);
+			lpPerSocketContext->Socket = INVALID_SOCKET;
 		}
-		closesocket(lpPerSocketContext->Socket);
-		lpPerSocketContext->Socket = INVALID_SOCKET;
-		CtxtListDeleteFrom(lpPerSocketContext);
+
+		//
+		// Once the completion queue is closed (at shutdown) nothing is in flight
+		// any more, whatever the count says.  Otherwise a connection that was
+		// already closing is freed by whoever brought the count to 0.
+		//
+		bFree = ((bClosed && lpPerSocketContext->lIoPending == 0) || !g_bCqCreated);
+		LeaveCriticalSection(&lpPerSocketContext->csIo);
+
+		if (bFree)
+			CtxtListDeleteFrom(lpPerSocketContext);
 		lpPerSocketContext = NULL;
 	}
 	else
 	{
-		myprintf("CloseClient: lpPerSocketContext is NULL\n");
+		LogPrintf(LOG_ERROR, "CloseClient: lpPerSocketContext is NULL\n");
 	}
 
-	LeaveCriticalSection(&g_CriticalSection);
-
 	return;
 }
 
 //
-// Allocate a socket context for the new connection.
+// Allocate a socket context for the new connection, along with its first I/O
+// context.  Both come from the context pools, so no lock is needed.
 //
 PPER_SOCKET_CONTEXT CtxtAllocate(SOCKET sd, IO_OPERATION ClientIO)
 {
 
 	PPER_SOCKET_CONTEXT lpPerSocketContext;
 
-	// __try
+	lpPerSocketContext = (PPER_SOCKET_CONTEXT)CtxtPoolAlloc(&g_SocketContextPool);
+	if (lpPerSocketContext == NULL)
 	{
-		EnterCriticalSection(&g_CriticalSection);
+		LogPrintf(LOG_ERROR, "CtxtPoolAlloc() PER_SOCKET_CONTEXT failed\n");
+		return (NULL);
 	}
-	// __except (EXCEPTION_EXECUTE_HANDLER)
-	// {
-	// 	myprintf("EnterCriticalSection raised an exception.\n");
-	// 	return NULL;
-	// }
 
-	lpPerSocketContext = (PPER_SOCKET_CONTEXT)xmalloc(sizeof(PER_SOCKET_CONTEXT));
-	if (lpPerSocketContext)
+	ZeroMemory(lpPerSocketContext, sizeof(PER_SOCKET_CONTEXT));
+	lpPerSocketContext->dwTimerShard = TIMER_SHARD_NONE;
+	lpPerSocketContext->dwBufferClass = g_dwRecvClassStart;
+	lpPerSocketContext->Socket = sd;
+	lpPerSocketContext->dwConnectionId = CtxtPoolIndex(lpPerSocketContext);
+	lpPerSocketContext->ullLastActive = GetTickCount64();
+	lpPerSocketContext->pIOContext = CtxtIoAllocate(lpPerSocketContext, ClientIO);
+	if (lpPerSocketContext->pIOContext == NULL)
 	{
-		lpPerSocketContext->pIOContext = (PPER_IO_CONTEXT)xmalloc(sizeof(PER_IO_CONTEXT));
-		if (lpPerSocketContext->pIOContext)
-		{
-			lpPerSocketContext->Socket = sd;
-			lpPerSocketContext->pCtxtBack = NULL;
-			lpPerSocketContext->pCtxtForward = NULL;
-
-			lpPerSocketContext->pIOContext->Overlapped.Internal = 0;
-			lpPerSocketContext->pIOContext->Overlapped.InternalHigh = 0;
-			lpPerSocketContext->pIOContext->Overlapped.Offset = 0;
-			lpPerSocketContext->pIOContext->Overlapped.OffsetHigh = 0;
-			lpPerSocketContext->pIOContext->Overlapped.hEvent = NULL;
-			lpPerSocketContext->pIOContext->IOOperation = ClientIO;
-			lpPerSocketContext->pIOContext->pIOContextForward = NULL;
-			lpPerSocketContext->pIOContext->nTotalBytes = 0;
-			lpPerSocketContext->pIOContext->nSentBytes = 0;
-			lpPerSocketContext->pIOContext->wsabuf.buf = lpPerSocketContext->pIOContext->Buffer;
-			lpPerSocketContext->pIOContext->wsabuf.len = sizeof(lpPerSocketContext->pIOContext->Buffer);
-
-			ZeroMemory(lpPerSocketContext->pIOContext->wsabuf.buf, lpPerSocketContext->pIOContext->wsabuf.len);
-		}
-		else
-		{
-			xfree(lpPerSocketContext);
-			myprintf("HeapAlloc() PER_IO_CONTEXT failed: %d\n", GetLastError());
-		}
+		CtxtPoolFree(&g_SocketContextPool, lpPerSocketContext);
+		return (NULL);
 	}
-	else
+	InitializeCriticalSection(&lpPerSocketContext->csIo);
+
+	return (lpPerSocketContext);
+}
+
+//
+// Allocate an I/O context for a socket, with a data buffer unless it is a receive
+// and buffers are shared.  A receive's is of the connection's size class, an
+// accept's MAX_BUFF_SIZE.  The data buffer is not cleared: every send only covers
+// bytes a receive has just written.
+//
+PPER_IO_CONTEXT CtxtIoAllocate(PPER_SOCKET_CONTEXT lpPerSocketContext, IO_OPERATION ClientIO)
+{
+
+	PPER_IO_CONTEXT lpIOContext;
+
+	lpIOContext = (PPER_IO_CONTEXT)CtxtPoolAlloc(&g_IoContextPool);
+	if (lpIOContext == NULL)
 	{
-		myprintf("HeapAlloc() PER_SOCKET_CONTEXT failed: %d\n", GetLastError());
+		LogPrintf(LOG_ERROR, "CtxtPoolAlloc() PER_IO_CONTEXT failed\n");
+		return (NULL);
 	}
 
-	LeaveCriticalSection(&g_CriticalSection);
+	ZeroMemory(&lpIOContext->Overlapped, sizeof(lpIOContext->Overlapped));
+	ZeroMemory(&lpIOContext->Buffer, sizeof(PER_IO_CONTEXT) - offsetof(PER_IO_CONTEXT, Buffer));
 
-	return (lpPerSocketContext);
+	//
+	// AcceptEx writes the addresses into the accept context's buffer, and a
+	// splice moves the data without one
+	//
+	lpIOContext->dwBufferClass = BUFFER_CLASS_DEFAULT;
+	if (!g_bSharedBuffers && ClientIO == ClientIoRead)
+		lpIOContext->dwBufferClass = lpPerSocketContext->dwBufferClass;
+	if ((!g_bSharedBuffers || ClientIO == ClientIoAccept) && ClientIO != ClientIoSpliceIn)
+	{
+		lpIOContext->Buffer = (char *)CtxtPoolAlloc(g_pBufferPools[lpIOContext->dwBufferClass]);
+		if (lpIOContext->Buffer == NULL)
+		{
+			LogPrintf(LOG_ERROR, "CtxtPoolAlloc() buffer failed\n");
+			CtxtPoolFree(&g_IoContextPool, lpIOContext);
+			return (NULL);
+		}
+	}
+	lpIOContext->IOOperation = ClientIO;
+	lpIOContext->SocketAccept = INVALID_SOCKET;
+	lpIOContext->pSocketContext = lpPerSocketContext;
+	lpIOContext->wsabuf.buf = lpIOContext->Buffer;
+	lpIOContext->wsabuf.len = lpIOContext->Buffer ? BUFFER_CLASS_SIZE(lpIOContext->dwBufferClass) : 0;
+
+	return (lpIOContext);
 }
 
 //
 //  Add a client connection context structure to the global list of context structures.
+//  The list is sharded by connection id; only that shard is locked.
 //
 VOID CtxtListAddTo(PPER_SOCKET_CONTEXT lpPerSocketContext)
 {
 
+	PCTXT_LIST_SHARD pShard = &g_CtxtListShards[lpPerSocketContext->dwConnectionId & (CTXT_LIST_SHARDS - 1)];
 	PPER_SOCKET_CONTEXT pTemp;
 
 	// __try
 	{
-		EnterCriticalSection(&g_CriticalSection);
+		EnterCriticalSection(&pShard->CriticalSection);
 	}
 	// __except (EXCEPTION_EXECUTE_HANDLER)
 	// {
@@ -841,49 +2403,54 @@ VOID CtxtListAddTo(PPER_SOCKET_CONTEXT lpPerSocketContext)
 	// 	return;
 	// }
 
-	if (g_pCtxtList == NULL)
-	{
-
-		//
-		// add the first node to the linked list
-		//
-		lpPerSocketContext->pCtxtBack = NULL;
-		lpPerSocketContext->pCtxtForward = NULL;
-		g_pCtxtList = lpPerSocketContext;
-	}
-	else
-	{
-
-		//
-		// add node to head of list
-		//
-		pTemp = g_pCtxtList;
+	//
+	// add node to head of list
+	//
+	pTemp = pShard->pCtxtList;
 
-		g_pCtxtList = lpPerSocketContext;
-		lpPerSocketContext->pCtxtBack = pTemp;
-		lpPerSocketContext->pCtxtForward = NULL;
+	pShard->pCtxtList = lpPerSocketContext;
+	lpPerSocketContext->pCtxtBack = pTemp;
+	lpPerSocketContext->pCtxtForward = NULL;
+	lpPerSocketContext->bInList = TRUE;
+	pShard->lCount++;
 
+	if (pTemp)
 		pTemp->pCtxtForward = lpPerSocketContext;
-	}
 
-	LeaveCriticalSection(&g_CriticalSection);
+	LeaveCriticalSection(&pShard->CriticalSection);
+	LogPrintf(LOG_VERBOSE, "WorkerThread %d: Socket(%d) is connection %u\n", GetCurrentThreadId(),
+			  lpPerSocketContext->Socket, lpPerSocketContext->dwConnectionId);
 	return;
 }
 
 //
-//  Remove a client context structure from the global list of context structures.
+//  Remove a client context structure from the global list of context structures
+//  and free it.
 //
 VOID CtxtListDeleteFrom(PPER_SOCKET_CONTEXT lpPerSocketContext)
 {
 
+	PCTXT_LIST_SHARD pShard = NULL;
 	PPER_SOCKET_CONTEXT pBack;
 	PPER_SOCKET_CONTEXT pForward;
-	PPER_IO_CONTEXT pNextIO = NULL;
-	PPER_IO_CONTEXT pTempIO = NULL;
+
+	if (lpPerSocketContext == NULL)
+	{
+		LogPrintf(LOG_ERROR, "CtxtListDeleteFrom: lpPerSocketContext is NULL\n");
+		return;
+	}
+
+	//
+	// off the timing wheel first: a firing timer closes its connection with the
+	// wheel's lock held, which may take this list's lock
+	//
+	TimerShardCancel(lpPerSocketContext);
+
+	pShard = &g_CtxtListShards[lpPerSocketContext->dwConnectionId & (CTXT_LIST_SHARDS - 1)];
 
 	// __try
 	{
-		EnterCriticalSection(&g_CriticalSection);
+		EnterCriticalSection(&pShard->CriticalSection);
 	}
 	// __except (EXCEPTION_EXECUTE_HANDLER)
 	// {
@@ -891,139 +2458,130 @@ VOID CtxtListDeleteFrom(PPER_SOCKET_CONTEXT lpPerSocketContext)
 	// 	return;
 	// }
 
-	if (lpPerSocketContext)
+	if (lpPerSocketContext->bInList)
 	{
 		pBack = lpPerSocketContext->pCtxtBack;
 		pForward = lpPerSocketContext->pCtxtForward;
 
-		if ((pBack == NULL) && (pForward == NULL))
-		{
+		if (pForward)
+			pForward->pCtxtBack = pBack;
+		else
+			pShard->pCtxtList = pBack;
+		if (pBack)
+			pBack->pCtxtForward = pForward;
 
-			//
-			// This is the only node in the list to delete
-			//
-			g_pCtxtList = NULL;
-		}
-		else if ((pBack == NULL) && (pForward != NULL))
-		{
+		lpPerSocketContext->bInList = FALSE;
+		pShard->lCount--;
+	}
 
-			//
-			// This is the start node in the list to delete
-			//
-			pForward->pCtxtBack = NULL;
-			g_pCtxtList = pForward;
-		}
-		else if ((pBack != NULL) && (pForward == NULL))
-		{
+	LeaveCriticalSection(&pShard->CriticalSection);
 
-			//
-			// This is the end node in the list to delete
-			//
-			pBack->pCtxtForward = NULL;
-		}
-		else if (pBack && pForward)
-		{
+	CtxtFree(lpPerSocketContext);
+	return;
+}
 
-			//
-			// Neither start node nor end node in the list
-			//
-			pBack->pCtxtForward = pForward;
-			pForward->pCtxtBack = pBack;
-		}
+//
+//  Free a socket context and all of its i/o context structures.
+//
+VOID CtxtFree(PPER_SOCKET_CONTEXT lpPerSocketContext)
+{
+
+	PPER_IO_CONTEXT pNextIO = NULL;
+	PPER_IO_CONTEXT pTempIO = NULL;
+
+	pTempIO = (PPER_IO_CONTEXT)(lpPerSocketContext->pIOContext);
+	while (pTempIO)
+	{
+		pNextIO = (PPER_IO_CONTEXT)(pTempIO->pIOContextForward);
 
 		//
-		// Free all i/o context structures per socket
+		// accept contexts may still hold a socket waiting for an AcceptEx
 		//
-		pTempIO = (PPER_IO_CONTEXT)(lpPerSocketContext->pIOContext);
-		do
-		{
-			pNextIO = (PPER_IO_CONTEXT)(pTempIO->pIOContextForward);
-			if (pTempIO)
-			{
-
-				//
-				//The overlapped structure is safe to free when only the posted i/o has
-				//completed. Here we only need to test those posted but not yet received
-				//by PQCS in the shutdown process.
-				//
-				if (g_bEndServer)
-					while (!HasOverlappedIoCompleted((LPOVERLAPPED)pTempIO))
-						Sleep(0);
-				xfree(pTempIO);
-				pTempIO = NULL;
-			}
-			pTempIO = pNextIO;
-		} while (pNextIO);
+		if (pTempIO->SocketAccept != INVALID_SOCKET)
+			closesocket(pTempIO->SocketAccept);
 
-		xfree(lpPerSocketContext);
-		lpPerSocketContext = NULL;
-	}
-	else
-	{
-		myprintf("CtxtListDeleteFrom: lpPerSocketContext is NULL\n");
+		//
+		//The overlapped structure is safe to free when only the posted i/o has
+		//completed. Here we only need to test those posted but not yet received
+		//by PQCS in the shutdown process.
+		//
+		if (g_bEndServer)
+			while (!HasOverlappedIoCompleted((LPOVERLAPPED)pTempIO))
+				Sleep(0);
+		if (pTempIO->bProvidedBuffer)
+			g_pCq->fnReleaseBuffer(pTempIO);
+		else if (pTempIO->Buffer)
+			CtxtPoolFree(g_pBufferPools[pTempIO->dwBufferClass], pTempIO->Buffer);
+		if (pTempIO->pCarry)
+			CtxtPoolFree(&g_BufferPool, pTempIO->pCarry);
+		CtxtPoolFree(&g_IoContextPool, pTempIO);
+		pTempIO = pNextIO;
 	}
+	if (lpPerSocketContext->pPipe)
+		PipeFree(lpPerSocketContext->pPipe);
+	FrameStateFree(&lpPerSocketContext->Frame);
 
-	LeaveCriticalSection(&g_CriticalSection);
+	DeleteCriticalSection(&lpPerSocketContext->csIo);
+	CtxtPoolFree(&g_SocketContextPool, lpPerSocketContext);
 	return;
 }
 
 //
-//  Free all context structure in the global list of context structures.
+//  Run lpRoutine on the connection with the given id, if it is still open.
 //
-VOID CtxtListFree()
+BOOL CtxtListLookup(DWORD dwConnectionId, PCTXT_LIST_ROUTINE lpRoutine, LPVOID lpParam)
 {
 
-	PPER_SOCKET_CONTEXT pTemp1, pTemp2;
+	PCTXT_LIST_SHARD pShard = &g_CtxtListShards[dwConnectionId & (CTXT_LIST_SHARDS - 1)];
+	PPER_SOCKET_CONTEXT lpPerSocketContext = NULL;
+	BOOL bFound = FALSE;
 
-	// __try
-	{
-		EnterCriticalSection(&g_CriticalSection);
-	}
-	// __except (EXCEPTION_EXECUTE_HANDLER)
-	// {
-	// 	myprintf("EnterCriticalSection raised an exception.\n");
-	// 	return;
-	// }
+	lpPerSocketContext = (PPER_SOCKET_CONTEXT)CtxtPoolObject(&g_SocketContextPool, dwConnectionId);
+	if (lpPerSocketContext == NULL)
+		return (FALSE);
 
-	pTemp1 = g_pCtxtList;
-	while (pTemp1)
+	//
+	// The slot itself is never freed; being in the list, checked under the
+	// shard lock, tells whether it holds a live connection.
+	//
+	EnterCriticalSection(&pShard->CriticalSection);
+	if (lpPerSocketContext->bInList && lpPerSocketContext->dwConnectionId == dwConnectionId)
 	{
-		pTemp2 = pTemp1->pCtxtBack;
-		CloseClient(pTemp1, FALSE);
-		pTemp1 = pTemp2;
+		lpRoutine(lpPerSocketContext, lpParam);
+		bFound = TRUE;
 	}
-
-	LeaveCriticalSection(&g_CriticalSection);
-	return;
+	LeaveCriticalSection(&pShard->CriticalSection);
+	return (bFound);
 }
 
 //
-// Our own printf. This is done because calling printf from multiple
-// threads can AV. The standard out for WriteConsole is buffered...
+//  Free all context structure in the global list of context structures.
 //
-int myprintf(const char *lpFormat, ...)
+VOID CtxtListFree()
 {
 
-	int nLen = 0;
-	int nRet = 0;
-	char cBuffer[512];
-	va_list arglist;
-	HANDLE hOut = NULL;
-	HRESULT hRet;
-
-	ZeroMemory(cBuffer, sizeof(cBuffer));
-
-	va_start(arglist, lpFormat);
+	for (DWORD i = 0; i < CTXT_LIST_SHARDS; i++)
+	{
+		PCTXT_LIST_SHARD pShard = &g_CtxtListShards[i];
 
-	nLen = lstrlen(lpFormat);
-	hRet = StringCchVPrintf(cBuffer, 512, lpFormat, arglist);
+		EnterCriticalSection(&pShard->CriticalSection);
+		while (pShard->pCtxtList)
+			CloseClient(pShard->pCtxtList, FALSE);
+		LeaveCriticalSection(&pShard->CriticalSection);
+	}
 
-	if (nRet >= nLen || GetLastError() == 0)
+	//
+	// The listening socket context is kept out of the list.  Its socket is closed
+	// with g_psdListen; here we free its accept contexts and any accept socket
+	// still waiting for an AcceptEx to complete.
+	//
+	EnterCriticalSection(&g_CriticalSection);
+	if (g_pCtxtListenSocket)
 	{
-		hOut = GetStdHandle(STD_OUTPUT_HANDLE);
-		if (hOut != INVALID_HANDLE_VALUE)
-			WriteConsole(hOut, cBuffer, lstrlen(cBuffer), (LPDWORD)&nLen, NULL);
+		CtxtFree(g_pCtxtListenSocket);
+		g_pCtxtListenSocket = NULL;
 	}
 
-	return nLen;
+	LeaveCriticalSection(&g_CriticalSection);
+	return;
 }
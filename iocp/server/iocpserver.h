@@ -12,16 +12,42 @@
 #ifndef IOCPSERVER_H
 #define IOCPSERVER_H
 
-#include <mswsock.h>
+#include "iocpcompat.h"
+#include "iocplog.h"
+#include "iocpframe.h"
+#include "iocptimer.h"
+#include "iocpwal.h"
 
 #define DEFAULT_PORT        "5001"
+#define MAX_ACCEPT_POSTED   1024
 #define MAX_BUFF_SIZE       8192
-#define MAX_WORKER_THREAD   16
+#define DEFAULT_POOL_PREALLOCATE 1024
+#define CTXT_LIST_SHARDS    64      // power of 2
+#define DEFAULT_IO_DEPTH    2
+#define MAX_IO_DEPTH        64
+#define MAX_SEND_BUFFERS    16      // most receives gathered into one send
+#define DEFAULT_SEND_HIGH_WATER (64 * 1024)
+#define DEFAULT_SEND_LOW_WATER  (16 * 1024)
+#define SPLICE_CHUNK        (64 * 1024)     // most spliced into a pipe at once, its default capacity
+#define TIMER_TICK_MS       100     // resolution of the idle and read timeouts
+#define TIMER_SHARD_NONE    ((DWORD)-1)
+#define DEFAULT_FRAME_BUDGET 100    // microseconds a worker's batch step of frames aims to take
+#define DEFAULT_RECV_MIN_SIZE (2 * 1024)    // smallest receive buffer a connection shrinks to
+#define DEFAULT_RECV_MAX_SIZE (256 * 1024)  // largest it grows to
+#define RECV_GROW_FULL      4       // receives in a row that fill their buffer before it doubles
+#define RECV_SHRINK_SMALL   16      // receives in a row into a quarter of it at most before it halves
+#define RECV_QUIET_MS       1000    // a gap between receives this long drops it to the smallest
 
 typedef enum _IO_OPERATION {
     ClientIoAccept,
     ClientIoRead,
-    ClientIoWrite
+    ClientIoWrite,
+    ClientIoQueued,     // received, waiting for its turn to be echoed
+    ClientIoReceived,   // received ahead of its turn to be framed
+    ClientIoFramed,     // received, its frames waiting for the worker's batch step
+    ClientIoHeld,       // echoed, receive held back until the send queue drains
+    ClientIoSpliceIn,   // splice from the socket into the connection's pipe
+    ClientIoSpliceOut   // splice from the pipe back out to the socket
 } IO_OPERATION, *PIO_OPERATION;
 
 //
@@ -29,7 +55,17 @@ typedef enum _IO_OPERATION {
 //
 typedef struct _PER_IO_CONTEXT {
     WSAOVERLAPPED               Overlapped;
-    char                        Buffer[MAX_BUFF_SIZE];
+
+	//
+    //data buffer from the pool of its size class (dwBufferClass), g_BufferPool's
+    //MAX_BUFF_SIZE for accepts.  With shared buffers a receive has none until
+    //data arrives, when the backend attaches one of its own (bProvidedBuffer,
+    //dwBufferId) that goes back through fnReleaseBuffer.
+	//
+    char                        *Buffer;
+    DWORD                       dwBufferClass;
+    BOOL                        bProvidedBuffer;
+    DWORD                       dwBufferId;
     WSABUF                      wsabuf;
     int                         nTotalBytes;
     int                         nSentBytes;
@@ -37,6 +73,80 @@ typedef struct _PER_IO_CONTEXT {
     SOCKET                      SocketAccept; 
 
     struct _PER_IO_CONTEXT      *pIOContextForward;
+
+	//
+    //owning socket context, for backends that return a single user pointer
+	//
+    struct _PER_SOCKET_CONTEXT  *pSocketContext;
+
+	//
+    //buffers of the operation parked by a readiness backend until the socket is
+    //ready: the receive's own, or the caller's array for a send
+	//
+    WSABUF                      wsabufPosted;
+    LPWSABUF                    lpSendBuffers;
+    DWORD                       dwSendBuffers;
+
+	//
+    //zero-copy send in flight (Linux): the kernel may read the buffers until it
+    //says it is done with them, so the send's result is held back until then
+    //and the buffers stay with this context.  dwZeroCopyId is the epoll
+    //backend's MSG_ZEROCOPY sequence number; ZeroCopyMsg describes a gathered
+    //io_uring send until the kernel has read it.
+	//
+    BOOL                        bZeroCopy;
+    int                         nZeroCopyResult;
+    DWORD                       dwZeroCopyId;
+#ifdef __linux__
+    struct msghdr               ZeroCopyMsg;
+#endif
+
+	//
+    //splice echo (Linux): the end of the connection's pipe a splice moves the
+    //data through, and how many bytes it is to move at most
+	//
+    int                         fdSplice;
+    DWORD                       cbSplice;
+
+	//
+    //framing (-f): the replies to the frames the receive completed lie in the
+    //buffer from dwReplyOffset on, after the reply to a frame that began in an
+    //earlier receive, which is cbCarry bytes in a g_BufferPool buffer of its
+    //own (pCarry).  nTotalBytes counts both.
+	//
+    char                        *pCarry;
+    DWORD                       cbCarry;
+    DWORD                       dwReplyOffset;
+
+	//
+    //accept contexts only: listening socket the accept is posted on, shard it
+    //is armed on, and whether a multishot or readiness based accept is still
+    //armed (so reposting it is a no-op)
+	//
+    SOCKET                      SocketListen;
+    DWORD                       dwAcceptShard;
+    BOOL                        bAcceptArmed;
+
+	//
+    //order in which the receive was posted, and so in which its data is echoed
+	//
+    DWORD                       dwSequence;
+
+	//
+    //when the receive completed, in StatsTimestamp ticks
+	//
+    LONG64                      llRecvTime;
+
+	//
+    //write-ahead log (-j): the LSN the log must be durable up to before the
+    //replies in the buffer are sent, 0 for none
+	//
+    ULONGLONG                   ullWalLsn;
+
+	//
+    //next operation parked on the same socket by a readiness backend
+	//
+    struct _PER_IO_CONTEXT      *pPendingNext;
 } PER_IO_CONTEXT, *PPER_IO_CONTEXT;
 
 //
@@ -53,16 +163,148 @@ typedef struct _PER_SOCKET_CONTEXT {
 
     LPFN_ACCEPTEX               fnAcceptEx;
 
+	//
+    //completion queue shard (worker) servicing this socket; set before the
+    //socket is associated, CQ_ANY_SHARD lets the backend pick one
+	//
+    DWORD                       dwShard;
+
+	//
+    //operations parked by the backend until the socket is ready, or until the
+    //receive ahead of them is done on backends that keep one in the kernel
+	//
+    struct _PER_IO_CONTEXT      *pRecvPending;
+    struct _PER_IO_CONTEXT      *pSendPending;
+    BOOL                        bRecvInFlight;
+
+	//
+    //MSG_ZEROCOPY on a readiness backend: the send waiting for its completion
+    //notification, the next sequence number the kernel assigns and the first
+    //one it has not reported done yet
+	//
+    struct _PER_IO_CONTEXT      *pZeroCopyPending;
+    DWORD                       dwZeroCopyNext;
+    DWORD                       dwZeroCopyDone;
+
+	//
+    //pipe the echo is spliced through, NULL when it goes through buffers
+	//
+    struct _SPLICE_PIPE         *pPipe;
+
+	//
+    //framing (-f): the frame split across receives so far, and the sequence
+    //number of the receive to be framed next.  Receives are framed in the
+    //order they were posted, not the order they complete in, so one that
+    //completes early waits (ClientIoReceived) for those before it, as does
+    //every receive while one of the connection's is in a batch step
+    //(bFramePending).
+	//
+    FRAME_STATE                 Frame;
+    DWORD                       dwFrameSequence;
+    BOOL                        bFramePending;
+
+	//
+    //write-ahead log (-j): the LSN of the last transfers the frame handler
+    //logged for the connection, and its registration with the committer while
+    //its next reply waits for the log (counted in lIoPending)
+	//
+    ULONGLONG                   ullWalLsn;
+    WAL_WAITER                  WalWaiter;
+
 	//
     //linked list for all outstanding i/o on the socket
 	//
     PPER_IO_CONTEXT             pIOContext;  
+
+	//
+    //With several receives in flight, completions for one socket may be handled
+    //on several threads at once.  csIo guards the fields below.  Receives are
+    //numbered as they are posted and echoed strictly in that order, one send at
+    //a time.  The context is freed once it is closing and the last operation in
+    //flight has come back.
+	//
+    CRITICAL_SECTION            csIo;
+    LONG                        lIoPending;
+    BOOL                        bClosing;
+    BOOL                        bSending;
+    DWORD                       dwRecvSequence;
+    DWORD                       dwSendSequence;
+
+	//
+    //receive buffer size class (-u) the connection's receives are reposted
+    //with, and the receives in a row that filled their buffer or used a
+    //quarter of it at most, which grow or shrink it, and when the last
+    //receive completed (ms), for the gap that drops it to the smallest
+	//
+    DWORD                       dwBufferClass;
+    DWORD                       dwRecvsFull;
+    DWORD                       dwRecvsSmall;
+    ULONGLONG                   ullLastRecv;
+
+	//
+    //The send in flight gathers the data of every receive queued in order, up
+    //to MAX_SEND_BUFFERS (two WSABUFs each with a carry), from wsabufSend.  lSendQueued counts the bytes
+    //received and not echoed yet; past the high watermark receives that are
+    //done echoing are held (ClientIoHeld) rather than posted again, until it
+    //falls to the low watermark.
+	//
+    WSABUF                      wsabufSend[2 * MAX_SEND_BUFFERS];
+    LONG                        lSendQueued;
+    BOOL                        bRecvPaused;
+
+	//
+    //timeout on the wheel of the worker that accepted the connection (or
+    //TIMER_SHARD_NONE).  Completions only note when they happened in
+    //ullLastActive (ms) and whether data arrived yet; the timer is moved to the
+    //new deadline when it fires, so it is re-armed without taking the wheel's
+    //lock on every completion.
+	//
+    TIMER_ENTRY                 Timer;
+    DWORD                       dwTimerShard;
+    volatile ULONGLONG          ullLastActive;
+    BOOL                        bReceived;
+
+	//
+    //connection id (the context's pool slot, reused once the connection closes)
+    //and links in the connection list shard the id selects
+	//
+    DWORD                       dwConnectionId;
+    BOOL                        bInList;
     struct _PER_SOCKET_CONTEXT  *pCtxtBack; 
     struct _PER_SOCKET_CONTEXT  *pCtxtForward;
 } PER_SOCKET_CONTEXT, *PPER_SOCKET_CONTEXT;
 
+//
+// one shard of the global connection list, each on its own cache line(s) so
+// workers adding and removing connections on different shards don't contend
+//
+typedef struct alignas(64) _CTXT_LIST_SHARD {
+    CRITICAL_SECTION            CriticalSection;
+    PPER_SOCKET_CONTEXT         pCtxtList;
+    LONG                        lCount;
+} CTXT_LIST_SHARD, *PCTXT_LIST_SHARD;
+
+//
+// a worker's timing wheel; only its worker advances it, but connections closed
+// on other threads take their timer off it
+//
+typedef struct alignas(64) _TIMER_SHARD {
+    CRITICAL_SECTION            CriticalSection;
+    TIMER_WHEEL                 Wheel;
+} TIMER_SHARD, *PTIMER_SHARD;
+
+typedef VOID (*PCTXT_LIST_ROUTINE)(PPER_SOCKET_CONTEXT lpPerSocketContext, LPVOID lpParam);
+
+extern BOOL g_bSharedBuffers;
+extern DWORD g_dwZeroCopyThreshold;
+extern BOOL g_bReactors;
+extern DWORD g_dwUringSqPollIdle;
+extern DWORD g_dwCompletionBatch;
+
 BOOL ValidOptions(int argc, char *argv[]);
 
+VOID PrintCqStats(void);
+
 BOOL WINAPI CtrlHandler(
     DWORD dwEvent
     );
@@ -70,22 +312,78 @@ BOOL WINAPI CtrlHandler(
 BOOL CreateListenSocket(void);
 
 BOOL CreateAcceptSocket(
-    BOOL fUpdateIOCP
+    BOOL fUpdateIOCP,
+    DWORD dwReactor
+    );
+
+BOOL PostRecv(
+    PPER_SOCKET_CONTEXT lpPerSocketContext,
+    PPER_IO_CONTEXT lpIOContext
+    );
+
+BOOL PostSplice(
+    PPER_SOCKET_CONTEXT lpPerSocketContext,
+    PPER_IO_CONTEXT lpIOContext,
+    IO_OPERATION SpliceOp,
+    DWORD dwLength
+    );
+
+BOOL PostNextSend(
+    PPER_SOCKET_CONTEXT lpPerSocketContext
+    );
+//
+// PostRecv, PostSplice and PostNextSend are called with lpPerSocketContext->csIo
+// held.
+//
+
+VOID WalReleased(
+    PWAL_WAITER pWaiter,
+    BOOL bDurable
+    );
+
+VOID AcceptCompleted(
+    PPER_IO_CONTEXT lpIOContext,
+    SOCKET sdAccept,
+    BOOL bSuccess
     );
 
 DWORD WINAPI WorkerThread (
     LPVOID WorkContext
     );
 
+VOID TimerShardArm(
+    PPER_SOCKET_CONTEXT lpPerSocketContext
+    );
+
+VOID TimerShardCancel(
+    PPER_SOCKET_CONTEXT lpPerSocketContext
+    );
+
+VOID TimerShardAdvance(
+    DWORD dwWorker
+    );
+
+VOID TimerExpired(
+    PTIMER_ENTRY pTimer,
+    LPVOID lpParam
+    );
+
+BOOL SetReactorAffinity(
+    HANDLE hThread,
+    DWORD dwReactor
+    );
+
 PPER_SOCKET_CONTEXT UpdateCompletionPort(
     SOCKET s,
     IO_OPERATION ClientIo,
-    BOOL bAddToList
+    BOOL bAddToList,
+    DWORD dwShard
     );
 //
 // bAddToList is FALSE for listening socket, and TRUE for connection sockets.
 // As we maintain the context for listening socket in a global structure, we
-// don't need to add it to the list.
+// don't need to add it to the list.  dwShard is the worker whose completion
+// queue shard the socket is bound to, or CQ_ANY_SHARD.
 //
 
 VOID CloseClient (
@@ -98,6 +396,15 @@ PPER_SOCKET_CONTEXT CtxtAllocate(
     IO_OPERATION ClientIO
     );
 
+PPER_IO_CONTEXT CtxtIoAllocate(
+    PPER_SOCKET_CONTEXT lpPerSocketContext,
+    IO_OPERATION ClientIO
+    );
+
+VOID CtxtFree(
+    PPER_SOCKET_CONTEXT lpPerSocketContext
+    );
+
 VOID CtxtListFree(
     );
 
@@ -109,4 +416,15 @@ VOID CtxtListDeleteFrom(
     PPER_SOCKET_CONTEXT lpPerSocketContext
     );
 
+//
+// run lpRoutine on the connection with id dwConnectionId, if it is open.
+// lpRoutine runs with the connection's list shard locked, so the context can't
+// be closed and freed underneath it; it must not block.
+//
+BOOL CtxtListLookup(
+    DWORD dwConnectionId,
+    PCTXT_LIST_ROUTINE lpRoutine,
+    LPVOID lpParam
+    );
+
 #endif
@@ -0,0 +1,510 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Module:
+//      iocpstats.cpp
+//
+// Abstract:
+//      Per-worker counters and latency histograms, and the admin port that
+//      serves snapshots of them.  See iocpstats.h.
+//
+
+#include <stddef.h>
+
+#include "iocpserver.h"
+#include "iocpstats.h"
+
+PWORKER_STATS g_pWorkerStats = NULL; // one block per worker, then the totals of the
+									 // admin thread and of StatsPrint
+LPVOID g_pWorkerStatsAlloc = NULL;
+DWORD g_dwStatsWorkers = 0;
+WORKER_STATS g_WorkerStatsShared; // for the other threads
+thread_local PWORKER_STATS t_pWorkerStats = &g_WorkerStatsShared;
+
+static LONG64 g_llStatsTickStart = 0; // tick clock and performance counter when started,
+static LARGE_INTEGER g_liStatsStart;  // to convert ticks to time
+
+static SOCKET g_sdStatsAdmin = INVALID_SOCKET;
+static HANDLE g_hStatsAdminThread = NULL;
+static volatile BOOL g_bStatsAdminStop = FALSE;
+
+//
+// snapshot being formatted
+//
+typedef struct _STATS_REPORT {
+	char *pBuffer;
+	size_t cbBuffer;
+	size_t cbUsed;
+} STATS_REPORT, *PSTATS_REPORT;
+
+BOOL StatsCreate(DWORD dwWorkers)
+{
+
+	g_pWorkerStatsAlloc = HeapAlloc(GetProcessHeap(), 0, (dwWorkers + 3) * sizeof(WORKER_STATS));
+	if (g_pWorkerStatsAlloc == NULL)
+		return (FALSE);
+	g_pWorkerStats = (PWORKER_STATS)(((ULONG_PTR)g_pWorkerStatsAlloc + alignof(WORKER_STATS) - 1) &
+									 ~(ULONG_PTR)(alignof(WORKER_STATS) - 1));
+	g_dwStatsWorkers = dwWorkers;
+	StatsReset();
+	return (TRUE);
+}
+
+VOID StatsDestroy()
+{
+
+	if (g_pWorkerStatsAlloc)
+		HeapFree(GetProcessHeap(), 0, g_pWorkerStatsAlloc);
+	g_pWorkerStatsAlloc = NULL;
+	g_pWorkerStats = NULL;
+	g_dwStatsWorkers = 0;
+	return;
+}
+
+VOID StatsReset()
+{
+
+	ZeroMemory(g_pWorkerStats, g_dwStatsWorkers * sizeof(WORKER_STATS));
+	ZeroMemory(&g_WorkerStatsShared, sizeof(g_WorkerStatsShared));
+	QueryPerformanceCounter(&g_liStatsStart);
+	g_llStatsTickStart = StatsTimestamp();
+	return;
+}
+
+//
+// ticks per second of StatsTimestamp, measured against the performance counter
+// since the blocks were last reset
+//
+double StatsTicksPerSecond(void)
+{
+
+	LARGE_INTEGER liFrequency;
+	LARGE_INTEGER liNow;
+
+	QueryPerformanceFrequency(&liFrequency);
+#ifdef STATS_TSC
+	QueryPerformanceCounter(&liNow);
+	if (liNow.QuadPart - g_liStatsStart.QuadPart < liFrequency.QuadPart / 100)
+	{
+		Sleep(10);
+		QueryPerformanceCounter(&liNow);
+	}
+	return ((double)(StatsTimestamp() - g_llStatsTickStart) * (double)liFrequency.QuadPart /
+			(double)(liNow.QuadPart - g_liStatsStart.QuadPart));
+#else
+	UNREFERENCED_PARAMETER(liNow);
+	return ((double)liFrequency.QuadPart);
+#endif
+}
+
+//
+// add one block to a running total
+//
+static VOID StatsAdd(PWORKER_STATS pTotal, const WORKER_STATS *pStats)
+{
+
+	pTotal->llCompletions += pStats->llCompletions;
+	pTotal->llBytesIn += pStats->llBytesIn;
+	pTotal->llBytesOut += pStats->llBytesOut;
+	pTotal->llSends += pStats->llSends;
+	pTotal->llSendBuffers += pStats->llSendBuffers;
+	pTotal->llPartialSends += pStats->llPartialSends;
+	pTotal->llZeroCopySends += pStats->llZeroCopySends;
+	pTotal->llZeroCopyCopied += pStats->llZeroCopyCopied;
+	pTotal->llFrames += pStats->llFrames;
+	pTotal->llFrameSteps += pStats->llFrameSteps;
+	pTotal->llSplices += pStats->llSplices;
+	pTotal->llRecvPauses += pStats->llRecvPauses;
+	pTotal->llRecvGrows += pStats->llRecvGrows;
+	pTotal->llRecvShrinks += pStats->llRecvShrinks;
+	pTotal->llErrors += pStats->llErrors;
+	pTotal->llAccepts += pStats->llAccepts;
+	pTotal->llCloses += pStats->llCloses;
+	pTotal->llTimeouts += pStats->llTimeouts;
+	pTotal->llSpinPolls += pStats->llSpinPolls;
+	pTotal->llSpinHits += pStats->llSpinHits;
+	pTotal->llSpinTicks += pStats->llSpinTicks;
+	pTotal->llBlockingWaits += pStats->llBlockingWaits;
+	pTotal->llWaitTicks += pStats->llWaitTicks;
+	if (pStats->llLatencyMax > pTotal->llLatencyMax)
+		pTotal->llLatencyMax = pStats->llLatencyMax;
+	for (DWORD i = 0; i < BUFFER_CLASSES; i++)
+		pTotal->llRecvClasses[i] += pStats->llRecvClasses[i];
+	for (DWORD i = 0; i < STATS_HIST_BUCKETS; i++)
+		pTotal->llHistogram[i] += pStats->llHistogram[i];
+	return;
+}
+
+//
+// highest value, in ticks, that falls in a bucket
+//
+static LONG64 StatsBucketHigh(DWORD dwBucket)
+{
+
+	DWORD dwShift = 0;
+
+	if (dwBucket < 2 * STATS_HIST_SUB_BUCKETS)
+		return ((LONG64)dwBucket);
+	dwShift = (dwBucket >> STATS_HIST_SUB_BITS) - 1;
+	return ((((LONG64)(dwBucket - (dwShift << STATS_HIST_SUB_BITS)) + 1) << dwShift) - 1);
+}
+
+static LONG64 StatsCount(const WORKER_STATS *pStats)
+{
+
+	LONG64 llCount = 0;
+
+	for (DWORD i = 0; i < STATS_HIST_BUCKETS; i++)
+		llCount += pStats->llHistogram[i];
+	return (llCount);
+}
+
+//
+// value at or below which dFraction of the recorded latencies fall, in ticks
+//
+static LONG64 StatsPercentile(const WORKER_STATS *pStats, LONG64 llCount, double dFraction)
+{
+
+	LONG64 llRank = (LONG64)(dFraction * (double)llCount + 0.5);
+	LONG64 llSeen = 0;
+
+	if (llRank < 1)
+		llRank = 1;
+	for (DWORD i = 0; i < STATS_HIST_BUCKETS; i++)
+	{
+		llSeen += pStats->llHistogram[i];
+		if (llSeen >= llRank)
+			return (StatsBucketHigh(i) < pStats->llLatencyMax ? StatsBucketHigh(i) : pStats->llLatencyMax);
+	}
+	return (pStats->llLatencyMax);
+}
+
+LONG64 StatsPercentileSince(const WORKER_STATS *pNow, const WORKER_STATS *pThen, double dFraction)
+{
+
+	LONG64 llCount = StatsCount(pNow) - StatsCount(pThen);
+	LONG64 llRank = (LONG64)(dFraction * (double)llCount + 0.5);
+	LONG64 llSeen = 0;
+
+	if (llRank < 1)
+		llRank = 1;
+	for (DWORD i = 0; i < STATS_HIST_BUCKETS && llCount > 0; i++)
+	{
+		llSeen += pNow->llHistogram[i] - pThen->llHistogram[i];
+		if (llSeen >= llRank)
+			return (StatsBucketHigh(i));
+	}
+	return (0);
+}
+
+VOID StatsTotal(PWORKER_STATS pTotal)
+{
+
+	ZeroMemory(pTotal, sizeof(WORKER_STATS));
+	StatsAdd(pTotal, &g_WorkerStatsShared);
+	for (DWORD i = 0; i < g_dwStatsWorkers; i++)
+		StatsAdd(pTotal, &g_pWorkerStats[i]);
+	return;
+}
+
+static VOID StatsAppend(PSTATS_REPORT pReport, const char *lpFormat, ...)
+{
+
+	va_list arglist;
+
+	va_start(arglist, lpFormat);
+	if (SUCCEEDED(StringCchVPrintf(pReport->pBuffer + pReport->cbUsed, pReport->cbBuffer - pReport->cbUsed,
+								   lpFormat, arglist)))
+		pReport->cbUsed += strlen(pReport->pBuffer + pReport->cbUsed);
+	va_end(arglist);
+	return;
+}
+
+//
+// one line of counters and latency percentiles, for a worker or the total
+//
+static VOID StatsAppendLine(PSTATS_REPORT pReport, const WORKER_STATS *pStats, double dTicksPerUs)
+{
+
+	LONG64 llCount = StatsCount(pStats);
+
+	StatsAppend(pReport, " completions=%lld bytes_in=%lld bytes_out=%lld sends=%lld send_buffers=%lld partial_sends=%lld recv_pauses=%lld recv_grows=%lld recv_shrinks=%lld",
+				(long long)pStats->llCompletions, (long long)pStats->llBytesIn, (long long)pStats->llBytesOut,
+				(long long)pStats->llSends, (long long)pStats->llSendBuffers, (long long)pStats->llPartialSends,
+				(long long)pStats->llRecvPauses, (long long)pStats->llRecvGrows, (long long)pStats->llRecvShrinks);
+	StatsAppend(pReport, " zerocopy_sends=%lld zerocopy_copied=%lld frames=%lld frame_steps=%lld splices=%lld errors=%lld accepts=%lld closes=%lld timeouts=%lld",
+				(long long)pStats->llZeroCopySends, (long long)pStats->llZeroCopyCopied, (long long)pStats->llFrames,
+				(long long)pStats->llFrameSteps, (long long)pStats->llSplices,
+				(long long)pStats->llErrors, (long long)pStats->llAccepts, (long long)pStats->llCloses,
+				(long long)pStats->llTimeouts);
+	StatsAppend(pReport, " echoes=%lld p50_us=%.1f p90_us=%.1f p99_us=%.1f p999_us=%.1f max_us=%.1f\n",
+				(long long)llCount,
+				StatsPercentile(pStats, llCount, 0.50) / dTicksPerUs,
+				StatsPercentile(pStats, llCount, 0.90) / dTicksPerUs,
+				StatsPercentile(pStats, llCount, 0.99) / dTicksPerUs,
+				StatsPercentile(pStats, llCount, 0.999) / dTicksPerUs,
+				pStats->llLatencyMax / dTicksPerUs);
+	return;
+}
+
+//
+// a line per receive buffer size class in use: the receives that completed
+// into its buffers and how many buffers its pool holds
+//
+static VOID StatsAppendClasses(PSTATS_REPORT pReport, const WORKER_STATS *pTotal)
+{
+
+	for (DWORD i = 0; i < BUFFER_CLASSES; i++)
+	{
+		if (pTotal->llRecvClasses[i] || BufferClassCapacity(i))
+			StatsAppend(pReport, "recv_class_kb=%u receives=%lld buffers=%u\n", BUFFER_CLASS_SIZE(i) / 1024,
+						(long long)pTotal->llRecvClasses[i], BufferClassCapacity(i));
+	}
+	return;
+}
+
+//
+// how the workers waited for completions: dequeues that blocked, and with a
+// spin budget the polls that found nothing or something and the CPU time they
+// took, in milliseconds and as a share of the workers' time since the reset
+//
+static VOID StatsAppendWaits(PSTATS_REPORT pReport, const WORKER_STATS *pTotal, double dTicksPerUs)
+{
+
+	double dElapsed = (double)(StatsTimestamp() - g_llStatsTickStart) * (g_dwStatsWorkers ? g_dwStatsWorkers : 1);
+
+	StatsAppend(pReport, "blocking_waits=%lld spin_polls=%lld spin_hits=%lld spin_ms=%.1f spin_cpu_pct=%.1f\n",
+				(long long)pTotal->llBlockingWaits, (long long)pTotal->llSpinPolls, (long long)pTotal->llSpinHits,
+				pTotal->llSpinTicks / dTicksPerUs / 1000, dElapsed > 0 ? pTotal->llSpinTicks * 100.0 / dElapsed : 0.0);
+	return;
+}
+
+//
+// Text snapshot: a line per worker, the total, how the workers waited, the
+// receive buffer size classes, then the non-empty buckets of the total histogram as
+// "bucket_us=<highest value> count=<latencies>".
+//
+static VOID StatsFormat(PSTATS_REPORT pReport, PWORKER_STATS pTotal)
+{
+
+	double dTicksPerUs = StatsTicksPerSecond() / 1e6;
+
+	ZeroMemory(pTotal, sizeof(WORKER_STATS));
+	StatsAdd(pTotal, &g_WorkerStatsShared);
+	for (DWORD i = 0; i < g_dwStatsWorkers; i++)
+	{
+		StatsAppend(pReport, "worker=%d", i);
+		StatsAppendLine(pReport, &g_pWorkerStats[i], dTicksPerUs);
+		StatsAdd(pTotal, &g_pWorkerStats[i]);
+	}
+	StatsAppend(pReport, "total");
+	StatsAppendLine(pReport, pTotal, dTicksPerUs);
+	StatsAppendWaits(pReport, pTotal, dTicksPerUs);
+	StatsAppendClasses(pReport, pTotal);
+	for (DWORD i = 0; i < STATS_HIST_BUCKETS; i++)
+	{
+		if (pTotal->llHistogram[i])
+			StatsAppend(pReport, "bucket_us=%.3f count=%lld\n", StatsBucketHigh(i) / dTicksPerUs,
+						(long long)pTotal->llHistogram[i]);
+	}
+	return;
+}
+
+//
+// one connection's state, read without its lock, so it is a snapshot of fields
+// that may be changing
+//
+static VOID StatsAppendConnection(PPER_SOCKET_CONTEXT lpPerSocketContext, LPVOID lpParam)
+{
+
+	PSTATS_REPORT pReport = (PSTATS_REPORT)lpParam;
+
+	StatsAppend(pReport, "conn=%u socket=%d io_pending=%d closing=%d recv_sequence=%u send_sequence=%u",
+				lpPerSocketContext->dwConnectionId, (int)lpPerSocketContext->Socket, lpPerSocketContext->lIoPending,
+				lpPerSocketContext->bClosing, lpPerSocketContext->dwRecvSequence, lpPerSocketContext->dwSendSequence);
+	StatsAppend(pReport, " send_queued=%d recv_paused=%d recv_class_kb=%u received=%d idle_ms=%llu\n",
+				lpPerSocketContext->lSendQueued, lpPerSocketContext->bRecvPaused,
+				BUFFER_CLASS_SIZE(lpPerSocketContext->dwBufferClass) / 1024, lpPerSocketContext->bReceived,
+				(unsigned long long)(GetTickCount64() - lpPerSocketContext->ullLastActive));
+	return;
+}
+
+//
+// Wait up to STATS_ADMIN_REQUEST_MS for a request.  "conn <id>" asks for that
+// connection's state; anything else, or nothing, for the snapshot.
+//
+static BOOL StatsAdminRequest(SOCKET sdAdmin, LPDWORD lpdwConnectionId)
+{
+
+	char szRequest[64];
+	char *pEnd = NULL;
+	fd_set fdsRead;
+	struct timeval tv = {0, STATS_ADMIN_REQUEST_MS * 1000};
+	int nRead = 0;
+
+	FD_ZERO(&fdsRead);
+	FD_SET(sdAdmin, &fdsRead);
+	if (select((int)sdAdmin + 1, &fdsRead, NULL, NULL, &tv) <= 0)
+		return (FALSE);
+	nRead = recv(sdAdmin, szRequest, sizeof(szRequest) - 1, 0);
+	if (nRead <= 0)
+		return (FALSE);
+	szRequest[nRead] = '\0';
+	if (strncmp(szRequest, "conn ", 5) != 0)
+		return (FALSE);
+	*lpdwConnectionId = strtoul(szRequest + 5, &pEnd, 10);
+	return (pEnd != szRequest + 5);
+}
+
+//
+// Accept on the admin port, answer with a snapshot or the connection asked
+// for, and close, until stopped.
+//
+static DWORD WINAPI StatsAdminThread(LPVOID lpParameter)
+{
+
+	STATS_REPORT report = {0};
+	PWORKER_STATS pTotal = NULL;
+	SOCKET sdAdmin = INVALID_SOCKET;
+	DWORD dwConnectionId = 0;
+	int nSent = 0;
+
+	UNREFERENCED_PARAMETER(lpParameter);
+
+	report.cbBuffer = (g_dwStatsWorkers + 2 + BUFFER_CLASSES + STATS_HIST_BUCKETS) * STATS_REPORT_LINE;
+	report.pBuffer = (char *)HeapAlloc(GetProcessHeap(), 0, report.cbBuffer);
+	pTotal = &g_pWorkerStats[g_dwStatsWorkers];
+	while (report.pBuffer && !g_bStatsAdminStop)
+	{
+		sdAdmin = accept(g_sdStatsAdmin, NULL, NULL);
+		if (sdAdmin == INVALID_SOCKET)
+		{
+			if (!g_bStatsAdminStop)
+			{
+				LogPrintf(LOG_ERROR, "accept(admin) failed: %d\n", WSAGetLastError());
+				Sleep(100);
+			}
+			continue;
+		}
+
+		report.cbUsed = 0;
+		if (!StatsAdminRequest(sdAdmin, &dwConnectionId))
+			StatsFormat(&report, pTotal);
+		else if (!CtxtListLookup(dwConnectionId, StatsAppendConnection, &report))
+			StatsAppend(&report, "conn=%u not open\n", dwConnectionId);
+		for (size_t cbSent = 0; cbSent < report.cbUsed; cbSent += nSent)
+		{
+			nSent = send(sdAdmin, report.pBuffer + cbSent, (int)(report.cbUsed - cbSent), 0);
+			if (nSent == SOCKET_ERROR)
+				break;
+		}
+		closesocket(sdAdmin);
+	}
+
+	if (report.pBuffer)
+		HeapFree(GetProcessHeap(), 0, report.pBuffer);
+	LogReleaseThread();
+	return (0);
+}
+
+BOOL StatsStartAdmin(const char *szPort)
+{
+
+	struct addrinfo hints = {0};
+	struct addrinfo *addrlocal = NULL;
+	int nOne = 1;
+	DWORD dwThreadId = 0;
+
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_IP;
+	hints.ai_flags = AI_NUMERICHOST;
+	if (getaddrinfo("127.0.0.1", szPort, &hints, &addrlocal) != 0 || addrlocal == NULL)
+	{
+		LogPrintf(LOG_ERROR, "getaddrinfo(admin) failed with error %d\n", WSAGetLastError());
+		return (FALSE);
+	}
+
+	g_sdStatsAdmin = socket(addrlocal->ai_family, addrlocal->ai_socktype, addrlocal->ai_protocol);
+	if (g_sdStatsAdmin == INVALID_SOCKET)
+	{
+		LogPrintf(LOG_ERROR, "socket(admin) failed: %d\n", WSAGetLastError());
+		freeaddrinfo(addrlocal);
+		return (FALSE);
+	}
+	setsockopt(g_sdStatsAdmin, SOL_SOCKET, SO_REUSEADDR, (char *)&nOne, sizeof(nOne));
+	if (bind(g_sdStatsAdmin, addrlocal->ai_addr, (int)addrlocal->ai_addrlen) == SOCKET_ERROR ||
+		listen(g_sdStatsAdmin, SOMAXCONN) == SOCKET_ERROR)
+	{
+		LogPrintf(LOG_ERROR, "bind/listen(admin) failed: %d\n", WSAGetLastError());
+		freeaddrinfo(addrlocal);
+		closesocket(g_sdStatsAdmin);
+		g_sdStatsAdmin = INVALID_SOCKET;
+		return (FALSE);
+	}
+	freeaddrinfo(addrlocal);
+
+	g_bStatsAdminStop = FALSE;
+	g_hStatsAdminThread = CreateThread(NULL, 0, StatsAdminThread, NULL, 0, &dwThreadId);
+	if (g_hStatsAdminThread == NULL)
+	{
+		LogPrintf(LOG_ERROR, "CreateThread(admin) failed: %d\n", GetLastError());
+		closesocket(g_sdStatsAdmin);
+		g_sdStatsAdmin = INVALID_SOCKET;
+		return (FALSE);
+	}
+	LogPrintf(LOG_INFO, "Metrics served on 127.0.0.1:%s\n", szPort);
+	return (TRUE);
+}
+
+VOID StatsStopAdmin()
+{
+
+	if (g_hStatsAdminThread == NULL)
+		return;
+
+	//
+	// shutdown wakes a blocked accept on Linux, closesocket does on Windows
+	//
+	g_bStatsAdminStop = TRUE;
+	shutdown(g_sdStatsAdmin, SD_BOTH);
+	closesocket(g_sdStatsAdmin);
+	WaitForMultipleObjects(1, &g_hStatsAdminThread, TRUE, INFINITE);
+	CloseHandle(g_hStatsAdminThread);
+	g_hStatsAdminThread = NULL;
+	g_sdStatsAdmin = INVALID_SOCKET;
+	return;
+}
+
+VOID StatsPrint()
+{
+
+	STATS_REPORT report = {0};
+	PWORKER_STATS pTotal = NULL;
+	char szLine[STATS_REPORT_LINE * BUFFER_CLASSES];
+
+	pTotal = &g_pWorkerStats[g_dwStatsWorkers + 1];
+	StatsTotal(pTotal);
+
+	report.pBuffer = szLine;
+	report.cbBuffer = sizeof(szLine);
+	StatsAppend(&report, "metrics:");
+	StatsAppendLine(&report, pTotal, StatsTicksPerSecond() / 1e6);
+	LogPrintf(LOG_INFO, "%s", szLine);
+
+	//
+	// a log record is a few lines at most
+	//
+	report.cbUsed = 0;
+	StatsAppendWaits(&report, pTotal, StatsTicksPerSecond() / 1e6);
+	LogPrintf(LOG_INFO, "%s", szLine);
+
+	report.cbUsed = 0;
+	szLine[0] = '\0';
+	StatsAppendClasses(&report, pTotal);
+	if (report.cbUsed)
+		LogPrintf(LOG_INFO, "%s", szLine);
+	return;
+}
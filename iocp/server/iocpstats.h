@@ -0,0 +1,195 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Module:
+//      iocpstats.h
+//
+// Abstract:
+//      Per-worker metrics of the echo server: counters for what WorkerThread
+//      does with each completion, and a histogram of the time from a receive
+//      completing to the send of its data completing.
+//
+//      Every worker owns a WORKER_STATS block, cache line aligned, that only it
+//      writes, so recording is a plain increment with no lock or interlocked
+//      operation.  Timestamps are read from the time stamp counter where there
+//      is one (a few nanoseconds) and converted to time only when reported.
+//
+//      The histogram is log-linear like an HDR histogram: values below
+//      2 * STATS_HIST_SUB_BUCKETS ticks each get a bucket, and every power of 2
+//      above that is split into STATS_HIST_SUB_BUCKETS buckets, so a recorded
+//      value is off by at most 1 / STATS_HIST_SUB_BUCKETS (3%).
+//
+//      With -m:port the server answers every connection to that port on the
+//      loopback interface with a text snapshot of the metrics and closes it, so
+//      a sidecar can scrape them (e.g. with nc) without stopping the process.
+//      Counters are read while the workers update them, so a snapshot is not
+//      an atomic cut across workers.
+//
+
+#ifndef IOCPSTATS_H
+#define IOCPSTATS_H
+
+#include "iocpcompat.h"
+#include "iocppool.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#define STATS_TSC
+#endif
+
+#define STATS_HIST_SUB_BITS     5
+#define STATS_HIST_SUB_BUCKETS  (1 << STATS_HIST_SUB_BITS)
+#define STATS_HIST_MAX_BITS     40      // longer latencies are clamped (minutes)
+#define STATS_HIST_BUCKETS      ((STATS_HIST_MAX_BITS - STATS_HIST_SUB_BITS + 1) * STATS_HIST_SUB_BUCKETS)
+#define STATS_REPORT_LINE       256
+#define STATS_ADMIN_REQUEST_MS  50      // an admin connection waits this long for a request
+
+typedef struct alignas(64) _WORKER_STATS {
+    LONG64                      llCompletions;  // I/O completions handled
+    LONG64                      llBytesIn;      // bytes received
+    LONG64                      llBytesOut;     // bytes sent
+    LONG64                      llSends;        // sends posted
+    LONG64                      llSendBuffers;  // buffers gathered into them
+    LONG64                      llPartialSends; // sends that completed short
+    LONG64                      llZeroCopySends;    // sends posted zero-copy
+    LONG64                      llZeroCopyCopied;   // of those, sends the kernel copied anyway
+    LONG64                      llFrames;       // frames handed to the frame handler
+    LONG64                      llFrameSteps;   // batch steps they were handled in, with a batch handler
+    LONG64                      llSplices;      // data spliced into a pipe to be echoed
+    LONG64                      llRecvPauses;   // times a connection's receives were held back
+    LONG64                      llRecvGrows;    // times a connection's receive buffers grew a size class
+    LONG64                      llRecvShrinks;  // or shrank one or more
+    LONG64                      llErrors;       // failed completions
+    LONG64                      llAccepts;      // connections accepted
+    LONG64                      llCloses;       // connections closed
+    LONG64                      llTimeouts;     // connections closed by the idle or read timeout
+    LONG64                      llSpinPolls;    // polls of the queue that found nothing, with -h
+    LONG64                      llSpinHits;     // polls that found completions
+    LONG64                      llSpinTicks;    // time spent polling, in ticks
+    LONG64                      llBlockingWaits;    // dequeues that blocked
+    LONG64                      llWaitTicks;    // time blocked in them or parked, in ticks
+    LONG64                      llLatencyMax;   // longest receive to send, in ticks
+    LONG64                      llRecvClasses[BUFFER_CLASSES];  // receives completed, by buffer size class
+
+	//
+    //receive completed to send completed, in timestamp ticks
+	//
+    LONG64                      llHistogram[STATS_HIST_BUCKETS];
+} WORKER_STATS, *PWORKER_STATS;
+
+extern PWORKER_STATS g_pWorkerStats;
+
+//
+// the calling thread's block: a worker's own, or a shared one for the main
+// thread
+//
+extern thread_local PWORKER_STATS t_pWorkerStats;
+
+//
+// cheap timestamp for latency measurements, in ticks
+//
+static inline LONG64 StatsTimestamp(void)
+{
+#ifdef STATS_TSC
+    return ((LONG64)__rdtsc());
+#else
+    LARGE_INTEGER li;
+
+    QueryPerformanceCounter(&li);
+    return (li.QuadPart);
+#endif
+}
+
+static inline DWORD StatsBucket(LONG64 llTicks)
+{
+    unsigned long ulBit = 0;
+    DWORD dwShift = 0;
+
+    if (llTicks < 2 * STATS_HIST_SUB_BUCKETS)
+        return ((DWORD)(llTicks > 0 ? llTicks : 0));
+    if (llTicks >= (1LL << STATS_HIST_MAX_BITS))
+        llTicks = (1LL << STATS_HIST_MAX_BITS) - 1;
+#ifdef _MSC_VER
+    _BitScanReverse64(&ulBit, (unsigned __int64)llTicks);
+#else
+    ulBit = 63 - __builtin_clzll((unsigned long long)llTicks);
+#endif
+    dwShift = (DWORD)ulBit - STATS_HIST_SUB_BITS;
+    return ((dwShift << STATS_HIST_SUB_BITS) + (DWORD)(llTicks >> dwShift));
+}
+
+//
+// record one receive to send latency on the calling thread
+//
+static inline VOID StatsRecordLatency(LONG64 llStart)
+{
+    LONG64 llTicks = StatsTimestamp() - llStart;
+
+    t_pWorkerStats->llHistogram[StatsBucket(llTicks)]++;
+    if (llTicks > t_pWorkerStats->llLatencyMax)
+        t_pWorkerStats->llLatencyMax = llTicks;
+}
+
+//
+// ticks per second of StatsTimestamp
+//
+double StatsTicksPerSecond(
+    );
+
+//
+// sum every block into pTotal
+//
+VOID StatsTotal(
+    PWORKER_STATS pTotal
+    );
+
+//
+// value at or below which dFraction of the latencies recorded between two
+// totals fall, in ticks
+//
+LONG64 StatsPercentileSince(
+    const WORKER_STATS *pNow,
+    const WORKER_STATS *pThen,
+    double dFraction
+    );
+
+//
+// allocate one block per worker and start the tick clock
+//
+BOOL StatsCreate(
+    DWORD dwWorkers
+    );
+
+VOID StatsDestroy(
+    );
+
+//
+// zero every block; called before the workers (re)start
+//
+VOID StatsReset(
+    );
+
+//
+// serve snapshots on szPort of the loopback interface from a thread of its own,
+// and the state of one connection to "conn <id>"
+//
+BOOL StatsStartAdmin(
+    const char *szPort
+    );
+
+VOID StatsStopAdmin(
+    );
+
+//
+// print the totals and latency percentiles
+//
+VOID StatsPrint(
+    );
+
+#endif
@@ -0,0 +1,173 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Module:
+//      iocptimer.cpp
+//
+// Abstract:
+//      Hierarchical timing wheel.  See iocptimer.h.
+//
+
+#include "iocptimer.h"
+
+static inline VOID TimerListInitialize(PTIMER_ENTRY pHead)
+{
+
+	pHead->pNext = pHead;
+	pHead->pPrev = pHead;
+}
+
+static inline VOID TimerLink(PTIMER_ENTRY pHead, PTIMER_ENTRY pTimer)
+{
+
+	pTimer->pNext = pHead;
+	pTimer->pPrev = pHead->pPrev;
+	pHead->pPrev->pNext = pTimer;
+	pHead->pPrev = pTimer;
+}
+
+static inline VOID TimerUnlink(PTIMER_ENTRY pTimer)
+{
+
+	pTimer->pPrev->pNext = pTimer->pNext;
+	pTimer->pNext->pPrev = pTimer->pPrev;
+	pTimer->pNext = NULL;
+	pTimer->pPrev = NULL;
+}
+
+//
+// slot list a timer goes on, by how far ahead of the wheel it fires
+//
+static PTIMER_ENTRY TimerSlot(PTIMER_WHEEL pWheel, ULONGLONG ullExpires)
+{
+
+	ULONGLONG ullDelta = ullExpires - pWheel->ullNow;
+	DWORD dwShift = TIMER_WHEEL_BITS0;
+
+	if (ullExpires < pWheel->ullNow)
+		return (&pWheel->Slots[pWheel->ullNow & (TIMER_WHEEL_SLOTS0 - 1)]);
+	if (ullDelta < TIMER_WHEEL_SLOTS0)
+		return (&pWheel->Slots[ullExpires & (TIMER_WHEEL_SLOTS0 - 1)]);
+	for (DWORD dwLevel = 1; dwLevel < TIMER_WHEEL_LEVELS; dwLevel++, dwShift += TIMER_WHEEL_BITS)
+	{
+		if (ullDelta < (1ULL << (dwShift + TIMER_WHEEL_BITS)) || dwLevel == TIMER_WHEEL_LEVELS - 1)
+			return (&pWheel->Slots[TIMER_WHEEL_SLOTS0 + (dwLevel - 1) * TIMER_WHEEL_SLOTSN +
+								   ((ullExpires >> dwShift) & (TIMER_WHEEL_SLOTSN - 1))]);
+	}
+	return (NULL);
+}
+
+VOID TimerWheelInitialize(PTIMER_WHEEL pWheel, ULONGLONG ullNow)
+{
+
+	pWheel->ullNow = ullNow;
+	pWheel->dwArmed = 0;
+	for (DWORD i = 0; i < TIMER_WHEEL_SLOTS; i++)
+		TimerListInitialize(&pWheel->Slots[i]);
+	return;
+}
+
+VOID TimerSet(PTIMER_WHEEL pWheel, PTIMER_ENTRY pTimer, ULONGLONG ullExpires)
+{
+
+	if (TimerArmed(pTimer))
+		TimerUnlink(pTimer);
+	else
+		pWheel->dwArmed++;
+	if (ullExpires > pWheel->ullNow && ullExpires - pWheel->ullNow >= TIMER_WHEEL_RANGE)
+		ullExpires = pWheel->ullNow + TIMER_WHEEL_RANGE - 1;
+	pTimer->ullExpires = ullExpires;
+	TimerLink(TimerSlot(pWheel, ullExpires), pTimer);
+	return;
+}
+
+VOID TimerCancel(PTIMER_WHEEL pWheel, PTIMER_ENTRY pTimer)
+{
+
+	if (TimerArmed(pTimer))
+	{
+		TimerUnlink(pTimer);
+		pWheel->dwArmed--;
+	}
+	return;
+}
+
+//
+// move the timers of one upper level slot down to where they now belong;
+// returns the slot index, 0 meaning the level wrapped around as well
+//
+static DWORD TimerCascade(PTIMER_WHEEL pWheel, DWORD dwLevel)
+{
+
+	DWORD dwShift = TIMER_WHEEL_BITS0 + (dwLevel - 1) * TIMER_WHEEL_BITS;
+	DWORD dwIndex = (DWORD)(pWheel->ullNow >> dwShift) & (TIMER_WHEEL_SLOTSN - 1);
+	PTIMER_ENTRY pHead = &pWheel->Slots[TIMER_WHEEL_SLOTS0 + (dwLevel - 1) * TIMER_WHEEL_SLOTSN + dwIndex];
+	PTIMER_ENTRY pTimer = NULL;
+
+	while (pHead->pNext != pHead)
+	{
+		pTimer = pHead->pNext;
+		TimerUnlink(pTimer);
+		TimerLink(TimerSlot(pWheel, pTimer->ullExpires), pTimer);
+	}
+	return (dwIndex);
+}
+
+DWORD TimerWheelAdvance(PTIMER_WHEEL pWheel, ULONGLONG ullNow, PTIMER_ROUTINE lpRoutine, LPVOID lpParam)
+{
+
+	TIMER_ENTRY Expired;
+	PTIMER_ENTRY pHead = NULL;
+	PTIMER_ENTRY pTimer = NULL;
+	DWORD dwIndex = 0;
+	DWORD dwFired = 0;
+
+	while (pWheel->ullNow <= ullNow)
+	{
+
+		//
+		// nothing armed: skip straight to the present
+		//
+		if (pWheel->dwArmed == 0)
+		{
+			pWheel->ullNow = ullNow + 1;
+			break;
+		}
+
+		dwIndex = (DWORD)pWheel->ullNow & (TIMER_WHEEL_SLOTS0 - 1);
+		if (dwIndex == 0)
+		{
+			for (DWORD dwLevel = 1; dwLevel < TIMER_WHEEL_LEVELS; dwLevel++)
+			{
+				if (TimerCascade(pWheel, dwLevel) != 0)
+					break;
+			}
+		}
+
+		//
+		// take the whole slot first, so the routine can arm timers again
+		// (including the one that fired) without them firing twice
+		//
+		pHead = &pWheel->Slots[dwIndex];
+		pWheel->ullNow++;
+		if (pHead->pNext == pHead)
+			continue;
+		Expired.pNext = pHead->pNext;
+		Expired.pPrev = pHead->pPrev;
+		Expired.pNext->pPrev = &Expired;
+		Expired.pPrev->pNext = &Expired;
+		TimerListInitialize(pHead);
+
+		while (Expired.pNext != &Expired)
+		{
+			pTimer = Expired.pNext;
+			TimerUnlink(pTimer);
+			pWheel->dwArmed--;
+			dwFired++;
+			lpRoutine(pTimer, lpParam);
+		}
+	}
+	return (dwFired);
+}
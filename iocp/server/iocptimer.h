@@ -0,0 +1,95 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Module:
+//      iocptimer.h
+//
+// Abstract:
+//      Hierarchical timing wheel.  Time is counted in ticks; the lowest level
+//      has a slot per tick for the next TIMER_WHEEL_SLOTS0 ticks and every
+//      level above it a slot per span of the level below, so TIMER_WHEEL_LEVELS
+//      levels cover TIMER_WHEEL_RANGE ticks (longer timers are clamped).
+//      Arming, re-arming and cancelling a timer link or unlink it from one
+//      slot's list, O(1).  Advancing the wheel fires the current slot and,
+//      each time the lowest level wraps around, moves the next slot of the
+//      level above down into the levels below it.
+//
+//      Timers are TIMER_ENTRY structures embedded in the caller's objects, so
+//      the wheel allocates nothing.  A wheel is not thread safe; the caller
+//      serializes access to it.
+//
+
+#ifndef IOCPTIMER_H
+#define IOCPTIMER_H
+
+#include "iocpcompat.h"
+
+#define TIMER_WHEEL_BITS0       8
+#define TIMER_WHEEL_BITS        6
+#define TIMER_WHEEL_LEVELS      4
+#define TIMER_WHEEL_SLOTS0      (1 << TIMER_WHEEL_BITS0)
+#define TIMER_WHEEL_SLOTSN      (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_SLOTS       (TIMER_WHEEL_SLOTS0 + (TIMER_WHEEL_LEVELS - 1) * TIMER_WHEEL_SLOTSN)
+#define TIMER_WHEEL_RANGE       (1ULL << (TIMER_WHEEL_BITS0 + (TIMER_WHEEL_LEVELS - 1) * TIMER_WHEEL_BITS))
+
+typedef struct _TIMER_ENTRY {
+    struct _TIMER_ENTRY         *pNext;     // NULL while the timer is not armed
+    struct _TIMER_ENTRY         *pPrev;
+    ULONGLONG                   ullExpires; // tick the timer fires at
+} TIMER_ENTRY, *PTIMER_ENTRY;
+
+typedef struct _TIMER_WHEEL {
+    ULONGLONG                   ullNow;     // next tick to be fired
+    DWORD                       dwArmed;
+
+	//
+    //list heads: TIMER_WHEEL_SLOTS0 slots of the lowest level, then
+    //TIMER_WHEEL_SLOTSN of each level above
+	//
+    TIMER_ENTRY                 Slots[TIMER_WHEEL_SLOTS];
+} TIMER_WHEEL, *PTIMER_WHEEL;
+
+//
+// called for every timer that fires, after it has been unlinked; it may arm
+// the timer again
+//
+typedef VOID (*PTIMER_ROUTINE)(PTIMER_ENTRY pTimer, LPVOID lpParam);
+
+static inline BOOL TimerArmed(const TIMER_ENTRY *pTimer)
+{
+    return (pTimer->pNext != NULL);
+}
+
+VOID TimerWheelInitialize(
+    PTIMER_WHEEL pWheel,
+    ULONGLONG ullNow
+    );
+
+//
+// arm pTimer to fire at tick ullExpires, or move it there if it is armed
+// already; ticks in the past fire on the next advance
+//
+VOID TimerSet(
+    PTIMER_WHEEL pWheel,
+    PTIMER_ENTRY pTimer,
+    ULONGLONG ullExpires
+    );
+
+VOID TimerCancel(
+    PTIMER_WHEEL pWheel,
+    PTIMER_ENTRY pTimer
+    );
+
+//
+// fire every timer due up to and including tick ullNow, returns how many fired
+//
+DWORD TimerWheelAdvance(
+    PTIMER_WHEEL pWheel,
+    ULONGLONG ullNow,
+    PTIMER_ROUTINE lpRoutine,
+    LPVOID lpParam
+    );
+
+#endif
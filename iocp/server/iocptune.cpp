@@ -0,0 +1,79 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Module:
+//      iocptune.cpp
+//
+// Abstract:
+//      Socket tuning profiles.  See iocptune.h.
+//
+
+#include "iocpserver.h"
+#include "iocptune.h"
+
+const TUNE_PROFILE g_TuneProfiles[] = {
+	//name, TCP_NODELAY, SO_SNDBUF, SO_RCVBUF, SO_BUSY_POLL, TCP_QUICKACK, TCP_NOTSENT_LOWAT
+#ifdef _WIN32
+	{"default", TUNE_KEEP, 0, TUNE_KEEP, TUNE_KEEP, TUNE_KEEP, TUNE_KEEP},
+#else
+	// 0 would fix Linux's send buffer at its smallest and stop it autotuning
+	{"default", TUNE_KEEP, TUNE_KEEP, TUNE_KEEP, TUNE_KEEP, TUNE_KEEP, TUNE_KEEP},
+#endif
+	{"latency", 1, TUNE_KEEP, TUNE_KEEP, 50, 1, 16 * 1024},
+	{"throughput", 0, 4 * 1024 * 1024, 4 * 1024 * 1024, TUNE_KEEP, TUNE_KEEP, TUNE_KEEP},
+	{"many-idle", 1, 16 * 1024, 16 * 1024, TUNE_KEEP, TUNE_KEEP, 4 * 1024},
+	{NULL, TUNE_KEEP, TUNE_KEEP, TUNE_KEEP, TUNE_KEEP, TUNE_KEEP, TUNE_KEEP}};
+
+const TUNE_PROFILE *TuneProfileFind(const char *szName)
+{
+
+	for (int i = 0; g_TuneProfiles[i].szName; i++)
+	{
+		if (strcmp(szName, g_TuneProfiles[i].szName) == 0)
+			return (&g_TuneProfiles[i]);
+	}
+	return (NULL);
+}
+
+//
+// set one option unless the profile keeps it
+//
+static BOOL TuneOption(SOCKET sd, int nLevel, int nOption, const char *szOption, int nValue)
+{
+
+	if (nValue == TUNE_KEEP)
+		return (TRUE);
+	if (setsockopt(sd, nLevel, nOption, (char *)&nValue, sizeof(nValue)) == SOCKET_ERROR)
+	{
+		LogPrintf(LOG_ERROR, "setsockopt(%s) failed: %d\n", szOption, WSAGetLastError());
+		return (FALSE);
+	}
+	return (TRUE);
+}
+
+BOOL TuneSocketBuffers(SOCKET sd, const TUNE_PROFILE *pProfile)
+{
+
+	return (TuneOption(sd, SOL_SOCKET, SO_SNDBUF, "SO_SNDBUF", pProfile->nSendBuffer) &&
+			TuneOption(sd, SOL_SOCKET, SO_RCVBUF, "SO_RCVBUF", pProfile->nRecvBuffer));
+}
+
+BOOL TuneSocket(SOCKET sd, const TUNE_PROFILE *pProfile)
+{
+
+	BOOL bRet = TRUE;
+
+	bRet &= TuneOption(sd, IPPROTO_TCP, TCP_NODELAY, "TCP_NODELAY", pProfile->nNoDelay);
+#ifdef SO_BUSY_POLL
+	bRet &= TuneOption(sd, SOL_SOCKET, SO_BUSY_POLL, "SO_BUSY_POLL", pProfile->nBusyPoll);
+#endif
+#ifdef TCP_QUICKACK
+	bRet &= TuneOption(sd, IPPROTO_TCP, TCP_QUICKACK, "TCP_QUICKACK", pProfile->nQuickAck);
+#endif
+#ifdef TCP_NOTSENT_LOWAT
+	bRet &= TuneOption(sd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, "TCP_NOTSENT_LOWAT", pProfile->nNotSentLowat);
+#endif
+	return (bRet);
+}
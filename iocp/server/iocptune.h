@@ -0,0 +1,75 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Module:
+//      iocptune.h
+//
+// Abstract:
+//      Socket tuning profiles (-y): named sets of socket options that the
+//      server applies to its listening sockets and to every connection it
+//      accepts, and that bench/tuning.cpp applies to its own end.
+//
+//      "default" is what the server always did: SO_SNDBUF 0 on the listening
+//      socket, so Winsock sends from the server's buffers, and nothing else;
+//      elsewhere it sets nothing, leaving the kernel to size the buffers.
+//      "latency" turns Nagle off, acknowledges at once and busy polls the
+//      socket, and keeps little unsent data queued in the kernel.
+//      "throughput" leaves Nagle on and gives the kernel large buffers.
+//      "many-idle" caps the kernel buffers low, for many connections that
+//      each carry little.
+//
+//      An option a platform lacks (the Linux ones on Windows) is skipped.
+//      Buffer sizes are set on the listening socket before it listens, so the
+//      window scale of the connections accepted on it allows for them, and
+//      the connections inherit them; the other options are set on every
+//      connection as it is accepted.
+//      TCP_QUICKACK is set once, at accept; the kernel leaves quick ack mode
+//      again on its own once the connection looks interactive.
+//
+
+#ifndef IOCPTUNE_H
+#define IOCPTUNE_H
+
+#include "iocpcompat.h"
+
+#define TUNE_KEEP               (-1)    // leave the option as the system has it
+
+typedef struct _TUNE_PROFILE {
+    const char                  *szName;
+    int                         nNoDelay;       // TCP_NODELAY
+    int                         nSendBuffer;    // SO_SNDBUF, bytes
+    int                         nRecvBuffer;    // SO_RCVBUF, bytes
+    int                         nBusyPoll;      // SO_BUSY_POLL, microseconds (Linux)
+    int                         nQuickAck;      // TCP_QUICKACK (Linux)
+    int                         nNotSentLowat;  // TCP_NOTSENT_LOWAT, bytes (Linux)
+} TUNE_PROFILE, *PTUNE_PROFILE;
+
+//
+// the profiles, "default" first, ending with a NULL name
+//
+extern const TUNE_PROFILE g_TuneProfiles[];
+
+const TUNE_PROFILE *TuneProfileFind(
+    const char *szName
+    );
+
+//
+// the buffer sizes: of a listening socket before it listens, which the
+// sockets accepted on it inherit, or of a socket before it connects
+//
+BOOL TuneSocketBuffers(
+    SOCKET sd,
+    const TUNE_PROFILE *pProfile
+    );
+
+//
+// the other options, of a connection accepted or connected
+//
+BOOL TuneSocket(
+    SOCKET sd,
+    const TUNE_PROFILE *pProfile
+    );
+
+#endif
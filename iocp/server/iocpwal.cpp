@@ -0,0 +1,520 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Module:
+//      iocpwal.cpp
+//
+// Abstract:
+//      Write-ahead log with group commit.  See iocpwal.h.
+//
+
+#include "iocpserver.h"
+#include "iocpwal.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+
+#if defined(__linux__) && defined(HAVE_LIBURING)
+#include <liburing.h>
+#endif
+
+#define WAL_IDLE_WAIT   100     // milliseconds the committer sleeps with nothing appended
+#define WAL_SLEEP_STEP  50      // microseconds it lingers at a time for more appends
+
+typedef struct _WAL {
+	CRITICAL_SECTION csWal;		  // guards the buffers and the waiters
+	CRITICAL_SECTION csRelease;	  // held while waiters are being released
+	char *pBuffers[2];
+	DWORD dwActive;				  // buffer appends go to
+	DWORD cbActive;				  // in it, with the block header
+	ULONGLONG ullAppended;		  // LSN of the last append
+	LONG64 llFirstAppend;		  // when the active buffer got its first append
+	PWAL_WAITER pWaiters;
+	PWAL_RELEASE_ROUTINE pfnRelease;
+	WSAEVENT hWake;				  // set when the active buffer gets its first append
+	HANDLE hCommitter;
+	volatile BOOL bStop;
+	volatile BOOL bFailed;
+#ifdef _WIN32
+	HANDLE hFile;
+#else
+	int fd;
+#endif
+#if defined(__linux__) && defined(HAVE_LIBURING)
+	struct io_uring Ring;
+	BOOL bRing;
+#endif
+	LONG64 llCommits;
+	LONG64 llBytes;
+	LONG64 llStalls;			  // appends that found both buffers full
+	LONG64 llCommitMicroseconds;  // spent writing and syncing
+} WAL;
+
+static WAL g_Wal;
+static BOOL g_bWalCreated = FALSE;
+DWORD g_dwWalWindow = WAL_DEFAULT_WINDOW;
+DWORD g_dwWalLatency = WAL_DEFAULT_LATENCY;
+volatile LONG64 g_llWalDurable = 0;
+
+static LONG64 WalMicroseconds(void)
+{
+
+	LARGE_INTEGER count;
+	LARGE_INTEGER frequency;
+
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&frequency);
+	return (count.QuadPart / (frequency.QuadPart / 1000000));
+}
+
+//
+// Sleep up to dwMicroseconds, in steps short enough for the window to be
+// noticed filling up.  Windows sleeps in milliseconds, so it only yields.
+//
+static VOID WalSleep(DWORD dwMicroseconds)
+{
+
+#ifdef _WIN32
+	UNREFERENCED_PARAMETER(dwMicroseconds);
+	Sleep(0);
+#else
+	struct timespec ts;
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = (long)(dwMicroseconds < WAL_SLEEP_STEP ? dwMicroseconds : WAL_SLEEP_STEP) * 1000L;
+	nanosleep(&ts, NULL);
+#endif
+}
+
+//
+// FNV-1a over 64-bit words, then the odd bytes
+//
+static ULONGLONG WalChecksum(const char *pData, DWORD cbData)
+{
+
+	ULONGLONG ullHash = 0xCBF29CE484222325ULL;
+	ULONGLONG ullWord = 0;
+	DWORD i = 0;
+
+	for (; i + sizeof(ullWord) <= cbData; i += sizeof(ullWord))
+	{
+		memcpy(&ullWord, pData + i, sizeof(ullWord));
+		ullHash = (ullHash ^ ullWord) * 0x100000001B3ULL;
+	}
+	for (; i < cbData; i++)
+		ullHash = (ullHash ^ (BYTE)pData[i]) * 0x100000001B3ULL;
+	return (ullHash);
+}
+
+//
+// Write cbData bytes at ullOffset and sync the file's data.
+//
+static BOOL WalWriteSync(const char *pData, DWORD cbData, ULONGLONG ullOffset)
+{
+
+#ifdef _WIN32
+	OVERLAPPED overlapped;
+	DWORD dwWritten = 0;
+
+	ZeroMemory(&overlapped, sizeof(overlapped));
+	overlapped.Offset = (DWORD)ullOffset;
+	overlapped.OffsetHigh = (DWORD)(ullOffset >> 32);
+	if (!WriteFile(g_Wal.hFile, pData, cbData, &dwWritten, &overlapped) || dwWritten != cbData)
+	{
+		LogPrintf(LOG_ERROR, "WriteFile(wal) failed: %d\n", GetLastError());
+		return (FALSE);
+	}
+	if (!FlushFileBuffers(g_Wal.hFile))
+	{
+		LogPrintf(LOG_ERROR, "FlushFileBuffers(wal) failed: %d\n", GetLastError());
+		return (FALSE);
+	}
+	return (TRUE);
+#else
+	ssize_t nWritten = 0;
+
+#if defined(__linux__) && defined(HAVE_LIBURING)
+
+	//
+	// the write and the fsync linked, so they go to the kernel together and
+	// the fsync starts only once the write is done
+	//
+	if (g_Wal.bRing)
+	{
+		struct io_uring_sqe *sqe = io_uring_get_sqe(&g_Wal.Ring);
+		struct io_uring_cqe *cqe = NULL;
+		int nRet = 0;
+		int nResult[2] = {0, 0};
+
+		io_uring_prep_write(sqe, g_Wal.fd, pData, cbData, ullOffset);
+		sqe->flags |= IOSQE_IO_LINK;
+		sqe->user_data = 0;
+		sqe = io_uring_get_sqe(&g_Wal.Ring);
+		io_uring_prep_fsync(sqe, g_Wal.fd, IORING_FSYNC_DATASYNC);
+		sqe->user_data = 1;
+		nRet = io_uring_submit_and_wait(&g_Wal.Ring, 2);
+		if (nRet < 0)
+		{
+			LogPrintf(LOG_ERROR, "io_uring_submit_and_wait(wal) failed: %d\n", -nRet);
+			return (FALSE);
+		}
+		for (int i = 0; i < 2; i++)
+		{
+			nRet = io_uring_wait_cqe(&g_Wal.Ring, &cqe);
+			if (nRet < 0)
+			{
+				LogPrintf(LOG_ERROR, "io_uring_wait_cqe(wal) failed: %d\n", -nRet);
+				return (FALSE);
+			}
+			nResult[cqe->user_data & 1] = cqe->res;
+			io_uring_cqe_seen(&g_Wal.Ring, cqe);
+		}
+		if (nResult[0] != (int)cbData || nResult[1] < 0)
+		{
+			LogPrintf(LOG_ERROR, "wal write %d of %d bytes, fsync %d\n", nResult[0], cbData, nResult[1]);
+			return (FALSE);
+		}
+		return (TRUE);
+	}
+#endif
+
+	while (cbData)
+	{
+		nWritten = pwrite(g_Wal.fd, pData, cbData, (off_t)ullOffset);
+		if (nWritten < 0 && errno == EINTR)
+			continue;
+		if (nWritten <= 0)
+		{
+			LogPrintf(LOG_ERROR, "pwrite(wal) failed: %d\n", errno);
+			return (FALSE);
+		}
+		pData += nWritten;
+		cbData -= (DWORD)nWritten;
+		ullOffset += (ULONGLONG)nWritten;
+	}
+	if (fdatasync(g_Wal.fd) != 0)
+	{
+		LogPrintf(LOG_ERROR, "fdatasync(wal) failed: %d\n", errno);
+		return (FALSE);
+	}
+	return (TRUE);
+#endif
+}
+
+//
+// Hand the waiters the log is now durable for (all of them once it failed) to
+// the release routine.
+//
+static VOID WalRelease(void)
+{
+
+	PWAL_WAITER pReleased = NULL;
+	PWAL_WAITER *ppWaiter = NULL;
+	PWAL_WAITER pWaiter = NULL;
+	BOOL bDurable = !g_Wal.bFailed;
+
+	EnterCriticalSection(&g_Wal.csRelease);
+	EnterCriticalSection(&g_Wal.csWal);
+	ppWaiter = &g_Wal.pWaiters;
+	while ((pWaiter = *ppWaiter) != NULL)
+	{
+		if (bDurable && pWaiter->ullLsn > WalDurable())
+		{
+			ppWaiter = &pWaiter->pNext;
+			continue;
+		}
+		*ppWaiter = pWaiter->pNext;
+		pWaiter->bWaiting = FALSE;
+		pWaiter->pNext = pReleased;
+		pReleased = pWaiter;
+	}
+	LeaveCriticalSection(&g_Wal.csWal);
+
+	//
+	// the routine may register the waiter again, so it is unlinked first
+	//
+	while ((pWaiter = pReleased) != NULL)
+	{
+		pReleased = pWaiter->pNext;
+		g_Wal.pfnRelease(pWaiter, bDurable);
+	}
+	LeaveCriticalSection(&g_Wal.csRelease);
+}
+
+//
+// Make the active buffer durable and switch appends to the other one.  Only
+// the committer calls this, and it is done with the other buffer by then.
+//
+static VOID WalCommit(void)
+{
+
+	PWAL_BLOCK_HEADER pHeader = NULL;
+	char *pBuffer = NULL;
+	DWORD cbBuffer = 0;
+	ULONGLONG ullLsn = 0;
+	LONG64 llStart = 0;
+
+	EnterCriticalSection(&g_Wal.csWal);
+	pBuffer = g_Wal.pBuffers[g_Wal.dwActive];
+	cbBuffer = g_Wal.cbActive;
+	ullLsn = g_Wal.ullAppended;
+	g_Wal.dwActive ^= 1;
+	g_Wal.cbActive = 0;
+	LeaveCriticalSection(&g_Wal.csWal);
+
+	pHeader = (PWAL_BLOCK_HEADER)pBuffer;
+	pHeader->dwMagic = WAL_BLOCK_MAGIC;
+	pHeader->cbData = cbBuffer - sizeof(WAL_BLOCK_HEADER);
+	pHeader->ullLsn = ullLsn;
+	pHeader->ullChecksum = WalChecksum(pBuffer + sizeof(WAL_BLOCK_HEADER), pHeader->cbData);
+	pHeader->ullReserved = 0;
+
+	llStart = WalMicroseconds();
+	if (!g_Wal.bFailed && !WalWriteSync(pBuffer, cbBuffer, ullLsn - cbBuffer))
+		g_Wal.bFailed = TRUE;
+	g_Wal.llCommitMicroseconds += WalMicroseconds() - llStart;
+	g_Wal.llCommits++;
+	g_Wal.llBytes += cbBuffer;
+
+	if (!g_Wal.bFailed)
+	{
+		EnterCriticalSection(&g_Wal.csWal);
+		InterlockedExchange64(&g_llWalDurable, (LONG64)ullLsn);
+		LeaveCriticalSection(&g_Wal.csWal);
+	}
+	WalRelease();
+}
+
+static DWORD WINAPI WalCommitterThread(LPVOID lpParameter)
+{
+
+	LONG64 llWaited = 0;
+	DWORD cbActive = 0;
+
+	UNREFERENCED_PARAMETER(lpParameter);
+
+	while (!g_Wal.bStop)
+	{
+		cbActive = g_Wal.cbActive;
+		if (cbActive == 0)
+		{
+			WSAWaitForMultipleEvents(1, &g_Wal.hWake, TRUE, WAL_IDLE_WAIT, FALSE);
+			WSAResetEvent(g_Wal.hWake);
+			continue;
+		}
+
+		//
+		// give the appends that come in meanwhile a chance to share the
+		// commit, unless there are enough already
+		//
+		llWaited = WalMicroseconds() - g_Wal.llFirstAppend;
+		if (cbActive < g_dwWalWindow && llWaited < (LONG64)g_dwWalLatency)
+		{
+			WalSleep((DWORD)(g_dwWalLatency - llWaited));
+			continue;
+		}
+		WalCommit();
+	}
+	if (g_Wal.cbActive)
+		WalCommit();
+	return (0);
+}
+
+BOOL WalCreate(const char *szPath, PWAL_RELEASE_ROUTINE pfnRelease)
+{
+
+	DWORD dwThreadId = 0;
+	ULONGLONG ullSize = 0;
+
+	ZeroMemory(&g_Wal, sizeof(g_Wal));
+	g_Wal.pfnRelease = pfnRelease;
+
+#ifdef _WIN32
+	LARGE_INTEGER size;
+
+	g_Wal.hFile = CreateFileA(szPath, GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (g_Wal.hFile == INVALID_HANDLE_VALUE)
+	{
+		LogPrintf(LOG_ERROR, "CreateFile(%s) failed: %d\n", szPath, GetLastError());
+		return (FALSE);
+	}
+	GetFileSizeEx(g_Wal.hFile, &size);
+	ullSize = (ULONGLONG)size.QuadPart;
+#else
+	struct stat st;
+
+	g_Wal.fd = open(szPath, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+	if (g_Wal.fd < 0 || fstat(g_Wal.fd, &st) != 0)
+	{
+		LogPrintf(LOG_ERROR, "open(%s) failed: %d\n", szPath, errno);
+		if (g_Wal.fd >= 0)
+			close(g_Wal.fd);
+		return (FALSE);
+	}
+	ullSize = (ULONGLONG)st.st_size;
+#endif
+
+#if defined(__linux__) && defined(HAVE_LIBURING)
+	g_Wal.bRing = (io_uring_queue_init(8, &g_Wal.Ring, 0) == 0);
+	if (!g_Wal.bRing)
+		LogPrintf(LOG_INFO, "wal: no io_uring, committing with pwrite and fdatasync\n");
+#endif
+
+	g_Wal.pBuffers[0] = (char *)HeapAlloc(GetProcessHeap(), 0, WAL_BUFFER_SIZE);
+	g_Wal.pBuffers[1] = (char *)HeapAlloc(GetProcessHeap(), 0, WAL_BUFFER_SIZE);
+	g_Wal.hWake = WSACreateEvent();
+	InitializeCriticalSection(&g_Wal.csWal);
+	InitializeCriticalSection(&g_Wal.csRelease);
+	g_Wal.ullAppended = ullSize;
+	g_llWalDurable = (LONG64)ullSize;
+	if (g_Wal.pBuffers[0] && g_Wal.pBuffers[1] && g_Wal.hWake != WSA_INVALID_EVENT)
+		g_Wal.hCommitter = CreateThread(NULL, 0, WalCommitterThread, NULL, 0, &dwThreadId);
+	if (g_Wal.hCommitter == NULL)
+	{
+		LogPrintf(LOG_ERROR, "wal: failed to start the committer\n");
+		g_bWalCreated = TRUE;
+		g_Wal.bStop = TRUE;
+		WalDestroy();
+		return (FALSE);
+	}
+
+	LogPrintf(LOG_INFO, "wal: %s, appending at %lld, commits of %d bytes or %d us\n", szPath, (LONG64)ullSize,
+			  g_dwWalWindow, g_dwWalLatency);
+	g_bWalCreated = TRUE;
+	return (TRUE);
+}
+
+VOID WalDestroy()
+{
+
+	if (!g_bWalCreated)
+		return;
+
+	if (g_Wal.hCommitter)
+	{
+		g_Wal.bStop = TRUE;
+		WSASetEvent(g_Wal.hWake);
+		WaitForMultipleObjects(1, &g_Wal.hCommitter, TRUE, INFINITE);
+		CloseHandle(g_Wal.hCommitter);
+		LogPrintf(LOG_INFO, "wal: %lld commits, %lld bytes, %.1f KB and %.0f us per commit%s\n",
+				  g_Wal.llCommits, g_Wal.llBytes,
+				  g_Wal.llCommits ? g_Wal.llBytes / 1024.0 / g_Wal.llCommits : 0.0,
+				  g_Wal.llCommits ? (double)g_Wal.llCommitMicroseconds / g_Wal.llCommits : 0.0,
+				  g_Wal.bFailed ? ", failed" : "");
+		if (g_Wal.llStalls)
+			LogPrintf(LOG_INFO, "wal: %lld appends waited for a commit\n", g_Wal.llStalls);
+	}
+	WalCancelWaiters();
+	g_bWalCreated = FALSE;
+
+#if defined(__linux__) && defined(HAVE_LIBURING)
+	if (g_Wal.bRing)
+		io_uring_queue_exit(&g_Wal.Ring);
+#endif
+#ifdef _WIN32
+	CloseHandle(g_Wal.hFile);
+#else
+	close(g_Wal.fd);
+#endif
+	if (g_Wal.hWake != WSA_INVALID_EVENT)
+		WSACloseEvent(g_Wal.hWake);
+	HeapFree(GetProcessHeap(), 0, g_Wal.pBuffers[0]);
+	HeapFree(GetProcessHeap(), 0, g_Wal.pBuffers[1]);
+	DeleteCriticalSection(&g_Wal.csWal);
+	DeleteCriticalSection(&g_Wal.csRelease);
+	g_llWalDurable = 0;
+}
+
+BOOL WalEnabled()
+{
+
+	return (g_bWalCreated);
+}
+
+ULONGLONG WalAppend(const void *pData, DWORD cbData)
+{
+
+	ULONGLONG ullLsn = 0;
+	BOOL bWake = FALSE;
+
+	EnterCriticalSection(&g_Wal.csWal);
+
+	//
+	// both buffers are full: wait for the commit in flight to free one
+	//
+	while (g_Wal.cbActive + cbData > WAL_BUFFER_SIZE && !g_Wal.bFailed)
+	{
+		g_Wal.llStalls++;
+		LeaveCriticalSection(&g_Wal.csWal);
+		Sleep(1);
+		EnterCriticalSection(&g_Wal.csWal);
+	}
+	if (g_Wal.bFailed)
+	{
+		LeaveCriticalSection(&g_Wal.csWal);
+		return (0);
+	}
+
+	if (g_Wal.cbActive == 0)
+	{
+		g_Wal.cbActive = sizeof(WAL_BLOCK_HEADER);
+		g_Wal.ullAppended += sizeof(WAL_BLOCK_HEADER);
+		g_Wal.llFirstAppend = WalMicroseconds();
+		bWake = TRUE;
+	}
+	memcpy(g_Wal.pBuffers[g_Wal.dwActive] + g_Wal.cbActive, pData, cbData);
+	g_Wal.cbActive += cbData;
+	g_Wal.ullAppended += cbData;
+	ullLsn = g_Wal.ullAppended;
+	LeaveCriticalSection(&g_Wal.csWal);
+
+	if (bWake)
+		WSASetEvent(g_Wal.hWake);
+	return (ullLsn);
+}
+
+BOOL WalWait(PWAL_WAITER pWaiter, ULONGLONG ullLsn)
+{
+
+	BOOL bRegistered = FALSE;
+
+	//
+	// checked again under the lock the committer advances it under, so a
+	// commit can't slip in between and leave the waiter behind
+	//
+	EnterCriticalSection(&g_Wal.csWal);
+	if (ullLsn > WalDurable() && !pWaiter->bWaiting)
+	{
+		pWaiter->ullLsn = ullLsn;
+		pWaiter->bWaiting = TRUE;
+		pWaiter->pNext = g_Wal.pWaiters;
+		g_Wal.pWaiters = pWaiter;
+		bRegistered = TRUE;
+	}
+	LeaveCriticalSection(&g_Wal.csWal);
+	return (bRegistered);
+}
+
+VOID WalCancelWaiters()
+{
+
+	PWAL_WAITER pWaiter = NULL;
+
+	if (!g_bWalCreated)
+		return;
+
+	EnterCriticalSection(&g_Wal.csRelease);
+	EnterCriticalSection(&g_Wal.csWal);
+	while ((pWaiter = g_Wal.pWaiters) != NULL)
+	{
+		g_Wal.pWaiters = pWaiter->pNext;
+		pWaiter->bWaiting = FALSE;
+		pWaiter->pNext = NULL;
+	}
+	LeaveCriticalSection(&g_Wal.csWal);
+	LeaveCriticalSection(&g_Wal.csRelease);
+}
@@ -0,0 +1,135 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Module:
+//      iocpwal.h
+//
+// Abstract:
+//      Append-only write-ahead log with group commit (-j:path).  What the
+//      ledger applies is appended to the log before it is answered, and a
+//      reply leaves the server only once the log is durable up to it.
+//
+//      Appends from every connection are copied into one buffer, under a
+//      lock, and numbered by the file offset they end at (their LSN).  A
+//      committer thread takes the buffer as a whole, once it holds
+//      g_dwWalWindow bytes or its oldest append has waited
+//      g_dwWalLatency microseconds, whichever comes first, and makes it
+//      durable with one write and one fdatasync: on Linux a write SQE linked
+//      to an IORING_FSYNC_DATASYNC fsync on a ring of its own, with a single
+//      io_uring_submit_and_wait, elsewhere (or without io_uring) pwrite and
+//      fdatasync, or WriteFile and FlushFileBuffers.  Appends meanwhile go to
+//      the second buffer, so a commit in flight holds nobody up until that one
+//      is full too; then appenders wait for it.
+//
+//      Every commit is a block: a WAL_BLOCK_HEADER, then the appends in LSN
+//      order.  The header carries the block's length and a checksum of its
+//      data, so a block torn by a crash is recognized when the log is read.
+//      The log is appended to across runs; it is not read back at startup.
+//
+//      A connection whose next reply is not durable yet registers a
+//      WAL_WAITER, embedded in its context, with WalWait.  Once a commit is
+//      durable the committer hands every waiter it covers to the release
+//      routine, on the committer thread, which posts the reply.  If the
+//      commit failed the routine is told so, and every commit after it fails
+//      too.
+//
+
+#ifndef IOCPWAL_H
+#define IOCPWAL_H
+
+#include "iocpcompat.h"
+
+#define WAL_BUFFER_SIZE         (4 * 1024 * 1024)   // per buffer, so the most one commit writes
+#define WAL_DEFAULT_WINDOW      (256 * 1024)        // bytes that make a commit
+#define WAL_DEFAULT_LATENCY     200                 // microseconds an append waits for others
+#define WAL_BLOCK_MAGIC         0x4C415749          // "IWAL"
+
+typedef struct _WAL_BLOCK_HEADER {
+    DWORD                       dwMagic;
+    DWORD                       cbData;         // after the header
+    ULONGLONG                   ullLsn;         // where the block ends in the file
+    ULONGLONG                   ullChecksum;    // of the data
+    ULONGLONG                   ullReserved;
+} WAL_BLOCK_HEADER, *PWAL_BLOCK_HEADER;
+
+static_assert(sizeof(WAL_BLOCK_HEADER) == 32, "WAL_BLOCK_HEADER is 32 bytes in the file");
+
+//
+// a connection waiting for the log to be durable up to ullLsn
+//
+typedef struct _WAL_WAITER {
+    struct _WAL_WAITER          *pNext;
+    ULONGLONG                   ullLsn;
+    BOOL                        bWaiting;
+} WAL_WAITER, *PWAL_WAITER;
+
+//
+// called on the committer thread for each waiter whose LSN a commit covered,
+// with bDurable FALSE if the log failed
+//
+typedef VOID (*PWAL_RELEASE_ROUTINE)(PWAL_WAITER pWaiter, BOOL bDurable);
+
+extern DWORD g_dwWalWindow;
+extern DWORD g_dwWalLatency;
+
+//
+// the LSN the log is durable up to, 0 while there is no log; read whole even
+// where 64-bit loads are not atomic
+//
+extern volatile LONG64 g_llWalDurable;
+
+static inline ULONGLONG WalDurable(void)
+{
+    return ((ULONGLONG)InterlockedCompareExchange64(&g_llWalDurable, 0, 0));
+}
+
+//
+// open (or create) the log at szPath, appending after what it holds, and start
+// the committer
+//
+BOOL WalCreate(
+    const char *szPath,
+    PWAL_RELEASE_ROUTINE pfnRelease
+    );
+
+//
+// commit what is left, stop the committer, log the totals and close the log
+//
+VOID WalDestroy(
+    );
+
+//
+// whether there is a log to append to
+//
+BOOL WalEnabled(
+    );
+
+//
+// Copy cbData bytes to the log and return their LSN.  Waits while both
+// buffers are full.  Returns 0 once the log has failed.
+//
+ULONGLONG WalAppend(
+    const void *pData,
+    DWORD cbData
+    );
+
+//
+// Register pWaiter to be released once the log is durable up to ullLsn.
+// Returns FALSE, registering nothing, if it already is, or if pWaiter is
+// registered already (for an earlier LSN, the release routine finds out).
+//
+BOOL WalWait(
+    PWAL_WAITER pWaiter,
+    ULONGLONG ullLsn
+    );
+
+//
+// drop every registered waiter without releasing it; called at shutdown, once
+// nothing is to be posted any more
+//
+VOID WalCancelWaiters(
+    );
+
+#endif